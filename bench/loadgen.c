@@ -0,0 +1,494 @@
+/*
+ * Loopback load generator.
+ *
+ * Opens --connections sockets spread over --threads epoll loops and keeps
+ * --pipeline requests in flight on each, cycling through a mix of files
+ * (by default every regular file in public/). Latency is measured from the
+ * moment a request is written to the moment its response is complete and
+ * recorded in a log-linear histogram, so p99/p999 stay accurate at high
+ * request rates.
+ *
+ *   build/bench/loadgen --port 8080 --connections 64 --pipeline 8 --json
+ */
+#include "server.h"
+#include <dirent.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+
+#define MAX_FILES 256
+#define MAX_PIPELINE 64
+#define CONN_BUFFER 65536
+#define HIST_SUB_BITS 3
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS) * HIST_SUB + HIST_SUB)
+
+typedef struct {
+    char host[64];
+    int port;
+    int connections;
+    int threads;
+    double duration;
+    double warmup;
+    int keepalive;
+    int pipeline;
+    int json;
+    const char *label;
+    int file_count;
+    char *files[MAX_FILES];
+} options_t;
+
+typedef struct {
+    uint64_t buckets[HIST_BUCKETS];
+    uint64_t count;
+    uint64_t max;
+} histogram_t;
+
+typedef struct {
+    int fd;
+    int next_file;
+    int in_flight;
+    uint64_t sent_at[MAX_PIPELINE];
+    int sent_head;
+    const char *out;       /* Unsent part of the current request batch */
+    size_t out_length;
+    char out_buf[MAX_PIPELINE * 256];
+    char in_buf[CONN_BUFFER];
+    size_t in_length;
+    long body_remaining;   /* -1 while reading headers */
+    int server_closing;    /* Last response carried "Connection: close" */
+} client_t;
+
+typedef struct {
+    int id;
+    pthread_t thread;
+    int epoll_fd;
+    int client_count;
+    client_t *clients;
+    histogram_t histogram;
+    uint64_t requests;
+    uint64_t errors;
+    uint64_t bytes;
+    uint64_t connects;
+} loader_t;
+
+static options_t options = {
+    .host = "127.0.0.1", .port = DEFAULT_PORT, .connections = 32, .threads = 2,
+    .duration = 5.0, .warmup = 1.0, .keepalive = TRUE, .pipeline = 1, .label = "load",
+};
+static char *requests[MAX_FILES];
+static size_t request_lengths[MAX_FILES];
+static volatile int measuring;
+static volatile int stopping;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void histogram_record(histogram_t *h, uint64_t value) {
+    int index = (int)value;
+    if (value >= HIST_SUB) {
+        int exponent = 63 - __builtin_clzll(value);
+        int sub = (int)((value >> (exponent - HIST_SUB_BITS)) & (HIST_SUB - 1));
+        index = (exponent - HIST_SUB_BITS + 1) * HIST_SUB + sub;
+    }
+    h->buckets[index]++;
+    h->count++;
+    if (value > h->max) {
+        h->max = value;
+    }
+}
+
+static uint64_t histogram_upper(int index) {
+    if (index < HIST_SUB) {
+        return (uint64_t)index;
+    }
+    int exponent = index / HIST_SUB + HIST_SUB_BITS - 1;
+    uint64_t step = 1ULL << (exponent - HIST_SUB_BITS);
+    return (1ULL << exponent) + ((uint64_t)(index % HIST_SUB) + 1) * step - 1;
+}
+
+static uint64_t histogram_quantile(const histogram_t *h, double quantile) {
+    uint64_t rank = (uint64_t)(quantile * (double)h->count);
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen > rank) {
+            uint64_t upper = histogram_upper(i);
+            return upper < h->max ? upper : h->max;
+        }
+    }
+    return h->max;
+}
+
+/* ---- Connections ---- */
+
+static int client_connect(loader_t *loader, client_t *client) {
+    struct sockaddr_in address = {0};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(options.port);
+    inet_pton(AF_INET, options.host, &address.sin_addr);
+
+    client->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (client->fd < 0) {
+        return -1;
+    }
+    int one = 1;
+    setsockopt(client->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (connect(client->fd, (struct sockaddr *)&address, sizeof(address)) < 0 && errno != EINPROGRESS) {
+        close(client->fd);
+        client->fd = -1;
+        return -1;
+    }
+
+    client->in_flight = 0;
+    client->sent_head = 0;
+    client->in_length = 0;
+    client->body_remaining = -1;
+    client->server_closing = FALSE;
+    client->out_length = 0;
+    if (measuring) {
+        loader->connects++;
+    }
+
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    ev.data.ptr = client;
+    return epoll_ctl(loader->epoll_fd, EPOLL_CTL_ADD, client->fd, &ev);
+}
+
+static void client_reconnect(loader_t *loader, client_t *client) {
+    if (client->fd >= 0) {
+        close(client->fd);
+        client->fd = -1;
+    }
+    if (!stopping && client_connect(loader, client) != 0) {
+        loader->errors++;
+    }
+}
+
+/* Top the pipeline back up to its configured depth */
+static int client_fill(client_t *client) {
+    if (client->out_length == 0) {
+        size_t used = 0;
+        int depth = options.keepalive ? options.pipeline : 1;
+        uint64_t now = now_ns();
+        while (client->in_flight < depth) {
+            int file = client->next_file;
+            client->next_file = (client->next_file + 1) % options.file_count;
+            memcpy(client->out_buf + used, requests[file], request_lengths[file]);
+            used += request_lengths[file];
+            client->sent_at[(client->sent_head + client->in_flight) % MAX_PIPELINE] = now;
+            client->in_flight++;
+        }
+        client->out = client->out_buf;
+        client->out_length = used;
+    }
+
+    while (client->out_length > 0) {
+        ssize_t n = send(client->fd, client->out, client->out_length, MSG_NOSIGNAL);
+        if (n < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        client->out += n;
+        client->out_length -= (size_t)n;
+    }
+    return 0;
+}
+
+/* Consume complete responses; returns 1 on an orderly close, -1 on a failure */
+static int client_read(loader_t *loader, client_t *client) {
+    for (;;) {
+        ssize_t n = recv(client->fd, client->in_buf + client->in_length,
+                         sizeof(client->in_buf) - client->in_length, 0);
+        if (n == 0) {
+            return -1;
+        }
+        if (n < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        client->in_length += (size_t)n;
+        if (measuring) {
+            loader->bytes += (uint64_t)n;
+        }
+
+        size_t offset = 0;
+        for (;;) {
+            if (client->body_remaining < 0) {
+                char *start = client->in_buf + offset;
+                char *end = memmem(start, client->in_length - offset, "\r\n\r\n", 4);
+                if (!end) {
+                    break;
+                }
+                *end = '\0';
+                const char *length = strcasestr(start, "\r\nContent-Length:");
+                client->body_remaining = length ? strtol(length + 17, NULL, 10) : 0;
+                client->server_closing = strcasestr(start, "\r\nConnection: close") != NULL;
+                if (strncmp(start, "HTTP/1.1 2", 10) != 0 && strncmp(start, "HTTP/1.1 3", 10) != 0 &&
+                    measuring) {
+                    loader->errors++;
+                }
+                offset = (size_t)(end - client->in_buf) + 4;
+            }
+
+            size_t available = client->in_length - offset;
+            size_t take = available < (size_t)client->body_remaining ? available : (size_t)client->body_remaining;
+            offset += take;
+            client->body_remaining -= (long)take;
+            if (client->body_remaining > 0) {
+                break;
+            }
+
+            /* One response finished */
+            client->body_remaining = -1;
+            if (measuring) {
+                histogram_record(&loader->histogram, now_ns() - client->sent_at[client->sent_head]);
+                loader->requests++;
+            }
+            client->sent_head = (client->sent_head + 1) % MAX_PIPELINE;
+            client->in_flight--;
+            if (!options.keepalive || client->server_closing) {
+                return 1; /* Expected end, e.g. the server's --max-requests limit */
+            }
+        }
+
+        memmove(client->in_buf, client->in_buf + offset, client->in_length - offset);
+        client->in_length -= offset;
+        if (client->in_length == sizeof(client->in_buf)) {
+            return -1; /* Header block larger than our buffer */
+        }
+    }
+}
+
+static void *loader_main(void *arg) {
+    loader_t *loader = arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    for (int i = 0; i < loader->client_count; i++) {
+        loader->clients[i].fd = -1;
+        loader->clients[i].next_file = (loader->id * 7 + i) % options.file_count;
+        client_reconnect(loader, &loader->clients[i]);
+    }
+
+    while (!stopping) {
+        int n = epoll_wait(loader->epoll_fd, events, MAX_EVENTS, 100);
+        for (int i = 0; i < n; i++) {
+            client_t *client = events[i].data.ptr;
+            int rc = (events[i].events & EPOLLERR) ? -1 : 0;
+
+            if (rc == 0 && (events[i].events & EPOLLIN)) {
+                rc = client_read(loader, client);
+            }
+            if (rc == 0) {
+                rc = client_fill(client);
+            }
+            if (rc != 0) {
+                if (rc < 0 && measuring) {
+                    loader->errors++;
+                }
+                client_reconnect(loader, client);
+                if (client->fd >= 0) {
+                    client_fill(client);
+                }
+            }
+        }
+    }
+
+    for (int i = 0; i < loader->client_count; i++) {
+        if (loader->clients[i].fd >= 0) {
+            close(loader->clients[i].fd);
+        }
+    }
+    return NULL;
+}
+
+/* ---- Setup ---- */
+
+static void add_file(const char *path) {
+    if (options.file_count < MAX_FILES) {
+        options.files[options.file_count++] = strdup(path);
+    }
+}
+
+/* Default mix: every regular file under public/ */
+static void scan_public(const char *dir, const char *prefix) {
+    DIR *d = opendir(dir);
+    if (!d) {
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        char full[MAX_PATH_LENGTH], url[MAX_PATH_LENGTH];
+        struct stat st;
+        snprintf(full, sizeof(full), "%s/%s", dir, entry->d_name);
+        snprintf(url, sizeof(url), "%s/%s", prefix, entry->d_name);
+        if (stat(full, &st) != 0) {
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            scan_public(full, url);
+        } else if (S_ISREG(st.st_mode)) {
+            add_file(url);
+        }
+    }
+    closedir(d);
+}
+
+static void usage(const char *program) {
+    fprintf(stderr,
+            "Usage: %s [--host ADDR] [--port N] [--connections N] [--threads N] [--duration SEC]\n"
+            "          [--warmup SEC] [--keepalive on|off] [--pipeline N] [--files /a,/b] [--label NAME] [--json]\n",
+            program);
+}
+
+static int parse_args(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+
+        if (strcmp(arg, "--json") == 0) {
+            options.json = TRUE;
+            continue;
+        }
+        if (!value) {
+            return -1;
+        }
+        i++;
+
+        if (strcmp(arg, "--host") == 0) {
+            snprintf(options.host, sizeof(options.host), "%s", value);
+        } else if (strcmp(arg, "--port") == 0) {
+            options.port = atoi(value);
+        } else if (strcmp(arg, "--connections") == 0) {
+            options.connections = atoi(value);
+        } else if (strcmp(arg, "--threads") == 0) {
+            options.threads = atoi(value);
+        } else if (strcmp(arg, "--duration") == 0) {
+            options.duration = atof(value);
+        } else if (strcmp(arg, "--warmup") == 0) {
+            options.warmup = atof(value);
+        } else if (strcmp(arg, "--keepalive") == 0) {
+            options.keepalive = strcmp(value, "off") != 0;
+        } else if (strcmp(arg, "--pipeline") == 0) {
+            options.pipeline = atoi(value);
+        } else if (strcmp(arg, "--label") == 0) {
+            options.label = value;
+        } else if (strcmp(arg, "--files") == 0) {
+            char *list = strdup(value), *saveptr = NULL;
+            for (char *file = strtok_r(list, ",", &saveptr); file; file = strtok_r(NULL, ",", &saveptr)) {
+                add_file(file);
+            }
+            free(list);
+        } else {
+            return -1;
+        }
+    }
+
+    if (options.connections < 1 || options.threads < 1 || options.pipeline < 1 ||
+        options.pipeline > MAX_PIPELINE || options.duration <= 0) {
+        return -1;
+    }
+    if (options.threads > options.connections) {
+        options.threads = options.connections;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (parse_args(argc, argv) != 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (options.file_count == 0) {
+        scan_public(PUBLIC_DIR, "");
+    }
+    if (options.file_count == 0) {
+        fprintf(stderr, "No files to request\n");
+        return EXIT_FAILURE;
+    }
+
+    for (int i = 0; i < options.file_count; i++) {
+        char request[256];
+        int length = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: %s\r\n%s\r\n",
+                              options.files[i], options.host, options.keepalive ? "" : "Connection: close\r\n");
+        if (length <= 0 || (size_t)length >= sizeof(request)) {
+            fprintf(stderr, "Path too long: %s\n", options.files[i]);
+            return EXIT_FAILURE;
+        }
+        requests[i] = strdup(request);
+        request_lengths[i] = (size_t)length;
+    }
+
+    loader_t *loaders = calloc((size_t)options.threads, sizeof(loader_t));
+    for (int t = 0; t < options.threads; t++) {
+        loader_t *loader = &loaders[t];
+        loader->id = t;
+        loader->client_count = options.connections / options.threads + (t < options.connections % options.threads);
+        loader->clients = calloc((size_t)loader->client_count, sizeof(client_t));
+        loader->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        pthread_create(&loader->thread, NULL, loader_main, loader);
+    }
+
+    struct timespec pause = { (time_t)options.warmup, (long)((options.warmup - (time_t)options.warmup) * 1e9) };
+    nanosleep(&pause, NULL);
+    measuring = TRUE;
+    uint64_t started = now_ns();
+    pause.tv_sec = (time_t)options.duration;
+    pause.tv_nsec = (long)((options.duration - (time_t)options.duration) * 1e9);
+    nanosleep(&pause, NULL);
+    measuring = FALSE;
+    double elapsed = (double)(now_ns() - started) / 1e9;
+    stopping = TRUE;
+
+    histogram_t total = {0};
+    uint64_t requests_done = 0, errors = 0, bytes = 0, connects = 0;
+    for (int t = 0; t < options.threads; t++) {
+        loader_t *loader = &loaders[t];
+        pthread_join(loader->thread, NULL);
+        for (int i = 0; i < HIST_BUCKETS; i++) {
+            total.buckets[i] += loader->histogram.buckets[i];
+        }
+        total.count += loader->histogram.count;
+        if (loader->histogram.max > total.max) {
+            total.max = loader->histogram.max;
+        }
+        requests_done += loader->requests;
+        errors += loader->errors;
+        bytes += loader->bytes;
+        connects += loader->connects;
+        close(loader->epoll_fd);
+        free(loader->clients);
+    }
+    free(loaders);
+
+    double rps = (double)requests_done / elapsed;
+    double p50 = (double)histogram_quantile(&total, 0.50) / 1e3;
+    double p99 = (double)histogram_quantile(&total, 0.99) / 1e3;
+    double p999 = (double)histogram_quantile(&total, 0.999) / 1e3;
+    double max = (double)total.max / 1e3;
+
+    if (options.json) {
+        printf("{\"label\": \"%s\", \"connections\": %d, \"threads\": %d, \"keepalive\": %s, "
+               "\"pipeline\": %d, \"files\": %d, \"duration_s\": %.3f, \"requests\": %llu, "
+               "\"errors\": %llu, \"connects\": %llu, \"requests_per_sec\": %.1f, \"mb_per_sec\": %.2f, "
+               "\"latency_us\": {\"p50\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f}}\n",
+               options.label, options.connections, options.threads, options.keepalive ? "true" : "false",
+               options.pipeline, options.file_count, elapsed, (unsigned long long)requests_done,
+               (unsigned long long)errors, (unsigned long long)connects, rps, (double)bytes / elapsed / 1e6,
+               p50, p99, p999, max);
+    } else {
+        printf("%s: %d connections, %d threads, keep-alive %s, pipeline %d, %d files\n",
+               options.label, options.connections, options.threads, options.keepalive ? "on" : "off",
+               options.pipeline, options.file_count);
+        printf("  %llu requests in %.2fs, %llu errors\n", (unsigned long long)requests_done, elapsed,
+               (unsigned long long)errors);
+        printf("  %.0f req/s, %.1f MB/s\n", rps, (double)bytes / elapsed / 1e6);
+        printf("  latency p50 %.1fus  p99 %.1fus  p999 %.1fus  max %.1fus\n", p50, p99, p999, max);
+    }
+    return errors > 0 && requests_done == 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,138 @@
+/*
+ * Hot-path microbenchmarks: request parsing, content type lookup and
+ * response header generation. Each benchmark runs for BENCH_SECONDS and
+ * reports ns/op; the output is one JSON object so runs can be diffed.
+ *
+ *   make bench
+ */
+#include "server.h"
+
+#define BENCH_SECONDS 0.5
+
+static const char *requests[] = {
+    "GET / HTTP/1.1\r\n"
+    "Host: localhost:8080\r\n"
+    "User-Agent: curl/7.88.1\r\n"
+    "Accept: */*\r\n"
+    "\r\n",
+
+    "GET /assets/app.3f9c2a.js HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "Connection: keep-alive\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/118.0.0.0 Safari/537.36\r\n"
+    "Accept: */*\r\n"
+    "Referer: https://www.example.com/products/list?page=2&sort=price\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: en-US,en;q=0.9,de;q=0.8\r\n"
+    "If-None-Match: \"5f2a-1a2b3c4d\"\r\n"
+    "\r\n",
+};
+
+static const char *paths[] = {
+    "/index.html", "/css/site.css", "/js/app.js", "/api/data.json",
+    "/img/logo.png", "/img/photo.jpeg", "/favicon.ico", "/README",
+};
+
+#define COUNT(array) (sizeof(array) / sizeof((array)[0]))
+
+/* Keeps results observable so the optimizer cannot drop the work */
+static volatile size_t sink;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int first_result = TRUE;
+
+static void report(const char *name, size_t operations, double elapsed) {
+    printf("%s\n    \"%s\": {\"ops_per_sec\": %.0f, \"ns_per_op\": %.1f}",
+           first_result ? "" : ",", name, operations / elapsed, elapsed * 1e9 / operations);
+    first_result = FALSE;
+}
+
+static void bench_parse(void) {
+    http_request_t request;
+    size_t lengths[COUNT(requests)];
+    size_t operations = 0;
+
+    for (size_t i = 0; i < COUNT(requests); i++) {
+        lengths[i] = strlen(requests[i]);
+    }
+
+    double start = now_seconds(), elapsed;
+    do {
+        for (int batch = 0; batch < 1000; batch++) {
+            size_t i = operations % COUNT(requests);
+            http_request_init(&request);
+            if (parse_http_request(requests[i], lengths[i], &request) != HTTP_PARSE_OK) {
+                fprintf(stderr, "parse_http_request rejected the corpus\n");
+                exit(EXIT_FAILURE);
+            }
+            sink += request.header_count;
+            operations++;
+        }
+        elapsed = now_seconds() - start;
+    } while (elapsed < BENCH_SECONDS);
+
+    report("parse_http_request", operations, elapsed);
+}
+
+static void bench_content_type(void) {
+    size_t operations = 0;
+
+    double start = now_seconds(), elapsed;
+    do {
+        for (int batch = 0; batch < 1000; batch++) {
+            sink += (size_t)get_content_type(paths[operations % COUNT(paths)])[14];
+            operations++;
+        }
+        elapsed = now_seconds() - start;
+    } while (elapsed < BENCH_SECONDS);
+
+    report("get_content_type", operations, elapsed);
+}
+
+/* Uncached responses format every header; this is the sendfile() path for large files */
+static void bench_build_response(void) {
+    http_response_t response;
+    char buffer[MAX_RESPONSE_HEADER_SIZE];
+    size_t operations = 0;
+
+    http_response_init(&response);
+    response.status_code = HTTP_OK;
+    strcpy(response.content_type, "Content-Type: application/javascript\r\n");
+    response.body_length = 48213;
+    response.vary_encoding = TRUE;
+    response.accept_ranges = TRUE;
+    response.max_age = 3600;
+    response.validators.last_modified = 1700000000;
+    strcpy(response.validators.etag, "\"11e178-bc55-18df795cb65327d3\"");
+
+    double start = now_seconds(), elapsed;
+    do {
+        for (int batch = 0; batch < 1000; batch++) {
+            response.keep_alive = (int)(operations & 1);
+            size_t length = build_http_response(&response, buffer, sizeof(buffer));
+            if (length == 0) {
+                fprintf(stderr, "build_http_response failed\n");
+                exit(EXIT_FAILURE);
+            }
+            sink += length;
+            operations++;
+        }
+        elapsed = now_seconds() - start;
+    } while (elapsed < BENCH_SECONDS);
+
+    report("build_http_response", operations, elapsed);
+}
+
+int main(void) {
+    printf("{\n  \"scanner\": \"%s\",\n  \"results\": {", http_parser_scanner());
+    bench_parse();
+    bench_content_type();
+    bench_build_response();
+    printf("\n  }\n}\n");
+    return 0;
+}
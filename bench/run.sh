@@ -0,0 +1,82 @@
+#!/bin/sh
+#
+# make bench: microbenchmarks plus loopback load scenarios against a freshly
+# started release build. Prints one JSON document and keeps a copy in
+# build/bench/results.json so runs from different commits can be diffed.
+#
+# Tunables (environment):
+#   BENCH_PORT         port for the server under test (18080)
+#   BENCH_DURATION     seconds measured per scenario (5)
+#   BENCH_CONNECTIONS  concurrent connections (64)
+#   BENCH_THREADS      load generator threads (2)
+#   BENCH_PIPELINE     depth for the pipelined scenario (16)
+#   BENCH_FILES        comma-separated URL paths (default: everything in public/)
+#   BENCH_SERVER_ARGS  extra options for the server, e.g. "--workers 2"
+#   BENCH_BACKENDS     socket I/O backends to compare ("epoll uring")
+
+set -e
+
+BIN=build/bench
+PORT=${BENCH_PORT:-18080}
+DURATION=${BENCH_DURATION:-5}
+CONNECTIONS=${BENCH_CONNECTIONS:-64}
+THREADS=${BENCH_THREADS:-2}
+PIPELINE=${BENCH_PIPELINE:-16}
+BACKENDS=${BENCH_BACKENDS:-epoll uring}
+OUT=$BIN/results.json
+SERVER_PID=
+
+stop_server() {
+    if [ -n "$SERVER_PID" ]; then
+        kill $SERVER_PID 2>/dev/null || true
+        wait $SERVER_PID 2>/dev/null || true
+        SERVER_PID=
+    fi
+}
+trap stop_server EXIT INT TERM
+
+# Without io_uring the server falls back to epoll; its log says which one ran
+start_server() {
+    $BIN/server --port "$PORT" --log-console off --io "$1" $BENCH_SERVER_ARGS >/dev/null 2>&1 &
+    SERVER_PID=$!
+
+    # Wait for the listener instead of sleeping a fixed time
+    for attempt in 1 2 3 4 5 6 7 8 9 10; do
+        if $BIN/loadgen --port "$PORT" --connections 1 --threads 1 --duration 0.05 --warmup 0 \
+            ${BENCH_FILES:+--files "$BENCH_FILES"} >/dev/null 2>&1; then
+            break
+        fi
+        sleep 0.2
+    done
+}
+
+load() {
+    $BIN/loadgen --port "$PORT" --duration "$DURATION" --threads "$THREADS" \
+        ${BENCH_FILES:+--files "$BENCH_FILES"} --json "$@"
+}
+
+{
+    echo "{"
+    echo "  \"commit\": \"$(git rev-parse --short HEAD 2>/dev/null || echo unknown)\","
+    echo "  \"date\": \"$(date -u +%Y-%m-%dT%H:%M:%SZ)\","
+    echo "  \"server_args\": \"$BENCH_SERVER_ARGS\","
+    printf '  "micro": '
+    $BIN/micro_bench | sed '2,$s/^/  /'
+    echo "  ,"
+    echo "  \"load\": {"
+    separator=
+    for backend in $BACKENDS; do
+        start_server "$backend"
+        echo "    $separator\"$backend\": ["
+        printf '      '; load --label keepalive --connections "$CONNECTIONS"
+        printf '      ,'; load --label pipelined --connections "$CONNECTIONS" --pipeline "$PIPELINE"
+        printf '      ,'; load --label close --connections "$CONNECTIONS" --keepalive off
+        echo "    ]"
+        stop_server
+        separator=,
+    done
+    echo "  }"
+    echo "}"
+} > "$OUT"
+
+cat "$OUT"
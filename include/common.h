@@ -4,6 +4,9 @@
 // Standard libraries includes
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
@@ -15,22 +18,86 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
+#include <sys/epoll.h>
 
 // Server configuration constants
 #define DEFAULT_PORT 8080
-#define MAX_CONNECTIONS 128
+#define MAX_CONNECTIONS 10000        /* Concurrent clients before new ones are shed with 503 */
+#define LISTEN_BACKLOG_DEFAULT 511    /* Accept queue length; the kernel caps it at somaxconn */
+#define RETRY_AFTER_SECONDS "1"       /* Retry-After sent with a shed connection's 503 and a rate-limited 429 */
+#define RATE_LIMIT_SLOTS 65536        /* Clients (or prefixes) the rate limiter tracks at once; a power of two */
+#define RATE_LIMIT_PROBES 8           /* Slots looked at per client before the table counts as full */
+#define MAX_BODY_SIZE_DEFAULT (1024UL * 1024 * 1024) /* Largest request body taken; beyond it a 413 */
+#define UPLOAD_PIPE_SIZE (256 * 1024) /* Pipe an upload is spliced through from the socket to its file */
 #define BUFFER_SIZE 8192
+#define INITIAL_BUFFER_SIZE 2048      /* Connection buffers start here and double up to demand */
 #define MAX_PATH_LENGTH 512
+#define MAX_ROOT_LENGTH 256
+#define MAX_FILE_PATH (MAX_ROOT_LENGTH + MAX_PATH_LENGTH)
+#define MAX_HOST_LENGTH 128
+#define MAX_VHOSTS 16
+#define MAX_ROUTES 32
 #define MAX_HEADERS_SIZE 4096
 #define MAX_HEADER_LENGTH 256
+#define MAX_HEADER_COUNT 64
+#define MAX_EVENTS 256
+#define MAX_WORKERS 256
+#define MAX_KEEPALIVE_REQUESTS 1000
+#define OUTPUT_HIGH_WATER 65536
+#define OUT_QUEUE_SIZE 48
+#define MAX_RANGES 8
+#define MAX_RESPONSE_CHUNKS (2 * MAX_RANGES + 2)
+#define MAX_RESPONSE_HEADER_SIZE 1024
+#define CACHE_SIZE_DEFAULT (64 * 1024 * 1024)
+#define CACHE_MAX_ENTRY_DEFAULT (1024 * 1024)
+#define GZIP_MIN_LENGTH_DEFAULT 1024
+#define GZIP_LEVEL_DEFAULT 6
+#define MAX_AGE_RULES 16
+#define TIMER_TICK_MS 100             /* Resolution of connection deadlines */
+#define HEADER_TIMEOUT_DEFAULT 10     /* Seconds to receive a complete request head */
+#define BODY_TIMEOUT_DEFAULT 30       /* Seconds to receive the request body */
+#define KEEPALIVE_TIMEOUT_DEFAULT 15  /* Seconds an idle keep-alive connection is kept */
+#define WRITE_TIMEOUT_DEFAULT 30      /* Seconds a response may make no progress */
+#define PROXY_TIMEOUT_DEFAULT 60      /* Seconds a proxied exchange may make no progress */
+#define DRAIN_TIMEOUT_DEFAULT 30      /* Seconds an old process finishes its connections after a hot restart */
+#define RESTART_READY_TIMEOUT 10      /* Seconds a new process may take to take over the listeners */
+#define MAX_UPSTREAMS 8
+#define MAX_UPSTREAM_SERVERS 16       /* Per upstream */
+#define UPSTREAM_KEEPALIVE 32         /* Idle connections kept per upstream server and worker */
+#define UPSTREAM_IDLE_TIMEOUT 30      /* Seconds an idle upstream connection is reused within */
+#define UPSTREAM_MAX_FAILS 3          /* Consecutive failures that take a server out of rotation */
+#define UPSTREAM_FAIL_TIMEOUT 10      /* Seconds it then stays out */
+#define UPSTREAM_BUFFER_SIZE 16384    /* Response head buffer, and the most read per recv() */
+#define HTTP2_MAX_STREAMS 100         /* SETTINGS_MAX_CONCURRENT_STREAMS per connection */
+#define HTTP2_FRAME_SIZE 16384        /* Largest frame payload we accept (the protocol minimum) */
+#define HTTP2_INPUT_SIZE 32768        /* in_buf limit of an HTTP/2 connection: a whole frame and then some */
+#define HTTP2_HEADER_LIST_SIZE 16384  /* SETTINGS_MAX_HEADER_LIST_SIZE, and the largest header block taken */
+#define HPACK_TABLE_SIZE 4096         /* Dynamic table size both ways (the protocol default) */
+#define TLS_SESSION_TIMEOUT 3600      /* Seconds a TLS session (ticket or cached ID) stays resumable */
+#define TLS_SESSION_CACHE_SIZE 20480  /* Sessions cached server-side for TLS 1.2 clients without tickets */
+#define TLS_RECORD_SIZE 16384         /* Plaintext per record when TLS is encrypted in userspace */
 #define PUBLIC_DIR "./public"
 #define LOG_FILE "./logs/server.log"
+#define METRICS_PATH "/__metrics"
 
 // HTTP status codes
 #define HTTP_OK 200
+#define HTTP_CREATED 201
+#define HTTP_NO_CONTENT 204
+#define HTTP_PARTIAL_CONTENT 206
+#define HTTP_NOT_MODIFIED 304
 #define HTTP_NOT_FOUND 404
 #define HTTP_INTERNAL_ERROR 500
 #define HTTP_BAD_REQUEST 400
+#define HTTP_METHOD_NOT_ALLOWED 405
+#define HTTP_CONFLICT 409
+#define HTTP_LENGTH_REQUIRED 411
+#define HTTP_CONTENT_TOO_LARGE 413
+#define HTTP_RANGE_NOT_SATISFIABLE 416
+#define HTTP_TOO_MANY_REQUESTS 429
+#define HTTP_BAD_GATEWAY 502
+#define HTTP_SERVICE_UNAVAILABLE 503
+#define HTTP_GATEWAY_TIMEOUT 504
 
 // HTTP response templates
 #define HTTP_200_TEMPLATE "HTTP/1.1 200 OK\r\n"
@@ -0,0 +1,635 @@
+#include "server.h"
+#include <dirent.h>
+#include <sys/mman.h>
+
+/*
+ * Prebuilt asset bundle (--bundle FILE, built with --build-bundle FILE or
+ * "make bundle").
+ *
+ * For immutable deployments the whole document root is packed into one
+ * file ahead of time: every asset's bytes, its Content-Type line as
+ * get_content_type() gives it, a content-derived ETag, its Last-Modified
+ * time and the compressed variants worth keeping. A perfect hash over the
+ * request paths (hash and displace: one seed per bucket, chosen at build
+ * time so that no two paths share a slot) finds an asset with one hash, two
+ * array reads and one compare.
+ *
+ * The server maps the file read-only at startup and reads nothing else, so
+ * startup costs the same for ten assets or a million, and the bytes live in
+ * the page cache once for all workers. Nothing is stat()ed or opened per
+ * request: the first hit on an asset wraps its mapped bytes in a cache
+ * entry (see file_cache_wrap) with the representation headers serialized
+ * under this process's --max-age and --gzip settings, and every later hit
+ * reuses it. Paths not in the bundle fall through to the document root.
+ *
+ * A bundle is never modified in place. A new one is renamed over the old
+ * and picked up by a hot restart, so the running process keeps serving the
+ * mapping it started with.
+ */
+
+#define BUNDLE_MAGIC "HTTPBNDL"
+#define BUNDLE_VERSION 1
+#define BUNDLE_BUCKET_LOAD 4      /* Paths per displacement bucket, on average */
+#define BUNDLE_MAX_SEED 65536     /* Seeds tried per bucket before the table is made larger */
+#define BUNDLE_MAX_ATTEMPTS 8
+
+struct bundle_header {
+    char magic[8];              /* BUNDLE_MAGIC */
+    uint32_t version;
+    uint32_t encodings;         /* ENCODING_COUNT the variant arrays were written with */
+    uint32_t count;             /* Assets */
+    uint32_t bucket_count;
+    uint32_t slot_count;        /* Index slots, count of them in use */
+    uint32_t reserved;
+    uint64_t buckets;           /* Offset of uint32_t seeds[bucket_count] */
+    uint64_t slots;             /* Offset of struct bundle_slot[slot_count] */
+    uint64_t size;              /* Whole file, so a truncated copy is refused */
+};
+
+struct bundle_variant {
+    uint64_t offset;            /* Of the body, 0 = no such variant */
+    uint64_t length;
+    char etag[48];              /* Quoted, from the variant's own bytes */
+};
+
+struct bundle_slot {
+    uint64_t path;              /* Offset of the NUL-terminated request path, 0 = empty slot */
+    uint64_t content_type;      /* Offset of the NUL-terminated "Content-Type: ...\r\n" line */
+    uint32_t path_length;
+    uint32_t content_type_length;
+    int64_t last_modified;
+    struct bundle_variant variants[ENCODING_COUNT];
+};
+
+static struct {
+    const char *map;
+    size_t size;
+    const struct bundle_header *header;
+    const uint32_t *seeds;
+    const struct bundle_slot *slots;
+    cache_entry_t **entries;    /* slot_count * ENCODING_COUNT, wrapped on first use */
+    char root[MAX_ROOT_LENGTH];
+} bundle;
+
+static uint64_t hash_bytes(const void *data, size_t length) {
+    /* FNV-1a */
+    const unsigned char *p = data;
+    uint64_t hash = 1469598103934665603ULL;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= p[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/* Slot hash of a path under a bucket's seed (the murmur3 finalizer) */
+static uint64_t displace(uint64_t hash, uint32_t seed) {
+    uint64_t x = hash ^ ((uint64_t)seed * 0x9E3779B97F4A7C15ULL);
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+/* ---- Building ---- */
+
+struct pack_asset {
+    char path[MAX_PATH_LENGTH]; /* Request path, "/css/site.css" */
+    uint64_t hash;
+    uint32_t bucket;
+    uint32_t slot;
+};
+
+struct pack_group {
+    int first;                  /* Into the assets, sorted by bucket */
+    int size;
+    uint32_t bucket;
+};
+
+struct packer {
+    const config_t *config;
+    FILE *file;
+    uint64_t offset;            /* Where the next blob goes */
+    struct pack_asset *assets;
+    int count;
+    int capacity;
+};
+
+static int add_asset(struct packer *packer, const char *path) {
+    if (packer->count == packer->capacity) {
+        int capacity = packer->capacity ? packer->capacity * 2 : 256;
+        struct pack_asset *assets = realloc(packer->assets, (size_t)capacity * sizeof(struct pack_asset));
+        if (!assets) {
+            return -1;
+        }
+        packer->assets = assets;
+        packer->capacity = capacity;
+    }
+
+    struct pack_asset *asset = &packer->assets[packer->count++];
+    memset(asset, 0, sizeof(struct pack_asset));
+    strcpy(asset->path, path);
+    asset->hash = hash_bytes(asset->path, strlen(asset->path));
+    return 0;
+}
+
+/* Regular files under root/relative; dot files are skipped, as the cache watcher skips dot directories */
+static int collect(struct packer *packer, const char *relative) {
+    char dir[MAX_FILE_PATH];
+    snprintf(dir, sizeof(dir), "%s%s", packer->config->root, relative);
+
+    DIR *handle = opendir(dir);
+    if (!handle) {
+        fprintf(stderr, "Cannot read %s: %s\n", dir, strerror(errno));
+        return -1;
+    }
+
+    int result = 0;
+    struct dirent *item;
+    while (result == 0 && (item = readdir(handle)) != NULL) {
+        if (item->d_name[0] == '.') {
+            continue;
+        }
+
+        char path[MAX_PATH_LENGTH];
+        char full_path[MAX_FILE_PATH];
+        struct stat st;
+        if (snprintf(path, sizeof(path), "%s/%s", relative, item->d_name) >= (int)sizeof(path)) {
+            fprintf(stderr, "Skipping %s%s/%s: path too long\n", packer->config->root, relative, item->d_name);
+            continue;
+        }
+        snprintf(full_path, sizeof(full_path), "%s%s", packer->config->root, path);
+        if (stat(full_path, &st) != 0) {
+            continue;
+        }
+
+        if (S_ISDIR(st.st_mode)) {
+            result = collect(packer, path);
+        } else if (S_ISREG(st.st_mode)) {
+            result = add_asset(packer, path);
+        }
+    }
+    closedir(handle);
+    return result;
+}
+
+static int compare_paths(const void *a, const void *b) {
+    return strcmp(((const struct pack_asset *)a)->path, ((const struct pack_asset *)b)->path);
+}
+
+static int compare_buckets(const void *a, const void *b) {
+    const struct pack_asset *x = a;
+    const struct pack_asset *y = b;
+    return x->bucket < y->bucket ? -1 : x->bucket > y->bucket;
+}
+
+/* Largest buckets first, while the table is still empty enough to place them */
+static int compare_groups(const void *a, const void *b) {
+    const struct pack_group *x = a;
+    const struct pack_group *y = b;
+    if (x->size != y->size) {
+        return y->size - x->size;
+    }
+    return x->bucket < y->bucket ? -1 : x->bucket > y->bucket;
+}
+
+/* Find a seed per bucket that puts every path in a slot of its own; -1 when some bucket has none */
+static int place_assets(struct packer *packer, uint32_t bucket_count, uint32_t slot_count, uint32_t *seeds) {
+    struct pack_asset *assets = packer->assets;
+    struct pack_group *groups = calloc((size_t)packer->count + 1, sizeof(struct pack_group));
+    unsigned char *taken = calloc(slot_count, 1);
+    int group_count = 0;
+    int result = 0;
+
+    if (!groups || !taken) {
+        free(groups);
+        free(taken);
+        return -1;
+    }
+
+    for (int i = 0; i < packer->count; i++) {
+        assets[i].bucket = (uint32_t)(assets[i].hash % bucket_count);
+    }
+    qsort(assets, (size_t)packer->count, sizeof(struct pack_asset), compare_buckets);
+    for (int i = 0; i < packer->count; i++) {
+        if (i == 0 || assets[i].bucket != assets[i - 1].bucket) {
+            groups[group_count].first = i;
+            groups[group_count].bucket = assets[i].bucket;
+            group_count++;
+        }
+        groups[group_count - 1].size++;
+    }
+    qsort(groups, (size_t)group_count, sizeof(struct pack_group), compare_groups);
+
+    memset(seeds, 0, bucket_count * sizeof(uint32_t));
+    for (int g = 0; g < group_count && result == 0; g++) {
+        const struct pack_group *group = &groups[g];
+        uint32_t seed;
+        for (seed = 0; seed < BUNDLE_MAX_SEED; seed++) {
+            int placed = 0;
+            for (; placed < group->size; placed++) {
+                struct pack_asset *asset = &assets[group->first + placed];
+                asset->slot = (uint32_t)(displace(asset->hash, seed) % slot_count);
+                if (taken[asset->slot]) {
+                    break;
+                }
+                taken[asset->slot] = 1;
+            }
+            if (placed == group->size) {
+                break;
+            }
+            while (placed-- > 0) {
+                taken[assets[group->first + placed].slot] = 0; /* Undo this seed's partial placement */
+            }
+        }
+
+        if (seed == BUNDLE_MAX_SEED) {
+            result = -1;
+        } else {
+            seeds[group->bucket] = seed;
+        }
+    }
+
+    free(groups);
+    free(taken);
+    return result;
+}
+
+static int pack_write(struct packer *packer, const void *data, size_t length, uint64_t *offset) {
+    *offset = packer->offset;
+    if (length > 0 && fwrite(data, 1, length, packer->file) != length) {
+        return -1;
+    }
+    packer->offset += length;
+    return 0;
+}
+
+/* A whole regular file into memory */
+static int read_file(const char *path, char **data, size_t *size, struct stat *st) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, st) != 0 || !S_ISREG(st->st_mode)) {
+        close(fd);
+        return -1;
+    }
+
+    *size = (size_t)st->st_size;
+    *data = malloc(*size ? *size : 1);
+    size_t done = 0;
+    while (*data && done < *size) {
+        ssize_t n = read(fd, *data + done, *size - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        done += (size_t)n;
+    }
+    close(fd);
+
+    if (!*data || done < *size) {
+        free(*data);
+        *data = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static int pack_variant(struct packer *packer, struct bundle_variant *variant, int encoding,
+                        const char *data, size_t length) {
+    snprintf(variant->etag, sizeof(variant->etag), "\"%llx-%llx%s%s\"", (unsigned long long)length,
+             (unsigned long long)hash_bytes(data, length), encoding != ENCODING_IDENTITY ? "-" : "",
+             encoding != ENCODING_IDENTITY ? encoding_name(encoding) : "");
+    variant->length = length;
+    return pack_write(packer, data, length, &variant->offset);
+}
+
+static int pack_asset(struct packer *packer, const struct pack_asset *asset, struct bundle_slot *slot) {
+    const config_t *config = packer->config;
+    char full_path[MAX_FILE_PATH];
+    struct stat st;
+    char *data;
+    size_t size;
+
+    snprintf(full_path, sizeof(full_path), "%s%s", config->root, asset->path);
+    if (read_file(full_path, &data, &size, &st) != 0) {
+        fprintf(stderr, "Cannot read %s: %s\n", full_path, strerror(errno));
+        return -1;
+    }
+
+    const char *content_type = get_content_type(asset->path);
+    slot->path_length = (uint32_t)strlen(asset->path);
+    slot->content_type_length = (uint32_t)strlen(content_type);
+    slot->last_modified = (int64_t)st.st_mtime;
+    if (pack_write(packer, asset->path, slot->path_length + 1, &slot->path) != 0 ||
+        pack_write(packer, content_type, slot->content_type_length + 1, &slot->content_type) != 0 ||
+        pack_variant(packer, &slot->variants[ENCODING_IDENTITY], ENCODING_IDENTITY, data, size) != 0) {
+        free(data);
+        return -1;
+    }
+
+    /* Variants are kept only where they are smaller; the server never compresses bundled assets itself */
+    int result = 0;
+    if (config->gzip && is_compressible_type(content_type) && size >= config->gzip_min_length) {
+        for (int encoding = ENCODING_IDENTITY + 1; encoding < ENCODING_COUNT && result == 0; encoding++) {
+            char *compressed = NULL;
+            size_t compressed_length = 0;
+
+            /* A precompressed sibling (foo.js.gz) wins, as it does when serving from disk */
+            if (encoding == ENCODING_GZIP) {
+                char gz_path[MAX_FILE_PATH + 3];
+                struct stat gz_st;
+                snprintf(gz_path, sizeof(gz_path), "%s.gz", full_path);
+                if (read_file(gz_path, &compressed, &compressed_length, &gz_st) != 0) {
+                    compressed = NULL;
+                }
+            }
+            if (!compressed && compress_buffer(encoding, config->gzip_level, data, size,
+                                               &compressed, &compressed_length) != 0) {
+                continue;
+            }
+
+            if (compressed_length < size) {
+                result = pack_variant(packer, &slot->variants[encoding], encoding, compressed, compressed_length);
+            }
+            free(compressed);
+        }
+    }
+
+    free(data);
+    return result;
+}
+
+static int write_bundle(struct packer *packer, const char *output) {
+    uint32_t bucket_count = (uint32_t)(packer->count / BUNDLE_BUCKET_LOAD + 1);
+    uint32_t slot_count = (uint32_t)(packer->count + packer->count / 4 + 1);
+    uint32_t *seeds = calloc(bucket_count, sizeof(uint32_t));
+    struct bundle_slot *slots = NULL;
+    int result = -1;
+
+    /* A failed search just means an unlucky table size */
+    for (int attempt = 0; seeds && attempt < BUNDLE_MAX_ATTEMPTS; attempt++) {
+        if (place_assets(packer, bucket_count, slot_count, seeds) == 0) {
+            slots = calloc(slot_count, sizeof(struct bundle_slot));
+            break;
+        }
+        slot_count += slot_count / 4 + 1;
+    }
+    if (!slots) {
+        fprintf(stderr, "Cannot build the bundle index for %d assets\n", packer->count);
+        free(seeds);
+        return -1;
+    }
+
+    struct bundle_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BUNDLE_MAGIC, sizeof(header.magic));
+    header.version = BUNDLE_VERSION;
+    header.encodings = ENCODING_COUNT;
+    header.count = (uint32_t)packer->count;
+    header.bucket_count = bucket_count;
+    header.slot_count = slot_count;
+    header.buckets = sizeof(header);
+    header.slots = (header.buckets + bucket_count * sizeof(uint32_t) + 7) & ~(uint64_t)7;
+
+    /* Bodies follow the index; the header and index are written last, once every offset is known */
+    packer->offset = header.slots + (uint64_t)slot_count * sizeof(struct bundle_slot);
+    if (fseeko(packer->file, (off_t)packer->offset, SEEK_SET) == 0) {
+        result = 0;
+    }
+    for (int i = 0; i < packer->count && result == 0; i++) {
+        result = pack_asset(packer, &packer->assets[i], &slots[packer->assets[i].slot]);
+    }
+
+    header.size = packer->offset;
+    if (result == 0 &&
+        (fseeko(packer->file, 0, SEEK_SET) != 0 ||
+         fwrite(&header, sizeof(header), 1, packer->file) != 1 ||
+         fseeko(packer->file, (off_t)header.buckets, SEEK_SET) != 0 ||
+         fwrite(seeds, sizeof(uint32_t), bucket_count, packer->file) != bucket_count ||
+         fseeko(packer->file, (off_t)header.slots, SEEK_SET) != 0 ||
+         fwrite(slots, sizeof(struct bundle_slot), slot_count, packer->file) != slot_count)) {
+        fprintf(stderr, "Cannot write %s: %s\n", output, strerror(errno));
+        result = -1;
+    }
+
+    if (result == 0) {
+        printf("Bundle %s: %d assets from %s, %llu bytes, %u index slots\n", output, packer->count,
+               packer->config->root, (unsigned long long)header.size, slot_count);
+    }
+    free(slots);
+    free(seeds);
+    return result;
+}
+
+/* Pack config->root into output; written beside it and renamed into place, so a running server never sees half a bundle */
+int bundle_build(const config_t *config, const char *output) {
+    struct packer packer;
+    char temp[MAX_ROOT_LENGTH + 8];
+    memset(&packer, 0, sizeof(packer));
+    packer.config = config;
+
+    if (!config || !output) {
+        return -1;
+    }
+    if (collect(&packer, "") != 0) {
+        free(packer.assets);
+        return -1;
+    }
+    if (packer.count == 0) {
+        fprintf(stderr, "Nothing to bundle under %s\n", config->root);
+        free(packer.assets);
+        return -1;
+    }
+
+    /* Same tree, same bundle: the layout does not depend on readdir() order */
+    qsort(packer.assets, (size_t)packer.count, sizeof(struct pack_asset), compare_paths);
+
+    snprintf(temp, sizeof(temp), "%s.XXXXXX", output);
+    int fd = mkostemp(temp, O_CLOEXEC);
+    if (fd < 0 || fchmod(fd, 0644) != 0 || !(packer.file = fdopen(fd, "wb"))) {
+        fprintf(stderr, "Cannot create %s: %s\n", temp, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+            unlink(temp);
+        }
+        free(packer.assets);
+        return -1;
+    }
+
+    int result = write_bundle(&packer, output);
+    if (fclose(packer.file) != 0) {
+        result = -1;
+    }
+    if (result == 0 && rename(temp, output) != 0) {
+        fprintf(stderr, "Cannot rename %s to %s: %s\n", temp, output, strerror(errno));
+        result = -1;
+    }
+    if (result != 0) {
+        unlink(temp);
+    }
+
+    free(packer.assets);
+    return result;
+}
+
+/* ---- Serving ---- */
+
+static int in_bounds(uint64_t offset, uint64_t length) {
+    return offset <= bundle.size && length <= bundle.size - offset;
+}
+
+int bundle_open(const char *path, const char *root) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        log_message(LOG_ERROR, "Cannot open bundle %s: %s", path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    if ((size_t)st.st_size < sizeof(struct bundle_header)) {
+        log_message(LOG_ERROR, "Bundle %s is not a bundle", path);
+        close(fd);
+        return -1;
+    }
+
+    /* The descriptor is not needed once mapped */
+    void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        log_message(LOG_ERROR, "Cannot map bundle %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    bundle.map = map;
+    bundle.size = (size_t)st.st_size;
+    bundle.header = map;
+
+    /* Only the header is checked here; each slot's offsets are checked when a lookup lands on it */
+    const struct bundle_header *header = bundle.header;
+    if (memcmp(header->magic, BUNDLE_MAGIC, sizeof(header->magic)) != 0 || header->version != BUNDLE_VERSION ||
+        header->encodings != ENCODING_COUNT || header->size != bundle.size || header->bucket_count == 0 ||
+        header->slot_count < header->count || header->slot_count == 0 || header->slots % 8 != 0 ||
+        !in_bounds(header->buckets, (uint64_t)header->bucket_count * sizeof(uint32_t)) ||
+        !in_bounds(header->slots, (uint64_t)header->slot_count * sizeof(struct bundle_slot))) {
+        log_message(LOG_ERROR, "Bundle %s is corrupt or from another version", path);
+        bundle_close();
+        return -1;
+    }
+
+    bundle.seeds = (const uint32_t *)(bundle.map + header->buckets);
+    bundle.slots = (const struct bundle_slot *)(bundle.map + header->slots);
+    bundle.entries = calloc((size_t)header->slot_count * ENCODING_COUNT, sizeof(cache_entry_t *));
+    if (!bundle.entries) {
+        bundle_close();
+        return -1;
+    }
+    strncpy(bundle.root, root, sizeof(bundle.root) - 1);
+
+    /* Read the index ahead; bodies are faulted in as they are first served */
+    madvise(map, (size_t)(header->slots + (uint64_t)header->slot_count * sizeof(struct bundle_slot)),
+            MADV_WILLNEED);
+
+    log_message(LOG_INFO, "Asset bundle %s: %u assets served for %s", path, header->count, bundle.root);
+    return 0;
+}
+
+/* Asset for a request path under a document root, or -1 to look on disk */
+int bundle_find(const char *root, const char *path) {
+    if (!bundle.map || strcmp(root, bundle.root) != 0) {
+        return -1;
+    }
+
+    size_t length = strlen(path);
+    uint64_t hash = hash_bytes(path, length);
+    uint32_t seed = bundle.seeds[hash % bundle.header->bucket_count];
+    uint32_t index = (uint32_t)(displace(hash, seed) % bundle.header->slot_count);
+
+    /* Any path hashes to some slot: the stored path decides whether it is this one */
+    const struct bundle_slot *slot = &bundle.slots[index];
+    if (slot->path == 0 || slot->path_length != length || !in_bounds(slot->path, length + 1) ||
+        memcmp(bundle.map + slot->path, path, length) != 0) {
+        return -1;
+    }
+
+    if (!in_bounds(slot->content_type, (uint64_t)slot->content_type_length + 1) ||
+        bundle.map[slot->content_type + slot->content_type_length] != '\0' ||
+        slot->variants[ENCODING_IDENTITY].offset == 0) {
+        return -1;
+    }
+    for (int encoding = 0; encoding < ENCODING_COUNT; encoding++) {
+        if (!in_bounds(slot->variants[encoding].offset, slot->variants[encoding].length)) {
+            return -1;
+        }
+    }
+    return (int)index;
+}
+
+const char* bundle_content_type(int asset) {
+    return bundle.map + bundle.slots[asset].content_type;
+}
+
+int bundle_has(int asset, int encoding) {
+    return bundle.slots[asset].variants[encoding].offset != 0;
+}
+
+void bundle_validators(int asset, int encoding, http_validators_t *validators) {
+    const struct bundle_variant *variant = &bundle.slots[asset].variants[encoding];
+    validators->last_modified = (time_t)bundle.slots[asset].last_modified;
+    snprintf(validators->etag, sizeof(validators->etag), "%.*s",
+             (int)strnlen(variant->etag, sizeof(variant->etag)), variant->etag);
+}
+
+/* The wrapped variant with a reference for the caller, NULL before its first use */
+cache_entry_t* bundle_entry(int asset, int encoding) {
+    cache_entry_t *entry = __atomic_load_n(&bundle.entries[asset * ENCODING_COUNT + encoding], __ATOMIC_ACQUIRE);
+    if (entry) {
+        file_cache_retain(entry);
+    }
+    return entry;
+}
+
+/* Wrap a variant with its serialized headers; when two workers race, the first one's entry is kept */
+cache_entry_t* bundle_publish(int asset, int encoding, const char *headers, size_t headers_length) {
+    const struct bundle_slot *slot = &bundle.slots[asset];
+    const struct bundle_variant *variant = &slot->variants[encoding];
+    http_validators_t validators;
+
+    bundle_validators(asset, encoding, &validators);
+    cache_entry_t *entry = file_cache_wrap(bundle.map + slot->path, bundle.map + variant->offset,
+                                           (size_t)variant->length, headers, headers_length, &validators);
+    if (!entry) {
+        return NULL;
+    }
+
+    cache_entry_t *expected = NULL;
+    if (!__atomic_compare_exchange_n(&bundle.entries[asset * ENCODING_COUNT + encoding], &expected, entry,
+                                     FALSE, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        file_cache_release(entry);
+        entry = expected;
+    }
+    file_cache_retain(entry); /* The bundle keeps its own reference until bundle_close() */
+    return entry;
+}
+
+/* At shutdown, once no response refers to the mapping any more */
+void bundle_close(void) {
+    if (bundle.entries) {
+        size_t count = (size_t)bundle.header->slot_count * ENCODING_COUNT;
+        for (size_t i = 0; i < count; i++) {
+            file_cache_release(bundle.entries[i]);
+        }
+        free(bundle.entries);
+    }
+    if (bundle.map) {
+        munmap((void *)bundle.map, bundle.size);
+    }
+    memset(&bundle, 0, sizeof(bundle));
+}
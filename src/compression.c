@@ -0,0 +1,157 @@
+#include "server.h"
+#include <ctype.h>
+#include <zlib.h>
+
+const char* encoding_name(int encoding) {
+    switch (encoding) {
+        case ENCODING_GZIP:
+            return "gzip";
+        case ENCODING_DEFLATE:
+            return "deflate";
+        default:
+            return "identity";
+    }
+}
+
+int is_compressible_type(const char *content_type) {
+    if (!content_type) {
+        return FALSE;
+    }
+
+    /* Text formats shrink several times over; images are already compressed */
+    return strstr(content_type, "text/") != NULL ||
+           strstr(content_type, "javascript") != NULL ||
+           strstr(content_type, "json") != NULL ||
+           strstr(content_type, "xml") != NULL;
+}
+
+/* Parse a qvalue ("1", "0.5", "0.001") into thousandths */
+static int parse_qvalue(const char *p, const char *end) {
+    int value = 0;
+    if (p < end && isdigit((unsigned char)*p)) {
+        value = (*p - '0') * 1000;
+        p++;
+    }
+    if (p < end && *p == '.') {
+        p++;
+        for (int scale = 100; scale > 0 && p < end && isdigit((unsigned char)*p); scale /= 10, p++) {
+            value += (*p - '0') * scale;
+        }
+    }
+    return value > 1000 ? 1000 : value;
+}
+
+int negotiate_encoding(const http_request_t *request) {
+    size_t length = 0;
+    const char *value = request ? http_request_header(request, "Accept-Encoding", &length) : NULL;
+    if (!value) {
+        return ENCODING_IDENTITY;
+    }
+
+    int quality[ENCODING_COUNT] = {0};
+    int listed[ENCODING_COUNT] = {0};
+    int wildcard = -1;
+    const char *end = value + length;
+
+    /* coding [ ";" "q=" qvalue ] { "," ... } */
+    for (const char *p = value; p < end;) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) {
+            p++;
+        }
+        const char *token = p;
+        while (p < end && *p != ',' && *p != ';' && *p != ' ' && *p != '\t') {
+            p++;
+        }
+        size_t token_len = (size_t)(p - token);
+
+        int q = 1000;
+        const char *item_end = memchr(p, ',', (size_t)(end - p));
+        if (!item_end) {
+            item_end = end;
+        }
+        const char *param = memchr(p, ';', (size_t)(item_end - p));
+        if (param) {
+            param++;
+            while (param < item_end && (*param == ' ' || *param == '\t')) {
+                param++;
+            }
+            if (item_end - param >= 2 && (param[0] == 'q' || param[0] == 'Q') && param[1] == '=') {
+                q = parse_qvalue(param + 2, item_end);
+            }
+        }
+
+        int encoding = ENCODING_IDENTITY;
+        if (token_len == 4 && strncasecmp(token, "gzip", 4) == 0) {
+            encoding = ENCODING_GZIP;
+        } else if (token_len == 7 && strncasecmp(token, "deflate", 7) == 0) {
+            encoding = ENCODING_DEFLATE;
+        }
+
+        if (encoding != ENCODING_IDENTITY) {
+            quality[encoding] = q;
+            listed[encoding] = TRUE;
+        } else if (token_len == 1 && *token == '*') {
+            wildcard = q;
+        }
+        p = item_end;
+    }
+
+    /* "*" covers codings that were not listed explicitly */
+    if (wildcard >= 0) {
+        for (int encoding = ENCODING_IDENTITY + 1; encoding < ENCODING_COUNT; encoding++) {
+            if (!listed[encoding]) {
+                quality[encoding] = wildcard;
+            }
+        }
+    }
+
+    /* Highest qvalue wins; gzip is preferred on ties */
+    int best = ENCODING_IDENTITY;
+    for (int encoding = ENCODING_IDENTITY + 1; encoding < ENCODING_COUNT; encoding++) {
+        if (quality[encoding] > 0 && (best == ENCODING_IDENTITY || quality[encoding] > quality[best])) {
+            best = encoding;
+        }
+    }
+    return best;
+}
+
+int compress_buffer(int encoding, int level, const char *input, size_t input_length,
+                    char **output, size_t *output_length) {
+    if (!input || !output || !output_length || encoding == ENCODING_IDENTITY) {
+        return -1;
+    }
+
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+
+    /* windowBits 15 gives a zlib stream (deflate), +16 a gzip one */
+    int window_bits = encoding == ENCODING_GZIP ? 15 + 16 : 15;
+    if (deflateInit2(&stream, level, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return -1;
+    }
+
+    uLong bound = deflateBound(&stream, (uLong)input_length);
+    char *buffer = malloc(bound);
+    if (!buffer) {
+        deflateEnd(&stream);
+        return -1;
+    }
+
+    stream.next_in = (Bytef *)input;
+    stream.avail_in = (uInt)input_length;
+    stream.next_out = (Bytef *)buffer;
+    stream.avail_out = (uInt)bound;
+
+    int rc = deflate(&stream, Z_FINISH);
+    size_t produced = stream.total_out;
+    deflateEnd(&stream);
+
+    if (rc != Z_STREAM_END) {
+        free(buffer);
+        return -1;
+    }
+
+    *output = buffer;
+    *output_length = produced;
+    return 0;
+}
@@ -0,0 +1,416 @@
+#include "server.h"
+#include <ctype.h>
+#include <sched.h>
+
+config_t g_config;
+
+void init_config(config_t *config) {
+    if (!config) {
+        return;
+    }
+
+    memset(config, 0, sizeof(config_t));
+    config->port = DEFAULT_PORT;
+    config->workers = 0; /* 0 = one worker per online CPU */
+    config->max_requests = MAX_KEEPALIVE_REQUESTS;
+    config->backlog = LISTEN_BACKLOG_DEFAULT;
+    config->max_connections = MAX_CONNECTIONS;
+    config->max_body_size = MAX_BODY_SIZE_DEFAULT;
+    config->rate_limit_prefix = 32;
+    config->cache_size = CACHE_SIZE_DEFAULT;
+    config->cache_max_entry = CACHE_MAX_ENTRY_DEFAULT;
+    config->gzip = TRUE;
+    config->gzip_level = GZIP_LEVEL_DEFAULT;
+    config->gzip_min_length = GZIP_MIN_LENGTH_DEFAULT;
+    config->max_age = -1;
+    config->log_console = TRUE;
+    config->ktls = TRUE;
+    config->timeouts[TIMEOUT_HEADER] = HEADER_TIMEOUT_DEFAULT;
+    config->timeouts[TIMEOUT_BODY] = BODY_TIMEOUT_DEFAULT;
+    config->timeouts[TIMEOUT_IDLE] = KEEPALIVE_TIMEOUT_DEFAULT;
+    config->timeouts[TIMEOUT_WRITE] = WRITE_TIMEOUT_DEFAULT;
+    config->timeouts[TIMEOUT_UPSTREAM] = PROXY_TIMEOUT_DEFAULT;
+    config->drain_timeout = DRAIN_TIMEOUT_DEFAULT;
+    strcpy(config->root, PUBLIC_DIR);
+}
+
+static int parse_int(const char *value, int min, int max, int *out) {
+    char *end;
+    long v = strtol(value, &end, 10);
+    if (end == value || *end != '\0' || v < min || v > max) {
+        return -1;
+    }
+    *out = (int)v;
+    return 0;
+}
+
+static int parse_bool(const char *value, int *out) {
+    if (strcmp(value, "on") == 0 || strcmp(value, "yes") == 0 || strcmp(value, "1") == 0) {
+        *out = TRUE;
+    } else if (strcmp(value, "off") == 0 || strcmp(value, "no") == 0 || strcmp(value, "0") == 0) {
+        *out = FALSE;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+/* Byte counts accept an optional K/M/G suffix */
+static int parse_size(const char *value, size_t *out) {
+    char *end;
+    unsigned long long v = strtoull(value, &end, 10);
+    if (end == value || value[0] == '-') {
+        return -1;
+    }
+    switch (*end) {
+        case 'K': case 'k': v <<= 10; end++; break;
+        case 'M': case 'm': v <<= 20; end++; break;
+        case 'G': case 'g': v <<= 30; end++; break;
+        default: break;
+    }
+    if (*end != '\0') {
+        return -1;
+    }
+    *out = (size_t)v;
+    return 0;
+}
+
+/* "SECONDS" sets the default, "TYPE=SECONDS" adds a per content type rule */
+static int parse_max_age(config_t *config, const char *value) {
+    const char *equals = strchr(value, '=');
+    if (!equals) {
+        return parse_int(value, -1, INT_MAX, &config->max_age);
+    }
+
+    size_t type_length = (size_t)(equals - value);
+    if (type_length == 0 || type_length >= sizeof(config->max_age_rules[0].type) ||
+        config->max_age_rule_count >= MAX_AGE_RULES) {
+        return -1;
+    }
+
+    int seconds;
+    if (parse_int(equals + 1, -1, INT_MAX, &seconds) != 0) {
+        return -1;
+    }
+
+    int index = config->max_age_rule_count++;
+    memcpy(config->max_age_rules[index].type, value, type_length);
+    config->max_age_rules[index].type[type_length] = '\0';
+    config->max_age_rules[index].seconds = seconds;
+    return 0;
+}
+
+static int parse_path(const char *value, char *out, size_t out_size) {
+    size_t length = strlen(value);
+    if (length == 0 || length >= out_size) {
+        return -1;
+    }
+    memcpy(out, value, length + 1);
+    return 0;
+}
+
+/* Document roots are used as path prefixes, so a trailing slash is dropped */
+static int parse_root(const char *value, size_t length, char *out, size_t out_size) {
+    while (length > 1 && value[length - 1] == '/') {
+        length--;
+    }
+    if (length == 0 || length >= out_size) {
+        return -1;
+    }
+    memcpy(out, value, length);
+    out[length] = '\0';
+    return 0;
+}
+
+/* "HOST=DIR" */
+static int parse_vhost(config_t *config, const char *value) {
+    const char *equals = strchr(value, '=');
+    if (!equals || equals == value || config->vhost_count >= MAX_VHOSTS) {
+        return -1;
+    }
+
+    size_t host_length = (size_t)(equals - value);
+    if (host_length >= sizeof(config->vhosts[0].host)) {
+        return -1;
+    }
+
+    int index = config->vhost_count;
+    if (parse_root(equals + 1, strlen(equals + 1), config->vhosts[index].root, sizeof(config->vhosts[index].root)) != 0) {
+        return -1;
+    }
+    memcpy(config->vhosts[index].host, value, host_length);
+    config->vhosts[index].host[host_length] = '\0';
+    config->vhost_count++;
+    return 0;
+}
+
+/* "[HOST]PATH=HANDLER[:ARG]": the path starts at the first '/', anything before it names the host */
+static int parse_route(config_t *config, const char *value) {
+    const char *path = strchr(value, '/');
+    const char *equals = path ? strchr(path, '=') : NULL;
+    if (!equals || equals[1] == '\0' || config->route_count >= MAX_ROUTES) {
+        return -1;
+    }
+
+    size_t host_length = (size_t)(path - value);
+    size_t path_length = (size_t)(equals - path);
+    size_t handler_length = strlen(equals + 1);
+    int index = config->route_count;
+    if (host_length >= sizeof(config->routes[index].host) || path_length >= sizeof(config->routes[index].path) ||
+        handler_length >= sizeof(config->routes[index].handler)) {
+        return -1;
+    }
+
+    memcpy(config->routes[index].host, value, host_length);
+    config->routes[index].host[host_length] = '\0';
+    memcpy(config->routes[index].path, path, path_length);
+    config->routes[index].path[path_length] = '\0';
+    memcpy(config->routes[index].handler, equals + 1, handler_length + 1);
+    config->route_count++;
+    return 0;
+}
+
+/* "NAME=ADDR[,ADDR...]", each ADDR "host:port" or "unix:/path"; addresses are resolved by the proxy */
+static int parse_upstream(config_t *config, const char *value) {
+    const char *equals = strchr(value, '=');
+    if (!equals || equals == value || equals[1] == '\0' || config->upstream_count >= MAX_UPSTREAMS) {
+        return -1;
+    }
+
+    size_t name_length = (size_t)(equals - value);
+    int index = config->upstream_count;
+    if (name_length >= sizeof(config->upstreams[index].name)) {
+        return -1;
+    }
+
+    const char *server = equals + 1;
+    int count = 0;
+    while (*server != '\0') {
+        size_t length = strcspn(server, ",");
+        if (length == 0 || length >= sizeof(config->upstreams[index].servers[0]) || count >= MAX_UPSTREAM_SERVERS) {
+            return -1;
+        }
+        memcpy(config->upstreams[index].servers[count], server, length);
+        config->upstreams[index].servers[count][length] = '\0';
+        count++;
+        server += length + (server[length] == ',');
+    }
+
+    memcpy(config->upstreams[index].name, value, name_length);
+    config->upstreams[index].name[name_length] = '\0';
+    config->upstreams[index].server_count = count;
+    config->upstream_count++;
+    return 0;
+}
+
+int config_set(config_t *config, const char *key, const char *value) {
+    if (!config || !key || !value) {
+        return -1;
+    }
+
+    if (strcmp(key, "port") == 0) {
+        return parse_int(value, 1, 65534, &config->port);
+    } else if (strcmp(key, "tls-port") == 0) {
+        return parse_int(value, 1, 65535, &config->tls_port);
+    } else if (strcmp(key, "tls-cert") == 0) {
+        return parse_path(value, config->tls_cert, sizeof(config->tls_cert));
+    } else if (strcmp(key, "tls-key") == 0) {
+        return parse_path(value, config->tls_key, sizeof(config->tls_key));
+    } else if (strcmp(key, "ktls") == 0) {
+        return parse_bool(value, &config->ktls);
+    } else if (strcmp(key, "workers") == 0) {
+        return parse_int(value, 0, MAX_WORKERS, &config->workers);
+    } else if (strcmp(key, "max-requests") == 0) {
+        return parse_int(value, 1, 1000000, &config->max_requests);
+    } else if (strcmp(key, "backlog") == 0) {
+        return parse_int(value, 1, 65535, &config->backlog);
+    } else if (strcmp(key, "max-connections") == 0) {
+        return parse_int(value, 1, 1000000, &config->max_connections);
+    } else if (strcmp(key, "max-body-size") == 0) {
+        return parse_size(value, &config->max_body_size);
+    } else if (strcmp(key, "rate-limit") == 0) {
+        return parse_int(value, 0, 1000000000, &config->rate_limit);
+    } else if (strcmp(key, "rate-limit-burst") == 0) {
+        return parse_int(value, 0, 1000000000, &config->rate_limit_burst);
+    } else if (strcmp(key, "rate-limit-prefix") == 0) {
+        return parse_int(value, 0, 32, &config->rate_limit_prefix);
+    } else if (strcmp(key, "bundle") == 0) {
+        return parse_path(value, config->bundle, sizeof(config->bundle));
+    } else if (strcmp(key, "build-bundle") == 0) {
+        return parse_path(value, config->build_bundle, sizeof(config->build_bundle));
+    } else if (strcmp(key, "cache-size") == 0) {
+        return parse_size(value, &config->cache_size);
+    } else if (strcmp(key, "cache-max-entry") == 0) {
+        return parse_size(value, &config->cache_max_entry);
+    } else if (strcmp(key, "gzip") == 0) {
+        return parse_bool(value, &config->gzip);
+    } else if (strcmp(key, "gzip-level") == 0) {
+        return parse_int(value, 1, 9, &config->gzip_level);
+    } else if (strcmp(key, "gzip-min-length") == 0) {
+        return parse_size(value, &config->gzip_min_length);
+    } else if (strcmp(key, "log-console") == 0) {
+        return parse_bool(value, &config->log_console);
+    } else if (strcmp(key, "io") == 0) {
+        if (strcmp(value, "epoll") == 0) {
+            config->io_backend = IO_BACKEND_EPOLL;
+        } else if (strcmp(value, "uring") == 0 || strcmp(value, "io_uring") == 0) {
+            config->io_backend = IO_BACKEND_URING;
+        } else {
+            return -1;
+        }
+        return 0;
+    } else if (strcmp(key, "header-timeout") == 0) {
+        return parse_int(value, 0, 3600, &config->timeouts[TIMEOUT_HEADER]);
+    } else if (strcmp(key, "body-timeout") == 0) {
+        return parse_int(value, 0, 3600, &config->timeouts[TIMEOUT_BODY]);
+    } else if (strcmp(key, "keepalive-timeout") == 0) {
+        return parse_int(value, 0, 3600, &config->timeouts[TIMEOUT_IDLE]);
+    } else if (strcmp(key, "write-timeout") == 0) {
+        return parse_int(value, 0, 3600, &config->timeouts[TIMEOUT_WRITE]);
+    } else if (strcmp(key, "proxy-timeout") == 0) {
+        return parse_int(value, 0, 3600, &config->timeouts[TIMEOUT_UPSTREAM]);
+    } else if (strcmp(key, "drain-timeout") == 0) {
+        return parse_int(value, 0, 3600, &config->drain_timeout);
+    } else if (strcmp(key, "upstream") == 0) {
+        return parse_upstream(config, value);
+    } else if (strcmp(key, "balance") == 0) {
+        if (strcmp(value, "round-robin") == 0) {
+            config->balance = BALANCE_ROUND_ROBIN;
+        } else if (strcmp(value, "least-conn") == 0) {
+            config->balance = BALANCE_LEAST_CONN;
+        } else {
+            return -1;
+        }
+        return 0;
+    } else if (strcmp(key, "max-age") == 0) {
+        return parse_max_age(config, value);
+    } else if (strcmp(key, "root") == 0) {
+        return parse_root(value, strlen(value), config->root, sizeof(config->root));
+    } else if (strcmp(key, "vhost") == 0) {
+        return parse_vhost(config, value);
+    } else if (strcmp(key, "route") == 0) {
+        return parse_route(config, value);
+    } else if (strcmp(key, "config") == 0) {
+        return config_load(config, value);
+    }
+
+    return -1;
+}
+
+/* One "key value" option per line, keys as on the command line without "--"; '#' starts a comment */
+int config_load(config_t *config, const char *path) {
+    static int depth;
+    char line[MAX_PATH_LENGTH * 2];
+    int line_number = 0;
+    int result = 0;
+
+    /* Files may include each other, but not forever */
+    if (!config || !path || depth >= 8) {
+        return -1;
+    }
+
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "Cannot open config file %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    depth++;
+    while (result == 0 && fgets(line, sizeof(line), file)) {
+        line_number++;
+
+        char *comment = strchr(line, '#');
+        if (comment) {
+            *comment = '\0';
+        }
+
+        char *key = line + strspn(line, " \t");
+        char *end = key + strlen(key);
+        while (end > key && isspace((unsigned char)end[-1])) {
+            *--end = '\0';
+        }
+        if (*key == '\0') {
+            continue;
+        }
+
+        char *value = key + strcspn(key, " \t");
+        if (*value != '\0') {
+            *value++ = '\0';
+            value += strspn(value, " \t");
+        }
+
+        if (config_set(config, key, value) != 0) {
+            fprintf(stderr, "%s:%d: invalid option: %s %s\n", path, line_number, key, value);
+            result = -1;
+        }
+    }
+    depth--;
+
+    fclose(file);
+    return result;
+}
+
+int parse_config_args(config_t *config, int argc, char *argv[]) {
+    if (!config) {
+        return -1;
+    }
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+
+        /* Options are "--key value"; a bare number is the port for compatibility */
+        if (strncmp(arg, "--", 2) == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Missing value for %s\n", arg);
+                return -1;
+            }
+            if (config_set(config, arg + 2, argv[i + 1]) != 0) {
+                fprintf(stderr, "Invalid option: %s %s\n", arg, argv[i + 1]);
+                return -1;
+            }
+            i++;
+        } else if (config_set(config, "port", arg) != 0) {
+            fprintf(stderr, "Invalid port number: %s\n", arg);
+            return -1;
+        }
+    }
+
+    /* Resolve the automatic worker count: one per CPU this process may run on */
+    if (config->workers == 0) {
+        cpu_set_t allowed;
+        long cpus = sched_getaffinity(0, sizeof(allowed), &allowed) == 0 ? CPU_COUNT(&allowed)
+                                                                          : sysconf(_SC_NPROCESSORS_ONLN);
+        config->workers = cpus > 0 ? (int)cpus : 1;
+        if (config->workers > MAX_WORKERS) {
+            config->workers = MAX_WORKERS;
+        }
+    }
+
+    return 0;
+}
+
+/* Cache-Control max-age for a "Content-Type: ...\r\n" header line; first matching rule wins */
+int config_max_age(const config_t *config, const char *content_type) {
+    if (!config || !content_type) {
+        return -1;
+    }
+
+    const char *mime = strchr(content_type, ':');
+    mime = mime ? mime + 1 : content_type;
+    while (*mime == ' ') {
+        mime++;
+    }
+    size_t mime_length = strcspn(mime, "; \r\n");
+
+    for (int i = 0; i < config->max_age_rule_count; i++) {
+        const char *type = config->max_age_rules[i].type;
+        size_t type_length = strlen(type);
+        int matches = type[type_length - 1] == '*'
+                          ? strncasecmp(mime, type, type_length - 1) == 0
+                          : type_length == mime_length && strncasecmp(mime, type, mime_length) == 0;
+        if (matches) {
+            return config->max_age_rules[i].seconds;
+        }
+    }
+    return config->max_age;
+}
@@ -0,0 +1,952 @@
+#include "server.h"
+#include <stddef.h>
+#include <linux/sockios.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+
+/* Written to shed clients as is: no request is parsed, nothing is allocated */
+static const char shed_response[] = HTTP_VERSION " 503 Service Unavailable\r\n"
+                                    "Server: " SERVER_NAME "\r\n"
+                                    "Retry-After: " RETRY_AFTER_SECONDS "\r\n"
+                                    "Content-Length: 0\r\n"
+                                    "Connection: close\r\n\r\n";
+
+/* Written to clients over --rate-limit as is: no handler runs, nothing is built */
+#define LIMITED_RESPONSE(connection) HTTP_VERSION " 429 Too Many Requests\r\n" \
+                                     "Server: " SERVER_NAME "\r\n" \
+                                     "Retry-After: " RETRY_AFTER_SECONDS "\r\n" \
+                                     "Content-Length: 0\r\n" \
+                                     "Connection: " connection "\r\n\r\n"
+static const char limited_response[] = LIMITED_RESPONSE("keep-alive");
+static const char limited_close_response[] = LIMITED_RESPONSE("close");
+
+/* Interim answer to "Expect: 100-continue" */
+static const char continue_response[] = HTTP_VERSION " 100 Continue\r\n\r\n";
+
+static int queue_overloaded(const listen_sample_t *sample) {
+    return sample->limit > 0 && sample->depth * 4 >= sample->limit * 3;
+}
+
+/*
+ * Sample a listener's accept queue with TCP_INFO, which reports its current
+ * length and cap for a listening socket. Each listener keeps its own sample.
+ * Once per tick is enough normally; while the queue looks overloaded every
+ * accept re-checks, so shedding stops as soon as the backlog has drained.
+ */
+static int listen_queue_overloaded(worker_t *worker, int listen_fd) {
+    int tls = listen_fd == worker->tls_listen_fd;
+    listen_sample_t *sample = &worker->listen_samples[tls];
+    uint64_t now = timer_now();
+    if (!queue_overloaded(sample) && now - sample->sampled_at < TIMER_TICK_MS) {
+        return FALSE;
+    }
+
+    struct tcp_info info;
+    socklen_t length = sizeof(info);
+    if (getsockopt(listen_fd, IPPROTO_TCP, TCP_INFO, &info, &length) == 0) {
+        sample->depth = info.tcpi_unacked;
+        sample->limit = info.tcpi_sacked;
+        metrics_listen_queue(tls, info.tcpi_unacked);
+    }
+    sample->sampled_at = now;
+    return queue_overloaded(sample);
+}
+
+/*
+ * Admission control for a freshly accepted socket. Past --max-connections, or
+ * when the accept queue is about to overflow (where the kernel would start
+ * dropping SYNs and clients would sit out retransmit timeouts), the client
+ * gets an immediate 503 with Retry-After instead, and the socket is closed.
+ * A TLS client could not read a cleartext answer, so it only sees the close.
+ * listen_fd is the listener fd was accepted from; its own queue is checked.
+ */
+int connection_admit(worker_t *worker, int listen_fd, int fd) {
+    int tls = listen_fd == worker->tls_listen_fd;
+    int reason = SHED_NONE;
+    if (__atomic_load_n(&g_server.active_connections, __ATOMIC_RELAXED) >= g_config.max_connections) {
+        reason = SHED_LIMIT;
+    } else if (listen_queue_overloaded(worker, listen_fd)) {
+        reason = SHED_QUEUE;
+    }
+    if (reason == SHED_NONE) {
+        return TRUE;
+    }
+
+    /* A new socket's send buffer is empty, so this neither blocks nor comes up short; a failure means the client left */
+    if (!tls) {
+        send(fd, shed_response, sizeof(shed_response) - 1, MSG_NOSIGNAL | MSG_DONTWAIT);
+    }
+
+    /* Swallow a request that already arrived, so close() sends FIN rather than RST over the answer */
+    char discard[1024];
+    while (recv(fd, discard, sizeof(discard), MSG_DONTWAIT) > 0) {
+    }
+    close(fd);
+    metrics_count_shed(reason);
+    return FALSE;
+}
+
+connection_t* connection_create(worker_t *worker, int fd, const struct sockaddr_in *client_addr) {
+    connection_t *conn = pool_alloc(sizeof(connection_t));
+    if (!conn) {
+        return NULL;
+    }
+
+    /* Buffers and request state are attached when the first bytes arrive */
+    memset(conn, 0, sizeof(connection_t));
+    conn->fd = fd;
+    conn->state = CONN_READING;
+    conn->worker = worker;
+
+    /* Track the connection so the worker can release it on shutdown */
+    if (worker) {
+        conn->next = worker->connections;
+        if (worker->connections) {
+            worker->connections->prev = conn;
+        }
+        worker->connections = conn;
+        worker->connection_count++;
+    }
+    __atomic_fetch_add(&g_server.active_connections, 1, __ATOMIC_RELAXED);
+    metrics_connection_opened(); /* Paired with the close every connection ends in, set up or not */
+
+    /* Remember the peer address once instead of asking the kernel per request */
+    if (client_addr) {
+        inet_ntop(AF_INET, &client_addr->sin_addr, conn->client_ip, sizeof(conn->client_ip));
+        conn->client_addr = client_addr->sin_addr.s_addr;
+    } else {
+        strcpy(conn->client_ip, "unknown");
+    }
+
+    return conn;
+}
+
+/* Room for more input; attaches the working state on first use and grows the buffer only when full */
+char* connection_input(connection_t *conn, size_t *space) {
+    if (!conn->work) {
+        conn->work = pool_alloc(sizeof(connection_work_t));
+        conn->in_buf = pool_alloc(INITIAL_BUFFER_SIZE);
+        if (!conn->work || !conn->in_buf) {
+            pool_free(conn->work, sizeof(connection_work_t));
+            pool_free(conn->in_buf, INITIAL_BUFFER_SIZE);
+            conn->work = NULL;
+            conn->in_buf = NULL;
+            return NULL;
+        }
+        http_request_init(&conn->work->request);
+        conn->in_cap = pool_capacity(INITIAL_BUFFER_SIZE);
+        conn->in_len = 0;
+        conn->in_buf[0] = '\0';
+    }
+
+    /* An HTTP/2 connection must hold a whole frame, larger than any request head we take */
+    size_t limit = conn->h2 ? HTTP2_INPUT_SIZE : BUFFER_SIZE;
+    if (conn->in_len + 1 >= conn->in_cap && conn->in_cap < limit) {
+        size_t new_cap = conn->in_cap * 2 < limit ? conn->in_cap * 2 : limit;
+        char *new_buf = pool_alloc(new_cap);
+        if (!new_buf) {
+            return NULL;
+        }
+        memcpy(new_buf, conn->in_buf, conn->in_len + 1);
+        pool_free(conn->in_buf, conn->in_cap);
+        conn->in_buf = new_buf;
+        conn->in_cap = new_cap;
+    }
+
+    *space = conn->in_cap - 1 - conn->in_len;
+    return conn->in_buf + conn->in_len;
+}
+
+int connection_read(connection_t *conn) {
+    if (!conn) {
+        return -1;
+    }
+
+    /* Edge-triggered: drain the socket until it would block or the buffer is at its limit */
+    for (;;) {
+        size_t space;
+        char *in = connection_input(conn, &space);
+        if (!in) {
+            return -1;
+        }
+        if (space == 0) {
+            break;
+        }
+
+        ssize_t n = conn->tls ? tls_recv(conn, in, space) : recv(conn->fd, in, space, 0);
+        if (n > 0) {
+            conn->in_len += (size_t)n;
+            continue;
+        }
+        if (n == 0) {
+            return -1; /* Peer closed the connection */
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+        }
+        return -1;
+    }
+
+    conn->in_buf[conn->in_len] = '\0';
+    return 0;
+}
+
+/* Room for at least `length` more bytes at the end of the output buffer */
+char* connection_reserve(connection_t *conn, size_t length) {
+    /* Grow the output buffer geometrically; pipelined responses queue up here */
+    if (conn->out_len + length > conn->out_cap) {
+        size_t new_cap = conn->out_cap ? conn->out_cap : INITIAL_BUFFER_SIZE;
+        while (new_cap < conn->out_len + length) {
+            new_cap *= 2;
+        }
+        char *new_buf = pool_alloc(new_cap);
+        if (!new_buf) {
+            return NULL;
+        }
+        memcpy(new_buf, conn->out_buf, conn->out_len);
+        pool_free(conn->out_buf, conn->out_cap);
+        conn->out_buf = new_buf;
+        conn->out_cap = pool_capacity(new_cap);
+    }
+    return conn->out_buf + conn->out_len;
+}
+
+/* Queue `length` bytes written in place after connection_reserve() */
+int connection_commit(connection_t *conn, size_t length) {
+    /* Extend the previous buffer chunk when it ends right here */
+    out_chunk_t *last = conn->out_count > conn->out_head ? &conn->work->out_queue[conn->out_count - 1] : NULL;
+    if (last && last->type == OUT_CHUNK_BUFFER && (size_t)last->offset + last->length == conn->out_len) {
+        last->length += length;
+    } else {
+        if (conn->out_count >= OUT_QUEUE_SIZE) {
+            return -1;
+        }
+        out_chunk_t *chunk = &conn->work->out_queue[conn->out_count++];
+        chunk->type = OUT_CHUNK_BUFFER;
+        chunk->fd = -1;
+        chunk->offset = (off_t)conn->out_len;
+        chunk->length = length;
+    }
+
+    conn->out_len += length;
+    return 0;
+}
+
+int connection_append(connection_t *conn, const char *data, size_t length) {
+    if (!conn || !data) {
+        return -1;
+    }
+    if (length == 0) {
+        return 0;
+    }
+
+    char *out = connection_reserve(conn, length);
+    if (!out) {
+        return -1;
+    }
+    memcpy(out, data, length);
+    return connection_commit(conn, length);
+}
+
+int connection_append_memory(connection_t *conn, const char *data, size_t length,
+                             void (*release)(void *ctx), void *ctx) {
+    if (!conn || !data || conn->out_count >= OUT_QUEUE_SIZE) {
+        return -1;
+    }
+
+    /* Referenced, not copied: release(ctx) runs once the bytes are on the wire */
+    out_chunk_t *chunk = &conn->work->out_queue[conn->out_count++];
+    chunk->type = OUT_CHUNK_MEMORY;
+    chunk->fd = -1;
+    chunk->data = data;
+    chunk->offset = 0;
+    chunk->length = length;
+    chunk->release = release;
+    chunk->ctx = ctx;
+    return 0;
+}
+
+int connection_append_file(connection_t *conn, int fd, off_t offset, size_t length) {
+    if (!conn || fd < 0 || conn->out_count >= OUT_QUEUE_SIZE) {
+        return -1;
+    }
+
+    /* The queue owns the descriptor from here on */
+    out_chunk_t *chunk = &conn->work->out_queue[conn->out_count++];
+    chunk->type = OUT_CHUNK_FILE;
+    chunk->fd = fd;
+    chunk->offset = offset;
+    chunk->length = length;
+    chunk->release = NULL;
+    return 0;
+}
+
+int connection_append_shared_file(connection_t *conn, int fd, off_t offset, size_t length,
+                                  void (*release)(void *ctx), void *ctx) {
+    if (connection_append_file(conn, fd, offset, length) != 0) {
+        return -1;
+    }
+
+    /* The descriptor stays with its owner: release(ctx) runs instead of close() once the range is out */
+    out_chunk_t *chunk = &conn->work->out_queue[conn->out_count - 1];
+    chunk->release = release;
+    chunk->ctx = ctx;
+    return 0;
+}
+
+static void release_chunk(out_chunk_t *chunk) {
+    if (chunk->type == OUT_CHUNK_FILE && chunk->fd >= 0) {
+        if (chunk->release) {
+            chunk->release(chunk->ctx);
+            chunk->release = NULL;
+        } else {
+            close(chunk->fd);
+        }
+        chunk->fd = -1;
+    } else if (chunk->type == OUT_CHUNK_MEMORY && chunk->release) {
+        chunk->release(chunk->ctx);
+        chunk->release = NULL;
+    }
+}
+
+/* Describe the consecutive in-memory chunks at the head of the queue; returns the iovec count */
+int connection_gather(const connection_t *conn, struct iovec *iov, int max_iov) {
+    int count = 0;
+
+    for (int i = conn->out_head; i < conn->out_count && count < max_iov &&
+                                 conn->work->out_queue[i].type != OUT_CHUNK_FILE; i++) {
+        const out_chunk_t *chunk = &conn->work->out_queue[i];
+        const char *base = chunk->type == OUT_CHUNK_BUFFER ? conn->out_buf : chunk->data;
+        iov[count].iov_base = (char *)base + chunk->offset;
+        iov[count].iov_len = chunk->length;
+        count++;
+    }
+    return count;
+}
+
+/* Gather consecutive in-memory chunks into one sendmsg(); returns bytes written or -1 */
+static ssize_t flush_buffers(connection_t *conn) {
+    struct iovec iov[OUT_QUEUE_SIZE];
+    struct msghdr msg = {0};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = (size_t)connection_gather(conn, iov, OUT_QUEUE_SIZE);
+
+    /* Headers in front of a file body are held back so they share its first segment */
+    int index = conn->out_head + (int)msg.msg_iovlen;
+    int more = index < conn->out_count && conn->work->out_queue[index].type == OUT_CHUNK_FILE;
+
+    ssize_t written = sendmsg(conn->fd, &msg, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+    if (written > 0) {
+        connection_advance(conn, (size_t)written);
+    }
+    return written;
+}
+
+/*
+ * TLS encrypted in userspace: copy up to one record's worth from the head of
+ * the queue, file ranges included, and hand it to SSL_write(). A write that
+ * would block is retried with the same head bytes, as OpenSSL requires.
+ */
+static ssize_t flush_tls(connection_t *conn) {
+    char record[TLS_RECORD_SIZE];
+    size_t length = 0;
+
+    for (int i = conn->out_head; i < conn->out_count && length < sizeof(record); i++) {
+        const out_chunk_t *chunk = &conn->work->out_queue[i];
+        size_t take = chunk->length < sizeof(record) - length ? chunk->length : sizeof(record) - length;
+        if (take == 0) {
+            continue;
+        }
+        if (chunk->type == OUT_CHUNK_FILE) {
+            ssize_t n = pread(chunk->fd, record + length, take, chunk->offset);
+            if (n <= 0) {
+                if (length > 0) {
+                    break; /* Send what we have; the file is dealt with on the next round */
+                }
+                return n; /* A file that shrank reads 0, like sendfile() */
+            }
+            length += (size_t)n;
+            if ((size_t)n < take) {
+                break;
+            }
+        } else {
+            const char *base = chunk->type == OUT_CHUNK_BUFFER ? conn->out_buf : chunk->data;
+            memcpy(record + length, base + chunk->offset, take);
+            length += take;
+        }
+    }
+
+    ssize_t written = tls_send(conn, record, length);
+    if (written > 0) {
+        connection_advance(conn, (size_t)written);
+    }
+    return written;
+}
+
+/* Advance the queue past bytes the kernel accepted, releasing finished chunks */
+void connection_advance(connection_t *conn, size_t bytes) {
+    size_t remaining = bytes;
+    while (conn->out_head < conn->out_count) {
+        out_chunk_t *chunk = &conn->work->out_queue[conn->out_head];
+        size_t step = remaining < chunk->length ? remaining : chunk->length;
+        chunk->offset += (off_t)step;
+        chunk->length -= step;
+        remaining -= step;
+        if (chunk->length > 0) {
+            break;
+        }
+        release_chunk(chunk);
+        conn->out_head++;
+    }
+}
+
+int connection_flush(connection_t *conn) {
+    if (!conn) {
+        return -1;
+    }
+
+    while (conn->out_head < conn->out_count) {
+        out_chunk_t *chunk = &conn->work->out_queue[conn->out_head];
+        ssize_t n;
+
+        if (chunk->length == 0) {
+            release_chunk(chunk);
+            conn->out_head++;
+            continue;
+        }
+
+        if (conn->tls && !tls_offloaded(conn)) {
+            n = flush_tls(conn);
+            if (n > 0) {
+                conn->bytes_sent += (size_t)n;
+                metrics_add_bytes((size_t)n);
+            }
+        } else if (chunk->type != OUT_CHUNK_FILE) {
+            n = flush_buffers(conn);
+            if (n > 0) {
+                conn->bytes_sent += (size_t)n;
+                metrics_add_bytes((size_t)n);
+            }
+        } else {
+            /* File bodies go straight from the page cache to the socket */
+            n = sendfile(conn->fd, chunk->fd, &chunk->offset, chunk->length);
+            if (n > 0) {
+                chunk->length -= (size_t)n;
+                conn->bytes_sent += (size_t)n;
+                metrics_add_bytes((size_t)n);
+            } else if (n == 0) {
+                return -1; /* File shrank underneath us; Content-Length is now a lie */
+            }
+        }
+
+        if (n > 0) {
+            continue;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0; /* Resume on EPOLLOUT */
+        }
+        return -1;
+    }
+
+    /* Everything went out: rewind the queue for the next batch */
+    conn->out_len = 0;
+    conn->out_head = 0;
+    conn->out_count = 0;
+    return 1;
+}
+
+/* Queue the whole body; ownership of the fd or cache reference moves to the queue */
+static int queue_body(connection_t *conn, http_response_t *response) {
+    int queued = 0;
+
+    if (response->file_fd >= 0) {
+        if (response->body_length == 0) {
+            close(response->file_fd);
+        } else if ((queued = connection_append_file(conn, response->file_fd, response->file_offset,
+                                                    response->body_length)) != 0) {
+            close(response->file_fd);
+        }
+        response->file_fd = -1;
+    } else if (response->cache_entry) {
+        const char *data = file_cache_data(response->cache_entry, NULL);
+        if (response->body_length == 0) {
+            file_cache_release(response->cache_entry);
+        } else if ((queued = connection_append_memory(conn, data, response->body_length,
+                                                      file_cache_release, response->cache_entry)) != 0) {
+            file_cache_release(response->cache_entry);
+        }
+        response->cache_entry = NULL;
+    } else if (response->body) {
+        queued = connection_append(conn, response->body, response->body_length);
+    }
+    return queued;
+}
+
+/* Queue each requested range, framed as multipart/byteranges when there are several */
+static int queue_ranges(connection_t *conn, http_response_t *response) {
+    char part_header[256];
+    int multipart = response->range_count > 1;
+
+    for (int i = 0; i < response->range_count; i++) {
+        const http_range_t *range = &response->ranges[i];
+
+        if (multipart) {
+            size_t length = build_range_part_header(response, i, part_header, sizeof(part_header));
+            if (length == 0 || connection_append(conn, part_header, length) != 0) {
+                return -1;
+            }
+        }
+
+        /* Every part holds its own descriptor or cache reference; free_response drops ours */
+        if (response->file_fd >= 0) {
+            int fd = fcntl(response->file_fd, F_DUPFD_CLOEXEC, 0);
+            if (fd < 0) {
+                return -1;
+            }
+            if (connection_append_file(conn, fd, range->start, range->length) != 0) {
+                close(fd);
+                return -1;
+            }
+        } else if (response->cache_entry) {
+            const char *data = file_cache_data(response->cache_entry, NULL);
+            file_cache_retain(response->cache_entry);
+            if (connection_append_memory(conn, data + range->start, range->length,
+                                         file_cache_release, response->cache_entry) != 0) {
+                file_cache_release(response->cache_entry);
+                return -1;
+            }
+        }
+    }
+
+    if (multipart) {
+        size_t length = build_multipart_trailer(part_header, sizeof(part_header));
+        if (length == 0 || connection_append(conn, part_header, length) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Queue headers and body of a response; returns -1 if it could not be queued whole */
+int connection_respond(connection_t *conn, http_response_t *response) {
+    /* Headers are built straight into the output buffer, behind any earlier pipelined responses */
+    response->keep_alive = !conn->close_after_write;
+    char *headers = connection_reserve(conn, MAX_RESPONSE_HEADER_SIZE);
+    size_t header_length = headers ? build_http_response(response, headers, MAX_RESPONSE_HEADER_SIZE) : 0;
+    int queued = header_length > 0 ? connection_commit(conn, header_length) : -1;
+    if (queued == 0) {
+        queued = response->range_count > 0 ? queue_ranges(conn, response) : queue_body(conn, response);
+    }
+    if (queued != 0) {
+        conn->close_after_write = TRUE; /* A truncated response cannot be repaired */
+    }
+    return queued;
+}
+
+/* Tell a client waiting on "Expect: 100-continue" to send its body; once per request */
+int connection_continue(connection_t *conn) {
+    http_request_t *request = &conn->work->request;
+    if (!request->expect_continue) {
+        return 0;
+    }
+
+    request->expect_continue = FALSE;
+    if (request->version_major == 1 && request->version_minor == 0) {
+        return 0; /* HTTP/1.0 has no interim responses */
+    }
+    return connection_append(conn, continue_response, sizeof(continue_response) - 1);
+}
+
+/* Parse and answer one buffered request; returns bytes consumed, 0 if incomplete */
+static size_t connection_handle_request(connection_t *conn, char *data, size_t length) {
+    http_request_t *request = &conn->work->request;
+    http_response_t response;
+    char method[16];
+    char path[MAX_PATH_LENGTH];
+    size_t consumed = length;
+    int streaming = FALSE;
+    int too_large = FALSE;
+    int limited = FALSE;
+
+    /* The parser resumes from its saved state, so partial reads are never rescanned */
+    uint64_t started = metrics_now();
+    int parsed = parse_http_request(data, length, request);
+    uint64_t parse_time = metrics_now() - started;
+    if (parsed == HTTP_PARSE_INCOMPLETE) {
+        if (length < BUFFER_SIZE - 1 && !conn->peer_closed) {
+            return 0;
+        }
+        parsed = HTTP_PARSE_ERROR; /* Headers larger than the buffer */
+    }
+
+    if (parsed == HTTP_PARSE_OK) {
+        size_t total = request->header_length + (size_t)request->content_length;
+        if (g_config.max_body_size > 0 && (size_t)request->content_length > g_config.max_body_size) {
+            too_large = TRUE; /* Refused from the head alone; a client that sent Expect never sends the body */
+        } else if (total > length && router_streams_body(request)) {
+            streaming = TRUE; /* Its handler relays the body from in_buf as it arrives */
+            consumed = request->header_length;
+        } else if (total > BUFFER_SIZE - 1) {
+            parsed = HTTP_PARSE_ERROR;
+        } else if (total > length) {
+            if (!conn->peer_closed) {
+                connection_continue(conn);
+                return 0; /* Body still in flight */
+            }
+            parsed = HTTP_PARSE_ERROR;
+        } else {
+            consumed = total;
+        }
+    }
+
+    /* "Upgrade: h2c" switches the connection; the request itself is answered on stream 1 */
+    if (parsed == HTTP_PARSE_OK && !streaming && !too_large && http2_upgrade(conn, request) == 0) {
+        metrics_observe(METRIC_PARSE, parse_time);
+        http_request_init(request);
+        return consumed;
+    }
+
+    conn->requests_served++;
+    http_response_init(&response);
+
+    if (parsed != HTTP_PARSE_OK) {
+        /* Framing is lost after a malformed request, so the connection must end */
+        log_message(LOG_ERROR, "Failed to parse HTTP request");
+        create_error_response(HTTP_BAD_REQUEST, &response);
+        conn->close_after_write = TRUE;
+    } else if (too_large) {
+        create_error_response(HTTP_CONTENT_TOO_LARGE, &response);
+        conn->close_after_write = TRUE;
+    } else {
+        limited = !ratelimit_allow(conn->client_addr);
+        if (limited) {
+            response.status_code = HTTP_TOO_MANY_REQUESTS;
+        } else {
+            handle_client(conn, request, &response);
+        }
+        if (!request->keep_alive || conn->requests_served >= g_config.max_requests || g_server.draining) {
+            conn->close_after_write = TRUE;
+        }
+    }
+
+    /* The proxy and uploads answer on their own time and take the body from in_buf, so only the head is consumed */
+    if (response.deferred) {
+        consumed = request->header_length;
+        metrics_observe(METRIC_PARSE, parse_time);
+        http_request_init(request);
+        return consumed;
+    }
+    if (streaming || request->chunked) {
+        conn->close_after_write = TRUE; /* The unread body would be taken for the next request */
+    }
+
+    if (limited) {
+        if (conn->close_after_write) {
+            connection_append(conn, limited_close_response, sizeof(limited_close_response) - 1);
+        } else {
+            connection_append(conn, limited_response, sizeof(limited_response) - 1);
+        }
+    } else {
+        connection_respond(conn, &response);
+    }
+
+    metrics_observe(METRIC_PARSE, parse_time);
+    metrics_observe(METRIC_TOTAL, metrics_now() - started);
+    metrics_count_request(parsed == HTTP_PARSE_OK ? request : NULL, response.status_code);
+
+    /* Log the request */
+    http_slice_copy(request, request->method, method, sizeof(method));
+    http_slice_copy(request, request->path, path, sizeof(path));
+    log_request(method, path, response.status_code, conn->client_ip);
+
+    /* Bodies built for this request were copied into out_buf; their arena can be reused */
+    free_response(&response);
+    arena_reset();
+    http_request_init(request);
+    return consumed;
+}
+
+/* Answer every complete pipelined request in the read buffer; returns how many were handled */
+int connection_handle_input(connection_t *conn) {
+    size_t offset = 0;
+    int handled = 0;
+
+    /* HTTP/2 with prior knowledge opens with the connection preface instead of a request */
+    if (!conn->h2 && conn->requests_served == 0 && conn->in_len > 0) {
+        int preface = http2_preface(conn->in_buf, conn->in_len);
+        if (preface < 0) {
+            return 0; /* Too short to tell yet */
+        }
+        if (preface > 0 && http2_start(conn) != 0) {
+            conn->close_after_write = TRUE;
+            return 1;
+        }
+    }
+    if (conn->h2) {
+        return http2_handle_input(conn);
+    }
+
+    while (offset < conn->in_len && !conn->close_after_write && !conn->proxy && !conn->upload && !conn->h2 &&
+           conn->out_len < OUTPUT_HIGH_WATER && conn->out_count + MAX_RESPONSE_CHUNKS <= OUT_QUEUE_SIZE) {
+        size_t used = connection_handle_request(conn, conn->in_buf + offset, conn->in_len - offset);
+        if (used == 0) {
+            break;
+        }
+        offset += used;
+        handled++;
+    }
+
+    /* Keep only the unconsumed tail (a partial or throttled request) */
+    if (offset > 0) {
+        memmove(conn->in_buf, conn->in_buf + offset, conn->in_len - offset);
+        conn->in_len -= offset;
+        conn->in_buf[conn->in_len] = '\0';
+    }
+    if (conn->h2) {
+        return handled + http2_handle_input(conn); /* Upgraded: what follows is the client preface */
+    }
+    if (conn->close_after_write && !conn->proxy && !conn->upload) {
+        conn->in_len = 0;
+    }
+    return handled;
+}
+
+/* Hand the buffers and request state back to the pool while nothing is buffered either way */
+void connection_idle(connection_t *conn) {
+    if (!conn->work || conn->in_len > 0 || conn->out_head < conn->out_count) {
+        return;
+    }
+
+    pool_free(conn->in_buf, conn->in_cap);
+    pool_free(conn->out_buf, conn->out_cap);
+    pool_free(conn->work, sizeof(connection_work_t));
+    conn->work = NULL;
+    conn->in_buf = NULL;
+    conn->in_cap = 0;
+    conn->out_buf = NULL;
+    conn->out_cap = 0;
+    conn->out_len = 0;
+    conn->out_head = 0;
+    conn->out_count = 0;
+}
+
+/* Hot restart: a keep-alive connection between requests closes instead of waiting for the next one */
+int connection_drained(const connection_t *conn) {
+    return g_server.draining && conn->in_len == 0 && conn->requests_served > 0 && !conn->h2 && !conn->proxy &&
+           !conn->upload;
+}
+
+/* Bytes the peer has acknowledged: what we sent minus what still sits in the socket send queue */
+static uint64_t connection_delivered(const connection_t *conn) {
+    int queued = 0;
+    if (ioctl(conn->fd, SIOCOUTQ, &queued) != 0 || queued < 0) {
+        queued = 0;
+    }
+    /* bytes_sent counts plaintext; with TLS the queue also holds record overhead */
+    if ((uint64_t)queued > conn->bytes_sent) {
+        return 0;
+    }
+    return conn->bytes_sent - (uint64_t)queued;
+}
+
+/*
+ * Arm the deadline of whatever the connection now waits for. Read deadlines
+ * run from the start of their phase, so a client trickling bytes cannot
+ * stretch them; the write and upstream deadlines restart on every bit of
+ * progress, and so does the body deadline of an upload, which may run to
+ * gigabytes.
+ */
+void connection_schedule(connection_t *conn, int writing) {
+    int deadline;
+    if (writing || http2_blocked(conn)) {
+        deadline = TIMEOUT_WRITE;
+    } else if (conn->proxy) {
+        deadline = TIMEOUT_UPSTREAM;
+    } else if (conn->upload) {
+        deadline = TIMEOUT_BODY;
+    } else if (conn->in_len == 0 && conn->requests_served > 0) {
+        deadline = TIMEOUT_IDLE;
+    } else if (conn->work && conn->work->request.header_length > 0) {
+        deadline = TIMEOUT_BODY;
+    } else {
+        deadline = TIMEOUT_HEADER;
+    }
+
+    if (deadline == conn->deadline && deadline != TIMEOUT_WRITE && deadline != TIMEOUT_UPSTREAM && !conn->upload &&
+        conn->deadline_requests == conn->requests_served) {
+        return;
+    }
+    if (deadline == TIMEOUT_WRITE && conn->deadline != TIMEOUT_WRITE) {
+        conn->bytes_delivered = connection_delivered(conn);
+    }
+    conn->deadline = deadline;
+    conn->deadline_requests = conn->requests_served;
+
+    if (!conn->worker) {
+        return;
+    }
+    if (g_config.timeouts[deadline] <= 0) {
+        timer_cancel(&conn->worker->timers, &conn->timer);
+        return;
+    }
+    timer_arm(&conn->worker->timers, &conn->timer, timer_now(), (unsigned)g_config.timeouts[deadline] * 1000);
+}
+
+/* Connection whose deadline fired, for the caller to close; NULL if it turned out to be making progress */
+connection_t* connection_expired(timer_entry_t *timer) {
+    connection_t *conn = (connection_t *)(void *)((char *)timer - offsetof(connection_t, timer));
+
+    /*
+     * A large send buffer can drain for seconds before the socket reports
+     * writable again, so a quiet socket is not necessarily a stalled peer:
+     * only one that acknowledged nothing since the last check is.
+     */
+    if (conn->deadline == TIMEOUT_WRITE) {
+        uint64_t delivered = connection_delivered(conn);
+        if (delivered > conn->bytes_delivered) {
+            conn->bytes_delivered = delivered;
+            timer_arm(&conn->worker->timers, &conn->timer, timer_now(),
+                      (unsigned)g_config.timeouts[TIMEOUT_WRITE] * 1000);
+            return NULL;
+        }
+    }
+
+    metrics_count_timeout(conn->deadline);
+
+    /* An upstream that never answered gets its client a 504 rather than a reset */
+    if (conn->deadline == TIMEOUT_UPSTREAM && proxy_timeout(conn)) {
+        return NULL;
+    }
+
+    /* A stalled peer gets a reset, so unsent data does not linger in kernel memory; idle ones a normal close */
+    if (conn->deadline != TIMEOUT_IDLE) {
+        struct linger linger = { 1, 0 };
+        setsockopt(conn->fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+    }
+    return conn;
+}
+
+void connection_process(connection_t *conn) {
+    if (!conn) {
+        return;
+    }
+
+    /* A TLS client is heard from only once its handshake is through */
+    if (conn->tls) {
+        int rc = tls_handshake(conn);
+        if (rc == TLS_HANDSHAKE_ERROR) {
+            conn->state = CONN_CLOSING;
+            return;
+        }
+        if (rc != TLS_HANDSHAKE_DONE) {
+            conn->state = rc == TLS_HANDSHAKE_WRITE ? CONN_WRITING : CONN_READING;
+            return;
+        }
+    }
+
+    for (;;) {
+        /* Responses leave strictly in request order: finish the queued ones first */
+        if (conn->out_head < conn->out_count) {
+            int rc = connection_flush(conn);
+            if (rc < 0) {
+                conn->state = CONN_CLOSING;
+                return;
+            }
+            if (rc == 0) {
+                conn->state = CONN_WRITING; /* Resume on EPOLLOUT */
+                return;
+            }
+        }
+
+        if (conn->close_after_write && !conn->proxy && !conn->upload) {
+            conn->state = CONN_CLOSING;
+            return;
+        }
+        conn->state = CONN_READING;
+
+        /* An upload owns the connection until its body is stored, and reads the socket itself */
+        if (conn->upload) {
+            upload_pump(conn);
+            if (conn->upload) {
+                return; /* Waiting on more of the body */
+            }
+            continue;
+        }
+
+        /* Pull in whatever the client has sent so far */
+        if (!conn->peer_closed && connection_read(conn) != 0) {
+            conn->peer_closed = TRUE;
+        }
+
+        /* A proxied exchange owns the connection until its response is complete */
+        if (conn->proxy) {
+            size_t pending = conn->in_len;
+            proxy_pump(conn);
+            if (conn->proxy && conn->out_head == conn->out_count) {
+                if (conn->in_len < pending && !conn->peer_closed) {
+                    continue; /* Body went up and made room: the socket may hold more of it */
+                }
+                return; /* Waiting on the upstream, or on more request body */
+            }
+            continue;
+        }
+
+        int handled = connection_handle_input(conn);
+        if (handled == 0 && conn->out_count == 0) {
+            if (conn->peer_closed || connection_drained(conn)) {
+                conn->state = CONN_CLOSING;
+            } else {
+                connection_idle(conn);
+            }
+            return; /* Need more input */
+        }
+    }
+}
+
+void connection_close(connection_t *conn) {
+    if (!conn) {
+        return;
+    }
+
+    if (conn->worker) {
+        if (conn->prev) {
+            conn->prev->next = conn->next;
+        } else {
+            conn->worker->connections = conn->next;
+        }
+        if (conn->next) {
+            conn->next->prev = conn->prev;
+        }
+        conn->worker->connection_count--;
+        timer_cancel(&conn->worker->timers, &conn->timer);
+    }
+
+    if (conn->proxy) {
+        proxy_abort(conn);
+    }
+    upload_abort(conn);
+    http2_close(conn);
+    for (int i = conn->out_head; i < conn->out_count; i++) {
+        release_chunk(&conn->work->out_queue[i]);
+    }
+    metrics_connection_closed();
+    __atomic_fetch_sub(&g_server.active_connections, 1, __ATOMIC_RELAXED);
+    tls_close(conn);
+
+    /* Closing the descriptor also removes it from the epoll set */
+    if (conn->fd >= 0) {
+        close(conn->fd);
+    }
+    pool_free(conn->in_buf, conn->in_cap);
+    pool_free(conn->out_buf, conn->out_cap);
+    pool_free(conn->work, sizeof(connection_work_t));
+    pool_free(conn, sizeof(connection_t));
+}
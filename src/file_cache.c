@@ -0,0 +1,515 @@
+#include "server.h"
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <dirent.h>
+
+#define CACHE_BUCKETS 4096
+#define CACHE_SLOTS 8192
+#define CACHE_MAX_WATCHES 1024
+#define CACHE_LOCK_SHARDS 64   /* Divides CACHE_BUCKETS, so a bucket's shard is its index modulo this */
+
+struct cache_entry {
+    char path[MAX_FILE_PATH + 16];
+    uint64_t hash;
+    char *data;
+    size_t size;
+    http_validators_t validators;
+    char headers[MAX_RESPONSE_HEADER_SIZE / 2];
+    size_t headers_length;
+    int refcount;     /* One reference held by the table, one per in-flight response */
+    int referenced;   /* CLOCK bit, set on every hit */
+    int slot;
+    int borrowed;     /* data belongs to someone else (the mapped bundle) and is not freed */
+    struct cache_entry *hash_next;
+};
+
+/*
+ * Shared by all workers. A lookup only read-locks the shard of its bucket,
+ * each shard lock on a cache line of its own, so lookups of different files
+ * never write the same line. Everything else (slots, CLOCK hand, byte
+ * counts) belongs to the table mutex; a holder of it may walk the chains
+ * freely, since only it changes them, and write-locks a shard just around
+ * linking or unlinking an entry.
+ */
+static struct {
+    pthread_mutex_t lock;
+    struct {
+        pthread_rwlock_t lock;
+    } __attribute__((aligned(64))) shards[CACHE_LOCK_SHARDS];
+    cache_entry_t *buckets[CACHE_BUCKETS];
+    cache_entry_t *slots[CACHE_SLOTS];
+    int hand;
+    size_t bytes;
+    int entries;
+    size_t capacity;
+    size_t max_entry;
+    unsigned long generation;
+
+    int inotify_fd;
+    int stop_fd;
+    pthread_t watcher;
+    int watcher_running;
+    int watch_count;
+    struct {
+        int wd;
+        char dir[MAX_FILE_PATH];
+    } watches[CACHE_MAX_WATCHES];
+
+    unsigned long evictions;
+    unsigned long invalidations;
+} cache; /* Zero-initialized, so the watch table stays out of the binary; init_file_cache() sets the rest */
+
+static uint64_t hash_path(const char *path) {
+    /* FNV-1a */
+    uint64_t hash = 1469598103934665603ULL;
+    for (; *path; path++) {
+        hash ^= (unsigned char)*path;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static void entry_free(cache_entry_t *entry) {
+    if (!entry->borrowed) {
+        free(entry->data);
+    }
+    free(entry);
+}
+
+void file_cache_release(void *ctx) {
+    cache_entry_t *entry = ctx;
+    if (entry && __atomic_sub_fetch(&entry->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+        entry_free(entry);
+    }
+}
+
+static pthread_rwlock_t *shard_lock(uint64_t hash) {
+    return &cache.shards[hash % CACHE_BUCKETS % CACHE_LOCK_SHARDS].lock;
+}
+
+/* Caller holds the table mutex */
+static void entry_unlink(cache_entry_t *entry) {
+    pthread_rwlock_wrlock(shard_lock(entry->hash));
+    cache_entry_t **link = &cache.buckets[entry->hash % CACHE_BUCKETS];
+    while (*link && *link != entry) {
+        link = &(*link)->hash_next;
+    }
+    if (*link) {
+        *link = entry->hash_next;
+    }
+    pthread_rwlock_unlock(shard_lock(entry->hash));
+
+    cache.slots[entry->slot] = NULL;
+    cache.bytes -= entry->size;
+    cache.entries--;
+
+    /* Drop the table's reference; in-flight responses keep the bytes alive */
+    file_cache_release(entry);
+}
+
+/* CLOCK sweep: give referenced entries a second chance, evict the first cold one */
+static int evict_one(void) {
+    if (cache.entries == 0) {
+        return -1;
+    }
+
+    for (int step = 0; step < 2 * CACHE_SLOTS; step++) {
+        cache_entry_t *entry = cache.slots[cache.hand];
+        cache.hand = (cache.hand + 1) % CACHE_SLOTS;
+        if (!entry) {
+            continue;
+        }
+        if (__atomic_exchange_n(&entry->referenced, 0, __ATOMIC_RELAXED)) {
+            continue;
+        }
+        entry_unlink(entry);
+        cache.evictions++;
+        return 0;
+    }
+    return -1;
+}
+
+/* Caller holds the bucket's shard lock or the table mutex */
+static cache_entry_t *find_locked(const char *path, uint64_t hash) {
+    for (cache_entry_t *entry = cache.buckets[hash % CACHE_BUCKETS]; entry; entry = entry->hash_next) {
+        if (entry->hash == hash && strcmp(entry->path, path) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+cache_entry_t* file_cache_lookup(const char *path) {
+    if (!path || cache.capacity == 0) {
+        return NULL;
+    }
+
+    uint64_t hash = hash_path(path);
+
+    pthread_rwlock_rdlock(shard_lock(hash));
+    cache_entry_t *entry = find_locked(path, hash);
+    if (entry) {
+        __atomic_add_fetch(&entry->refcount, 1, __ATOMIC_RELAXED);
+        if (!__atomic_load_n(&entry->referenced, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&entry->referenced, 1, __ATOMIC_RELAXED);
+        }
+    }
+    pthread_rwlock_unlock(shard_lock(hash));
+
+    metrics_count_cache_lookup(entry != NULL);
+    return entry;
+}
+
+unsigned long file_cache_generation(void) {
+    return __atomic_load_n(&cache.generation, __ATOMIC_ACQUIRE);
+}
+
+static cache_entry_t *entry_new(const char *key, char *data, size_t size, const char *headers,
+                                size_t headers_length, const http_validators_t *validators) {
+    cache_entry_t *entry = calloc(1, sizeof(cache_entry_t));
+    if (!entry) {
+        return NULL;
+    }
+
+    entry->data = data;
+    entry->size = size;
+    if (validators) {
+        entry->validators = *validators;
+    }
+    strncpy(entry->path, key, sizeof(entry->path) - 1);
+    entry->hash = hash_path(entry->path);
+    entry->refcount = 1; /* The caller's reference */
+
+    /* Serialize the headers that never change for this representation */
+    char content_length[48];
+    int written = snprintf(content_length, sizeof(content_length), "Content-Length: %zu\r\n", entry->size);
+    if (written > 0 && headers_length + (size_t)written <= sizeof(entry->headers)) {
+        memcpy(entry->headers, headers, headers_length);
+        memcpy(entry->headers + headers_length, content_length, (size_t)written);
+        entry->headers_length = headers_length + (size_t)written;
+    }
+    return entry;
+}
+
+cache_entry_t* file_cache_store(const char *key, char *data, size_t size, const char *headers,
+                                size_t headers_length, const http_validators_t *validators,
+                                unsigned long generation) {
+    if (!key || !data || !headers) {
+        free(data);
+        return NULL;
+    }
+
+    cache_entry_t *entry = entry_new(key, data, size, headers, headers_length, validators);
+    if (!entry) {
+        free(data);
+        return NULL;
+    }
+
+    if (cache.capacity == 0 || size > cache.max_entry || size > cache.capacity) {
+        return entry; /* Too big to keep, but still usable for this response */
+    }
+
+    pthread_mutex_lock(&cache.lock);
+    cache_entry_t *existing = find_locked(entry->path, entry->hash);
+    if (existing || generation != cache.generation) {
+        pthread_mutex_unlock(&cache.lock);
+        return entry; /* Serve this copy once but don't publish it */
+    }
+
+    while (cache.bytes + entry->size > cache.capacity || cache.entries >= CACHE_SLOTS) {
+        if (evict_one() != 0) {
+            break;
+        }
+    }
+
+    if (cache.bytes + entry->size <= cache.capacity && cache.entries < CACHE_SLOTS) {
+        int slot = cache.hand;
+        while (cache.slots[slot]) {
+            slot = (slot + 1) % CACHE_SLOTS;
+        }
+        entry->slot = slot;
+        cache.slots[slot] = entry;
+        cache.bytes += entry->size;
+        cache.entries++;
+        entry->refcount++;
+
+        pthread_rwlock_wrlock(shard_lock(entry->hash));
+        entry->hash_next = cache.buckets[entry->hash % CACHE_BUCKETS];
+        cache.buckets[entry->hash % CACHE_BUCKETS] = entry;
+        pthread_rwlock_unlock(shard_lock(entry->hash));
+    }
+    pthread_mutex_unlock(&cache.lock);
+
+    return entry;
+}
+
+cache_entry_t* file_cache_fill(const char *key, int fd, size_t size, const char *headers,
+                               size_t headers_length, const http_validators_t *validators) {
+    if (!key || fd < 0 || cache.capacity == 0 || size > cache.max_entry || size > cache.capacity) {
+        return NULL;
+    }
+
+    /* Snapshot the invalidation generation so a change during the read is not cached */
+    unsigned long generation = file_cache_generation();
+
+    char *data = malloc(size ? size : 1);
+    if (!data) {
+        return NULL;
+    }
+
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = pread(fd, data + done, size - done, (off_t)done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            free(data);
+            return NULL;
+        }
+        done += (size_t)n;
+    }
+
+    return file_cache_store(key, data, size, headers, headers_length, validators, generation);
+}
+
+/* An entry over memory the cache does not own; never published, freed with its last reference */
+cache_entry_t* file_cache_wrap(const char *key, const char *data, size_t size, const char *headers,
+                               size_t headers_length, const http_validators_t *validators) {
+    if (!key || !data || !headers) {
+        return NULL;
+    }
+
+    cache_entry_t *entry = entry_new(key, (char *)data, size, headers, headers_length, validators);
+    if (entry) {
+        entry->borrowed = TRUE;
+    }
+    return entry;
+}
+
+void file_cache_retain(cache_entry_t *entry) {
+    __atomic_add_fetch(&entry->refcount, 1, __ATOMIC_RELAXED);
+}
+
+const char* file_cache_data(const cache_entry_t *entry, size_t *size) {
+    if (size) {
+        *size = entry->size;
+    }
+    return entry->data;
+}
+
+const http_validators_t* file_cache_validators(const cache_entry_t *entry) {
+    return &entry->validators;
+}
+
+const char* file_cache_headers(const cache_entry_t *entry, size_t *length) {
+    if (length) {
+        *length = entry->headers_length;
+    }
+    return entry->headers;
+}
+
+static void invalidate_key(const char *key) {
+    cache_entry_t *entry = find_locked(key, hash_path(key));
+    if (entry) {
+        entry_unlink(entry);
+        cache.invalidations++;
+    }
+}
+
+void file_cache_invalidate(const char *path) {
+    pthread_mutex_lock(&cache.lock);
+    __atomic_add_fetch(&cache.generation, 1, __ATOMIC_RELEASE);
+
+    if (path) {
+        /* A file change also stales its compressed variants; a .gz change stales its source's */
+        char base[MAX_FILE_PATH];
+        char key[MAX_FILE_PATH + 16];
+        size_t length = strlen(path);
+        strncpy(base, path, sizeof(base) - 1);
+        base[sizeof(base) - 1] = '\0';
+        if (length > 3 && strcmp(path + length - 3, ".gz") == 0) {
+            base[length - 3] = '\0';
+        }
+
+        invalidate_key(path);
+        invalidate_key(base);
+        for (int encoding = ENCODING_IDENTITY + 1; encoding < ENCODING_COUNT; encoding++) {
+            snprintf(key, sizeof(key), "%s %s", base, encoding_name(encoding));
+            invalidate_key(key);
+        }
+    } else {
+        for (int i = 0; i < CACHE_SLOTS; i++) {
+            if (cache.slots[i]) {
+                entry_unlink(cache.slots[i]);
+                cache.invalidations++;
+            }
+        }
+    }
+    pthread_mutex_unlock(&cache.lock);
+}
+
+void file_cache_stats(file_cache_stats_t *stats) {
+    if (!stats) {
+        return;
+    }
+
+    pthread_mutex_lock(&cache.lock);
+    stats->entries = cache.entries;
+    stats->bytes = cache.bytes;
+    stats->capacity = cache.capacity;
+    stats->evictions = cache.evictions;
+    stats->invalidations = cache.invalidations;
+    pthread_mutex_unlock(&cache.lock);
+}
+
+/* ---- inotify watcher ---- */
+
+/* Directories are watched by their filesystem path, the same form the cache keys use */
+static void add_watch_tree(const char *dir) {
+    if (cache.watch_count >= CACHE_MAX_WATCHES) {
+        log_message(LOG_ERROR, "Cache watch limit reached, %s is not watched", dir);
+        return;
+    }
+
+    int wd = inotify_add_watch(cache.inotify_fd, dir,
+                               IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_CREATE | IN_DELETE |
+                               IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_ONLYDIR);
+    if (wd < 0) {
+        return;
+    }
+    cache.watches[cache.watch_count].wd = wd;
+    strncpy(cache.watches[cache.watch_count].dir, dir, MAX_FILE_PATH - 1);
+    cache.watch_count++;
+
+    /* Subdirectories get their own watch */
+    DIR *handle = opendir(dir);
+    if (!handle) {
+        return;
+    }
+    struct dirent *item;
+    while ((item = readdir(handle)) != NULL) {
+        if (item->d_name[0] == '.' || item->d_type != DT_DIR) {
+            continue;
+        }
+        char child[MAX_FILE_PATH];
+        if (snprintf(child, sizeof(child), "%s/%s", dir, item->d_name) < (int)sizeof(child)) {
+            add_watch_tree(child);
+        }
+    }
+    closedir(handle);
+}
+
+static const char *watch_dir(int wd) {
+    for (int i = 0; i < cache.watch_count; i++) {
+        if (cache.watches[i].wd == wd) {
+            return cache.watches[i].dir;
+        }
+    }
+    return NULL;
+}
+
+static void *watcher_main(void *arg) {
+    char events[16 * (sizeof(struct inotify_event) + NAME_MAX + 1)]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct pollfd fds[2] = {
+        { .fd = cache.inotify_fd, .events = POLLIN },
+        { .fd = cache.stop_fd, .events = POLLIN },
+    };
+
+    (void)arg;
+
+    while (poll(fds, 2, -1) >= 0 || errno == EINTR) {
+        if (fds[1].revents) {
+            break;
+        }
+        if (!(fds[0].revents & POLLIN)) {
+            continue;
+        }
+
+        ssize_t n = read(cache.inotify_fd, events, sizeof(events));
+        for (char *p = events; n > 0 && p < events + n;) {
+            const struct inotify_event *event = (const struct inotify_event *)p;
+            const char *dir = watch_dir(event->wd);
+
+            if (event->mask & IN_Q_OVERFLOW || !dir) {
+                file_cache_invalidate(NULL); /* Lost track: start over */
+            } else if (event->len > 0) {
+                char path[MAX_FILE_PATH];
+                snprintf(path, sizeof(path), "%s/%s", dir, event->name);
+                if ((event->mask & (IN_CREATE | IN_MOVED_TO)) && (event->mask & IN_ISDIR)) {
+                    add_watch_tree(path);
+                }
+                file_cache_invalidate(path);
+            }
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+    return NULL;
+}
+
+int init_file_cache(size_t capacity, size_t max_entry, const char *const *roots, int root_count) {
+    pthread_mutex_init(&cache.lock, NULL);
+    cache.inotify_fd = -1;
+    cache.stop_fd = -1;
+    for (int i = 0; i < CACHE_LOCK_SHARDS; i++) {
+        pthread_rwlock_init(&cache.shards[i].lock, NULL);
+    }
+    cache.capacity = capacity;
+    cache.max_entry = max_entry;
+    if (capacity == 0) {
+        return 0; /* Caching disabled */
+    }
+
+    cache.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    cache.stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (cache.inotify_fd < 0 || cache.stop_fd < 0) {
+        log_message(LOG_ERROR, "inotify unavailable, static file cache disabled");
+        cache.capacity = 0;
+        return -1;
+    }
+
+    for (int i = 0; i < root_count; i++) {
+        add_watch_tree(roots[i]);
+    }
+    if (pthread_create(&cache.watcher, NULL, watcher_main, NULL) != 0) {
+        log_message(LOG_ERROR, "Failed to start cache watcher, static file cache disabled");
+        cache.capacity = 0;
+        return -1;
+    }
+    cache.watcher_running = TRUE;
+
+    log_message(LOG_INFO, "Static file cache: %zu bytes, %zu bytes max per file, %d directories watched",
+                capacity, max_entry, cache.watch_count);
+    return 0;
+}
+
+void cleanup_file_cache(void) {
+    if (cache.watcher_running) {
+        uint64_t one = 1;
+        if (write(cache.stop_fd, &one, sizeof(one)) == sizeof(one)) {
+            pthread_join(cache.watcher, NULL);
+        }
+        cache.watcher_running = FALSE;
+    }
+
+    file_cache_stats_t stats;
+    file_cache_stats(&stats);
+    if (stats.capacity > 0) {
+        log_message(LOG_INFO, "Static file cache: %d entries, %lu evictions, %lu invalidations",
+                    stats.entries, stats.evictions, stats.invalidations);
+    }
+
+    file_cache_invalidate(NULL);
+    cache.capacity = 0;
+
+    if (cache.inotify_fd >= 0) {
+        close(cache.inotify_fd);
+        cache.inotify_fd = -1;
+    }
+    if (cache.stop_fd >= 0) {
+        close(cache.stop_fd);
+        cache.stop_fd = -1;
+    }
+}
@@ -1,58 +1,351 @@
 #include "server.h"
 #include "ctype.h"
 
-int serve_static_file(const char *path, http_response_t *response) {
-    if (!path || !response) {
+/* Describe the selected representation; the fields also drive 206/304 header generation */
+static void set_representation(http_response_t *response, const char *content_type, int encoding, int vary) {
+    response->status_code = HTTP_OK;
+    response->content_encoding = encoding;
+    response->vary_encoding = vary;
+    response->accept_ranges = TRUE;
+    response->max_age = config_max_age(&g_config, content_type);
+    strncpy(response->content_type, content_type, sizeof(response->content_type) - 1);
+    response->content_type[sizeof(response->content_type) - 1] = '\0';
+}
+
+/* Strong ETag from inode, size and mtime; compressed variants get a coding suffix */
+static void make_validators(const struct stat *st, int encoding, http_validators_t *validators) {
+    unsigned long long mtime_ns = (unsigned long long)st->st_mtim.tv_sec * 1000000000ULL +
+                                  (unsigned long long)st->st_mtim.tv_nsec;
+    validators->last_modified = st->st_mtime;
+    snprintf(validators->etag, sizeof(validators->etag), "\"%llx-%llx-%llx%s%s\"",
+             (unsigned long long)st->st_ino, (unsigned long long)st->st_size, mtime_ns,
+             encoding != ENCODING_IDENTITY ? "-" : "",
+             encoding != ENCODING_IDENTITY ? encoding_name(encoding) : "");
+}
+
+/* Validators of a variant compressed from the identity copy */
+static void variant_validators(const http_validators_t *identity, int encoding, http_validators_t *validators) {
+    size_t length = strlen(identity->etag);
+    validators->last_modified = identity->last_modified;
+    snprintf(validators->etag, sizeof(validators->etag), "%.*s-%s\"",
+             (int)(length > 0 ? length - 1 : 0), identity->etag, encoding_name(encoding));
+}
+
+static void use_cache_entry(http_response_t *response, cache_entry_t *entry) {
+    response->cache_entry = entry;
+    response->validators = *file_cache_validators(entry);
+    file_cache_data(entry, &response->body_length);
+}
+
+static void use_file(http_response_t *response, int fd, const struct stat *st) {
+    response->file_fd = fd;
+    response->file_offset = 0;
+    response->body_length = (size_t)st->st_size;
+}
+
+/* Open a regular file and fstat it; returns the descriptor or -1 */
+static int open_regular(const char *full_path, struct stat *st) {
+    int fd = open(full_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (fstat(fd, st) != 0 || !S_ISREG(st->st_mode)) {
+        close(fd);
         return -1;
     }
+    return fd;
+}
 
-    /* Build full file path */
-    char full_path[MAX_PATH_LENGTH];
-    snprintf(full_path, sizeof(full_path), "%s%s", PUBLIC_DIR, path);
+/* Answer with a compressed representation; returns 0 on success, -1 to fall back to identity */
+static int serve_encoded(const char *full_path, int encoding, const char *content_type,
+                         cache_entry_t *identity, unsigned long generation, http_response_t *response) {
+    char key[MAX_FILE_PATH + 16];
+    char headers[MAX_RESPONSE_HEADER_SIZE / 2];
+    snprintf(key, sizeof(key), "%s %s", full_path, encoding_name(encoding));
 
-    /* Security check: prevent directory traversal */
-    if (strstr(path, "..") != NULL) {
+    cache_entry_t *entry = file_cache_lookup(key);
+    if (entry) {
+        set_representation(response, content_type, encoding, TRUE);
+        use_cache_entry(response, entry);
+        return 0;
+    }
+
+    /* Precompressed sibling (foo.js.gz next to foo.js) wins over compressing ourselves */
+    if (encoding == ENCODING_GZIP) {
+        char gz_path[MAX_FILE_PATH + 3];
+        struct stat st;
+        snprintf(gz_path, sizeof(gz_path), "%s.gz", full_path);
+
+        int fd = open_regular(gz_path, &st);
+        if (fd >= 0) {
+            set_representation(response, content_type, encoding, TRUE);
+            make_validators(&st, encoding, &response->validators);
+            size_t headers_length = build_representation_headers(response, headers, sizeof(headers));
+            entry = file_cache_fill(key, fd, (size_t)st.st_size, headers, headers_length, &response->validators);
+            if (entry) {
+                close(fd);
+                use_cache_entry(response, entry);
+            } else {
+                use_file(response, fd, &st); /* Too large to cache: stream it like any other big file */
+            }
+            return 0;
+        }
+    }
+
+    /* Compress the cached identity copy once and keep the result next to it */
+    if (!identity) {
         return -1;
     }
 
-    /* Check if file exists and is readable */
-    if (!file_exists(full_path)) {
+    size_t size;
+    const char *data = file_cache_data(identity, &size);
+    char *compressed;
+    size_t compressed_length;
+    if (compress_buffer(encoding, g_config.gzip_level, data, size, &compressed, &compressed_length) != 0) {
         return -1;
     }
 
-    /* Read file content */
-    size_t file_size;
-    char *file_content = read_file(full_path, &file_size);
-    if (!file_content) {
+    set_representation(response, content_type, encoding, TRUE);
+    variant_validators(file_cache_validators(identity), encoding, &response->validators);
+    size_t headers_length = build_representation_headers(response, headers, sizeof(headers));
+    entry = file_cache_store(key, compressed, compressed_length, headers, headers_length, &response->validators,
+                             generation);
+    if (!entry) {
         return -1;
     }
+    use_cache_entry(response, entry);
+    return 0;
+}
 
-    /* Set response properties */
-    response->status_code = HTTP_OK;
-    response->body = file_content;
-    response->body_length = file_size;
+/* Answer from the prebuilt bundle, whose variants are all there is: nothing is compressed here */
+static int serve_bundled(int asset, const http_request_t *request, http_response_t *response) {
+    const char *content_type = bundle_content_type(asset);
+    int compressible = g_config.gzip && is_compressible_type(content_type);
+    int encoding = compressible ? negotiate_encoding(request) : ENCODING_IDENTITY;
+    if (!bundle_has(asset, encoding)) {
+        encoding = ENCODING_IDENTITY;
+    }
 
-    /* Set content type based on file extension */
+    set_representation(response, content_type, encoding, compressible);
+    cache_entry_t *entry = bundle_entry(asset, encoding);
+    if (!entry) {
+        /* First hit on this variant: its headers are serialized once, like a cache fill */
+        char headers[MAX_RESPONSE_HEADER_SIZE / 2];
+        bundle_validators(asset, encoding, &response->validators);
+        size_t headers_length = build_representation_headers(response, headers, sizeof(headers));
+        entry = bundle_publish(asset, encoding, headers, headers_length);
+        if (!entry) {
+            return -1;
+        }
+    }
+    use_cache_entry(response, entry);
+    return 0;
+}
+
+/* Pick the representation (bundled, cached or on disk, identity or compressed) for a path */
+static int select_representation(const char *root, const char *path, const http_request_t *request,
+                                 http_response_t *response) {
+    /* Bundled assets need neither the filesystem nor the cache's lock */
+    int asset = bundle_find(root, path);
+    if (asset >= 0 && serve_bundled(asset, request, response) == 0) {
+        return 0;
+    }
+
+    /* Build full file path; it doubles as the cache key, so virtual hosts never share entries by accident */
+    char full_path[MAX_FILE_PATH];
+    snprintf(full_path, sizeof(full_path), "%s%s", root, path);
+
+    /* Compressible types always advertise Vary, whichever coding is picked */
     const char *content_type = get_content_type(path);
-    strncpy(response->content_type, content_type, sizeof(response->content_type) - 1);
+    int compressible = g_config.gzip && is_compressible_type(content_type);
+
+    unsigned long generation = file_cache_generation();
+    int fd = -1;
+    struct stat st;
+    size_t size;
+
+    /* Hot files are answered from memory without touching the filesystem */
+    cache_entry_t *entry = file_cache_lookup(full_path);
+    if (!entry) {
+        fd = open_regular(full_path, &st);
+        if (fd < 0) {
+            return -1;
+        }
+
+        /* Small files are loaded into the cache; the rest go out with sendfile() */
+        char headers[MAX_RESPONSE_HEADER_SIZE / 2];
+        set_representation(response, content_type, ENCODING_IDENTITY, compressible);
+        make_validators(&st, ENCODING_IDENTITY, &response->validators);
+        size_t headers_length = build_representation_headers(response, headers, sizeof(headers));
+        entry = file_cache_fill(full_path, fd, (size_t)st.st_size, headers, headers_length, &response->validators);
+        if (entry) {
+            close(fd);
+            fd = -1;
+        }
+    }
 
+    if (entry) {
+        file_cache_data(entry, &size);
+    } else {
+        size = (size_t)st.st_size;
+    }
+
+    /* Content negotiation, skipped for bodies too small to be worth it */
+    int encoding = compressible && size >= g_config.gzip_min_length ? negotiate_encoding(request)
+                                                                     : ENCODING_IDENTITY;
+    if (encoding != ENCODING_IDENTITY &&
+        serve_encoded(full_path, encoding, content_type, entry, generation, response) == 0) {
+        if (entry) {
+            file_cache_release(entry);
+        } else {
+            close(fd);
+        }
+        return 0;
+    }
+
+    set_representation(response, content_type, ENCODING_IDENTITY, compressible);
+    if (entry) {
+        use_cache_entry(response, entry);
+    } else {
+        make_validators(&st, ENCODING_IDENTITY, &response->validators);
+        use_file(response, fd, &st);
+    }
     return 0;
 }
 
-int file_exists(const char *path) {
-    if (!path) {
-        return FALSE;
+/* Drop the body source of a response that turned out not to need one */
+static void drop_body(http_response_t *response) {
+    if (response->file_fd >= 0) {
+        close(response->file_fd);
+        response->file_fd = -1;
     }
+    if (response->cache_entry) {
+        file_cache_release(response->cache_entry);
+        response->cache_entry = NULL;
+    }
+    response->body_length = 0;
+}
 
-    struct stat st;
-    if (stat(path, &st) == 0) {
-        /* Check if it's a regular file */
-        return S_ISREG(st.st_mode) ? TRUE : FALSE;
+/* If-None-Match takes precedence; If-Modified-Since is only consulted without it */
+static int not_modified(const http_request_t *request, const http_response_t *response) {
+    size_t length;
+    const char *value = http_request_header(request, "If-None-Match", &length);
+    if (value) {
+        return http_etag_matches(value, length, response->validators.etag);
     }
 
+    value = http_request_header(request, "If-Modified-Since", &length);
+    time_t since;
+    if (value && http_parse_date(value, length, &since) == 0) {
+        return response->validators.last_modified <= since;
+    }
     return FALSE;
 }
 
+/* If-Range holds a strong ETag or a date; anything else means "send it all" */
+static int if_range_matches(const char *value, size_t length, const http_response_t *response) {
+    if (length > 0 && value[0] == '"') {
+        return strlen(response->validators.etag) == length &&
+               memcmp(value, response->validators.etag, length) == 0;
+    }
+
+    time_t date;
+    return http_parse_date(value, length, &date) == 0 && date == response->validators.last_modified;
+}
+
+/* Narrow a 200 down to the byte ranges asked for, or turn it into a 416 */
+static void apply_range(const http_request_t *request, http_response_t *response) {
+    size_t length;
+    const char *range = http_request_header(request, "Range", &length);
+    response->total_length = response->body_length;
+    if (!range) {
+        return;
+    }
+
+    /* If-Range: when the validator no longer matches, the client wants the whole new body */
+    size_t if_range_length;
+    const char *if_range = http_request_header(request, "If-Range", &if_range_length);
+    if (if_range && !if_range_matches(if_range, if_range_length, response)) {
+        return;
+    }
+
+    int count = http_parse_range(range, length, response->total_length, response->ranges, MAX_RANGES);
+    if (count < 0) {
+        return; /* Malformed or too fragmented: ignoring Range is always allowed */
+    }
+
+    if (count == 0) {
+        drop_body(response);
+        response->status_code = HTTP_RANGE_NOT_SATISFIABLE;
+        response->content_type[0] = '\0';
+        response->content_encoding = ENCODING_IDENTITY;
+        return;
+    }
+
+    response->status_code = HTTP_PARTIAL_CONTENT;
+    response->range_count = count;
+    if (count == 1) {
+        response->body_length = response->ranges[0].length;
+        return;
+    }
+
+    /* multipart/byteranges: every part carries its own small header block */
+    char part_header[256];
+    response->body_length = build_multipart_trailer(part_header, sizeof(part_header));
+    for (int i = 0; i < count; i++) {
+        response->body_length += build_range_part_header(response, i, part_header, sizeof(part_header));
+        response->body_length += response->ranges[i].length;
+    }
+}
+
+/* Collapse "//" and "/./" so every spelling of a file maps to the one cache key the watcher invalidates */
+static int canonical_path(const char *path, char *out, size_t size) {
+    size_t length = 0;
+    for (const char *p = path; *p != '\0'; p++) {
+        int after_slash = length > 0 && out[length - 1] == '/';
+        if (after_slash && (*p == '/' || (*p == '.' && (p[1] == '/' || p[1] == '\0')))) {
+            continue;
+        }
+        if (length + 1 >= size) {
+            return -1;
+        }
+        out[length++] = *p;
+    }
+    out[length] = '\0';
+    return 0;
+}
+
+int serve_static_file(const char *root, const char *path, const http_request_t *request, http_response_t *response) {
+    if (!root || !path || !response) {
+        return -1;
+    }
+
+    char canonical[MAX_PATH_LENGTH];
+    if (canonical_path(path, canonical, sizeof(canonical)) != 0) {
+        return -1;
+    }
+
+    /* Security check: prevent directory traversal */
+    if (strstr(canonical, "..") != NULL) {
+        return -1;
+    }
+
+    if (select_representation(root, canonical, request, response) != 0) {
+        return -1;
+    }
+
+    if (request) {
+        if (not_modified(request, response)) {
+            drop_body(response);
+            response->status_code = HTTP_NOT_MODIFIED;
+            return 0;
+        }
+        apply_range(request, response);
+    }
+    return 0;
+}
+
 const char* get_content_type(const char *path) {
     if (!path) {
         return CONTENT_TYPE_TEXT;
@@ -95,44 +388,3 @@ const char* get_content_type(const char *path) {
     /* Default to plain text */
     return CONTENT_TYPE_TEXT;
 }
-
-char* read_file(const char *path, size_t *file_size) {
-    if (!path || !file_size) {
-        return NULL;
-    }
-
-    FILE *file = fopen(path, "rb");
-    if (!file) {
-        return NULL;
-    }
-
-    /* Get file size */
-    fseek(file, 0, SEEK_END);
-    *file_size = ftell(file);
-    fseek(file, 0, SEEK_SET);
-
-    /* Check for reasonable file size (prevent memory exhaustion) */
-    if (*file_size > 10 * 1024 * 1024) { /* 10MB limit */
-        fclose(file);
-        return NULL;
-    }
-
-    /* Allocate buffer */
-    char *buffer = malloc(*file_size + 1);
-    if (!buffer) {
-        fclose(file);
-        return NULL;
-    }
-
-    /* Read file content */
-    size_t bytes_read = fread(buffer, 1, *file_size, file);
-    fclose(file);
-
-    if (bytes_read != *file_size) {
-        free(buffer);
-        return NULL;
-    }
-
-    buffer[*file_size] = '\0'; /* Null terminate for text files */
-    return buffer;
-}
@@ -0,0 +1,533 @@
+#include "server.h"
+
+/*
+ * HPACK header compression for HTTP/2 (RFC 7541).
+ *
+ * Each direction of a connection has its own dynamic table: the decoder's
+ * follows the client's header blocks, the encoder's the blocks we send. A
+ * table is a ring of pooled name/value copies, newest first, evicted from
+ * the oldest end as soon as the RFC 7541 size (lengths plus 32 per entry)
+ * would exceed the limit.
+ *
+ * The Huffman code is canonical (codes of one length are consecutive and
+ * ordered by symbol), so only the code lengths are kept; the codes, and the
+ * per-length first code and symbol order the decoder walks, are derived at
+ * startup.
+ */
+
+#define HUFFMAN_SYMBOLS 257             /* 256 octets plus EOS */
+#define HUFFMAN_EOS 256
+#define HUFFMAN_MAX_LENGTH 30
+#define HPACK_INTEGER_LIMIT (1u << 24)  /* Larger than any length or index we could accept */
+
+static const struct {
+    const char *name;
+    const char *value;
+} static_table[] = {
+    { ":authority", "" },
+    { ":method", "GET" },
+    { ":method", "POST" },
+    { ":path", "/" },
+    { ":path", "/index.html" },
+    { ":scheme", "http" },
+    { ":scheme", "https" },
+    { ":status", "200" },
+    { ":status", "204" },
+    { ":status", "206" },
+    { ":status", "304" },
+    { ":status", "400" },
+    { ":status", "404" },
+    { ":status", "500" },
+    { "accept-charset", "" },
+    { "accept-encoding", "gzip, deflate" },
+    { "accept-language", "" },
+    { "accept-ranges", "" },
+    { "accept", "" },
+    { "access-control-allow-origin", "" },
+    { "age", "" },
+    { "allow", "" },
+    { "authorization", "" },
+    { "cache-control", "" },
+    { "content-disposition", "" },
+    { "content-encoding", "" },
+    { "content-language", "" },
+    { "content-length", "" },
+    { "content-location", "" },
+    { "content-range", "" },
+    { "content-type", "" },
+    { "cookie", "" },
+    { "date", "" },
+    { "etag", "" },
+    { "expect", "" },
+    { "expires", "" },
+    { "from", "" },
+    { "host", "" },
+    { "if-match", "" },
+    { "if-modified-since", "" },
+    { "if-none-match", "" },
+    { "if-range", "" },
+    { "if-unmodified-since", "" },
+    { "last-modified", "" },
+    { "link", "" },
+    { "location", "" },
+    { "max-forwards", "" },
+    { "proxy-authenticate", "" },
+    { "proxy-authorization", "" },
+    { "range", "" },
+    { "referer", "" },
+    { "refresh", "" },
+    { "retry-after", "" },
+    { "server", "" },
+    { "set-cookie", "" },
+    { "strict-transport-security", "" },
+    { "transfer-encoding", "" },
+    { "user-agent", "" },
+    { "vary", "" },
+    { "via", "" },
+    { "www-authenticate", "" },
+};
+
+#define STATIC_TABLE_SIZE ((int)(sizeof(static_table) / sizeof(static_table[0])))
+
+/* Code length of every symbol (RFC 7541 Appendix B) */
+static const uint8_t huffman_length[HUFFMAN_SYMBOLS] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+
+static struct {
+    uint32_t code[HUFFMAN_SYMBOLS];
+    uint32_t first[HUFFMAN_MAX_LENGTH + 1];     /* Code of the first symbol of each length */
+    uint16_t count[HUFFMAN_MAX_LENGTH + 1];     /* Symbols of each length */
+    uint16_t index[HUFFMAN_MAX_LENGTH + 1];     /* Position of the first of them in `symbols` */
+    uint16_t symbols[HUFFMAN_SYMBOLS];          /* By code length, then by symbol */
+} huffman;
+
+/* Rebuild the canonical code from its lengths before any worker starts */
+__attribute__((constructor))
+static void hpack_init(void) {
+    uint32_t code = 0;
+    int position = 0;
+
+    for (int length = 1; length <= HUFFMAN_MAX_LENGTH; length++) {
+        huffman.first[length] = code;
+        huffman.index[length] = (uint16_t)position;
+        for (int symbol = 0; symbol < HUFFMAN_SYMBOLS; symbol++) {
+            if (huffman_length[symbol] == length) {
+                huffman.code[symbol] = code++;
+                huffman.symbols[position++] = (uint16_t)symbol;
+                huffman.count[length]++;
+            }
+        }
+        code <<= 1;
+    }
+}
+
+/* Decode a Huffman string; returns its length or -1 if it is malformed or does not fit */
+static long huffman_decode(const uint8_t *src, size_t length, char *out, size_t space) {
+    uint32_t code = 0;
+    int code_length = 0;
+    size_t written = 0;
+
+    for (size_t i = 0; i < length; i++) {
+        for (int bit = 7; bit >= 0; bit--) {
+            code = (code << 1) | ((src[i] >> bit) & 1u);
+            code_length++;
+
+            uint32_t offset = code - huffman.first[code_length];
+            if (code >= huffman.first[code_length] && offset < huffman.count[code_length]) {
+                int symbol = huffman.symbols[huffman.index[code_length] + offset];
+                if (symbol == HUFFMAN_EOS || written >= space) {
+                    return -1;
+                }
+                out[written++] = (char)symbol;
+                code = 0;
+                code_length = 0;
+            } else if (code_length == HUFFMAN_MAX_LENGTH) {
+                return -1;
+            }
+        }
+    }
+
+    /* Padding is the most significant bits of EOS: fewer than eight 1-bits */
+    if (code_length > 7 || code != (1u << code_length) - 1) {
+        return -1;
+    }
+    return (long)written;
+}
+
+static size_t huffman_encoded_length(const char *src, size_t length) {
+    size_t bits = 0;
+    for (size_t i = 0; i < length; i++) {
+        bits += huffman_length[(unsigned char)src[i]];
+    }
+    return (bits + 7) / 8;
+}
+
+static void huffman_encode(const char *src, size_t length, uint8_t *out) {
+    uint64_t bits = 0;
+    int count = 0;
+
+    for (size_t i = 0; i < length; i++) {
+        unsigned char symbol = (unsigned char)src[i];
+        bits = (bits << huffman_length[symbol]) | huffman.code[symbol];
+        count += huffman_length[symbol];
+        while (count >= 8) {
+            count -= 8;
+            *out++ = (uint8_t)(bits >> count);
+        }
+    }
+    if (count > 0) {
+        *out = (uint8_t)((bits << (8 - count)) | (0xffu >> count));
+    }
+}
+
+/* Integer with an N-bit prefix (RFC 7541 5.1); returns bytes read, 0 if malformed */
+static size_t decode_integer(const uint8_t *src, size_t length, int prefix_bits, uint32_t *value) {
+    uint32_t limit = (1u << prefix_bits) - 1;
+    if (length == 0) {
+        return 0;
+    }
+
+    *value = src[0] & limit;
+    if (*value < limit) {
+        return 1;
+    }
+    for (size_t i = 1, shift = 0; i < length && shift <= 21; i++, shift += 7) {
+        *value += (uint32_t)(src[i] & 0x7f) << shift;
+        if (!(src[i] & 0x80)) {
+            return *value < HPACK_INTEGER_LIMIT ? i + 1 : 0;
+        }
+    }
+    return 0;
+}
+
+/* Returns bytes written, 0 if it does not fit */
+static size_t encode_integer(uint32_t value, int prefix_bits, uint8_t flags, uint8_t *out, size_t size) {
+    uint32_t limit = (1u << prefix_bits) - 1;
+    size_t used = 0;
+
+    if (size == 0) {
+        return 0;
+    }
+    if (value < limit) {
+        out[used++] = (uint8_t)(flags | value);
+        return used;
+    }
+    out[used++] = (uint8_t)(flags | limit);
+    value -= limit;
+    while (value >= 0x80) {
+        if (used >= size) {
+            return 0;
+        }
+        out[used++] = (uint8_t)((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    if (used >= size) {
+        return 0;
+    }
+    out[used++] = (uint8_t)value;
+    return used;
+}
+
+/* Huffman-coded when that is shorter; returns bytes written, 0 if it does not fit */
+static size_t encode_string(const char *src, size_t length, uint8_t *out, size_t size) {
+    size_t huffman_size = huffman_encoded_length(src, length);
+    int use_huffman = huffman_size < length;
+    size_t encoded = use_huffman ? huffman_size : length;
+
+    size_t used = encode_integer((uint32_t)encoded, 7, use_huffman ? 0x80 : 0, out, size);
+    if (used == 0 || encoded > size - used) {
+        return 0;
+    }
+    if (use_huffman) {
+        huffman_encode(src, length, out + used);
+    } else {
+        memcpy(out + used, src, length);
+    }
+    return used + encoded;
+}
+
+void hpack_table_init(hpack_table_t *table, size_t limit) {
+    memset(table, 0, sizeof(*table));
+    table->max_size = limit;
+    table->limit = limit;
+}
+
+static hpack_entry_t *table_entry(hpack_table_t *table, int position) {
+    return &table->entries[(table->first + position) % HPACK_MAX_ENTRIES];
+}
+
+static void evict_oldest(hpack_table_t *table) {
+    hpack_entry_t *oldest = table_entry(table, table->count - 1);
+    pool_free(oldest->field, oldest->name_length + oldest->value_length + 1);
+    table->size -= oldest->name_length + oldest->value_length + 32;
+    table->count--;
+}
+
+void hpack_table_resize(hpack_table_t *table, size_t max_size) {
+    table->max_size = max_size;
+    while (table->count > 0 && table->size > table->max_size) {
+        evict_oldest(table);
+    }
+}
+
+void hpack_table_free(hpack_table_t *table) {
+    hpack_table_resize(table, 0);
+}
+
+/* An entry larger than the whole table empties it and is not added (RFC 7541 4.4) */
+static void table_add(hpack_table_t *table, const char *name, size_t name_length,
+                      const char *value, size_t value_length) {
+    size_t size = name_length + value_length + 32;
+    while (table->count > 0 && table->size + size > table->max_size) {
+        evict_oldest(table);
+    }
+    if (size > table->max_size) {
+        return;
+    }
+
+    char *field = pool_alloc(name_length + value_length + 1);
+    if (!field) {
+        return; /* Only our own encoder table can get here with room to spare; it just indexes less */
+    }
+    memcpy(field, name, name_length);
+    memcpy(field + name_length, value, value_length);
+
+    table->first = (table->first + HPACK_MAX_ENTRIES - 1) % HPACK_MAX_ENTRIES;
+    hpack_entry_t *entry = &table->entries[table->first];
+    entry->field = field;
+    entry->name_length = (uint32_t)name_length;
+    entry->value_length = (uint32_t)value_length;
+    table->size += size;
+    table->count++;
+}
+
+/* Field `index` of the combined address space: 1-61 static, then the dynamic table newest first */
+static int table_lookup(hpack_table_t *table, uint32_t index, const char **name, size_t *name_length,
+                        const char **value, size_t *value_length) {
+    if (index == 0) {
+        return -1;
+    }
+    if (index <= (uint32_t)STATIC_TABLE_SIZE) {
+        *name = static_table[index - 1].name;
+        *name_length = strlen(*name);
+        *value = static_table[index - 1].value;
+        *value_length = strlen(*value);
+        return 0;
+    }
+    if (index - STATIC_TABLE_SIZE > (uint32_t)table->count) {
+        return -1;
+    }
+    const hpack_entry_t *entry = table_entry(table, (int)(index - STATIC_TABLE_SIZE - 1));
+    *name = entry->field;
+    *name_length = entry->name_length;
+    *value = entry->field + entry->name_length;
+    *value_length = entry->value_length;
+    return 0;
+}
+
+/* Decode a string literal to out + *used; returns bytes read, 0 if malformed or out of room */
+static size_t decode_string(const uint8_t *src, size_t length, char *out, size_t size, size_t *used,
+                            http_slice_t *slice) {
+    uint32_t string_length;
+    size_t read = decode_integer(src, length, 7, &string_length);
+    if (read == 0 || string_length > length - read) {
+        return 0;
+    }
+
+    if (src[0] & 0x80) {
+        long decoded = huffman_decode(src + read, string_length, out + *used, size - *used);
+        if (decoded < 0) {
+            return 0;
+        }
+        slice->length = (uint32_t)decoded;
+    } else {
+        if (string_length > size - *used) {
+            return 0;
+        }
+        memcpy(out + *used, src + read, string_length);
+        slice->length = string_length;
+    }
+    slice->offset = (uint32_t)*used;
+    *used += slice->length;
+    return read + string_length;
+}
+
+static int copy_field(const char *data, size_t length, char *out, size_t size, size_t *used, http_slice_t *slice) {
+    if (length > size - *used) {
+        return -1;
+    }
+    memcpy(out + *used, data, length);
+    slice->offset = (uint32_t)*used;
+    slice->length = (uint32_t)length;
+    *used += length;
+    return 0;
+}
+
+/*
+ * Decode a whole header block into `out` (names and values back to back)
+ * and `fields` (slices into it). Returns the number of fields, which is
+ * max_fields + 1 if there were more than that, or -1 if the block is not
+ * valid HPACK or does not fit in `out` -- a compression error, since the
+ * table may now be out of step with the peer's.
+ */
+int hpack_decode(hpack_table_t *table, const uint8_t *block, size_t length, char *out, size_t out_size,
+                 http_header_t *fields, int max_fields) {
+    size_t position = 0;
+    size_t used = 0;
+    int count = 0;
+
+    while (position < length) {
+        const uint8_t *src = block + position;
+        size_t left = length - position;
+        http_header_t field;
+        uint32_t index;
+        size_t read;
+
+        if (src[0] & 0x80) {
+            /* Indexed field */
+            const char *name;
+            const char *value;
+            size_t name_length;
+            size_t value_length;
+            read = decode_integer(src, left, 7, &index);
+            if (read == 0 || table_lookup(table, index, &name, &name_length, &value, &value_length) != 0 ||
+                copy_field(name, name_length, out, out_size, &used, &field.name) != 0 ||
+                copy_field(value, value_length, out, out_size, &used, &field.value) != 0) {
+                return -1;
+            }
+        } else if ((src[0] & 0xe0) == 0x20) {
+            /* Dynamic table size update, only ahead of the first field */
+            read = decode_integer(src, left, 5, &index);
+            if (read == 0 || count > 0 || index > table->limit) {
+                return -1;
+            }
+            hpack_table_resize(table, index);
+            position += read;
+            continue;
+        } else {
+            /* Literal: with incremental indexing (01), without (0000) or never indexed (0001) */
+            int indexing = (src[0] & 0xc0) == 0x40;
+            read = decode_integer(src, left, indexing ? 6 : 4, &index);
+            if (read == 0) {
+                return -1;
+            }
+            if (index > 0) {
+                const char *name;
+                const char *value;
+                size_t name_length;
+                size_t value_length;
+                if (table_lookup(table, index, &name, &name_length, &value, &value_length) != 0 ||
+                    copy_field(name, name_length, out, out_size, &used, &field.name) != 0) {
+                    return -1;
+                }
+            } else {
+                size_t name_read = decode_string(src + read, left - read, out, out_size, &used, &field.name);
+                if (name_read == 0) {
+                    return -1;
+                }
+                read += name_read;
+            }
+            size_t value_read = decode_string(src + read, left - read, out, out_size, &used, &field.value);
+            if (value_read == 0) {
+                return -1;
+            }
+            read += value_read;
+
+            if (indexing) {
+                table_add(table, out + field.name.offset, field.name.length,
+                          out + field.value.offset, field.value.length);
+            }
+        }
+
+        position += read;
+        if (count < max_fields) {
+            fields[count] = field;
+        }
+        if (count <= max_fields) {
+            count++;
+        }
+    }
+    return count;
+}
+
+/* Dynamic table size update that opens a block after the peer lowered the limit; 0 if it does not fit */
+size_t hpack_encode_size_update(size_t max_size, uint8_t *out, size_t size) {
+    return encode_integer((uint32_t)max_size, 5, 0x20, out, size);
+}
+
+/*
+ * Append one field (name in lower case) to a header block. An exact match
+ * in either table becomes a one-byte index; otherwise the name is indexed
+ * when possible and the value sent as a literal, entered into the dynamic
+ * table when `indexing` says the value is likely to repeat. Returns bytes
+ * written, 0 if it does not fit.
+ */
+size_t hpack_encode(hpack_table_t *table, const char *name, size_t name_length, const char *value,
+                    size_t value_length, int indexing, uint8_t *out, size_t size) {
+    uint32_t name_index = 0;
+
+    for (int i = 0; i < STATIC_TABLE_SIZE; i++) {
+        if (strlen(static_table[i].name) != name_length || memcmp(static_table[i].name, name, name_length) != 0) {
+            continue;
+        }
+        if (strlen(static_table[i].value) == value_length && memcmp(static_table[i].value, value, value_length) == 0) {
+            return encode_integer((uint32_t)i + 1, 7, 0x80, out, size);
+        }
+        if (name_index == 0) {
+            name_index = (uint32_t)i + 1;
+        }
+    }
+    for (int i = 0; i < table->count; i++) {
+        const hpack_entry_t *entry = table_entry(table, i);
+        if (entry->name_length != name_length || memcmp(entry->field, name, name_length) != 0) {
+            continue;
+        }
+        if (entry->value_length == value_length &&
+            memcmp(entry->field + name_length, value, value_length) == 0) {
+            return encode_integer((uint32_t)(STATIC_TABLE_SIZE + i + 1), 7, 0x80, out, size);
+        }
+        if (name_index == 0) {
+            name_index = (uint32_t)(STATIC_TABLE_SIZE + i + 1);
+        }
+    }
+
+    size_t used = indexing ? encode_integer(name_index, 6, 0x40, out, size)
+                           : encode_integer(name_index, 4, 0x00, out, size);
+    if (used == 0) {
+        return 0;
+    }
+    if (name_index == 0) {
+        size_t written = encode_string(name, name_length, out + used, size - used);
+        if (written == 0) {
+            return 0;
+        }
+        used += written;
+    }
+    size_t written = encode_string(value, value_length, out + used, size - used);
+    if (written == 0) {
+        return 0;
+    }
+    used += written;
+
+    if (indexing) {
+        table_add(table, name, name_length, value, value_length);
+    }
+    return used;
+}
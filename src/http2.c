@@ -0,0 +1,1258 @@
+#include "server.h"
+#include <ctype.h>
+#include <netinet/tcp.h>
+#include <strings.h>
+
+/*
+ * HTTP/2 over cleartext TCP (h2c, RFC 9113).
+ *
+ * A connection switches to HTTP/2 either with prior knowledge, when its
+ * first bytes are the client connection preface, or by upgrading an
+ * HTTP/1.1 request that carries "Upgrade: h2c"; that request is then
+ * answered as stream 1.
+ *
+ * Frames are parsed straight out of in_buf. Each request's header block is
+ * decoded into the request arena and handed to the router as an ordinary
+ * http_request_t, so every handler serves HTTP/2 unchanged, and the
+ * response headers the handler produced are re-encoded with HPACK. The
+ * body stays with its stream as a short list of segments -- a range of an
+ * open file, of a cached file, or a copy of a generated body -- and a
+ * round-robin scheduler cuts the streams' segments into DATA frames as far
+ * as both flow-control windows allow. Frame headers go into out_buf and
+ * payloads are queued by reference like HTTP/1 bodies, so files still
+ * leave through sendfile() (or splice under io_uring) while many streams
+ * share the connection.
+ *
+ * Request bodies are read for flow control but not kept: the built-in
+ * handlers take none. Proxy routes relay HTTP/1 byte streams, so their
+ * streams are refused with HTTP_1_1_REQUIRED, which clients answer by
+ * retrying over HTTP/1.1.
+ */
+
+#define FRAME_HEADER_SIZE 9
+#define DEFAULT_WINDOW 65535
+#define MAX_WINDOW 0x7fffffff
+#define MAX_FRAME_SIZE_LIMIT 0xffffff
+#define HEADER_BLOCK_SIZE (2 * MAX_RESPONSE_HEADER_SIZE)   /* HPACK never grows a header much */
+#define MAX_SETTINGS_PAYLOAD 96                            /* HTTP2-Settings of an upgrade, decoded */
+
+enum {
+    FRAME_DATA = 0,
+    FRAME_HEADERS,
+    FRAME_PRIORITY,
+    FRAME_RST_STREAM,
+    FRAME_SETTINGS,
+    FRAME_PUSH_PROMISE,
+    FRAME_PING,
+    FRAME_GOAWAY,
+    FRAME_WINDOW_UPDATE,
+    FRAME_CONTINUATION
+};
+
+#define FLAG_END_STREAM 0x1
+#define FLAG_ACK 0x1
+#define FLAG_END_HEADERS 0x4
+#define FLAG_PADDED 0x8
+#define FLAG_PRIORITY 0x20
+
+enum {
+    ERROR_NONE = 0x0,
+    ERROR_PROTOCOL = 0x1,
+    ERROR_INTERNAL = 0x2,
+    ERROR_FLOW_CONTROL = 0x3,
+    ERROR_STREAM_CLOSED = 0x5,
+    ERROR_FRAME_SIZE = 0x6,
+    ERROR_REFUSED_STREAM = 0x7,
+    ERROR_COMPRESSION = 0x9,
+    ERROR_ENHANCE_YOUR_CALM = 0xb,
+    ERROR_HTTP_1_1_REQUIRED = 0xd
+};
+
+enum {
+    SETTINGS_HEADER_TABLE_SIZE = 0x1,
+    SETTINGS_ENABLE_PUSH = 0x2,
+    SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+    SETTINGS_INITIAL_WINDOW_SIZE = 0x4,
+    SETTINGS_MAX_FRAME_SIZE = 0x5,
+    SETTINGS_MAX_HEADER_LIST_SIZE = 0x6
+};
+
+// Where a connection is in its opening sequence
+enum {
+    PHASE_PREFACE,          /* Waiting for the client connection preface */
+    PHASE_SETTINGS,         /* Preface read; the first frame must be SETTINGS */
+    PHASE_OPEN
+};
+
+// Where the next bytes of a response body come from
+enum {
+    SEGMENT_COPY,           /* The stream's own copy (generated bodies, multipart framing) */
+    SEGMENT_CACHE,          /* A cached file, referenced per frame */
+    SEGMENT_FILE            /* An open file, sent per frame with sendfile() */
+};
+
+typedef struct {
+    int source;
+    const char *data;       /* Next byte of a COPY or CACHE segment */
+    off_t offset;           /* Next byte of a FILE segment */
+    size_t length;          /* Bytes not framed yet */
+} segment_t;
+
+// Descriptor shared by a stream and the DATA frames still queued from it
+typedef struct {
+    int fd;
+    int refs;
+} shared_file_t;
+
+typedef struct {
+    uint32_t id;
+    int remote_closed;      /* The client sent END_STREAM */
+    int64_t window;         /* Send window; negative after SETTINGS shrank it */
+    segment_t segments[MAX_RESPONSE_CHUNKS];
+    int segment_count;
+    int segment_index;
+    cache_entry_t *cache;
+    shared_file_t *file;
+    char *copy;
+    size_t copy_size;
+} stream_t;
+
+struct http2_conn {
+    int phase;
+    uint32_t last_stream_id;        /* Highest stream the client opened */
+    int goaway_sent;
+    int goaway_received;
+    int64_t send_window;            /* Connection-level windows */
+    int64_t recv_window;
+    int64_t initial_window;         /* Peer's SETTINGS_INITIAL_WINDOW_SIZE */
+    size_t max_frame;               /* Peer's SETTINGS_MAX_FRAME_SIZE */
+    int table_update;               /* Encoder table resized: the next block must say so */
+    hpack_table_t decoder;
+    hpack_table_t encoder;
+    uint32_t block_stream;          /* Stream whose header block continues in CONTINUATION frames, 0 if none */
+    int block_end_stream;
+    uint8_t *block;                 /* Fragments so far (HTTP2_HEADER_LIST_SIZE from the pool) */
+    size_t block_length;
+    stream_t *streams[HTTP2_MAX_STREAMS];   /* Open streams, in scheduling order */
+    int stream_count;
+    int cursor;                     /* Stream the scheduler visits next */
+};
+
+static const char client_preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+#define PREFACE_LENGTH (sizeof(client_preface) - 1)
+
+static const char switching_protocols[] = HTTP_VERSION " 101 Switching Protocols\r\n"
+                                          "Connection: Upgrade\r\n"
+                                          "Upgrade: h2c\r\n\r\n";
+
+static uint32_t read_u32(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static void write_u32(uint8_t *p, uint32_t value) {
+    p[0] = (uint8_t)(value >> 24);
+    p[1] = (uint8_t)(value >> 16);
+    p[2] = (uint8_t)(value >> 8);
+    p[3] = (uint8_t)value;
+}
+
+static void write_frame_header(uint8_t *out, size_t length, int type, int flags, uint32_t stream_id) {
+    out[0] = (uint8_t)(length >> 16);
+    out[1] = (uint8_t)(length >> 8);
+    out[2] = (uint8_t)length;
+    out[3] = (uint8_t)type;
+    out[4] = (uint8_t)flags;
+    write_u32(out + 5, stream_id & MAX_WINDOW);
+}
+
+/* Queue a whole frame, copied into out_buf */
+static int queue_frame(connection_t *conn, int type, int flags, uint32_t stream_id, const void *payload,
+                       size_t length) {
+    uint8_t *out = (uint8_t *)connection_reserve(conn, FRAME_HEADER_SIZE + length);
+    if (!out) {
+        return -1;
+    }
+    write_frame_header(out, length, type, flags, stream_id);
+    if (length > 0) {
+        memcpy(out + FRAME_HEADER_SIZE, payload, length);
+    }
+    return connection_commit(conn, FRAME_HEADER_SIZE + length);
+}
+
+static int queue_window_update(connection_t *conn, uint32_t stream_id, uint32_t increment) {
+    uint8_t payload[4];
+    write_u32(payload, increment);
+    return queue_frame(conn, FRAME_WINDOW_UPDATE, 0, stream_id, payload, sizeof(payload));
+}
+
+static int queue_goaway(connection_t *conn, uint32_t code) {
+    uint8_t payload[8];
+    write_u32(payload, conn->h2->last_stream_id);
+    write_u32(payload + 4, code);
+    conn->h2->goaway_sent = TRUE;
+    return queue_frame(conn, FRAME_GOAWAY, 0, 0, payload, sizeof(payload));
+}
+
+/* Fatal for the whole connection: say why, then close once that is out */
+static int connection_error(connection_t *conn, uint32_t code) {
+    if (!conn->h2->goaway_sent || code != ERROR_NONE) {
+        queue_goaway(conn, code);
+    }
+    conn->close_after_write = TRUE;
+    return -1;
+}
+
+static void release_shared_file(void *ctx) {
+    shared_file_t *file = ctx;
+    if (--file->refs == 0) {
+        close(file->fd);
+        pool_free(file, sizeof(shared_file_t));
+    }
+}
+
+static void stream_free(stream_t *stream) {
+    if (stream->cache) {
+        file_cache_release(stream->cache);
+    }
+    if (stream->file) {
+        release_shared_file(stream->file);
+    }
+    pool_free(stream->copy, stream->copy_size);
+    pool_free(stream, sizeof(stream_t));
+}
+
+static int stream_index(const struct http2_conn *h2, uint32_t stream_id) {
+    for (int i = 0; i < h2->stream_count; i++) {
+        if (h2->streams[i]->id == stream_id) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void stream_remove(struct http2_conn *h2, int index) {
+    stream_free(h2->streams[index]);
+    memmove(&h2->streams[index], &h2->streams[index + 1],
+            (size_t)(h2->stream_count - index - 1) * sizeof(h2->streams[0]));
+    h2->stream_count--;
+    if (h2->cursor > index) {
+        h2->cursor--;
+    }
+}
+
+/* Fatal for one stream only: tell the client and forget the stream */
+static int stream_error(connection_t *conn, uint32_t stream_id, uint32_t code) {
+    uint8_t payload[4];
+    write_u32(payload, code);
+    int index = stream_index(conn->h2, stream_id);
+    if (index >= 0) {
+        stream_remove(conn->h2, index);
+    }
+    return queue_frame(conn, FRAME_RST_STREAM, 0, stream_id, payload, sizeof(payload));
+}
+
+/* The response went out whole; a client still sending a body is told to stop */
+static int stream_finish(connection_t *conn, int index) {
+    stream_t *stream = conn->h2->streams[index];
+    if (!stream->remote_closed) {
+        return stream_error(conn, stream->id, ERROR_NONE);
+    }
+    stream_remove(conn->h2, index);
+    return 0;
+}
+
+/* 1 if the bytes open with the client connection preface, 0 if not, -1 if too few to tell */
+int http2_preface(const char *data, size_t length) {
+    size_t compare = length < PREFACE_LENGTH ? length : PREFACE_LENGTH;
+    if (memcmp(data, client_preface, compare) != 0) {
+        return 0;
+    }
+    return compare == PREFACE_LENGTH ? 1 : -1;
+}
+
+/* Switch the connection to HTTP/2 and queue our SETTINGS; the client preface is read next */
+int http2_start(connection_t *conn) {
+    struct http2_conn *h2 = pool_alloc(sizeof(struct http2_conn));
+    if (!h2) {
+        return -1;
+    }
+
+    memset(h2, 0, offsetof(struct http2_conn, decoder));
+    h2->phase = PHASE_PREFACE;
+    h2->send_window = DEFAULT_WINDOW;
+    h2->recv_window = DEFAULT_WINDOW;
+    h2->initial_window = DEFAULT_WINDOW;
+    h2->max_frame = HTTP2_FRAME_SIZE;
+    hpack_table_init(&h2->decoder, HPACK_TABLE_SIZE);
+    hpack_table_init(&h2->encoder, HPACK_TABLE_SIZE);
+    h2->block_stream = 0;
+    h2->block = NULL;
+    h2->block_length = 0;
+    h2->stream_count = 0;
+    h2->cursor = 0;
+    conn->h2 = h2;
+
+    /* Window-bounded DATA leaves small tails that Nagle would hold for the peer's delayed ACK */
+    int one = 1;
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    uint8_t settings[12];
+    settings[0] = 0;
+    settings[1] = SETTINGS_MAX_CONCURRENT_STREAMS;
+    write_u32(settings + 2, HTTP2_MAX_STREAMS);
+    settings[6] = 0;
+    settings[7] = SETTINGS_MAX_HEADER_LIST_SIZE;
+    write_u32(settings + 8, HTTP2_HEADER_LIST_SIZE);
+    return queue_frame(conn, FRAME_SETTINGS, 0, 0, settings, sizeof(settings));
+}
+
+/* Apply a SETTINGS payload; returns 0 or the error code it deserves */
+static uint32_t apply_settings(struct http2_conn *h2, const uint8_t *payload, size_t length) {
+    for (size_t i = 0; i + 6 <= length; i += 6) {
+        int id = payload[i] << 8 | payload[i + 1];
+        uint32_t value = read_u32(payload + i + 2);
+
+        switch (id) {
+            case SETTINGS_HEADER_TABLE_SIZE: {
+                /* Our encoder never uses more than the default, whatever the client allows */
+                size_t size = value < HPACK_TABLE_SIZE ? value : HPACK_TABLE_SIZE;
+                if (size != h2->encoder.max_size) {
+                    hpack_table_resize(&h2->encoder, size);
+                    h2->encoder.limit = size;
+                    h2->table_update = TRUE;
+                }
+                break;
+            }
+            case SETTINGS_ENABLE_PUSH:
+                if (value > 1) {
+                    return ERROR_PROTOCOL;
+                }
+                break;
+            case SETTINGS_INITIAL_WINDOW_SIZE: {
+                if (value > MAX_WINDOW) {
+                    return ERROR_FLOW_CONTROL;
+                }
+                /* Open streams' windows move by the difference (RFC 9113 6.9.2) */
+                int64_t delta = (int64_t)value - h2->initial_window;
+                for (int s = 0; s < h2->stream_count; s++) {
+                    h2->streams[s]->window += delta;
+                    if (h2->streams[s]->window > MAX_WINDOW) {
+                        return ERROR_FLOW_CONTROL;
+                    }
+                }
+                h2->initial_window = value;
+                break;
+            }
+            case SETTINGS_MAX_FRAME_SIZE:
+                if (value < HTTP2_FRAME_SIZE || value > MAX_FRAME_SIZE_LIMIT) {
+                    return ERROR_PROTOCOL;
+                }
+                h2->max_frame = value;
+                break;
+            default:
+                break; /* Unknown settings must be ignored */
+        }
+    }
+    return 0;
+}
+
+/*
+ * Response headers come from the same builder as HTTP/1: its lines are
+ * re-encoded as lower-case HPACK fields, minus the status line (it becomes
+ * :status) and the connection-level headers HTTP/2 forbids. Values that
+ * differ from file to file are not worth a dynamic table entry.
+ */
+static size_t encode_headers(struct http2_conn *h2, const http_response_t *response, uint8_t *out, size_t size) {
+    char headers[MAX_RESPONSE_HEADER_SIZE];
+    size_t length = build_http_response(response, headers, sizeof(headers));
+    size_t used = 0;
+    size_t written;
+
+    if (length == 0) {
+        return 0;
+    }
+    if (h2->table_update) {
+        if ((written = hpack_encode_size_update(h2->encoder.max_size, out, size)) == 0) {
+            return 0;
+        }
+        used += written;
+        h2->table_update = FALSE;
+    }
+
+    char status[4];
+    int code = response->status_code;
+    status[0] = (char)('0' + code / 100 % 10);
+    status[1] = (char)('0' + code / 10 % 10);
+    status[2] = (char)('0' + code % 10);
+    if ((written = hpack_encode(&h2->encoder, ":status", 7, status, 3, TRUE, out + used, size - used)) == 0) {
+        return 0;
+    }
+    used += written;
+
+    const char *line = memchr(headers, '\n', length);
+    const char *end = headers + length;
+    while (line && ++line < end) {
+        const char *eol = memchr(line, '\r', (size_t)(end - line));
+        const char *colon = eol ? memchr(line, ':', (size_t)(eol - line)) : NULL;
+        if (!colon) {
+            break; /* The blank line that ends the block */
+        }
+
+        char name[64];
+        size_t name_length = (size_t)(colon - line);
+        if (name_length >= sizeof(name)) {
+            return 0;
+        }
+        for (size_t i = 0; i < name_length; i++) {
+            name[i] = (char)tolower((unsigned char)line[i]);
+        }
+        const char *value = colon + 1;
+        while (value < eol && *value == ' ') {
+            value++;
+        }
+        line = memchr(eol, '\n', (size_t)(end - eol));
+
+        if ((name_length == 10 && memcmp(name, "connection", 10) == 0) ||
+            (name_length == 10 && memcmp(name, "keep-alive", 10) == 0) ||
+            (name_length == 17 && memcmp(name, "transfer-encoding", 17) == 0)) {
+            continue;
+        }
+        int indexing = !((name_length == 14 && memcmp(name, "content-length", 14) == 0) ||
+                         (name_length == 13 && memcmp(name, "content-range", 13) == 0) ||
+                         (name_length == 13 && memcmp(name, "last-modified", 13) == 0) ||
+                         (name_length == 4 && memcmp(name, "etag", 4) == 0));
+        written = hpack_encode(&h2->encoder, name, name_length, value, (size_t)(eol - value), indexing,
+                               out + used, size - used);
+        if (written == 0) {
+            return 0;
+        }
+        used += written;
+    }
+    return used;
+}
+
+static void add_segment(stream_t *stream, int source, const char *data, off_t offset, size_t length) {
+    if (length == 0) {
+        return;
+    }
+    segment_t *segment = &stream->segments[stream->segment_count++];
+    segment->source = source;
+    segment->data = data;
+    segment->offset = offset;
+    segment->length = length;
+}
+
+static void add_range(stream_t *stream, const http_range_t *range) {
+    if (stream->file) {
+        add_segment(stream, SEGMENT_FILE, NULL, range->start, range->length);
+    } else if (stream->cache) {
+        add_segment(stream, SEGMENT_CACHE, file_cache_data(stream->cache, NULL) + range->start, 0, range->length);
+    }
+}
+
+/* Move the response body into the stream as segments; the fd or cache reference moves with it */
+static int attach_body(stream_t *stream, http_response_t *response) {
+    if (response->file_fd >= 0) {
+        stream->file = pool_alloc(sizeof(shared_file_t));
+        if (!stream->file) {
+            return -1;
+        }
+        stream->file->fd = response->file_fd;
+        stream->file->refs = 1;
+        response->file_fd = -1;
+    } else if (response->cache_entry) {
+        stream->cache = response->cache_entry;
+        response->cache_entry = NULL;
+    }
+
+    if (response->range_count == 0) {
+        if (stream->file) {
+            add_segment(stream, SEGMENT_FILE, NULL, response->file_offset, response->body_length);
+        } else if (stream->cache) {
+            add_segment(stream, SEGMENT_CACHE, file_cache_data(stream->cache, NULL), 0, response->body_length);
+        } else if (response->body && response->body_length > 0) {
+            /* Generated bodies live in the request arena, which is reset before they are framed */
+            stream->copy_size = response->body_length;
+            stream->copy = pool_alloc(stream->copy_size);
+            if (!stream->copy) {
+                return -1;
+            }
+            memcpy(stream->copy, response->body, response->body_length);
+            add_segment(stream, SEGMENT_COPY, stream->copy, 0, response->body_length);
+        }
+        return 0;
+    }
+
+    if (response->range_count == 1) {
+        add_range(stream, &response->ranges[0]);
+        return 0;
+    }
+
+    /* multipart/byteranges: part headers and the trailer are copied, the parts themselves referenced */
+    stream->copy_size = (size_t)(response->range_count + 1) * 256;
+    stream->copy = pool_alloc(stream->copy_size);
+    if (!stream->copy) {
+        return -1;
+    }
+    size_t used = 0;
+    for (int i = 0; i < response->range_count; i++) {
+        size_t length = build_range_part_header(response, i, stream->copy + used, stream->copy_size - used);
+        if (length == 0) {
+            return -1;
+        }
+        add_segment(stream, SEGMENT_COPY, stream->copy + used, 0, length);
+        add_range(stream, &response->ranges[i]);
+        used += length;
+    }
+    size_t length = build_multipart_trailer(stream->copy + used, stream->copy_size - used);
+    if (length == 0) {
+        return -1;
+    }
+    add_segment(stream, SEGMENT_COPY, stream->copy + used, 0, length);
+    return 0;
+}
+
+/* Queue the HEADERS frame of a response and keep its body for the scheduler */
+static int queue_response(connection_t *conn, stream_t *stream, int method, http_response_t *response) {
+    struct http2_conn *h2 = conn->h2;
+    int bodyless = method == HTTP_METHOD_HEAD || response->status_code == HTTP_NOT_MODIFIED ||
+                   response->status_code == 204;
+
+    if (!bodyless && attach_body(stream, response) != 0) {
+        return stream_error(conn, stream->id, ERROR_INTERNAL);
+    }
+
+    uint8_t *out = (uint8_t *)connection_reserve(conn, FRAME_HEADER_SIZE + HEADER_BLOCK_SIZE);
+    if (!out) {
+        return -1;
+    }
+    response->keep_alive = TRUE;
+    /* A block that failed halfway may have changed the encoder table already, and the peer's copy
+     * never sees it: no later block would decode, so this ends the connection, not just the stream */
+    size_t length = encode_headers(h2, response, out + FRAME_HEADER_SIZE, HEADER_BLOCK_SIZE);
+    if (length == 0 || length > h2->max_frame) {
+        return -1;
+    }
+
+    int end_stream = stream->segment_count == 0;
+    write_frame_header(out, length, FRAME_HEADERS, FLAG_END_HEADERS | (end_stream ? FLAG_END_STREAM : 0),
+                       stream->id);
+    if (connection_commit(conn, FRAME_HEADER_SIZE + length) != 0) {
+        return -1;
+    }
+    return end_stream ? stream_finish(conn, stream_index(h2, stream->id)) : 0;
+}
+
+/* Answer one request on its stream, then log it like any other */
+static void dispatch(connection_t *conn, stream_t *stream, const http_request_t *request) {
+    http_response_t response;
+    char method[16];
+    char path[MAX_PATH_LENGTH];
+    uint64_t started = metrics_now();
+
+    conn->requests_served++;
+    http_response_init(&response);
+
+    if (router_streams_body(request)) {
+        stream_error(conn, stream->id, ERROR_HTTP_1_1_REQUIRED);
+        arena_reset();
+        return;
+    }
+
+    /* Over --rate-limit: no handler, no body, only the status and when to come back */
+    if (ratelimit_allow(conn->client_addr)) {
+        handle_client(conn, request, &response);
+    } else {
+        response.status_code = HTTP_TOO_MANY_REQUESTS;
+        response.retry_after = atoi(RETRY_AFTER_SECONDS);
+    }
+    if (queue_response(conn, stream, http_request_method(request), &response) != 0) {
+        connection_error(conn, ERROR_INTERNAL);
+    }
+
+    metrics_observe(METRIC_TOTAL, metrics_now() - started);
+    metrics_count_request(request, response.status_code);
+    http_slice_copy(request, request->method, method, sizeof(method));
+    http_slice_copy(request, request->path, path, sizeof(path));
+    log_request(method, path, response.status_code, conn->client_ip);
+
+    /* The body was framed or copied already; the decoded headers go with the arena too */
+    free_response(&response);
+    arena_reset();
+
+    /* Past --max-requests the client is asked to move on once the open streams are done */
+    if (conn->requests_served >= g_config.max_requests && !conn->h2->goaway_sent) {
+        queue_goaway(conn, ERROR_NONE);
+    }
+}
+
+static stream_t *stream_open(struct http2_conn *h2, uint32_t stream_id, int remote_closed) {
+    stream_t *stream = pool_alloc(sizeof(stream_t));
+    if (!stream) {
+        return NULL;
+    }
+    memset(stream, 0, offsetof(stream_t, segments));
+    stream->id = stream_id;
+    stream->remote_closed = remote_closed;
+    stream->window = h2->initial_window;
+    stream->segment_count = 0;
+    stream->segment_index = 0;
+    stream->cache = NULL;
+    stream->file = NULL;
+    stream->copy = NULL;
+    stream->copy_size = 0;
+    h2->streams[h2->stream_count++] = stream;
+    return stream;
+}
+
+static int is_connection_header(const char *name, size_t length) {
+    static const char *const names[] = { "connection", "keep-alive", "proxy-connection", "transfer-encoding",
+                                         "upgrade" };
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strlen(names[i]) == length && memcmp(names[i], name, length) == 0) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/*
+ * Turn decoded fields into a request: pseudo-headers become the method,
+ * path and query slices (:authority the Host header), the rest are copied
+ * as they are. Returns -1 for a malformed request (RFC 9113 8.1.1) or
+ * one with more fields than an HTTP/1 request may have.
+ */
+static int build_request(char *buf, http_header_t *fields, int count, http_request_t *request) {
+    int seen_regular = FALSE;
+    int has_scheme = FALSE;
+
+    if (count > MAX_HEADER_COUNT) {
+        return -1;
+    }
+
+    http_request_init(request);
+    request->buf = buf;
+    request->version_major = 2;
+    request->version_minor = 0;
+    request->keep_alive = TRUE;
+
+    for (int i = 0; i < count; i++) {
+        http_header_t *field = &fields[i];
+        char *name = buf + field->name.offset;
+        const char *value = buf + field->value.offset;
+
+        if (field->name.length > 0 && name[0] == ':') {
+            http_slice_t *target = NULL;
+            if (seen_regular) {
+                return -1;
+            }
+            if (field->name.length == 7 && memcmp(name, ":method", 7) == 0) {
+                target = &request->method;
+            } else if (field->name.length == 5 && memcmp(name, ":path", 5) == 0) {
+                target = &request->path;
+            } else if (field->name.length == 7 && memcmp(name, ":scheme", 7) == 0) {
+                if (has_scheme) {
+                    return -1;
+                }
+                has_scheme = TRUE;
+                continue;
+            } else if (field->name.length == 10 && memcmp(name, ":authority", 10) == 0) {
+                /* Rename in place, so Host lookups (virtual hosts, routes) see it */
+                memcpy(name, "host", 4);
+                field->name.length = 4;
+            } else {
+                return -1;
+            }
+            if (target) {
+                if (target->length > 0 || field->value.length == 0) {
+                    return -1;
+                }
+                *target = field->value;
+                continue;
+            }
+        } else {
+            seen_regular = TRUE;
+            for (uint32_t c = 0; c < field->name.length; c++) {
+                if (isupper((unsigned char)name[c])) {
+                    return -1;
+                }
+            }
+            if (is_connection_header(name, field->name.length) ||
+                (field->name.length == 2 && memcmp(name, "te", 2) == 0 &&
+                 !(field->value.length == 8 && memcmp(value, "trailers", 8) == 0))) {
+                return -1;
+            }
+            if (field->name.length == 14 && memcmp(name, "content-length", 14) == 0) {
+                long length = 0;
+                for (uint32_t c = 0; c < field->value.length; c++) {
+                    if (!isdigit((unsigned char)value[c]) || length > (LONG_MAX - 9) / 10) {
+                        return -1;
+                    }
+                    length = length * 10 + (value[c] - '0');
+                }
+                request->content_length = length;
+            }
+        }
+
+        if (request->header_count >= MAX_HEADER_COUNT) {
+            return -1;
+        }
+        request->headers[request->header_count++] = *field;
+    }
+
+    if (request->method.length == 0 || request->path.length == 0 || !has_scheme) {
+        return -1;
+    }
+    const char *path = buf + request->path.offset;
+    if (path[0] != '/' && !(request->path.length == 1 && path[0] == '*')) {
+        return -1;
+    }
+
+    /* Split the query string off the path, as the HTTP/1 parser does */
+    const char *query = memchr(path, '?', request->path.length);
+    if (query) {
+        uint32_t length = (uint32_t)(query - path);
+        request->query.offset = request->path.offset + length + 1;
+        request->query.length = request->path.length - length - 1;
+        request->path.length = length;
+    }
+    return 0;
+}
+
+/* A complete header block: decode it (always, to keep the table in step), then open the stream */
+static int on_header_block(connection_t *conn, uint32_t stream_id, int end_stream, const uint8_t *block,
+                           size_t length) {
+    struct http2_conn *h2 = conn->h2;
+    http_header_t fields[MAX_HEADER_COUNT];
+    http_request_t request;
+
+    char *buf = arena_alloc(HTTP2_HEADER_LIST_SIZE);
+    if (!buf) {
+        return connection_error(conn, ERROR_INTERNAL);
+    }
+    int count = hpack_decode(&h2->decoder, block, length, buf, HTTP2_HEADER_LIST_SIZE, fields, MAX_HEADER_COUNT);
+    if (count < 0) {
+        arena_reset();
+        return connection_error(conn, ERROR_COMPRESSION);
+    }
+
+    /* Trailers of a stream we are still answering end its request body; they are not used */
+    int index = stream_index(h2, stream_id);
+    if (index >= 0 || stream_id <= h2->last_stream_id) {
+        arena_reset();
+        if (index < 0) {
+            return 0; /* A stream we already reset; frames may still be in flight */
+        }
+        if (!end_stream) {
+            return stream_error(conn, stream_id, ERROR_PROTOCOL);
+        }
+        h2->streams[index]->remote_closed = TRUE;
+        return 0;
+    }
+    if (stream_id % 2 == 0) {
+        arena_reset();
+        return connection_error(conn, ERROR_PROTOCOL);
+    }
+    if (h2->goaway_sent) {
+        arena_reset();
+        return 0; /* Past the last stream our GOAWAY promised to answer */
+    }
+    h2->last_stream_id = stream_id;
+    if (h2->stream_count >= HTTP2_MAX_STREAMS) {
+        arena_reset();
+        return stream_error(conn, stream_id, ERROR_REFUSED_STREAM);
+    }
+
+    if (build_request(buf, fields, count, &request) != 0) {
+        arena_reset();
+        return stream_error(conn, stream_id, ERROR_PROTOCOL);
+    }
+    stream_t *stream = stream_open(h2, stream_id, end_stream);
+    if (!stream) {
+        arena_reset();
+        return connection_error(conn, ERROR_INTERNAL);
+    }
+    dispatch(conn, stream, &request);
+    return 0;
+}
+
+static int on_headers(connection_t *conn, int flags, uint32_t stream_id, const uint8_t *payload, size_t length) {
+    struct http2_conn *h2 = conn->h2;
+    size_t start = 0;
+    size_t padding = 0;
+
+    if (stream_id == 0) {
+        return connection_error(conn, ERROR_PROTOCOL);
+    }
+    if (flags & FLAG_PADDED) {
+        if (length < 1) {
+            return connection_error(conn, ERROR_FRAME_SIZE);
+        }
+        padding = payload[0];
+        start = 1;
+    }
+    if (flags & FLAG_PRIORITY) {
+        start += 5; /* Stream dependency and weight; we schedule round-robin regardless */
+    }
+    if (start + padding > length) {
+        return connection_error(conn, ERROR_PROTOCOL);
+    }
+
+    const uint8_t *fragment = payload + start;
+    size_t fragment_length = length - start - padding;
+    if (flags & FLAG_END_HEADERS) {
+        return on_header_block(conn, stream_id, flags & FLAG_END_STREAM, fragment, fragment_length);
+    }
+
+    /* The block continues in CONTINUATION frames; collect it */
+    if (!h2->block) {
+        h2->block = pool_alloc(HTTP2_HEADER_LIST_SIZE);
+        if (!h2->block) {
+            return connection_error(conn, ERROR_INTERNAL);
+        }
+    }
+    if (fragment_length > HTTP2_HEADER_LIST_SIZE) {
+        return connection_error(conn, ERROR_ENHANCE_YOUR_CALM);
+    }
+    memcpy(h2->block, fragment, fragment_length);
+    h2->block_length = fragment_length;
+    h2->block_stream = stream_id;
+    h2->block_end_stream = flags & FLAG_END_STREAM;
+    return 0;
+}
+
+static int on_continuation(connection_t *conn, int flags, uint32_t stream_id, const uint8_t *payload,
+                           size_t length) {
+    struct http2_conn *h2 = conn->h2;
+
+    if (stream_id != h2->block_stream) {
+        return connection_error(conn, ERROR_PROTOCOL);
+    }
+    if (length > HTTP2_HEADER_LIST_SIZE - h2->block_length) {
+        return connection_error(conn, ERROR_ENHANCE_YOUR_CALM);
+    }
+    memcpy(h2->block + h2->block_length, payload, length);
+    h2->block_length += length;
+    if (!(flags & FLAG_END_HEADERS)) {
+        return 0;
+    }
+
+    h2->block_stream = 0;
+    return on_header_block(conn, stream_id, h2->block_end_stream, h2->block, h2->block_length);
+}
+
+/* Request bodies are discarded, but every byte still passes through flow control */
+static int on_data(connection_t *conn, int flags, uint32_t stream_id, const uint8_t *payload, size_t length) {
+    struct http2_conn *h2 = conn->h2;
+
+    if (stream_id == 0) {
+        return connection_error(conn, ERROR_PROTOCOL);
+    }
+    if ((flags & FLAG_PADDED) && (length < 1 || payload[0] >= length)) {
+        return connection_error(conn, ERROR_PROTOCOL);
+    }
+    h2->recv_window -= (int64_t)length;
+    if (h2->recv_window < 0) {
+        return connection_error(conn, ERROR_FLOW_CONTROL);
+    }
+    if (h2->recv_window < DEFAULT_WINDOW / 2) {
+        if (queue_window_update(conn, 0, (uint32_t)(DEFAULT_WINDOW - h2->recv_window)) != 0) {
+            return -1;
+        }
+        h2->recv_window = DEFAULT_WINDOW;
+    }
+
+    int index = stream_index(h2, stream_id);
+    if (index < 0) {
+        return stream_id > h2->last_stream_id ? connection_error(conn, ERROR_PROTOCOL) : 0;
+    }
+    stream_t *stream = h2->streams[index];
+    if (stream->remote_closed) {
+        return stream_error(conn, stream_id, ERROR_STREAM_CLOSED);
+    }
+    if (flags & FLAG_END_STREAM) {
+        stream->remote_closed = TRUE;
+    } else if (length > 0) {
+        return queue_window_update(conn, stream_id, (uint32_t)length);
+    }
+    return 0;
+}
+
+static int on_settings(connection_t *conn, int flags, uint32_t stream_id, const uint8_t *payload, size_t length) {
+    if (stream_id != 0) {
+        return connection_error(conn, ERROR_PROTOCOL);
+    }
+    if (flags & FLAG_ACK) {
+        return length == 0 ? 0 : connection_error(conn, ERROR_FRAME_SIZE);
+    }
+    if (length % 6 != 0) {
+        return connection_error(conn, ERROR_FRAME_SIZE);
+    }
+
+    uint32_t error = apply_settings(conn->h2, payload, length);
+    if (error != 0) {
+        return connection_error(conn, error);
+    }
+    return queue_frame(conn, FRAME_SETTINGS, FLAG_ACK, 0, NULL, 0);
+}
+
+static int on_window_update(connection_t *conn, uint32_t stream_id, const uint8_t *payload, size_t length) {
+    struct http2_conn *h2 = conn->h2;
+
+    if (length != 4) {
+        return connection_error(conn, ERROR_FRAME_SIZE);
+    }
+    uint32_t increment = read_u32(payload) & MAX_WINDOW;
+
+    if (stream_id == 0) {
+        if (increment == 0) {
+            return connection_error(conn, ERROR_PROTOCOL);
+        }
+        h2->send_window += increment;
+        return h2->send_window > MAX_WINDOW ? connection_error(conn, ERROR_FLOW_CONTROL) : 0;
+    }
+
+    int index = stream_index(h2, stream_id);
+    if (index < 0) {
+        return stream_id > h2->last_stream_id ? connection_error(conn, ERROR_PROTOCOL) : 0;
+    }
+    if (increment == 0) {
+        return stream_error(conn, stream_id, ERROR_PROTOCOL);
+    }
+    h2->streams[index]->window += increment;
+    return h2->streams[index]->window > MAX_WINDOW ? stream_error(conn, stream_id, ERROR_FLOW_CONTROL) : 0;
+}
+
+static int process_frame(connection_t *conn, int type, int flags, uint32_t stream_id, const uint8_t *payload,
+                         size_t length) {
+    struct http2_conn *h2 = conn->h2;
+
+    /* A header block must not be interleaved with anything else */
+    if (h2->block_stream != 0 && type != FRAME_CONTINUATION) {
+        return connection_error(conn, ERROR_PROTOCOL);
+    }
+    if (h2->phase == PHASE_SETTINGS) {
+        if (type != FRAME_SETTINGS || (flags & FLAG_ACK)) {
+            return connection_error(conn, ERROR_PROTOCOL);
+        }
+        h2->phase = PHASE_OPEN;
+    }
+
+    switch (type) {
+        case FRAME_DATA:
+            return on_data(conn, flags, stream_id, payload, length);
+        case FRAME_HEADERS:
+            return on_headers(conn, flags, stream_id, payload, length);
+        case FRAME_PRIORITY:
+            if (stream_id == 0) {
+                return connection_error(conn, ERROR_PROTOCOL);
+            }
+            return length == 5 ? 0 : stream_error(conn, stream_id, ERROR_FRAME_SIZE);
+        case FRAME_RST_STREAM: {
+            if (stream_id == 0 || stream_id > h2->last_stream_id) {
+                return connection_error(conn, ERROR_PROTOCOL);
+            }
+            if (length != 4) {
+                return connection_error(conn, ERROR_FRAME_SIZE);
+            }
+            int index = stream_index(h2, stream_id);
+            if (index >= 0) {
+                stream_remove(h2, index);
+            }
+            return 0;
+        }
+        case FRAME_SETTINGS:
+            return on_settings(conn, flags, stream_id, payload, length);
+        case FRAME_PING:
+            if (stream_id != 0) {
+                return connection_error(conn, ERROR_PROTOCOL);
+            }
+            if (length != 8) {
+                return connection_error(conn, ERROR_FRAME_SIZE);
+            }
+            return (flags & FLAG_ACK) ? 0 : queue_frame(conn, FRAME_PING, FLAG_ACK, 0, payload, length);
+        case FRAME_GOAWAY:
+            if (stream_id != 0) {
+                return connection_error(conn, ERROR_PROTOCOL);
+            }
+            h2->goaway_received = TRUE; /* Streams already open are still answered */
+            return 0;
+        case FRAME_WINDOW_UPDATE:
+            return on_window_update(conn, stream_id, payload, length);
+        case FRAME_CONTINUATION:
+            if (h2->block_stream == 0) {
+                return connection_error(conn, ERROR_PROTOCOL);
+            }
+            return on_continuation(conn, flags, stream_id, payload, length);
+        case FRAME_PUSH_PROMISE:
+            return connection_error(conn, ERROR_PROTOCOL); /* Clients never push */
+        default:
+            return 0; /* Unknown frame types are ignored */
+    }
+}
+
+/* Cut the next DATA frame from a stream; returns 1 once its body is all queued, -1 on failure */
+static int send_frame(connection_t *conn, stream_t *stream) {
+    struct http2_conn *h2 = conn->h2;
+    segment_t *segment = &stream->segments[stream->segment_index];
+    size_t length = segment->length;
+    size_t limit = h2->max_frame < OUTPUT_HIGH_WATER ? h2->max_frame : OUTPUT_HIGH_WATER;
+
+    if (length > limit) {
+        length = limit;
+    }
+    if ((int64_t)length > stream->window) {
+        length = (size_t)stream->window;
+    }
+    if ((int64_t)length > h2->send_window) {
+        length = (size_t)h2->send_window;
+    }
+    int last = length == segment->length && stream->segment_index + 1 == stream->segment_count;
+
+    size_t inline_length = segment->source == SEGMENT_COPY ? length : 0;
+    uint8_t *out = (uint8_t *)connection_reserve(conn, FRAME_HEADER_SIZE + inline_length);
+    if (!out) {
+        return -1;
+    }
+    write_frame_header(out, length, FRAME_DATA, last ? FLAG_END_STREAM : 0, stream->id);
+    memcpy(out + FRAME_HEADER_SIZE, segment->data, inline_length);
+    if (connection_commit(conn, FRAME_HEADER_SIZE + inline_length) != 0) {
+        return -1;
+    }
+
+    /* Payloads are referenced: every queued frame holds its own cache or file reference */
+    if (segment->source == SEGMENT_CACHE) {
+        file_cache_retain(stream->cache);
+        if (connection_append_memory(conn, segment->data, length, file_cache_release, stream->cache) != 0) {
+            file_cache_release(stream->cache);
+            return -1;
+        }
+    } else if (segment->source == SEGMENT_FILE) {
+        stream->file->refs++;
+        if (connection_append_shared_file(conn, stream->file->fd, segment->offset, length,
+                                          release_shared_file, stream->file) != 0) {
+            release_shared_file(stream->file);
+            return -1;
+        }
+    }
+
+    segment->data += segment->source == SEGMENT_FILE ? 0 : length;
+    segment->offset += (off_t)length;
+    segment->length -= length;
+    if (segment->length == 0) {
+        stream->segment_index++;
+    }
+    stream->window -= (int64_t)length;
+    h2->send_window -= (int64_t)length;
+    return last;
+}
+
+/* Round-robin over the streams, one frame each per turn, while the windows and the output queue allow */
+static int send_data(connection_t *conn) {
+    struct http2_conn *h2 = conn->h2;
+    int frames = 0;
+    int idle = 0;
+
+    /* After an upgrade, hold DATA until the client preface: a client still
+     * reading the 101 may not have room for a whole window behind it */
+    if (h2->phase == PHASE_PREFACE) {
+        return 0;
+    }
+    while (h2->stream_count > 0 && idle < h2->stream_count && h2->send_window > 0 &&
+           !conn->close_after_write && conn->out_count + 2 <= OUT_QUEUE_SIZE && conn->out_len < OUTPUT_HIGH_WATER) {
+        if (h2->cursor >= h2->stream_count) {
+            h2->cursor = 0;
+        }
+        stream_t *stream = h2->streams[h2->cursor];
+        if (stream->window <= 0 || stream->segment_index >= stream->segment_count) {
+            h2->cursor++;
+            idle++;
+            continue;
+        }
+
+        int sent = send_frame(conn, stream);
+        if (sent < 0) {
+            connection_error(conn, ERROR_INTERNAL);
+            break;
+        }
+        frames++;
+        idle = 0;
+        if (sent > 0) {
+            stream_finish(conn, h2->cursor); /* The next stream moves into its slot */
+        } else {
+            h2->cursor++;
+        }
+    }
+    return frames;
+}
+
+/* Frames in in_buf, then DATA for the open streams; returns how much was done (0 = wait for input) */
+int http2_handle_input(connection_t *conn) {
+    struct http2_conn *h2 = conn->h2;
+    size_t offset = 0;
+    int handled = 0;
+
+    if (h2->phase == PHASE_PREFACE && conn->in_len > 0) {
+        int preface = http2_preface(conn->in_buf, conn->in_len);
+        if (preface == 0) {
+            connection_error(conn, ERROR_PROTOCOL);
+            conn->in_len = 0;
+            return 1;
+        }
+        if (preface > 0) {
+            offset = PREFACE_LENGTH;
+            h2->phase = PHASE_SETTINGS;
+            handled++;
+        }
+    }
+
+    /* Stop reading frames while the output queue is full; what they would answer has to wait its turn */
+    while (h2->phase != PHASE_PREFACE && !conn->close_after_write && conn->in_len - offset >= FRAME_HEADER_SIZE &&
+           conn->out_count + 2 <= OUT_QUEUE_SIZE && conn->out_len < OUTPUT_HIGH_WATER) {
+        const uint8_t *frame = (const uint8_t *)conn->in_buf + offset;
+        size_t length = (size_t)frame[0] << 16 | (size_t)frame[1] << 8 | frame[2];
+        if (length > HTTP2_FRAME_SIZE) {
+            connection_error(conn, ERROR_FRAME_SIZE);
+            break;
+        }
+        if (conn->in_len - offset < FRAME_HEADER_SIZE + length) {
+            break;
+        }
+
+        uint32_t stream_id = read_u32(frame + 5) & MAX_WINDOW;
+        if (process_frame(conn, frame[3], frame[4], stream_id, frame + FRAME_HEADER_SIZE, length) != 0 &&
+            !conn->close_after_write) {
+            connection_error(conn, ERROR_INTERNAL); /* Out of memory or queue space mid-frame */
+        }
+        offset += FRAME_HEADER_SIZE + length;
+        handled++;
+    }
+
+    if (offset > 0) {
+        memmove(conn->in_buf, conn->in_buf + offset, conn->in_len - offset);
+        conn->in_len -= offset;
+        conn->in_buf[conn->in_len] = '\0';
+    }
+    if (conn->close_after_write) {
+        conn->in_len = 0;
+        return handled + 1;
+    }
+
+    /* A hot restart winds the session down as max_requests does: GOAWAY, then close after the last stream */
+    if (g_server.draining && !h2->goaway_sent) {
+        queue_goaway(conn, ERROR_NONE);
+        handled++;
+    }
+
+    handled += send_data(conn);
+
+    /* After a GOAWAY either way the connection ends with its last stream */
+    if ((h2->goaway_sent || h2->goaway_received) && h2->stream_count == 0 && h2->block_stream == 0) {
+        conn->close_after_write = TRUE;
+        conn->in_len = 0;
+        handled++;
+    }
+    return handled;
+}
+
+/* base64url without padding, as HTTP2-Settings carries it; returns the decoded length or -1 */
+static long base64url_decode(const char *src, size_t length, uint8_t *out, size_t size) {
+    uint32_t bits = 0;
+    int count = 0;
+    size_t written = 0;
+
+    for (size_t i = 0; i < length; i++) {
+        int c = (unsigned char)src[i];
+        int value;
+        if (c >= 'A' && c <= 'Z') {
+            value = c - 'A';
+        } else if (c >= 'a' && c <= 'z') {
+            value = c - 'a' + 26;
+        } else if (c >= '0' && c <= '9') {
+            value = c - '0' + 52;
+        } else if (c == '-') {
+            value = 62;
+        } else if (c == '_') {
+            value = 63;
+        } else if (c == '=') {
+            break;
+        } else {
+            return -1;
+        }
+        bits = (bits << 6) | (uint32_t)value;
+        count += 6;
+        if (count >= 8) {
+            count -= 8;
+            if (written >= size) {
+                return -1;
+            }
+            out[written++] = (uint8_t)(bits >> count);
+        }
+    }
+    return (long)written;
+}
+
+/*
+ * "Upgrade: h2c" with an HTTP2-Settings header: answer 101, switch to
+ * HTTP/2 and serve the request as stream 1. Returns -1, leaving the request
+ * to HTTP/1.1, when the upgrade does not apply: a request body (it would
+ * have to be read as HTTP/1 first), a proxy route, a bad settings value, or
+ * TLS, where h2 is negotiated with ALPN instead.
+ */
+int http2_upgrade(connection_t *conn, const http_request_t *request) {
+    uint8_t settings[MAX_SETTINGS_PAYLOAD];
+    size_t length;
+
+    const char *upgrade = http_request_header(request, "Upgrade", &length);
+    if (conn->h2 || conn->tls || !upgrade || !http_has_token(upgrade, length, "h2c") || request->content_length > 0) {
+        return -1;
+    }
+    const char *encoded = http_request_header(request, "HTTP2-Settings", &length);
+    long settings_length = encoded ? base64url_decode(encoded, length, settings, sizeof(settings)) : -1;
+    if (settings_length < 0 || settings_length % 6 != 0 || router_streams_body(request)) {
+        return -1;
+    }
+
+    if (connection_append(conn, switching_protocols, sizeof(switching_protocols) - 1) != 0 ||
+        http2_start(conn) != 0) {
+        conn->close_after_write = TRUE;
+        return 0;
+    }
+    struct http2_conn *h2 = conn->h2;
+    uint32_t error = apply_settings(h2, settings, (size_t)settings_length);
+    if (error != 0) {
+        connection_error(conn, error);
+        return 0;
+    }
+
+    /* The upgraded request is stream 1, already half-closed by the client */
+    h2->last_stream_id = 1;
+    stream_t *stream = stream_open(h2, 1, TRUE);
+    if (!stream) {
+        connection_error(conn, ERROR_INTERNAL);
+        return 0;
+    }
+    dispatch(conn, stream, request);
+    return 0;
+}
+
+/* Streams with body still to send: the connection waits on the client's windows, not on a request */
+int http2_blocked(const connection_t *conn) {
+    return conn->h2 && conn->h2->stream_count > 0;
+}
+
+void http2_close(connection_t *conn) {
+    struct http2_conn *h2 = conn->h2;
+    if (!h2) {
+        return;
+    }
+
+    while (h2->stream_count > 0) {
+        stream_remove(h2, h2->stream_count - 1);
+    }
+    hpack_table_free(&h2->decoder);
+    hpack_table_free(&h2->encoder);
+    pool_free(h2->block, HTTP2_HEADER_LIST_SIZE);
+    pool_free(h2, sizeof(struct http2_conn));
+    conn->h2 = NULL;
+}
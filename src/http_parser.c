@@ -1,120 +1,992 @@
 #include "server.h"
+#include <ctype.h>
 
-int parse_http_request(const char *raw_request, http_request_t *request) {
-    if (!raw_request || !request) {
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HTTP_PARSER_X86 1
+#endif
+
+/* Parser states, kept in request->parse_state between partial reads */
+enum {
+    PARSE_REQUEST_LINE = 0,
+    PARSE_HEADER_NAME,
+    PARSE_HEADER_VALUE,
+    PARSE_DONE
+};
+
+/* RFC 7230 tchar lookup table, built once at startup */
+static unsigned char token_table[256];
+
+/* ---- Delimiter scanning: first byte equal to a, b or c ---- */
+
+typedef const char *(*scan_fn)(const char *p, const char *end, char a, char b, char c);
+
+static const char *scan_scalar(const char *p, const char *end, char a, char b, char c) {
+    for (; p < end; p++) {
+        if (*p == a || *p == b || *p == c) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+#ifdef HTTP_PARSER_X86
+static const char *scan_sse2(const char *p, const char *end, char a, char b, char c) {
+    const __m128i va = _mm_set1_epi8(a);
+    const __m128i vb = _mm_set1_epi8(b);
+    const __m128i vc = _mm_set1_epi8(c);
+
+    while (end - p >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        __m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)),
+                                   _mm_cmpeq_epi8(v, vc));
+        int mask = _mm_movemask_epi8(hit);
+        if (mask) {
+            return p + __builtin_ctz((unsigned)mask);
+        }
+        p += 16;
+    }
+    return scan_scalar(p, end, a, b, c);
+}
+
+__attribute__((target("avx2")))
+static const char *scan_avx2(const char *p, const char *end, char a, char b, char c) {
+    const __m256i va = _mm256_set1_epi8(a);
+    const __m256i vb = _mm256_set1_epi8(b);
+    const __m256i vc = _mm256_set1_epi8(c);
+
+    while (end - p >= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)p);
+        __m256i hit = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, va), _mm256_cmpeq_epi8(v, vb)),
+                                      _mm256_cmpeq_epi8(v, vc));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(hit);
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 32;
+    }
+
+    /* Tail stays VEX-encoded here; calling the SSE2 variant would mix encodings */
+    if (end - p >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        __m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm256_castsi256_si128(va)),
+                                                _mm_cmpeq_epi8(v, _mm256_castsi256_si128(vb))),
+                                   _mm_cmpeq_epi8(v, _mm256_castsi256_si128(vc)));
+        int mask = _mm_movemask_epi8(hit);
+        if (mask) {
+            return p + __builtin_ctz((unsigned)mask);
+        }
+        p += 16;
+    }
+    for (; p < end; p++) {
+        if (*p == a || *p == b || *p == c) {
+            return p;
+        }
+    }
+    return NULL;
+}
+#endif
+
+static scan_fn scan_delims = scan_scalar;
+static const char *scan_name = "scalar";
+
+/* multipart/byteranges delimiter, unlikely enough to appear inside a file */
+static char multipart_boundary[40];
+
+/* Pick the widest scanner the CPU supports before any worker starts */
+__attribute__((constructor))
+static void http_parser_init(void) {
+    for (int ch = 0x21; ch < 0x7f; ch++) {
+        token_table[ch] = strchr("()<>@,;:\\\"/[]?={}", ch) == NULL;
+    }
+
+    unsigned long long seed = (unsigned long long)time(NULL) ^ ((unsigned long long)getpid() << 32) ^
+                              (unsigned long long)(uintptr_t)&seed;
+    snprintf(multipart_boundary, sizeof(multipart_boundary), "SimpleHTTP-%016llx",
+             seed * 0x9E3779B97F4A7C15ULL);
+
+#ifdef HTTP_PARSER_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        scan_delims = scan_avx2;
+        scan_name = "avx2";
+    } else {
+        scan_delims = scan_sse2;
+        scan_name = "sse2";
+    }
+#endif
+}
+
+int http_parser_set_scanner(const char *name) {
+    if (!name) {
         return -1;
     }
 
-    /* Initialize request structure */
-    memset(request, 0, sizeof(http_request_t));
+    if (strcmp(name, "scalar") == 0) {
+        scan_delims = scan_scalar;
+        scan_name = "scalar";
+#ifdef HTTP_PARSER_X86
+    } else if (strcmp(name, "sse2") == 0) {
+        scan_delims = scan_sse2;
+        scan_name = "sse2";
+    } else if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+        scan_delims = scan_avx2;
+        scan_name = "avx2";
+#endif
+    } else {
+        return -1;
+    }
+
+    return 0;
+}
+
+const char* http_parser_scanner(void) {
+    return scan_name;
+}
+
+/* ---- Request parsing ---- */
+
+static http_slice_t make_slice(const char *base, const char *start, const char *end) {
+    http_slice_t slice;
+    slice.offset = (uint32_t)(start - base);
+    slice.length = (uint32_t)(end - start);
+    return slice;
+}
 
-    /* Create a copy of the request for parsing */
-    char *request_copy = strdup(raw_request);
-    if (!request_copy) {
+static int is_token_char(unsigned char ch) {
+    return token_table[ch];
+}
+
+static int parse_request_line(const char *buf, const char *line, const char *eol, http_request_t *request) {
+    /* METHOD SP request-target SP HTTP/x.y */
+    const char *sp1 = memchr(line, ' ', (size_t)(eol - line));
+    if (!sp1 || sp1 == line || sp1 - line >= 16) {
+        return -1;
+    }
+    for (const char *p = line; p < sp1; p++) {
+        if (!is_token_char((unsigned char)*p)) {
+            return -1;
+        }
+    }
+
+    const char *target = sp1 + 1;
+    const char *sp2 = memchr(target, ' ', (size_t)(eol - target));
+    if (!sp2 || sp2 == target || *target != '/') {
         return -1;
     }
 
-    /* Parse the request line (GET /path HTTP/1.1) */
-    char *line = strtok(request_copy, "\r\n");
-    if (!line) {
-        free(request_copy);
+    const char *version = sp2 + 1;
+    if (eol - version != 8 || memcmp(version, "HTTP/", 5) != 0 ||
+        !isdigit((unsigned char)version[5]) || version[6] != '.' || !isdigit((unsigned char)version[7])) {
         return -1;
     }
 
-    /* Extract method, path, and version */
-    char *method = strtok(line, " ");
-    char *path = strtok(NULL, " ");
-    char *version = strtok(NULL, " ");
+    request->method = make_slice(buf, line, sp1);
+
+    /* Split the query string off the path */
+    const char *query = memchr(target, '?', (size_t)(sp2 - target));
+    if (query) {
+        request->path = make_slice(buf, target, query);
+        request->query = make_slice(buf, query + 1, sp2);
+    } else {
+        request->path = make_slice(buf, target, sp2);
+    }
+
+    request->version_major = version[5] - '0';
+    request->version_minor = version[7] - '0';
+
+    /* HTTP/1.1 connections persist by default, HTTP/1.0 ones only on request */
+    request->keep_alive = request->version_major == 1 && request->version_minor >= 1;
+    return 0;
+}
+
+int http_has_token(const char *value, size_t length, const char *token) {
+    size_t token_len = strlen(token);
+
+    /* Comma-separated, case-insensitive token list */
+    while (length > 0) {
+        while (length > 0 && (*value == ' ' || *value == '\t' || *value == ',')) {
+            value++;
+            length--;
+        }
+        const char *comma = memchr(value, ',', length);
+        size_t item = comma ? (size_t)(comma - value) : length;
+        size_t trimmed = item;
+        while (trimmed > 0 && (value[trimmed - 1] == ' ' || value[trimmed - 1] == '\t')) {
+            trimmed--;
+        }
+        if (trimmed == token_len && strncasecmp(value, token, token_len) == 0) {
+            return TRUE;
+        }
+        value += item;
+        length -= item;
+    }
+    return FALSE;
+}
+
+static int process_header(const char *buf, http_request_t *request, const http_header_t *header) {
+    const char *name = buf + header->name.offset;
+    const char *value = buf + header->value.offset;
+
+    if (header->name.length == 14 && strncasecmp(name, "Content-Length", 14) == 0) {
+        long length = 0;
+        if (header->value.length == 0) {
+            return -1;
+        }
+        for (uint32_t i = 0; i < header->value.length; i++) {
+            if (!isdigit((unsigned char)value[i]) || length > (LONG_MAX - 9) / 10) {
+                return -1;
+            }
+            length = length * 10 + (value[i] - '0');
+        }
+        /* Conflicting duplicates, or a length next to chunked, would let a proxy and us frame differently */
+        if ((request->content_length >= 0 && request->content_length != length) || request->chunked) {
+            return -1;
+        }
+        request->content_length = length;
+    } else if (header->name.length == 10 && strncasecmp(name, "Connection", 10) == 0) {
+        if (http_has_token(value, header->value.length, "close")) {
+            request->keep_alive = FALSE;
+        } else if (http_has_token(value, header->value.length, "keep-alive")) {
+            request->keep_alive = TRUE;
+        }
+    } else if (header->name.length == 17 && strncasecmp(name, "Transfer-Encoding", 17) == 0) {
+        /* "chunked" alone: under any other coding the end of the body cannot be found */
+        if (request->chunked || request->content_length >= 0 || header->value.length != 7 ||
+            strncasecmp(value, "chunked", 7) != 0) {
+            return -1;
+        }
+        request->chunked = TRUE;
+    } else if (header->name.length == 6 && strncasecmp(name, "Expect", 6) == 0) {
+        request->expect_continue = header->value.length == 12 && strncasecmp(value, "100-continue", 12) == 0;
+    }
+
+    return 0;
+}
+
+void http_request_init(http_request_t *request) {
+    if (!request) {
+        return;
+    }
+
+    /* Header slots are written before they are read, so only reset the scalars */
+    memset(request, 0, offsetof(http_request_t, headers));
+    request->header_count = 0;
+    request->content_length = -1;
+    request->keep_alive = FALSE;
+    request->chunked = FALSE;
+    request->expect_continue = FALSE;
+}
+
+int parse_http_request(const char *buf, size_t length, http_request_t *request) {
+    if (!buf || !request) {
+        return HTTP_PARSE_ERROR;
+    }
+
+    const char *end = buf + length;
+    request->buf = buf;
+
+    /* Resume where the previous call ran out of input */
+    while (request->parse_state != PARSE_DONE) {
+        const char *line = buf + request->line_start;
+        const char *scan = buf + request->scan_offset;
+
+        if (request->parse_state == PARSE_HEADER_NAME && scan == line) {
+            /* A blank line terminates the header block */
+            if (line < end && (*line == '\r' || *line == '\n')) {
+                if (*line == '\r' && line + 1 >= end) {
+                    return HTTP_PARSE_INCOMPLETE;
+                }
+                if (*line == '\r' && line[1] != '\n') {
+                    return HTTP_PARSE_ERROR;
+                }
+                request->header_length = (size_t)(line - buf) + (*line == '\r' ? 2 : 1);
+                request->parse_state = PARSE_DONE;
+                break;
+            }
+            /* Obsolete line folding is rejected outright */
+            if (line < end && (*line == ' ' || *line == '\t')) {
+                return HTTP_PARSE_ERROR;
+            }
+        }
+
+        const char *hit;
+        if (request->parse_state == PARSE_HEADER_NAME) {
+            hit = scan_delims(scan, end, ':', '\r', '\n');
+        } else {
+            hit = scan_delims(scan, end, '\r', '\n', '\n');
+        }
+
+        if (!hit) {
+            request->scan_offset = (uint32_t)length;
+            return HTTP_PARSE_INCOMPLETE;
+        }
+
+        if (request->parse_state == PARSE_HEADER_NAME) {
+            if (*hit != ':' || hit == line) {
+                return HTTP_PARSE_ERROR;
+            }
+            for (const char *p = line; p < hit; p++) {
+                if (!is_token_char((unsigned char)*p)) {
+                    return HTTP_PARSE_ERROR;
+                }
+            }
+            if (request->header_count >= MAX_HEADER_COUNT) {
+                return HTTP_PARSE_ERROR;
+            }
+            request->headers[request->header_count].name = make_slice(buf, line, hit);
+            request->parse_state = PARSE_HEADER_VALUE;
+            request->scan_offset = (uint32_t)(hit + 1 - buf);
+            continue;
+        }
+
+        /* End of line: need the full CRLF before acting on it */
+        const char *next;
+        if (*hit == '\r') {
+            if (hit + 1 >= end) {
+                request->scan_offset = (uint32_t)(hit - buf);
+                return HTTP_PARSE_INCOMPLETE;
+            }
+            if (hit[1] != '\n') {
+                return HTTP_PARSE_ERROR;
+            }
+            next = hit + 2;
+        } else {
+            next = hit + 1;
+        }
+
+        if (request->parse_state == PARSE_REQUEST_LINE) {
+            if (parse_request_line(buf, line, hit, request) != 0) {
+                return HTTP_PARSE_ERROR;
+            }
+        } else {
+            /* Header value with optional whitespace trimmed on both sides */
+            http_header_t *header = &request->headers[request->header_count];
+            const char *value = buf + header->name.offset + header->name.length + 1;
+            const char *value_end = hit;
+            while (value < value_end && (*value == ' ' || *value == '\t')) {
+                value++;
+            }
+            while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t')) {
+                value_end--;
+            }
+            header->value = make_slice(buf, value, value_end);
+            request->header_count++;
+            if (process_header(buf, request, header) != 0) {
+                return HTTP_PARSE_ERROR;
+            }
+        }
+
+        request->parse_state = PARSE_HEADER_NAME;
+        request->line_start = (uint32_t)(next - buf);
+        request->scan_offset = request->line_start;
+    }
+
+    if (request->content_length < 0) {
+        request->content_length = 0;
+    }
+    return HTTP_PARSE_OK;
+}
+
+int http_slice_equals(const http_request_t *request, http_slice_t slice, const char *literal) {
+    size_t length = strlen(literal);
+    return slice.length == length && memcmp(request->buf + slice.offset, literal, length) == 0;
+}
+
+size_t http_slice_copy(const http_request_t *request, http_slice_t slice, char *out, size_t out_size) {
+    if (!out || out_size == 0) {
+        return 0;
+    }
+
+    size_t length = slice.length < out_size - 1 ? slice.length : out_size - 1;
+    if (request && request->buf) {
+        memcpy(out, request->buf + slice.offset, length);
+    }
+    out[length] = '\0';
+    return length;
+}
+
+const char* http_request_header(const http_request_t *request, const char *name, size_t *value_length) {
+    if (!request || !name) {
+        return NULL;
+    }
+
+    size_t name_len = strlen(name);
+    for (int i = 0; i < request->header_count; i++) {
+        const http_header_t *header = &request->headers[i];
+        if (header->name.length == name_len &&
+            strncasecmp(request->buf + header->name.offset, name, name_len) == 0) {
+            if (value_length) {
+                *value_length = header->value.length;
+            }
+            return request->buf + header->value.offset;
+        }
+    }
+    return NULL;
+}
+
+static const char *method_names[HTTP_METHOD_COUNT] = {
+    "GET", "HEAD", "POST", "PUT", "DELETE", "OPTIONS", "PATCH",
+};
+
+/* HTTP_METHOD_* of the request line, HTTP_METHOD_COUNT for anything else */
+int http_request_method(const http_request_t *request) {
+    for (int method = 0; method < HTTP_METHOD_COUNT; method++) {
+        if (http_slice_equals(request, request->method, method_names[method])) {
+            return method;
+        }
+    }
+    return HTTP_METHOD_COUNT;
+}
+
+const char* http_method_name(int method) {
+    return method >= 0 && method < HTTP_METHOD_COUNT ? method_names[method] : "";
+}
+
+void http_response_init(http_response_t *response) {
+    if (!response) {
+        return;
+    }
+
+    memset(response, 0, sizeof(http_response_t));
+    response->file_fd = -1;
+    response->max_age = -1;
+}
+
+/* IMF-fixdate, plus the obsolete RFC 850 and asctime forms recipients must accept */
+int http_parse_date(const char *value, size_t length, time_t *out) {
+    static const char *formats[] = {
+        "%a, %d %b %Y %H:%M:%S GMT",
+        "%A, %d-%b-%y %H:%M:%S GMT",
+        "%a %b %e %H:%M:%S %Y",
+    };
+    char date[64];
 
-    if (!method || !path || !version) {
-        free(request_copy);
+    if (!value || !out || length == 0 || length >= sizeof(date)) {
         return -1;
     }
+    memcpy(date, value, length);
+    date[length] = '\0';
+
+    for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+        struct tm tm;
+        memset(&tm, 0, sizeof(tm));
+        const char *end = strptime(date, formats[i], &tm);
+        if (end && *end == '\0') {
+            *out = timegm(&tm);
+            return 0;
+        }
+    }
+    return -1;
+}
 
-    /* Copy parsed components */
-    strncpy(request->method, method, sizeof(request->method) - 1);
-    strncpy(request->path, path, sizeof(request->path) - 1);
-    strncpy(request->version, version, sizeof(request->version) - 1);
+/* Decimal byte position; returns characters consumed, 0 if none or on overflow */
+static size_t parse_position(const char *p, const char *end, unsigned long long *out) {
+    const char *start = p;
+    unsigned long long value = 0;
+    while (p < end && *p >= '0' && *p <= '9') {
+        if (value > (ULLONG_MAX - 9) / 10) {
+            return 0;
+        }
+        value = value * 10 + (unsigned long long)(*p - '0');
+        p++;
+    }
+    *out = value;
+    return (size_t)(p - start);
+}
 
-    /* Handle root path */
-    if (strcmp(request->path, "/") == 0) {
-        strcpy(request->path, "/index.html");
+/*
+ * Range: bytes=0-499, 1000-, -500
+ * Returns the number of satisfiable ranges written to ranges[], 0 when none is
+ * satisfiable (416) and -1 when the header must be ignored (bad syntax, other
+ * units, or more ranges than we are willing to serve).
+ */
+int http_parse_range(const char *value, size_t length, size_t total, http_range_t *ranges, int max_ranges) {
+    if (!value || !ranges || length < 6 || strncasecmp(value, "bytes=", 6) != 0) {
+        return -1;
     }
 
-    /* Parse headers (basic implementation for Phase 1) */
-    char *header_line;
-    int header_pos = 0;
-    while ((header_line = strtok(NULL, "\r\n")) != NULL && strlen(header_line) > 0) {
-        /* Store headers for potential future use */
-        int remaining_space = MAX_HEADER_SIZE - header_pos - 1;
-        if (remaining_space > 0) {
-            strncat(request->headers + header_pos, header_line, remaining_space);
-            header_pos += strlen(header_line);
-            if (header_pos < MAX_HEADER_SIZE - 2) {
-                strcat(request->headers + header_pos, "\n");
-                header_pos++;
+    const char *p = value + 6;
+    const char *end = value + length;
+    int count = 0;
+    int specs = 0;
+
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) {
+            p++;
+        }
+        if (p == end) {
+            break;
+        }
+
+        unsigned long long first = 0, last = 0;
+        int has_first = 0, has_last = 0;
+        size_t n = parse_position(p, end, &first);
+        if (n > 0) {
+            has_first = 1;
+            p += n;
+        }
+        if (p == end || *p != '-') {
+            return -1;
+        }
+        p++;
+        n = parse_position(p, end, &last);
+        if (n > 0) {
+            has_last = 1;
+            p += n;
+        }
+        while (p < end && (*p == ' ' || *p == '\t')) {
+            p++;
+        }
+        if ((!has_first && !has_last) || (has_first && has_last && last < first) ||
+            (p < end && *p != ',')) {
+            return -1;
+        }
+        specs++;
+
+        /* Resolve against the representation length; unsatisfiable specs are dropped */
+        unsigned long long start, stop;
+        if (!has_first) {
+            if (last == 0 || total == 0) {
+                continue;
+            }
+            start = last >= total ? 0 : total - last;
+            stop = total - 1;
+        } else {
+            if (first >= total) {
+                continue;
             }
+            start = first;
+            stop = has_last && last < total ? last : total - 1;
         }
 
-        /* Check for Content-Length header */
-        if (strncasecmp(header_line, "Content-Length:", 15) == 0) {
-            request->content_length = atoi(header_line + 15);
+        if (count == max_ranges) {
+            return -1;
         }
+        ranges[count].start = (off_t)start;
+        ranges[count].length = (size_t)(stop - start + 1);
+        count++;
     }
 
-    free(request_copy);
+    return specs > 0 ? count : -1;
+}
+
+/* IMF-fixdate ("Sun, 06 Nov 1994 08:49:37 GMT"), always 29 bytes; no strftime, no locale */
+size_t http_format_date(time_t t, char *buf, size_t size) {
+    static const char days[] = "SunMonTueWedThuFriSat";
+    static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    struct tm tm;
+    if (size < 30 || !gmtime_r(&t, &tm) || tm.tm_year + 1900 < 0 || tm.tm_year + 1900 > 9999) {
+        return 0;
+    }
+
+    int year = tm.tm_year + 1900;
+    char *p = buf;
+    memcpy(p, days + tm.tm_wday * 3, 3);
+    p += 3;
+    *p++ = ',';
+    *p++ = ' ';
+    *p++ = (char)('0' + tm.tm_mday / 10);
+    *p++ = (char)('0' + tm.tm_mday % 10);
+    *p++ = ' ';
+    memcpy(p, months + tm.tm_mon * 3, 3);
+    p += 3;
+    *p++ = ' ';
+    *p++ = (char)('0' + year / 1000);
+    *p++ = (char)('0' + year / 100 % 10);
+    *p++ = (char)('0' + year / 10 % 10);
+    *p++ = (char)('0' + year % 10);
+    *p++ = ' ';
+    *p++ = (char)('0' + tm.tm_hour / 10);
+    *p++ = (char)('0' + tm.tm_hour % 10);
+    *p++ = ':';
+    *p++ = (char)('0' + tm.tm_min / 10);
+    *p++ = (char)('0' + tm.tm_min % 10);
+    *p++ = ':';
+    *p++ = (char)('0' + tm.tm_sec / 10);
+    *p++ = (char)('0' + tm.tm_sec % 10);
+    memcpy(p, " GMT", 5);
+    return (size_t)(p + 4 - buf);
+}
+
+/* If-None-Match list ("*" or comma-separated tags); weak comparison, so W/ is ignored */
+int http_etag_matches(const char *list, size_t length, const char *etag) {
+    if (!list || !etag || etag[0] == '\0') {
+        return FALSE;
+    }
+
+    size_t etag_length = strlen(etag);
+    const char *p = list;
+    const char *end = list + length;
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) {
+            p++;
+        }
+        if (p < end && *p == '*') {
+            return TRUE;
+        }
+        if (end - p >= 2 && p[0] == 'W' && p[1] == '/') {
+            p += 2;
+        }
+
+        const char *tag = p;
+        if (p < end && *p == '"') {
+            const char *close = memchr(p + 1, '"', (size_t)(end - p - 1));
+            p = close ? close + 1 : end;
+        }
+        if ((size_t)(p - tag) == etag_length && memcmp(tag, etag, etag_length) == 0) {
+            return TRUE;
+        }
+        while (p < end && *p != ',') {
+            p++;
+        }
+    }
+    return FALSE;
+}
+
+/* ---- Chunked transfer coding ---- */
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c = (char)tolower((unsigned char)c);
+    return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+}
+
+/*
+ * Parse framing up to the start of the next chunk's data or the end of the
+ * body, whichever comes first; *used is set to the bytes it took. Chunk data
+ * itself is never scanned: the caller moves it and reports it with
+ * http_chunked_consume(). Returns 0, or the status a malformed body deserves.
+ */
+int http_chunked_scan(http_chunked_t *chunked, const char *data, size_t length, size_t *used) {
+    size_t i = 0;
+
+    while (i < length && chunked->state != CHUNK_DATA && chunked->state != CHUNK_DONE) {
+        char c = data[i];
+        switch (chunked->state) {
+            case CHUNK_SIZE: {
+                int digit = hex_value(c);
+                if (digit < 0) {
+                    if (chunked->digits == 0) {
+                        return HTTP_BAD_REQUEST;
+                    }
+                    chunked->state = CHUNK_EXTENSION; /* Extensions, whitespace and the CR alike */
+                    break;
+                }
+                if (chunked->remaining > (UINT64_MAX >> 4)) {
+                    return HTTP_CONTENT_TOO_LARGE;
+                }
+                chunked->remaining = chunked->remaining * 16 + (uint64_t)digit;
+                chunked->digits++;
+                i++;
+                break;
+            }
+            case CHUNK_EXTENSION:
+                if (c == '\n') {
+                    chunked->state = chunked->remaining > 0 ? CHUNK_DATA : CHUNK_TRAILER;
+                    chunked->digits = 0;
+                    chunked->framing = 0;
+                } else {
+                    chunked->framing++;
+                }
+                i++;
+                break;
+            case CHUNK_DATA_END:
+                if (c == '\n') {
+                    chunked->state = CHUNK_SIZE;
+                } else if (c != '\r') {
+                    return HTTP_BAD_REQUEST;
+                }
+                i++;
+                break;
+            case CHUNK_TRAILER:
+                if (c == '\n') {
+                    chunked->state = CHUNK_DONE;
+                } else if (c != '\r') {
+                    chunked->state = CHUNK_TRAILER_LINE;
+                }
+                chunked->framing++;
+                i++;
+                break;
+            default: /* CHUNK_TRAILER_LINE */
+                if (c == '\n') {
+                    chunked->state = CHUNK_TRAILER;
+                }
+                chunked->framing++;
+                i++;
+                break;
+        }
+
+        /* Extensions and trailers are skipped, but not without end */
+        if (chunked->framing > MAX_HEADERS_SIZE) {
+            return HTTP_BAD_REQUEST;
+        }
+    }
+    *used = i;
     return 0;
 }
 
-void build_http_response(http_response_t *response, char *output_buffer, size_t buffer_size) {
-    if (!response || !output_buffer) {
+/* `length` bytes of the current chunk's data have been dealt with */
+void http_chunked_consume(http_chunked_t *chunked, size_t length) {
+    chunked->remaining -= length;
+    if (chunked->remaining == 0) {
+        chunked->state = CHUNK_DATA_END;
+    }
+}
+
+/* ---- Response headers ----
+ *
+ * Nothing here goes through printf: status lines (with the Server header)
+ * are string constants, Content-Type lines come pre-serialized from the
+ * content type table, cached files carry their whole entity block, and the
+ * Date line is rebuilt at most once per second. What is left is memcpy and
+ * a little integer formatting.
+ */
+
+typedef struct {
+    char *buf;
+    size_t size;
+    size_t used;
+    int overflow;
+} header_buf_t;
+
+static void put(header_buf_t *out, const char *data, size_t length) {
+    if (out->overflow || length >= out->size - out->used) {
+        out->overflow = TRUE;
         return;
     }
+    memcpy(out->buf + out->used, data, length);
+    out->used += length;
+}
 
-    /* Build status line */
-    const char *status_text;
-    switch (response->status_code) {
-        case HTTP_OK:
-            status_text = "OK";
-            break;
-        case HTTP_NOT_FOUND:
-            status_text = "Not Found";
-            break;
-        case HTTP_INTERNAL_ERROR:
-            status_text = "Internal Server Error";
-            break;
-        case HTTP_BAD_REQUEST:
-            status_text = "Bad Request";
-            break;
-        default:
-            status_text = "Unknown";
-            break;
+#define PUT_LITERAL(out, literal) put((out), (literal), sizeof(literal) - 1)
+
+static void put_string(header_buf_t *out, const char *text) {
+    put(out, text, strlen(text));
+}
+
+static void put_number(header_buf_t *out, unsigned long long value) {
+    char digits[24];
+    char *p = digits + sizeof(digits);
+    do {
+        *--p = (char)('0' + value % 10);
+        value /= 10;
+    } while (value > 0);
+    put(out, p, (size_t)(digits + sizeof(digits) - p));
+}
+
+/* Length of the block, or 0 if it did not fit */
+static size_t header_length(const header_buf_t *out) {
+    return out->overflow ? 0 : out->used;
+}
+
+#define STATUS_LINE(code, text) { code, HTTP_VERSION " " #code " " text "\r\nServer: " SERVER_NAME "\r\n", \
+                                  sizeof(HTTP_VERSION " " #code " " text "\r\nServer: " SERVER_NAME "\r\n") - 1 }
+
+/* Most frequent first */
+static const struct {
+    int code;
+    const char *line;
+    size_t length;
+} status_lines[] = {
+    STATUS_LINE(200, "OK"),
+    STATUS_LINE(201, "Created"),
+    STATUS_LINE(204, "No Content"),
+    STATUS_LINE(304, "Not Modified"),
+    STATUS_LINE(206, "Partial Content"),
+    STATUS_LINE(404, "Not Found"),
+    STATUS_LINE(400, "Bad Request"),
+    STATUS_LINE(405, "Method Not Allowed"),
+    STATUS_LINE(409, "Conflict"),
+    STATUS_LINE(411, "Length Required"),
+    STATUS_LINE(413, "Content Too Large"),
+    STATUS_LINE(416, "Range Not Satisfiable"),
+    STATUS_LINE(429, "Too Many Requests"),
+    STATUS_LINE(500, "Internal Server Error"),
+    STATUS_LINE(502, "Bad Gateway"),
+    STATUS_LINE(503, "Service Unavailable"),
+    STATUS_LINE(504, "Gateway Timeout"),
+};
+
+static void put_status_line(header_buf_t *out, int status_code) {
+    for (size_t i = 0; i < sizeof(status_lines) / sizeof(status_lines[0]); i++) {
+        if (status_lines[i].code == status_code) {
+            put(out, status_lines[i].line, status_lines[i].length);
+            return;
+        }
+    }
+
+    PUT_LITERAL(out, HTTP_VERSION " ");
+    put_number(out, (unsigned long long)(status_code > 0 ? status_code : 0));
+    PUT_LITERAL(out, " Unknown\r\nServer: " SERVER_NAME "\r\n");
+}
+
+/* "Date: ...\r\n", reformatted only when the second changes; per thread, so no locking */
+static __thread struct {
+    time_t second;
+    char line[48];
+    size_t length;
+} date_line;
+
+static void put_date(header_buf_t *out) {
+    time_t now = time(NULL);
+    if (now != date_line.second || date_line.length == 0) {
+        size_t length = http_format_date(now, date_line.line + 6, sizeof(date_line.line) - 8);
+        memcpy(date_line.line, "Date: ", 6);
+        memcpy(date_line.line + 6 + length, "\r\n", 2);
+        date_line.length = length > 0 ? 6 + length + 2 : 0;
+        date_line.second = now;
+    }
+    if (date_line.length > 0) {
+        put(out, date_line.line, date_line.length);
+    }
+}
+
+/* Headers describing the representation itself; also the prefix of cached header blocks */
+static void put_representation_headers(header_buf_t *out, const http_response_t *response) {
+    char date[32];
+
+    /* A 304 repeats only the validators and caching metadata */
+    if (response->status_code != HTTP_NOT_MODIFIED) {
+        if (response->range_count > 1) {
+            PUT_LITERAL(out, "Content-Type: multipart/byteranges; boundary=");
+            put_string(out, multipart_boundary);
+            PUT_LITERAL(out, "\r\n");
+        } else {
+            put_string(out, response->content_type);
+        }
+
+        if (response->content_encoding != ENCODING_IDENTITY) {
+            PUT_LITERAL(out, "Content-Encoding: ");
+            put_string(out, encoding_name(response->content_encoding));
+            PUT_LITERAL(out, "\r\n");
+        }
+    }
+    if (response->vary_encoding) {
+        PUT_LITERAL(out, "Vary: Accept-Encoding\r\n");
+    }
+    if (response->validators.etag[0]) {
+        PUT_LITERAL(out, "ETag: ");
+        put_string(out, response->validators.etag);
+        PUT_LITERAL(out, "\r\n");
+    }
+    if (response->validators.last_modified > 0) {
+        size_t length = http_format_date(response->validators.last_modified, date, sizeof(date));
+        if (length > 0) {
+            PUT_LITERAL(out, "Last-Modified: ");
+            put(out, date, length);
+            PUT_LITERAL(out, "\r\n");
+        }
+    }
+    if (response->max_age >= 0) {
+        PUT_LITERAL(out, "Cache-Control: max-age=");
+        put_number(out, (unsigned long long)response->max_age);
+        PUT_LITERAL(out, "\r\n");
+    }
+    if (response->accept_ranges && response->status_code != HTTP_NOT_MODIFIED) {
+        PUT_LITERAL(out, "Accept-Ranges: bytes\r\n");
+    }
+}
+
+size_t build_representation_headers(const http_response_t *response, char *buf, size_t size) {
+    header_buf_t out = { buf, size, 0, FALSE };
+    put_representation_headers(&out, response);
+    return header_length(&out);
+}
+
+/* Everything about the body: representation, range and length */
+static void put_entity_headers(header_buf_t *out, const http_response_t *response) {
+    put_representation_headers(out, response);
+
+    if (response->range_count == 1) {
+        const http_range_t *range = &response->ranges[0];
+        PUT_LITERAL(out, "Content-Range: bytes ");
+        put_number(out, (unsigned long long)range->start);
+        PUT_LITERAL(out, "-");
+        put_number(out, (unsigned long long)range->start + range->length - 1);
+        PUT_LITERAL(out, "/");
+        put_number(out, response->total_length);
+        PUT_LITERAL(out, "\r\n");
+    } else if (response->status_code == HTTP_RANGE_NOT_SATISFIABLE) {
+        PUT_LITERAL(out, "Content-Range: bytes */");
+        put_number(out, response->total_length);
+        PUT_LITERAL(out, "\r\n");
     }
 
-    /* Format response */
-    snprintf(output_buffer, buffer_size,
-        "%s %d %s\r\n"
-        "Server: %s\r\n"
-        "%s"
-        "Content-Length: %zu\r\n"
-        "Connection: close\r\n"
-        "\r\n",
-        HTTP_VERSION,
-        response->status_code,
-        status_text,
-        SERVER_NAME,
-        response->content_type,
-        response->body_length
-    );
+    /* 405 lists what the resource does accept */
+    if (response->allow) {
+        const char *separator = "Allow: ";
+        for (int method = 0; method < HTTP_METHOD_COUNT; method++) {
+            if (response->allow & (1u << method)) {
+                put_string(out, separator);
+                put_string(out, http_method_name(method));
+                separator = ", ";
+            }
+        }
+        PUT_LITERAL(out, "\r\n");
+    }
+
+    if (response->retry_after > 0) {
+        PUT_LITERAL(out, "Retry-After: ");
+        put_number(out, (unsigned long long)response->retry_after);
+        PUT_LITERAL(out, "\r\n");
+    }
+
+    /* 304 has no body, and its Content-Length would describe the 200; 204 has none by definition */
+    if (response->status_code != HTTP_NOT_MODIFIED && response->status_code != HTTP_NO_CONTENT) {
+        PUT_LITERAL(out, "Content-Length: ");
+        put_number(out, response->body_length);
+        PUT_LITERAL(out, "\r\n");
+    }
+}
+
+size_t build_http_response(const http_response_t *response, char *output_buffer, size_t buffer_size) {
+    if (!response || !output_buffer || buffer_size == 0) {
+        return 0;
+    }
+
+    header_buf_t out = { output_buffer, buffer_size, 0, FALSE };
+    put_status_line(&out, response->status_code);
+    put_date(&out);
+
+    /* Whole cached bodies carry their serialized entity header block */
+    if (response->cache_entry && response->status_code == HTTP_OK) {
+        size_t length;
+        const char *headers = file_cache_headers(response->cache_entry, &length);
+        put(&out, headers, length);
+    } else {
+        put_entity_headers(&out, response);
+    }
+
+    /* The body is queued separately */
+    if (response->keep_alive) {
+        PUT_LITERAL(&out, "Connection: keep-alive\r\n\r\n");
+    } else {
+        PUT_LITERAL(&out, "Connection: close\r\n\r\n");
+    }
+    return header_length(&out);
+}
 
-    /* Append body if it fits */
-    size_t header_len = strlen(output_buffer);
-    size_t remaining_space = buffer_size - header_len - 1;
+/* Delimiter and headers that precede part `index` of a multipart/byteranges body */
+size_t build_range_part_header(const http_response_t *response, int index, char *buf, size_t size) {
+    const http_range_t *range = &response->ranges[index];
+    int written = snprintf(buf, size, "\r\n--%s\r\n%sContent-Range: bytes %lld-%lld/%zu\r\n\r\n",
+                           multipart_boundary, response->content_type, (long long)range->start,
+                           (long long)range->start + (long long)range->length - 1, response->total_length);
+    if (written < 0 || (size_t)written >= size) {
+        return 0;
+    }
+    return (size_t)written;
+}
 
-    if (response->body && response->body_length > 0 && response->body_length <= remaining_space) {
-        memcpy(output_buffer + header_len, response->body, response->body_length);
-        output_buffer[header_len + response->body_length] = '\0';
+size_t build_multipart_trailer(char *buf, size_t size) {
+    int written = snprintf(buf, size, "\r\n--%s--\r\n", multipart_boundary);
+    if (written < 0 || (size_t)written >= size) {
+        return 0;
     }
+    return (size_t)written;
 }
 
 void create_error_response(int status_code, http_response_t *response) {
@@ -129,7 +1001,13 @@ void create_error_response(int status_code, http_response_t *response) {
     char error_file[MAX_PATH_LENGTH];
     snprintf(error_file, sizeof(error_file), "/%d.html", status_code);
 
-    if (serve_static_file(error_file, response) == 0) {
+    const char *root = response->error_root ? response->error_root : g_config.root;
+    if (serve_static_file(root, error_file, NULL, response) == 0) {
+        /* Same bytes as /404.html, but an error must not look like a cacheable resource */
+        response->status_code = status_code;
+        memset(&response->validators, 0, sizeof(response->validators));
+        response->max_age = -1;
+        response->accept_ranges = FALSE;
         return; /* Custom error page served successfully */
     }
 
@@ -150,6 +1028,34 @@ void create_error_response(int status_code, http_response_t *response) {
             error_title = "400 Bad Request";
             error_message = "The server could not understand the request.";
             break;
+        case HTTP_METHOD_NOT_ALLOWED:
+            error_title = "405 Method Not Allowed";
+            error_message = "The requested resource does not support this method.";
+            break;
+        case HTTP_CONFLICT:
+            error_title = "409 Conflict";
+            error_message = "The target's directory does not exist, or the target is a directory.";
+            break;
+        case HTTP_LENGTH_REQUIRED:
+            error_title = "411 Length Required";
+            error_message = "This resource needs a request body framed by Content-Length.";
+            break;
+        case HTTP_CONTENT_TOO_LARGE:
+            error_title = "413 Content Too Large";
+            error_message = "The request body is larger than the server accepts.";
+            break;
+        case HTTP_BAD_GATEWAY:
+            error_title = "502 Bad Gateway";
+            error_message = "The upstream server could not be reached or sent an invalid response.";
+            break;
+        case HTTP_SERVICE_UNAVAILABLE:
+            error_title = "503 Service Unavailable";
+            error_message = "The server is temporarily unable to handle the request.";
+            break;
+        case HTTP_GATEWAY_TIMEOUT:
+            error_title = "504 Gateway Timeout";
+            error_message = "The upstream server did not answer in time.";
+            break;
         default:
             error_title = "Error";
             error_message = "An error occurred.";
@@ -180,22 +1086,36 @@ void create_error_response(int status_code, http_response_t *response) {
     size_t html_size = strlen(html_template) + strlen(error_title) * 2 +
                        strlen(error_message) + strlen(SERVER_NAME) + 100;
 
-    response->body = malloc(html_size);
-    if (response->body) {
-        snprintf(response->body, html_size, html_template,
+    /* Lives until the response is queued; the request arena is reset after that */
+    char *body = arena_alloc(html_size);
+    if (body) {
+        snprintf(body, html_size, html_template,
                 error_title, error_title, error_message, SERVER_NAME);
-        response->body_length = strlen(response->body);
+        response->body = body;
+        response->body_length = strlen(body);
     } else {
         /* Fallback minimal response */
-        response->body = strdup("Error");
+        response->body = "Error";
         response->body_length = 5;
     }
 }
 
 void free_response(http_response_t *response) {
-    if (response && response->body) {
-        free(response->body);
-        response->body = NULL;
-        response->body_length = 0;
+    if (!response) {
+        return;
+    }
+
+    /* Generated bodies belong to the request arena */
+    response->body = NULL;
+    response->body_length = 0;
+
+    if (response->file_fd >= 0) {
+        close(response->file_fd);
+        response->file_fd = -1;
+    }
+
+    if (response->cache_entry) {
+        file_cache_release(response->cache_entry);
+        response->cache_entry = NULL;
     }
 }
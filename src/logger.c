@@ -1,33 +1,253 @@
 #include "server.h"
 #include <stdarg.h>
 
-static FILE *log_file = NULL;
-static int log_initialized = FALSE;
+/*
+ * Asynchronous logger.
+ *
+ * Every thread that logs owns a single-producer/single-consumer ring of
+ * fixed-size records. Appending never blocks and never makes a syscall: when
+ * the ring is full the line is dropped and counted. A background writer
+ * thread drains all rings into large buffers and emits them with one write()
+ * per batch, to the log file and (optionally) to the console.
+ */
+
+#define LOG_RING_SIZE 1024          /* Records per thread, power of two */
+#define LOG_LINE_SIZE 248
+#define LOG_MAX_RINGS (MAX_WORKERS + 8)
+#define LOG_BATCH_SIZE (64 * 1024)
+#define LOG_IDLE_SLEEP_NS 10000000  /* 10ms between polls when there is nothing to write */
+#define LOG_REQUEST -1              /* Record level for access log lines */
+
+typedef struct {
+    int level;
+    int status_code;
+    size_t length;
+    char text[LOG_LINE_SIZE];
+} log_record_t;
+
+typedef struct {
+    unsigned long head;   /* Written by the owning thread only */
+    char pad[64 - sizeof(unsigned long)];
+    unsigned long tail;   /* Written by the writer thread only */
+    log_record_t records[LOG_RING_SIZE];
+} log_ring_t;
+
+static struct {
+    int file_fd;
+    int console;
+    volatile int running;
+    pthread_t writer;
+    log_ring_t *rings[LOG_MAX_RINGS];
+    int ring_count;
+    unsigned long dropped;
+} logger = { .file_fd = -1 };
+
+static __thread log_ring_t *thread_ring;
+static __thread int thread_ring_failed;
+static __thread time_t cached_second = -1;
+static __thread char cached_timestamp[32];
+
+/* Formatting the local time is the expensive part; redo it once per second */
+static const char *log_timestamp(void) {
+    time_t now = time(NULL);
+    if (now != cached_second) {
+        struct tm tm_info;
+        localtime_r(&now, &tm_info);
+        strftime(cached_timestamp, sizeof(cached_timestamp), "%Y-%m-%d %H:%M:%S", &tm_info);
+        cached_second = now;
+    }
+    return cached_timestamp;
+}
+
+/* First log call on a thread registers its ring with the writer */
+static log_ring_t *log_ring(void) {
+    if (thread_ring || thread_ring_failed) {
+        return thread_ring;
+    }
+
+    log_ring_t *ring = calloc(1, sizeof(log_ring_t));
+    int index = __atomic_load_n(&logger.ring_count, __ATOMIC_RELAXED);
+    do {
+        if (!ring || index >= LOG_MAX_RINGS) {
+            free(ring);
+            thread_ring_failed = TRUE;
+            return NULL;
+        }
+    } while (!__atomic_compare_exchange_n(&logger.ring_count, &index, index + 1, FALSE,
+                                          __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+    __atomic_store_n(&logger.rings[index], ring, __ATOMIC_RELEASE);
+    thread_ring = ring;
+    return ring;
+}
+
+/* Claim the next free record, or count a drop when the writer has fallen behind */
+static log_record_t *log_reserve(void) {
+    log_ring_t *ring = log_ring();
+    if (!ring) {
+        __atomic_add_fetch(&logger.dropped, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    unsigned long tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (ring->head - tail >= LOG_RING_SIZE) {
+        __atomic_add_fetch(&logger.dropped, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    return &ring->records[ring->head & (LOG_RING_SIZE - 1)];
+}
+
+static void log_commit(log_record_t *record, int written) {
+    if (written <= 0) {
+        return;
+    }
+    record->length = (size_t)written < sizeof(record->text) ? (size_t)written : sizeof(record->text) - 1;
+    if (record->text[record->length - 1] != '\n') {
+        record->text[record->length - 1] = '\n'; /* Truncated line */
+    }
+
+    log_ring_t *ring = thread_ring;
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+static void write_all(int fd, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t n = write(fd, data, length);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return; /* Nowhere to report a failing log sink */
+        }
+        data += n;
+        length -= (size_t)n;
+    }
+}
+
+static const char *console_color(const log_record_t *record) {
+    if (record->level == LOG_REQUEST) {
+        if (record->status_code >= 500) {
+            return COLOR_RED;
+        } else if (record->status_code >= 400) {
+            return COLOR_YELLOW;
+        } else if (record->status_code >= 200 && record->status_code < 300) {
+            return COLOR_GREEN;
+        }
+        return COLOR_BLUE;
+    }
+
+    switch (record->level) {
+        case LOG_INFO:
+            return COLOR_GREEN;
+        case LOG_ERROR:
+            return COLOR_RED;
+        case LOG_DEBUG:
+            return COLOR_BLUE;
+        default:
+            return COLOR_RESET;
+    }
+}
+
+/* Move every pending record into the batches; returns how many were taken */
+static size_t drain_rings(char *file_batch, size_t *file_length, char *console_batch, size_t *console_length) {
+    size_t taken = 0;
+    int count = __atomic_load_n(&logger.ring_count, __ATOMIC_ACQUIRE);
+
+    for (int i = 0; i < count; i++) {
+        log_ring_t *ring = __atomic_load_n(&logger.rings[i], __ATOMIC_ACQUIRE);
+        if (!ring) {
+            continue; /* Slot claimed, ring not published yet */
+        }
+
+        unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        unsigned long tail = ring->tail;
+        for (; tail != head; tail++) {
+            const log_record_t *record = &ring->records[tail & (LOG_RING_SIZE - 1)];
+            size_t console_need = record->length + sizeof(COLOR_RESET) * 2;
+
+            /* Flush a batch before it would overflow */
+            if (*file_length + record->length > LOG_BATCH_SIZE ||
+                (logger.console && *console_length + console_need > LOG_BATCH_SIZE)) {
+                write_all(logger.file_fd, file_batch, *file_length);
+                write_all(STDOUT_FILENO, console_batch, *console_length);
+                *file_length = 0;
+                *console_length = 0;
+            }
+
+            memcpy(file_batch + *file_length, record->text, record->length);
+            *file_length += record->length;
+
+            if (logger.console) {
+                const char *color = console_color(record);
+                size_t color_length = strlen(color);
+                memcpy(console_batch + *console_length, color, color_length);
+                *console_length += color_length;
+                memcpy(console_batch + *console_length, record->text, record->length - 1);
+                *console_length += record->length - 1;
+                memcpy(console_batch + *console_length, COLOR_RESET "\n", sizeof(COLOR_RESET));
+                *console_length += sizeof(COLOR_RESET);
+            }
+            taken++;
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    }
+    return taken;
+}
+
+static void *log_writer_main(void *arg) {
+    static char file_batch[LOG_BATCH_SIZE];
+    static char console_batch[LOG_BATCH_SIZE];
+    (void)arg;
+
+    for (;;) {
+        int running = __atomic_load_n(&logger.running, __ATOMIC_ACQUIRE);
+        size_t file_length = 0, console_length = 0;
+        size_t taken = drain_rings(file_batch, &file_length, console_batch, &console_length);
+
+        write_all(logger.file_fd, file_batch, file_length);
+        write_all(STDOUT_FILENO, console_batch, console_length);
+
+        /* The final pass after shutdown was requested picks up the last lines */
+        if (!running) {
+            break;
+        }
+        if (taken == 0) {
+            struct timespec idle = { 0, LOG_IDLE_SLEEP_NS };
+            nanosleep(&idle, NULL);
+        }
+    }
+    return NULL;
+}
 
 void init_logger(void) {
-    if (log_initialized) {
+    if (logger.running) {
         return;
     }
 
     /* Create logs directory if it doesn't exist */
     mkdir("./logs", 0755);
 
-    /* Open log file */
-    log_file = fopen(LOG_FILE, "a");
-    if (!log_file) {
+    /* Open log file; the writer thread is its only user */
+    logger.file_fd = open(LOG_FILE, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (logger.file_fd < 0) {
         fprintf(stderr, "Warning: Could not open log file %s\n", LOG_FILE);
-        return;
     }
-
-    log_initialized = TRUE;
+    logger.console = g_config.log_console;
 
     /* Log startup message */
+    char banner[128];
     time_t now = time(NULL);
     char *timestamp = ctime(&now);
-    timestamp[strlen(timestamp) - 1] = '\0'; /* Remove newline */
+    int length = snprintf(banner, sizeof(banner), "\n=== Server Started at %.24s ===\n", timestamp);
+    if (logger.file_fd >= 0 && length > 0) {
+        write_all(logger.file_fd, banner, (size_t)length);
+    }
 
-    fprintf(log_file, "\n=== Server Started at %s ===\n", timestamp);
-    fflush(log_file);
+    logger.running = TRUE;
+    if (pthread_create(&logger.writer, NULL, log_writer_main, NULL) != 0) {
+        logger.running = FALSE;
+        fprintf(stderr, "Warning: Could not start the log writer thread\n");
+    }
 }
 
 void log_message(int level, const char *format, ...) {
@@ -35,52 +255,44 @@ void log_message(int level, const char *format, ...) {
         return;
     }
 
-    /* Get current time */
-    time_t now = time(NULL);
-    struct tm *tm_info = localtime(&now);
-    char timestamp[64];
-    strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", tm_info);
-
-    /* Determine log level string and color */
+    /* Determine log level string */
     const char *level_str;
-    const char *color;
-
     switch (level) {
         case LOG_INFO:
             level_str = "INFO";
-            color = COLOR_GREEN;
             break;
         case LOG_ERROR:
             level_str = "ERROR";
-            color = COLOR_RED;
             break;
         case LOG_DEBUG:
             level_str = "DEBUG";
-            color = COLOR_BLUE;
             break;
         default:
             level_str = "UNKNOWN";
-            color = COLOR_RESET;
             break;
     }
 
-    /* Format the message */
+    log_record_t *record = log_reserve();
+    if (!record) {
+        return;
+    }
+
+    /* Format straight into the ring slot */
+    int prefix = snprintf(record->text, sizeof(record->text), "[%s] %s - ", log_timestamp(), level_str);
     va_list args;
     va_start(args, format);
-
-    char message[1024];
-    vsnprintf(message, sizeof(message), format, args);
-
+    int message = vsnprintf(record->text + prefix, sizeof(record->text) - (size_t)prefix, format, args);
     va_end(args);
 
-    /* Print to console with color */
-    printf("%s[%s] %s - %s%s\n", color, timestamp, level_str, message, COLOR_RESET);
-
-    /* Write to log file if available */
-    if (log_file) {
-        fprintf(log_file, "[%s] %s - %s\n", timestamp, level_str, message);
-        fflush(log_file);
+    size_t used = (size_t)prefix + (message > 0 ? (size_t)message : 0);
+    if (used < sizeof(record->text) - 1) {
+        record->text[used++] = '\n';
+        record->text[used] = '\0';
     }
+
+    record->level = level;
+    record->status_code = 0;
+    log_commit(record, (int)used);
 }
 
 void log_request(const char *method, const char *path, int status_code, const char *client_ip) {
@@ -88,46 +300,49 @@ void log_request(const char *method, const char *path, int status_code, const ch
         return;
     }
 
-    /* Get current time */
-    time_t now = time(NULL);
-    struct tm *tm_info = localtime(&now);
-    char timestamp[64];
-    strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", tm_info);
-
-    /* Determine status color for console output */
-    const char *status_color;
-    if (status_code >= 200 && status_code < 300) {
-        status_color = COLOR_GREEN;
-    } else if (status_code >= 400 && status_code < 500) {
-        status_color = COLOR_YELLOW;
-    } else if (status_code >= 500) {
-        status_color = COLOR_RED;
-    } else {
-        status_color = COLOR_RESET;
-    }
-
-    /* Format request log entry */
-    printf("%s[%s] REQUEST - %s %s %s%d%s from %s\n",
-           COLOR_BLUE, timestamp, method, path,
-           status_color, status_code, COLOR_RESET, client_ip);
-
-    /* Write to log file if available */
-    if (log_file) {
-        fprintf(log_file, "[%s] REQUEST - %s %s %d from %s\n",
-                timestamp, method, path, status_code, client_ip);
-        fflush(log_file);
+    log_record_t *record = log_reserve();
+    if (!record) {
+        return;
     }
+
+    record->level = LOG_REQUEST;
+    record->status_code = status_code;
+    log_commit(record, snprintf(record->text, sizeof(record->text), "[%s] REQUEST - %s %s %d from %s\n",
+                                log_timestamp(), method, path, status_code, client_ip));
+}
+
+unsigned long log_dropped(void) {
+    return __atomic_load_n(&logger.dropped, __ATOMIC_RELAXED);
 }
 
 void close_logger(void) {
-    if (log_file) {
+    if (logger.running) {
+        __atomic_store_n(&logger.running, FALSE, __ATOMIC_RELEASE);
+        pthread_join(logger.writer, NULL);
+    }
+
+    if (logger.file_fd >= 0) {
+        char banner[160];
         time_t now = time(NULL);
         char *timestamp = ctime(&now);
-        timestamp[strlen(timestamp) - 1] = '\0'; /* Remove newline */
+        int length;
+
+        if (log_dropped() > 0) {
+            length = snprintf(banner, sizeof(banner), "=== %lu log lines dropped ===\n", log_dropped());
+            write_all(logger.file_fd, banner, (size_t)length);
+        }
+        length = snprintf(banner, sizeof(banner), "=== Server Stopped at %.24s ===\n\n", timestamp);
+        write_all(logger.file_fd, banner, (size_t)length);
+        close(logger.file_fd);
+        logger.file_fd = -1;
+    }
 
-        fprintf(log_file, "=== Server Stopped at %s ===\n\n", timestamp);
-        fclose(log_file);
-        log_file = NULL;
+    /* Worker threads are gone; their rings can go too */
+    int count = logger.ring_count;
+    for (int i = 0; i < count; i++) {
+        free(logger.rings[i]);
+        logger.rings[i] = NULL;
     }
-    log_initialized = FALSE;
+    logger.ring_count = 0;
+    thread_ring = NULL;
 }
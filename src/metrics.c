@@ -0,0 +1,445 @@
+#include "server.h"
+#include <stdarg.h>
+
+/*
+ * Prometheus metrics.
+ *
+ * Each worker thread owns one cache-line aligned slot and is its only
+ * writer, so the hot path does plain relaxed increments with no sharing.
+ * The scrape handler sums the slots of every worker when /__metrics is hit.
+ *
+ * Latencies go into log-linear (HDR-style) histograms: every power of two
+ * is split into HISTOGRAM_SUB_BUCKETS linear steps, which bounds the
+ * relative error of reported quantiles to 1/HISTOGRAM_SUB_BUCKETS.
+ */
+
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS) * HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BUCKETS)
+#define HISTOGRAM_EXPORT_MIN 10   /* Exported "le" bounds run from 2^10ns (~1us) ... */
+#define HISTOGRAM_EXPORT_MAX 34   /* ... to 2^34ns (~17s) */
+#define STATUS_MIN 100
+#define STATUS_MAX 599
+
+enum {
+    METHOD_GET,
+    METHOD_HEAD,
+    METHOD_POST,
+    METHOD_PUT,
+    METHOD_DELETE,
+    METHOD_OPTIONS,
+    METHOD_PATCH,
+    METHOD_OTHER,
+    METHOD_COUNT
+};
+
+static const char *method_names[METHOD_COUNT] = {
+    "GET", "HEAD", "POST", "PUT", "DELETE", "OPTIONS", "PATCH", "OTHER"
+};
+
+static const struct {
+    const char *name;
+    const char *help;
+} histogram_info[METRIC_HISTOGRAM_COUNT] = {
+    { "http_request_parse_seconds", "Time spent parsing request headers" },
+    { "http_file_lookup_seconds", "Time spent resolving the response body (cache or filesystem)" },
+    { "http_request_duration_seconds", "Time from parse to queued response" },
+};
+
+typedef struct {
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+    uint64_t count;
+    uint64_t sum_ns;
+} histogram_t;
+
+typedef struct {
+    uint64_t status[STATUS_MAX - STATUS_MIN + 1];
+    uint64_t methods[METHOD_COUNT];
+    uint64_t bytes_sent;
+    uint64_t accepted;
+    uint64_t closed;
+    uint64_t timeouts[TIMEOUT_COUNT];
+    uint64_t shed[SHED_COUNT];
+    uint64_t listen_queue[2];               /* Gauge: accept queue depth at the last sample, cleartext and TLS */
+    uint64_t handshakes[HANDSHAKE_COUNT];
+    uint64_t ktls;                          /* TLS connections whose records the kernel encrypts */
+    uint64_t cache_lookups[2];              /* Static file cache misses, hits */
+    histogram_t histograms[METRIC_HISTOGRAM_COUNT];
+} __attribute__((aligned(64))) worker_metrics_t;
+
+static worker_metrics_t worker_metrics[MAX_WORKERS];
+static int worker_slots;            /* One past the highest slot taken; a scrape sums those */
+static __thread worker_metrics_t *local_metrics;
+
+/* Single writer per slot: relaxed load+store is enough and never bounces a lock */
+static inline void counter_add(uint64_t *counter, uint64_t value) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t counter_read(const uint64_t *counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static int histogram_index(uint64_t value) {
+    if (value < HISTOGRAM_SUB_BUCKETS) {
+        return (int)value;
+    }
+    int exponent = 63 - __builtin_clzll(value);
+    int sub = (int)((value >> (exponent - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1));
+    return (exponent - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS + sub;
+}
+
+/* Largest value that still falls into bucket `index` */
+static uint64_t histogram_upper(int index) {
+    if (index < HISTOGRAM_SUB_BUCKETS) {
+        return (uint64_t)index;
+    }
+    int exponent = index / HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BITS - 1;
+    uint64_t sub = (uint64_t)(index % HISTOGRAM_SUB_BUCKETS);
+    uint64_t step = 1ULL << (exponent - HISTOGRAM_SUB_BITS);
+    return (1ULL << exponent) + (sub + 1) * step - 1;
+}
+
+void metrics_thread_init(int worker_id) {
+    if (worker_id >= 0 && worker_id < MAX_WORKERS) {
+        local_metrics = &worker_metrics[worker_id];
+        int slots = __atomic_load_n(&worker_slots, __ATOMIC_RELAXED);
+        while (slots <= worker_id && !__atomic_compare_exchange_n(&worker_slots, &slots, worker_id + 1, FALSE,
+                                                                  __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        }
+    }
+}
+
+uint64_t metrics_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+void metrics_observe(int histogram, uint64_t ns) {
+    if (!local_metrics || histogram < 0 || histogram >= METRIC_HISTOGRAM_COUNT) {
+        return;
+    }
+    histogram_t *h = &local_metrics->histograms[histogram];
+    counter_add(&h->buckets[histogram_index(ns)], 1);
+    counter_add(&h->count, 1);
+    counter_add(&h->sum_ns, ns);
+}
+
+void metrics_count_request(const http_request_t *request, int status_code) {
+    metrics_count_response(request ? http_request_method(request) : HTTP_METHOD_COUNT, status_code);
+}
+
+/* For answers that outlive their request buffer (proxied ones); method is HTTP_METHOD_*, or COUNT for others */
+void metrics_count_response(int method, int status_code) {
+    if (!local_metrics) {
+        return;
+    }
+
+    /* METHOD_* follows HTTP_METHOD_* order, with OTHER in the place of the count */
+    if (method < 0 || method > METHOD_OTHER) {
+        method = METHOD_OTHER;
+    }
+    counter_add(&local_metrics->methods[method], 1);
+
+    if (status_code >= STATUS_MIN && status_code <= STATUS_MAX) {
+        counter_add(&local_metrics->status[status_code - STATUS_MIN], 1);
+    }
+}
+
+void metrics_add_bytes(size_t bytes) {
+    if (local_metrics) {
+        counter_add(&local_metrics->bytes_sent, bytes);
+    }
+}
+
+void metrics_connection_opened(void) {
+    if (local_metrics) {
+        counter_add(&local_metrics->accepted, 1);
+    }
+}
+
+void metrics_connection_closed(void) {
+    if (local_metrics) {
+        counter_add(&local_metrics->closed, 1);
+    }
+}
+
+void metrics_count_timeout(int deadline) {
+    if (local_metrics && deadline > TIMEOUT_NONE && deadline < TIMEOUT_COUNT) {
+        counter_add(&local_metrics->timeouts[deadline], 1);
+    }
+}
+
+void metrics_count_shed(int reason) {
+    if (local_metrics && reason > SHED_NONE && reason < SHED_COUNT) {
+        counter_add(&local_metrics->shed[reason], 1);
+    }
+}
+
+void metrics_listen_queue(int tls, unsigned depth) {
+    if (local_metrics) {
+        __atomic_store_n(&local_metrics->listen_queue[tls ? 1 : 0], depth, __ATOMIC_RELAXED);
+    }
+}
+
+void metrics_count_handshake(int outcome, int offloaded) {
+    if (!local_metrics || outcome < 0 || outcome >= HANDSHAKE_COUNT) {
+        return;
+    }
+    counter_add(&local_metrics->handshakes[outcome], 1);
+    if (offloaded) {
+        counter_add(&local_metrics->ktls, 1);
+    }
+}
+
+void metrics_count_cache_lookup(int hit) {
+    if (local_metrics) {
+        counter_add(&local_metrics->cache_lookups[hit ? 1 : 0], 1);
+    }
+}
+
+/* Growable text buffer for the exposition output, in the request arena */
+typedef struct {
+    char *data;
+    size_t length;
+    size_t capacity;
+} metrics_buffer_t;
+
+static void emit(metrics_buffer_t *out, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+static void emit(metrics_buffer_t *out, const char *format, ...) {
+    for (;;) {
+        size_t available = out->capacity - out->length;
+        va_list args;
+        va_start(args, format);
+        int n = out->data ? vsnprintf(out->data + out->length, available, format, args) : -1;
+        va_end(args);
+
+        if (n >= 0 && (size_t)n < available) {
+            out->length += (size_t)n;
+            return;
+        }
+
+        size_t capacity = out->capacity ? out->capacity * 2 : 16384;
+        char *data = arena_alloc(capacity);
+        if (!data) {
+            return;
+        }
+        if (out->data) {
+            memcpy(data, out->data, out->length);
+        }
+        out->data = data;
+        out->capacity = capacity;
+    }
+}
+
+static double histogram_quantile(const uint64_t *buckets, uint64_t count, double quantile) {
+    uint64_t rank = (uint64_t)(quantile * (double)count);
+    uint64_t seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += buckets[i];
+        if (seen > rank) {
+            return (double)histogram_upper(i) / 1e9;
+        }
+    }
+    return 0.0;
+}
+
+static void emit_histogram(metrics_buffer_t *out, int histogram, int workers) {
+    static uint64_t buckets[HISTOGRAM_BUCKETS];
+    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    uint64_t count = 0, sum_ns = 0;
+    const char *name = histogram_info[histogram].name;
+
+    /* Concurrent scrapes share the merge buffer */
+    pthread_mutex_lock(&lock);
+    memset(buckets, 0, sizeof(buckets));
+    for (int w = 0; w < workers; w++) {
+        const histogram_t *h = &worker_metrics[w].histograms[histogram];
+        for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+            buckets[i] += counter_read(&h->buckets[i]);
+        }
+        count += counter_read(&h->count);
+        sum_ns += counter_read(&h->sum_ns);
+    }
+
+    emit(out, "# HELP %s %s\n# TYPE %s histogram\n", name, histogram_info[histogram].help, name);
+
+    /* Export cumulative counts at power-of-two boundaries; the fine buckets feed the quantiles */
+    uint64_t cumulative = 0;
+    int next = 0;
+    for (int exponent = HISTOGRAM_EXPORT_MIN; exponent <= HISTOGRAM_EXPORT_MAX; exponent++) {
+        uint64_t bound = (1ULL << exponent) - 1;
+        while (next < HISTOGRAM_BUCKETS && histogram_upper(next) <= bound) {
+            cumulative += buckets[next++];
+        }
+        emit(out, "%s_bucket{le=\"%.9g\"} %llu\n", name, (double)(bound + 1) / 1e9,
+             (unsigned long long)cumulative);
+    }
+    emit(out, "%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)count);
+    emit(out, "%s_sum %.9f\n", name, (double)sum_ns / 1e9);
+    emit(out, "%s_count %llu\n", name, (unsigned long long)count);
+
+    static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+    emit(out, "# HELP %s_quantile %s (HDR estimate)\n# TYPE %s_quantile gauge\n",
+         name, histogram_info[histogram].help, name);
+    for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+        emit(out, "%s_quantile{quantile=\"%g\"} %.9f\n", name, quantiles[q],
+             histogram_quantile(buckets, count, quantiles[q]));
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+int metrics_render(http_response_t *response) {
+    if (!response) {
+        return -1;
+    }
+
+    metrics_buffer_t out = { NULL, 0, 0 };
+    int workers = __atomic_load_n(&worker_slots, __ATOMIC_RELAXED);
+
+    /* Requests by status code */
+    emit(&out, "# HELP http_requests_total Requests answered, by status code\n"
+               "# TYPE http_requests_total counter\n");
+    for (int code = STATUS_MIN; code <= STATUS_MAX; code++) {
+        uint64_t total = 0;
+        for (int w = 0; w < workers; w++) {
+            total += counter_read(&worker_metrics[w].status[code - STATUS_MIN]);
+        }
+        if (total > 0) {
+            emit(&out, "http_requests_total{code=\"%d\"} %llu\n", code, (unsigned long long)total);
+        }
+    }
+
+    /* Requests by method */
+    emit(&out, "# HELP http_requests_by_method_total Requests received, by method\n"
+               "# TYPE http_requests_by_method_total counter\n");
+    for (int method = 0; method < METHOD_COUNT; method++) {
+        uint64_t total = 0;
+        for (int w = 0; w < workers; w++) {
+            total += counter_read(&worker_metrics[w].methods[method]);
+        }
+        emit(&out, "http_requests_by_method_total{method=\"%s\"} %llu\n",
+             method_names[method], (unsigned long long)total);
+    }
+
+    /* Traffic and connections */
+    uint64_t bytes = 0, accepted = 0, closed = 0;
+    for (int w = 0; w < workers; w++) {
+        bytes += counter_read(&worker_metrics[w].bytes_sent);
+        accepted += counter_read(&worker_metrics[w].accepted);
+        closed += counter_read(&worker_metrics[w].closed);
+    }
+    emit(&out, "# HELP http_sent_bytes_total Bytes written to client sockets\n"
+               "# TYPE http_sent_bytes_total counter\n"
+               "http_sent_bytes_total %llu\n", (unsigned long long)bytes);
+    emit(&out, "# HELP http_connections_accepted_total Connections accepted\n"
+               "# TYPE http_connections_accepted_total counter\n"
+               "http_connections_accepted_total %llu\n", (unsigned long long)accepted);
+    emit(&out, "# HELP http_connections_active Connections currently open\n"
+               "# TYPE http_connections_active gauge\n"
+               "http_connections_active %llu\n", (unsigned long long)(accepted - closed));
+
+    /* Deadlines that closed a connection, by the phase it stalled in */
+    static const char *phases[TIMEOUT_COUNT] = { "", "header", "body", "idle", "write", "upstream" };
+    emit(&out, "# HELP http_connection_timeouts_total Connections closed by a deadline, by phase\n"
+               "# TYPE http_connection_timeouts_total counter\n");
+    for (int deadline = TIMEOUT_NONE + 1; deadline < TIMEOUT_COUNT; deadline++) {
+        uint64_t total = 0;
+        for (int w = 0; w < workers; w++) {
+            total += counter_read(&worker_metrics[w].timeouts[deadline]);
+        }
+        emit(&out, "http_connection_timeouts_total{phase=\"%s\"} %llu\n", phases[deadline],
+             (unsigned long long)total);
+    }
+
+    /* Admission control: clients turned away at accept, and the queue that drives it */
+    static const char *reasons[SHED_COUNT] = { "", "limit", "queue" };
+    emit(&out, "# HELP http_connections_shed_total Connections answered 503 at accept, by reason\n"
+               "# TYPE http_connections_shed_total counter\n");
+    for (int reason = SHED_NONE + 1; reason < SHED_COUNT; reason++) {
+        uint64_t total = 0;
+        for (int w = 0; w < workers; w++) {
+            total += counter_read(&worker_metrics[w].shed[reason]);
+        }
+        emit(&out, "http_connections_shed_total{reason=\"%s\"} %llu\n", reasons[reason],
+             (unsigned long long)total);
+    }
+    uint64_t queued = 0;
+    for (int w = 0; w < workers; w++) {
+        queued += counter_read(&worker_metrics[w].listen_queue[0]) + counter_read(&worker_metrics[w].listen_queue[1]);
+    }
+    emit(&out, "# HELP http_listen_queue_depth Connections waiting in the accept queues (sampled)\n"
+               "# TYPE http_listen_queue_depth gauge\n"
+               "http_listen_queue_depth %llu\n", (unsigned long long)queued);
+
+    /* TLS handshakes; resumed over full is the session reuse rate */
+    static const char *outcomes[HANDSHAKE_COUNT] = { "full", "resumed", "failed" };
+    emit(&out, "# HELP tls_handshakes_total TLS handshakes, by outcome\n"
+               "# TYPE tls_handshakes_total counter\n");
+    for (int outcome = 0; outcome < HANDSHAKE_COUNT; outcome++) {
+        uint64_t total = 0;
+        for (int w = 0; w < workers; w++) {
+            total += counter_read(&worker_metrics[w].handshakes[outcome]);
+        }
+        emit(&out, "tls_handshakes_total{outcome=\"%s\"} %llu\n", outcomes[outcome], (unsigned long long)total);
+    }
+    uint64_t ktls = 0;
+    for (int w = 0; w < workers; w++) {
+        ktls += counter_read(&worker_metrics[w].ktls);
+    }
+    emit(&out, "# HELP tls_ktls_connections_total TLS connections handed to kernel TLS after the handshake\n"
+               "# TYPE tls_ktls_connections_total counter\n"
+               "tls_ktls_connections_total %llu\n", (unsigned long long)ktls);
+
+    for (int histogram = 0; histogram < METRIC_HISTOGRAM_COUNT; histogram++) {
+        emit_histogram(&out, histogram, workers);
+    }
+
+    uint64_t lookups[2] = {0, 0};
+    for (int w = 0; w < workers; w++) {
+        lookups[0] += counter_read(&worker_metrics[w].cache_lookups[0]);
+        lookups[1] += counter_read(&worker_metrics[w].cache_lookups[1]);
+    }
+    emit(&out, "# HELP file_cache_hits_total Static file cache hits\n"
+               "# TYPE file_cache_hits_total counter\n"
+               "file_cache_hits_total %llu\n", (unsigned long long)lookups[1]);
+    emit(&out, "# HELP file_cache_misses_total Static file cache misses\n"
+               "# TYPE file_cache_misses_total counter\n"
+               "file_cache_misses_total %llu\n", (unsigned long long)lookups[0]);
+
+    /* Process-wide counters kept elsewhere */
+    file_cache_stats_t cache;
+    file_cache_stats(&cache);
+    emit(&out, "# HELP file_cache_evictions_total Static file cache entries evicted to make room\n"
+               "# TYPE file_cache_evictions_total counter\n"
+               "file_cache_evictions_total %lu\n", cache.evictions);
+    emit(&out, "# HELP file_cache_invalidations_total Static file cache entries dropped because their file changed\n"
+               "# TYPE file_cache_invalidations_total counter\n"
+               "file_cache_invalidations_total %lu\n", cache.invalidations);
+    emit(&out, "# HELP file_cache_bytes Bytes held by the static file cache\n"
+               "# TYPE file_cache_bytes gauge\n"
+               "file_cache_bytes %zu\n", cache.bytes);
+    ratelimit_stats_t limiter;
+    ratelimit_stats(&limiter);
+    emit(&out, "# HELP http_requests_limited_total Requests answered 429 by the per-client rate limit\n"
+               "# TYPE http_requests_limited_total counter\n"
+               "http_requests_limited_total %lu\n", limiter.limited);
+    emit(&out, "# HELP rate_limit_table_full_total Requests let through because no rate limiter slot was free\n"
+               "# TYPE rate_limit_table_full_total counter\n"
+               "rate_limit_table_full_total %lu\n", limiter.overflows);
+    emit(&out, "# HELP log_dropped_lines_total Log lines dropped because a log ring was full\n"
+               "# TYPE log_dropped_lines_total counter\n"
+               "log_dropped_lines_total %lu\n", log_dropped());
+
+    if (!out.data) {
+        return -1;
+    }
+
+    response->status_code = HTTP_OK;
+    response->body = out.data;
+    response->body_length = out.length;
+    strcpy(response->content_type, "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n");
+    return 0;
+}
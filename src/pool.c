@@ -0,0 +1,189 @@
+#include "server.h"
+
+/*
+ * Per-thread memory for the request path.
+ *
+ * Size-class slabs: connection objects, request state and I/O buffers come
+ * from power-of-two classes. Small classes are carved out of 64 KB slabs;
+ * larger ones are allocated one by one. Everything freed goes back to the
+ * class's free list, so a worker in steady state never calls malloc().
+ *
+ * Request arena: scratch memory for one request (error pages, the metrics
+ * text), handed out with a bump pointer and reset after the response has
+ * been queued.
+ *
+ * Both are thread-local. A connection is created, served and closed by one
+ * worker, so no locking is needed.
+ */
+
+#define POOL_MIN_SHIFT 6                     /* 64 bytes */
+#define POOL_MAX_SHIFT 16                    /* 64 KB */
+#define POOL_CLASSES (POOL_MAX_SHIFT - POOL_MIN_SHIFT + 1)
+#define POOL_SLAB_SIZE (64 * 1024)
+#define POOL_SLAB_MAX_OBJECT 4096            /* Larger classes are not carved from slabs */
+#define POOL_MAX_FREE_LARGE 64               /* Cached free objects per large class */
+#define ARENA_BLOCK_SIZE 4096
+
+typedef struct pool_free {
+    struct pool_free *next;
+} pool_free_t;
+
+typedef struct pool_slab {
+    struct pool_slab *next;
+} pool_slab_t;
+
+typedef struct arena_block {
+    struct arena_block *next;
+    size_t size;
+    size_t used;
+    char data[];
+} arena_block_t;
+
+static __thread struct {
+    pool_free_t *free[POOL_CLASSES];
+    int free_count[POOL_CLASSES];
+    pool_slab_t *slabs;
+    arena_block_t *arena;
+} local;
+
+static int size_class(size_t size) {
+    int shift = POOL_MIN_SHIFT;
+    while (shift <= POOL_MAX_SHIFT && ((size_t)1 << shift) < size) {
+        shift++;
+    }
+    return shift - POOL_MIN_SHIFT;
+}
+
+/* Usable bytes of an allocation of this size, so buffers can grow into the slack */
+size_t pool_capacity(size_t size) {
+    int index = size_class(size);
+    return index < POOL_CLASSES ? (size_t)1 << (index + POOL_MIN_SHIFT) : size;
+}
+
+/* Carve a fresh slab into free objects of one class */
+static int pool_refill(int index) {
+    size_t object_size = (size_t)1 << (index + POOL_MIN_SHIFT);
+    char *slab = malloc(POOL_SLAB_SIZE);
+    if (!slab) {
+        return -1;
+    }
+
+    /* The first object slot holds the slab link so cleanup can find it */
+    ((pool_slab_t *)slab)->next = local.slabs;
+    local.slabs = (pool_slab_t *)slab;
+
+    for (size_t offset = object_size; offset + object_size <= POOL_SLAB_SIZE; offset += object_size) {
+        pool_free_t *object = (pool_free_t *)(slab + offset);
+        object->next = local.free[index];
+        local.free[index] = object;
+        local.free_count[index]++;
+    }
+    return 0;
+}
+
+void* pool_alloc(size_t size) {
+    int index = size_class(size);
+    if (index >= POOL_CLASSES) {
+        return malloc(size);
+    }
+
+    if (!local.free[index]) {
+        size_t object_size = (size_t)1 << (index + POOL_MIN_SHIFT);
+        if (object_size > POOL_SLAB_MAX_OBJECT) {
+            return malloc(object_size);
+        }
+        if (pool_refill(index) != 0) {
+            return NULL;
+        }
+    }
+
+    pool_free_t *object = local.free[index];
+    local.free[index] = object->next;
+    local.free_count[index]--;
+    return object;
+}
+
+/* size must fall in the same class as the size it was allocated with */
+void pool_free(void *ptr, size_t size) {
+    if (!ptr) {
+        return;
+    }
+
+    int index = size_class(size);
+    size_t object_size = (size_t)1 << (index + POOL_MIN_SHIFT);
+    if (index >= POOL_CLASSES ||
+        (object_size > POOL_SLAB_MAX_OBJECT && local.free_count[index] >= POOL_MAX_FREE_LARGE)) {
+        free(ptr);
+        return;
+    }
+
+    pool_free_t *object = ptr;
+    object->next = local.free[index];
+    local.free[index] = object;
+    local.free_count[index]++;
+}
+
+void* arena_alloc(size_t size) {
+    arena_block_t *block = local.arena;
+    size = (size + 15) & ~(size_t)15;
+
+    if (!block || block->used + size > block->size) {
+        /* Grow geometrically; reset keeps only the newest block, so growth stops at the peak */
+        size_t block_size = block ? block->size * 2 : ARENA_BLOCK_SIZE;
+        while (block_size < size) {
+            block_size *= 2;
+        }
+        arena_block_t *grown = malloc(sizeof(arena_block_t) + block_size);
+        if (!grown) {
+            return NULL;
+        }
+        grown->next = block;
+        grown->size = block_size;
+        grown->used = 0;
+        local.arena = block = grown;
+    }
+
+    void *ptr = block->data + block->used;
+    block->used += size;
+    return ptr;
+}
+
+void arena_reset(void) {
+    arena_block_t *block = local.arena;
+    if (!block) {
+        return;
+    }
+
+    while (block->next) {
+        arena_block_t *older = block->next;
+        block->next = older->next;
+        free(older);
+    }
+    block->used = 0;
+}
+
+/* Release everything this thread cached; nothing from the pool may be in use */
+void pool_thread_cleanup(void) {
+    for (int i = 0; i < POOL_CLASSES; i++) {
+        size_t object_size = (size_t)1 << (i + POOL_MIN_SHIFT);
+        if (object_size > POOL_SLAB_MAX_OBJECT) {
+            while (local.free[i]) {
+                pool_free_t *object = local.free[i];
+                local.free[i] = object->next;
+                free(object);
+            }
+        }
+        local.free[i] = NULL;
+        local.free_count[i] = 0;
+    }
+
+    while (local.slabs) {
+        pool_slab_t *slab = local.slabs;
+        local.slabs = slab->next;
+        free(slab);
+    }
+
+    arena_reset();
+    free(local.arena);
+    local.arena = NULL;
+}
@@ -0,0 +1,1008 @@
+#include "server.h"
+#include <ctype.h>
+#include <netdb.h>
+#include <netinet/tcp.h>
+#include <strings.h>
+#include <sys/un.h>
+
+/*
+ * Reverse proxy ("proxy:NAME" routes).
+ *
+ * The request head is rewritten once (hop-by-hop headers dropped,
+ * X-Forwarded-For and X-Forwarded-Proto added) and sent to a server of the
+ * named upstream; the body follows straight from the client's in_buf as it
+ * arrives, so uploads of any size pass through a fixed amount of memory.
+ * The response head is rebuilt the same way and the body is received
+ * directly into the client's out_buf, never reading further ahead than the
+ * client takes: the output queue's high-water mark is the only buffer.
+ *
+ * Upstream sockets live in the worker's epoll set with their pointer tagged
+ * (EPOLL_TAG_UPSTREAM); their events just resume the client connection,
+ * which owns the whole exchange and drives it from connection_process().
+ *
+ * Each worker keeps its own pool of idle keep-alive connections per server
+ * and its own view of server health (consecutive failures take a server out
+ * of rotation for a while), so nothing here is shared or locked. The
+ * upstream table itself is resolved once at startup and read-only.
+ */
+
+typedef struct {
+    char name[MAX_ROOT_LENGTH];             /* As configured, for logs */
+    char host[MAX_ROOT_LENGTH];             /* Host header for requests that carry none */
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+} upstream_server_t;
+
+typedef struct {
+    char name[64];
+    int server_count;
+    upstream_server_t servers[MAX_UPSTREAM_SERVERS];
+} upstream_t;
+
+static upstream_t upstreams[MAX_UPSTREAMS];
+static int upstream_count;
+
+/* How the end of a response body is found */
+enum {
+    BODY_NONE = 0,
+    BODY_LENGTH,
+    BODY_CHUNKED,
+    BODY_CLOSE              /* Read until the upstream closes */
+};
+
+struct upstream_conn {
+    int fd;
+    int upstream;               /* Index into upstreams[] */
+    int server;                 /* Index into its servers[] */
+    connection_t *client;       /* NULL while idle in the pool */
+    struct upstream_conn *next; /* Idle list, or the list awaiting proxy_collect() */
+    struct upstream_conn *prev;
+    uint64_t idle_since;
+    int reused;                 /* Carried an earlier exchange */
+    int dead;                   /* Socket closed; freed at the next proxy_collect() */
+
+    /* The exchange, from here on reset per request: the request going up ... */
+    char *head;                 /* Request head as forwarded, kept for a retry */
+    size_t head_size;
+    size_t head_length;
+    size_t head_sent;
+    size_t body_remaining;      /* Request body still to relay from the client's in_buf */
+    size_t body_sent;
+    int method;
+    int tries;
+    char method_name[16];
+    char path[MAX_PATH_LENGTH];
+    uint64_t started;
+    const char *error_root;     /* The virtual host's root, for its error pages */
+
+    /* ... and the response coming back */
+    char *in;                   /* Response head, UPSTREAM_BUFFER_SIZE */
+    size_t in_len;
+    int received;               /* Any response byte arrived */
+    int send_failed;
+    int head_done;              /* Final response head queued for the client */
+    int status;
+    int keep_alive;             /* The upstream allows another exchange on this connection */
+    int framing;                /* BODY_* */
+    uint64_t remaining;         /* BODY_LENGTH bytes left */
+    http_chunked_t chunk;       /* BODY_CHUNKED framing */
+};
+
+#define EXCHANGE_OFFSET offsetof(struct upstream_conn, head)
+#define RESPONSE_OFFSET offsetof(struct upstream_conn, in)
+
+/* One worker's view of one server */
+typedef struct {
+    struct upstream_conn *idle; /* Most recently used first */
+    int idle_count;
+    int active;
+    int fails;                  /* Consecutive */
+    uint64_t down_until;
+} server_state_t;
+
+static __thread server_state_t state[MAX_UPSTREAMS][MAX_UPSTREAM_SERVERS];
+static __thread int cursor[MAX_UPSTREAMS];
+static __thread struct upstream_conn *graveyard;
+
+/* Hop-by-hop headers, never forwarded in either direction */
+static const char *const hop_by_hop_headers[] = {
+    "Connection", "Keep-Alive", "Proxy-Connection", "TE", "Trailer", "Upgrade",
+};
+
+/* "host:port", "[v6addr]:port" or "unix:/path" */
+static int resolve_server(const char *spec, upstream_server_t *server) {
+    memset(server, 0, sizeof(*server));
+    snprintf(server->name, sizeof(server->name), "%s", spec);
+
+    if (strncmp(spec, "unix:", 5) == 0) {
+        struct sockaddr_un *un = (struct sockaddr_un *)&server->addr;
+        const char *path = spec + 5;
+        if (*path == '\0' || strlen(path) >= sizeof(un->sun_path)) {
+            return -1;
+        }
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, path);
+        server->addr_len = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + strlen(path) + 1);
+        strcpy(server->host, "localhost");
+        return 0;
+    }
+
+    char host[MAX_ROOT_LENGTH];
+    const char *port;
+    const char *start = spec;
+    const char *end;
+    if (spec[0] == '[') {
+        start = spec + 1;
+        end = strchr(spec, ']');
+        if (!end || end[1] != ':') {
+            return -1;
+        }
+        port = end + 2;
+    } else {
+        end = strrchr(spec, ':');
+        if (!end) {
+            return -1;
+        }
+        port = end + 1;
+    }
+    if (end == start || *port == '\0') {
+        return -1;
+    }
+    memcpy(host, start, (size_t)(end - start));
+    host[end - start] = '\0';
+
+    struct addrinfo hints;
+    struct addrinfo *result;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &result) != 0) {
+        return -1;
+    }
+    memcpy(&server->addr, result->ai_addr, result->ai_addrlen);
+    server->addr_len = result->ai_addrlen;
+    freeaddrinfo(result);
+
+    snprintf(server->host, sizeof(server->host), "%s", spec);
+    return 0;
+}
+
+int proxy_init(const config_t *config) {
+    upstream_count = 0;
+    for (int i = 0; i < config->upstream_count; i++) {
+        upstream_t *upstream = &upstreams[i];
+        snprintf(upstream->name, sizeof(upstream->name), "%s", config->upstreams[i].name);
+        upstream->server_count = config->upstreams[i].server_count;
+
+        for (int j = 0; j < upstream->server_count; j++) {
+            if (resolve_server(config->upstreams[i].servers[j], &upstream->servers[j]) != 0) {
+                log_message(LOG_ERROR, "Upstream %s: cannot resolve %s", upstream->name,
+                            config->upstreams[i].servers[j]);
+                return -1;
+            }
+        }
+        upstream_count++;
+    }
+    return 0;
+}
+
+const void* proxy_upstream(const char *name) {
+    for (int i = 0; i < upstream_count; i++) {
+        if (strcmp(upstreams[i].name, name) == 0) {
+            return &upstreams[i];
+        }
+    }
+    return NULL;
+}
+
+/* Round-robin, or fewest active exchanges with round-robin among equals; servers marked down are skipped */
+static int pick_server(int index, int exclude) {
+    const upstream_t *upstream = &upstreams[index];
+    uint64_t now = timer_now();
+    int best = -1;
+
+    /* With every server down (or excluded), health is ignored rather than failing the request */
+    for (int pass = 0; pass < 2 && best < 0; pass++) {
+        for (int i = 0; i < upstream->server_count; i++) {
+            int server = (cursor[index] + i) % upstream->server_count;
+            const server_state_t *st = &state[index][server];
+            if (pass == 0 && (server == exclude || st->down_until > now)) {
+                continue;
+            }
+            if (best < 0 || st->active < state[index][best].active) {
+                best = server;
+            }
+            if (g_config.balance == BALANCE_ROUND_ROBIN) {
+                break;
+            }
+        }
+    }
+
+    cursor[index] = (best + 1) % upstream->server_count;
+    return best;
+}
+
+static void server_failed(int index, int server) {
+    server_state_t *st = &state[index][server];
+    if (++st->fails >= UPSTREAM_MAX_FAILS) {
+        st->fails = 0;
+        st->down_until = timer_now() + (uint64_t)UPSTREAM_FAIL_TIMEOUT * 1000;
+        log_message(LOG_ERROR, "Upstream %s: %s marked down for %d seconds", upstreams[index].name,
+                    upstreams[index].servers[server].name, UPSTREAM_FAIL_TIMEOUT);
+    }
+}
+
+/* Close the socket; the object itself outlives any event for it still queued in this batch */
+static void bury(struct upstream_conn *up) {
+    if (up->fd >= 0) {
+        close(up->fd);
+        up->fd = -1;
+    }
+    up->dead = TRUE;
+    up->client = NULL;
+    up->next = graveyard;
+    graveyard = up;
+}
+
+static void unlink_idle(struct upstream_conn *up) {
+    server_state_t *st = &state[up->upstream][up->server];
+    if (up->prev) {
+        up->prev->next = up->next;
+    } else {
+        st->idle = up->next;
+    }
+    if (up->next) {
+        up->next->prev = up->prev;
+    }
+    up->next = NULL;
+    up->prev = NULL;
+    st->idle_count--;
+}
+
+/* An idle connection is fine as long as there is nothing to read: data or EOF means the server gave up on it */
+static int still_open(const struct upstream_conn *up) {
+    char byte;
+    ssize_t n = recv(up->fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/* An idle pooled connection to the server, or a new one still connecting */
+static struct upstream_conn* open_connection(worker_t *worker, int index, int server) {
+    server_state_t *st = &state[index][server];
+    uint64_t now = timer_now();
+
+    /* Most recently used first: the likeliest to still be open at the other end */
+    while (st->idle) {
+        struct upstream_conn *up = st->idle;
+        unlink_idle(up);
+        if (now - up->idle_since < (uint64_t)UPSTREAM_IDLE_TIMEOUT * 1000 && still_open(up)) {
+            return up;
+        }
+        bury(up);
+    }
+
+    const upstream_server_t *target = &upstreams[index].servers[server];
+    int fd = socket(target->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (target->addr.ss_family != AF_UNIX) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    if (connect(fd, (const struct sockaddr *)&target->addr, target->addr_len) != 0 && errno != EINPROGRESS) {
+        close(fd);
+        return NULL;
+    }
+
+    struct upstream_conn *up = pool_alloc(sizeof(struct upstream_conn));
+    if (!up) {
+        close(fd);
+        return NULL;
+    }
+    memset(up, 0, sizeof(struct upstream_conn));
+    up->fd = fd;
+    up->upstream = index;
+    up->server = server;
+
+    /* Registered once for both directions, like client sockets */
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = (char *)up + EPOLL_TAG_UPSTREAM;
+    if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        close(fd);
+        pool_free(up, sizeof(struct upstream_conn));
+        return NULL;
+    }
+    return up;
+}
+
+/* Bind the client to a server of the upstream, moving on to the next when connecting fails outright */
+static struct upstream_conn* attach(connection_t *conn, int index, int exclude) {
+    for (int attempt = 0; attempt < upstreams[index].server_count; attempt++) {
+        int server = pick_server(index, exclude);
+        struct upstream_conn *up = open_connection(conn->worker, index, server);
+        if (up) {
+            up->client = conn;
+            state[index][server].active++;
+            conn->proxy = up;
+            return up;
+        }
+        log_message(LOG_ERROR, "Upstream %s: cannot connect to %s: %s", upstreams[index].name,
+                    upstreams[index].servers[server].name, strerror(errno));
+        server_failed(index, server);
+        exclude = server;
+    }
+    return NULL;
+}
+
+/* End an exchange on the upstream side: back to the pool when another one may follow, closed otherwise */
+static void release(struct upstream_conn *up, int reusable) {
+    server_state_t *st = &state[up->upstream][up->server];
+
+    st->active--;
+    up->client = NULL;
+    pool_free(up->head, up->head_size);
+    pool_free(up->in, UPSTREAM_BUFFER_SIZE);
+    up->head = NULL;
+    up->in = NULL;
+
+    if (!reusable || st->idle_count >= UPSTREAM_KEEPALIVE) {
+        bury(up);
+        return;
+    }
+    up->reused = TRUE;
+    up->idle_since = timer_now();
+    up->prev = NULL;
+    up->next = st->idle;
+    if (st->idle) {
+        st->idle->prev = up;
+    }
+    st->idle = up;
+    st->idle_count++;
+}
+
+static void detach(connection_t *conn, int reusable) {
+    struct upstream_conn *up = conn->proxy;
+
+    /* Unsent request body would be parsed as the next request */
+    if (up->body_remaining > 0) {
+        conn->close_after_write = TRUE;
+    }
+    conn->proxy = NULL;
+    release(up, reusable && up->keep_alive && !up->send_failed && up->body_remaining == 0);
+}
+
+/* Bounded append; FALSE once the buffer is full */
+static int append(char *buf, size_t *length, size_t size, const char *data, size_t n) {
+    if (*length + n > size) {
+        return FALSE;
+    }
+    memcpy(buf + *length, data, n);
+    *length += n;
+    return TRUE;
+}
+
+static int append_string(char *buf, size_t *length, size_t size, const char *data) {
+    return append(buf, length, size, data, strlen(data));
+}
+
+/* A hop-by-hop header, or one the Connection header names as such */
+static int is_hop_by_hop(const char *name, size_t length, const char *connection, size_t connection_length) {
+    for (size_t i = 0; i < sizeof(hop_by_hop_headers) / sizeof(hop_by_hop_headers[0]); i++) {
+        if (strlen(hop_by_hop_headers[i]) == length && strncasecmp(name, hop_by_hop_headers[i], length) == 0) {
+            return TRUE;
+        }
+    }
+
+    char token[64];
+    if (!connection || length >= sizeof(token)) {
+        return FALSE;
+    }
+    memcpy(token, name, length);
+    token[length] = '\0';
+    return http_has_token(connection, connection_length, token);
+}
+
+static int header_is(const char *name, size_t length, const char *literal) {
+    return strlen(literal) == length && strncasecmp(name, literal, length) == 0;
+}
+
+/* The request head as the upstream gets it */
+static int build_request(struct upstream_conn *up, const connection_t *conn, const http_request_t *request) {
+    const upstream_server_t *server = &upstreams[up->upstream].servers[up->server];
+    const char *buf = request->buf;
+    size_t connection_length = 0;
+    size_t forwarded_length = 0;
+    const char *connection = http_request_header(request, "Connection", &connection_length);
+    const char *forwarded = http_request_header(request, "X-Forwarded-For", &forwarded_length);
+    int has_host = FALSE;
+
+    size_t size = request->header_length + forwarded_length + sizeof(server->host) + 256;
+    char *head = pool_alloc(size);
+    if (!head) {
+        return -1;
+    }
+    up->head = head;
+    up->head_size = size;
+
+    /* Same target and version as the client used, so framing and persistence match what it expects */
+    size_t length = 0;
+    int ok = append(head, &length, size, buf + request->method.offset, request->method.length) &&
+             append_string(head, &length, size, " ") &&
+             append(head, &length, size, buf + request->path.offset, request->path.length);
+    if (ok && request->query.offset != 0) {
+        ok = append_string(head, &length, size, "?") &&
+             append(head, &length, size, buf + request->query.offset, request->query.length);
+    }
+    ok = ok && append_string(head, &length, size, request->version_minor >= 1 || request->version_major > 1
+                                                      ? " HTTP/1.1\r\n" : " HTTP/1.0\r\n");
+
+    for (int i = 0; ok && i < request->header_count; i++) {
+        const http_header_t *header = &request->headers[i];
+        const char *name = buf + header->name.offset;
+        if (is_hop_by_hop(name, header->name.length, connection, connection_length) ||
+            header_is(name, header->name.length, "X-Forwarded-For") ||
+            header_is(name, header->name.length, "X-Forwarded-Proto")) {
+            continue;
+        }
+        if (header_is(name, header->name.length, "Host")) {
+            has_host = TRUE;
+        }
+        ok = append(head, &length, size, name, header->name.length) &&
+             append_string(head, &length, size, ": ") &&
+             append(head, &length, size, buf + header->value.offset, header->value.length) &&
+             append_string(head, &length, size, "\r\n");
+    }
+
+    if (ok && !has_host) {
+        ok = append_string(head, &length, size, "Host: ") &&
+             append_string(head, &length, size, server->host) &&
+             append_string(head, &length, size, "\r\n");
+    }
+    ok = ok && append_string(head, &length, size, "X-Forwarded-For: ");
+    if (ok && forwarded) {
+        ok = append(head, &length, size, forwarded, forwarded_length) &&
+             append_string(head, &length, size, ", ");
+    }
+    ok = ok && append_string(head, &length, size, conn->client_ip) &&
+         append_string(head, &length, size, conn->tls ? "\r\nX-Forwarded-Proto: https\r\n\r\n"
+                                                      : "\r\nX-Forwarded-Proto: http\r\n\r\n");
+
+    up->head_length = length;
+    return ok ? 0 : -1;
+}
+
+int proxy_start(const route_t *route, connection_t *conn, const http_request_t *request) {
+    const upstream_t *upstream = route->target;
+    if (!upstream || !conn->worker) {
+        return -1;
+    }
+
+    struct upstream_conn *up = attach(conn, (int)(upstream - upstreams), -1);
+    if (!up) {
+        return -1;
+    }
+    memset((char *)up + EXCHANGE_OFFSET, 0, sizeof(struct upstream_conn) - EXCHANGE_OFFSET);
+    if (build_request(up, conn, request) != 0) {
+        detach(conn, TRUE);
+        return -1;
+    }
+
+    up->body_remaining = request->content_length > 0 ? (size_t)request->content_length : 0;
+    up->method = http_request_method(request);
+    up->tries = 1;
+    up->started = metrics_now();
+    up->error_root = route->root;
+    http_slice_copy(request, request->method, up->method_name, sizeof(up->method_name));
+    http_slice_copy(request, request->path, up->path, sizeof(up->path));
+    return 0;
+}
+
+/* Write the request head, then as much of the body as the client has sent; -1 on a socket error */
+static int send_request(struct upstream_conn *up, connection_t *conn) {
+    while (up->head_sent < up->head_length) {
+        ssize_t n = send(up->fd, up->head + up->head_sent, up->head_length - up->head_sent, MSG_NOSIGNAL);
+        if (n > 0) {
+            up->head_sent += (size_t)n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    }
+
+    while (up->body_remaining > 0 && conn->in_len > 0) {
+        size_t length = conn->in_len < up->body_remaining ? conn->in_len : up->body_remaining;
+        ssize_t n = send(up->fd, conn->in_buf, length, MSG_NOSIGNAL);
+        if (n > 0) {
+            memmove(conn->in_buf, conn->in_buf + n, conn->in_len - (size_t)n);
+            conn->in_len -= (size_t)n;
+            conn->in_buf[conn->in_len] = '\0';
+            up->body_remaining -= (size_t)n;
+            up->body_sent += (size_t)n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    }
+    return 0;
+}
+
+/* Follow chunked framing over relayed bytes; returns how many belong to this response, -1 on bad framing */
+static ssize_t scan_chunked(struct upstream_conn *up, const char *data, size_t length) {
+    size_t i = 0;
+
+    while (i < length && up->chunk.state != CHUNK_DONE) {
+        if (up->chunk.state == CHUNK_DATA) {
+            size_t n = length - i < up->chunk.remaining ? length - i : (size_t)up->chunk.remaining;
+            http_chunked_consume(&up->chunk, n);
+            i += n;
+            continue;
+        }
+
+        size_t used;
+        if (http_chunked_scan(&up->chunk, data + i, length - i, &used) != 0) {
+            return -1;
+        }
+        i += used;
+    }
+    return (ssize_t)i;
+}
+
+/* Queue `length` body bytes just received at the end of out_buf, as far as they belong to the response */
+static int relay_body(struct upstream_conn *up, connection_t *conn, size_t length) {
+    size_t used = length;
+
+    if (up->framing == BODY_NONE) {
+        used = 0;
+    } else if (up->framing == BODY_LENGTH) {
+        if (used > up->remaining) {
+            used = (size_t)up->remaining;
+        }
+        up->remaining -= used;
+    } else if (up->framing == BODY_CHUNKED) {
+        ssize_t n = scan_chunked(up, conn->out_buf + conn->out_len, length);
+        if (n < 0) {
+            return -1;
+        }
+        used = (size_t)n;
+    }
+
+    /* Anything past the end of the body leaves the connection in an unknown state */
+    if (used < length) {
+        up->keep_alive = FALSE;
+    }
+    return used > 0 ? connection_commit(conn, used) : 0;
+}
+
+static int body_complete(const struct upstream_conn *up) {
+    switch (up->framing) {
+        case BODY_NONE:
+            return TRUE;
+        case BODY_LENGTH:
+            return up->remaining == 0;
+        case BODY_CHUNKED:
+            return up->chunk.state == CHUNK_DONE;
+        default:
+            return FALSE;
+    }
+}
+
+/* Length of the head at the start of buf, 0 while its blank line has not arrived */
+static size_t head_end(const char *buf, size_t length) {
+    const char *p = buf;
+    const char *end = buf + length;
+
+    while ((p = memchr(p, '\n', (size_t)(end - p))) != NULL) {
+        p++;
+        if (p < end && *p == '\n') {
+            return (size_t)(p - buf) + 1;
+        }
+        if (end - p >= 2 && p[0] == '\r' && p[1] == '\n') {
+            return (size_t)(p - buf) + 2;
+        }
+    }
+    return 0;
+}
+
+typedef struct {
+    const char *name;
+    size_t name_length;
+    const char *value;
+    size_t value_length;
+} header_view_t;
+
+/* Next header line of a response head; 0 at the blank line, -1 if malformed */
+static int next_header(const char **line, const char *end, header_view_t *header) {
+    const char *eol = memchr(*line, '\n', (size_t)(end - *line));
+    if (!eol) {
+        return -1;
+    }
+    const char *start = *line;
+    const char *stop = eol > start && eol[-1] == '\r' ? eol - 1 : eol;
+    *line = eol + 1;
+    if (stop == start) {
+        return 0;
+    }
+
+    const char *colon = memchr(start, ':', (size_t)(stop - start));
+    if (!colon || colon == start) {
+        return -1;
+    }
+    header->name = start;
+    header->name_length = (size_t)(colon - start);
+    header->value = colon + 1;
+    while (header->value < stop && (*header->value == ' ' || *header->value == '\t')) {
+        header->value++;
+    }
+    while (stop > header->value && (stop[-1] == ' ' || stop[-1] == '\t')) {
+        stop--;
+    }
+    header->value_length = (size_t)(stop - header->value);
+    return 1;
+}
+
+/* "chunked" is the final transfer coding */
+static int chunked_last(const char *value, size_t length) {
+    size_t token = strlen("chunked");
+    return length >= token && strncasecmp(value + length - token, "chunked", token) == 0 &&
+           (length == token || value[length - token - 1] == ',' || value[length - token - 1] == ' ');
+}
+
+/*
+ * Queue the final response head for the client, rebuilt without hop-by-hop
+ * headers, and work out how its body is framed (RFC 9112, section 6.3).
+ */
+static int forward_head(struct upstream_conn *up, connection_t *conn, size_t length, int status, int minor) {
+    const char *end = up->in + length;
+    const char *status_line = up->in + strlen("HTTP/1.x ");
+    const char *first = (const char *)memchr(up->in, '\n', length) + 1;
+    const char *connection = NULL;
+    size_t connection_length = 0;
+    long content_length = -1;
+    int transfer_encoding = FALSE;
+    int chunked = FALSE;
+    header_view_t header;
+    const char *line;
+    int rc;
+
+    for (line = first; (rc = next_header(&line, end, &header)) > 0;) {
+        if (header_is(header.name, header.name_length, "Connection")) {
+            connection = header.value;
+            connection_length = header.value_length;
+        } else if (header_is(header.name, header.name_length, "Transfer-Encoding")) {
+            transfer_encoding = TRUE;
+            chunked = chunked_last(header.value, header.value_length);
+        } else if (header_is(header.name, header.name_length, "Content-Length")) {
+            long value = 0;
+            for (size_t i = 0; i < header.value_length; i++) {
+                if (!isdigit((unsigned char)header.value[i]) || value > (LONG_MAX - 9) / 10) {
+                    return -1;
+                }
+                value = value * 10 + (header.value[i] - '0');
+            }
+            if (header.value_length == 0 || (content_length >= 0 && content_length != value)) {
+                return -1;
+            }
+            content_length = value;
+        }
+    }
+    if (rc < 0) {
+        return -1;
+    }
+
+    if (up->method == HTTP_METHOD_HEAD || status == HTTP_NOT_MODIFIED || status == 204) {
+        up->framing = BODY_NONE;
+    } else if (transfer_encoding) {
+        up->framing = chunked ? BODY_CHUNKED : BODY_CLOSE;
+    } else if (content_length >= 0) {
+        up->framing = content_length > 0 ? BODY_LENGTH : BODY_NONE;
+        up->remaining = (uint64_t)content_length;
+    } else {
+        up->framing = BODY_CLOSE;
+    }
+    up->keep_alive = up->framing != BODY_CLOSE &&
+                     (minor >= 1 ? !(connection && http_has_token(connection, connection_length, "close"))
+                                 : connection && http_has_token(connection, connection_length, "keep-alive"));
+    if (up->framing == BODY_CLOSE) {
+        conn->close_after_write = TRUE; /* Only closing tells the client where the body ends */
+    }
+
+    /* Lines only lose their hop-by-hop members and gain at most a CR each */
+    size_t size = 2 * length + 64;
+    char *out = connection_reserve(conn, size);
+    if (!out) {
+        return -1;
+    }
+    size_t written = 0;
+    const char *status_end = memchr(status_line, '\n', (size_t)(end - status_line));
+    if (status_end > status_line && status_end[-1] == '\r') {
+        status_end--;
+    }
+    int ok = append_string(out, &written, size, HTTP_VERSION " ") &&
+             append(out, &written, size, status_line, (size_t)(status_end - status_line)) &&
+             append_string(out, &written, size, "\r\n");
+
+    for (line = first; ok && next_header(&line, end, &header) > 0;) {
+        if (is_hop_by_hop(header.name, header.name_length, connection, connection_length)) {
+            continue;
+        }
+        ok = append(out, &written, size, header.name, header.name_length) &&
+             append_string(out, &written, size, ": ") &&
+             append(out, &written, size, header.value, header.value_length) &&
+             append_string(out, &written, size, "\r\n");
+    }
+    ok = ok && append_string(out, &written, size, conn->close_after_write ? "Connection: close\r\n\r\n"
+                                                                           : "Connection: keep-alive\r\n\r\n");
+    if (!ok || connection_commit(conn, written) != 0) {
+        return -1;
+    }
+
+    up->status = status;
+    up->head_done = TRUE;
+    state[up->upstream][up->server].fails = 0;
+    return 0;
+}
+
+/* "HTTP/1.x NNN ..."; returns the status, -1 if this is not a status line */
+static int parse_status(const char *buf, size_t length, int *minor) {
+    if (length < 13 || strncmp(buf, "HTTP/1.", 7) != 0 || !isdigit((unsigned char)buf[7]) || buf[8] != ' ' ||
+        !isdigit((unsigned char)buf[9]) || !isdigit((unsigned char)buf[10]) || !isdigit((unsigned char)buf[11]) ||
+        (buf[12] != ' ' && buf[12] != '\r' && buf[12] != '\n')) {
+        return -1;
+    }
+    *minor = buf[7] - '0';
+    return (buf[9] - '0') * 100 + (buf[10] - '0') * 10 + (buf[11] - '0');
+}
+
+/* Consume complete heads from the head buffer: interim ones are relayed as they are, the final one rebuilt */
+static int parse_heads(struct upstream_conn *up, connection_t *conn) {
+    while (!up->head_done) {
+        size_t length = head_end(up->in, up->in_len);
+        if (length == 0) {
+            return up->in_len < UPSTREAM_BUFFER_SIZE ? 0 : -1;
+        }
+
+        int minor;
+        int status = parse_status(up->in, length, &minor);
+        if (status < 100 || status == 101) {
+            return -1; /* Upgrade was not forwarded, so a switch is as broken as garbage */
+        }
+        if (status < 200) {
+            if (connection_append(conn, up->in, length) != 0) {
+                return -1;
+            }
+        } else if (forward_head(up, conn, length, status, minor) != 0) {
+            return -1;
+        }
+        memmove(up->in, up->in + length, up->in_len - length);
+        up->in_len -= length;
+    }
+
+    /* Whatever arrived behind the head already belongs to the body */
+    if (up->in_len > 0) {
+        char *out = connection_reserve(conn, up->in_len);
+        if (!out) {
+            return -1;
+        }
+        memcpy(out, up->in, up->in_len);
+        size_t length = up->in_len;
+        up->in_len = 0;
+        return relay_body(up, conn, length);
+    }
+    return 0;
+}
+
+/* Read the response into the client's output queue; 1 once it is complete, 0 to wait, -1 on failure */
+static int receive_response(struct upstream_conn *up, connection_t *conn) {
+    while (!up->head_done) {
+        if (!up->in && !(up->in = pool_alloc(UPSTREAM_BUFFER_SIZE))) {
+            return -1;
+        }
+        ssize_t n = recv(up->fd, up->in + up->in_len, UPSTREAM_BUFFER_SIZE - up->in_len, 0);
+        if (n > 0) {
+            up->received = TRUE;
+            up->in_len += (size_t)n;
+            if (parse_heads(up, conn) != 0) {
+                return -1;
+            }
+            continue;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    }
+
+    while (!body_complete(up)) {
+        /* The client has to take what is queued before more is read: this is the only buffer */
+        if (conn->out_len >= OUTPUT_HIGH_WATER || conn->out_count >= OUT_QUEUE_SIZE) {
+            return 0;
+        }
+        size_t want = UPSTREAM_BUFFER_SIZE;
+        if (up->framing == BODY_LENGTH && up->remaining < want) {
+            want = (size_t)up->remaining;
+        }
+        char *out = connection_reserve(conn, want);
+        if (!out) {
+            return -1;
+        }
+
+        ssize_t n = recv(up->fd, out, want, 0);
+        if (n > 0) {
+            if (relay_body(up, conn, (size_t)n) != 0) {
+                return -1;
+            }
+            continue;
+        }
+        if (n == 0 && up->framing == BODY_CLOSE) {
+            return 1;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    }
+    return 1;
+}
+
+static void exchange_done(connection_t *conn, int reusable) {
+    struct upstream_conn *up = conn->proxy;
+
+    log_request(up->method_name, up->path, up->status, conn->client_ip);
+    metrics_count_response(up->method, up->status);
+    metrics_observe(METRIC_TOTAL, metrics_now() - up->started);
+    detach(conn, reusable);
+}
+
+static int idempotent(int method) {
+    return method == HTTP_METHOD_GET || method == HTTP_METHOD_HEAD || method == HTTP_METHOD_PUT ||
+           method == HTTP_METHOD_DELETE || method == HTTP_METHOD_OPTIONS;
+}
+
+/* Send the request again over another connection; only called while the client has seen nothing */
+static int retry(connection_t *conn) {
+    struct upstream_conn *failed = conn->proxy;
+
+    /* A pooled connection the server had already closed says nothing about the server */
+    struct upstream_conn *up = attach(conn, failed->upstream, failed->reused ? -1 : failed->server);
+    if (!up) {
+        return -1;
+    }
+    memcpy((char *)up + EXCHANGE_OFFSET, (char *)failed + EXCHANGE_OFFSET, RESPONSE_OFFSET - EXCHANGE_OFFSET);
+    memset((char *)up + RESPONSE_OFFSET, 0, sizeof(struct upstream_conn) - RESPONSE_OFFSET);
+    up->head_sent = 0;
+    up->tries++;
+
+    failed->head = NULL; /* Moved */
+    release(failed, FALSE);
+    return 0;
+}
+
+/*
+ * The exchange failed. Before any response byte arrived (and with no body
+ * bytes spent) an idempotent request is retried on another connection;
+ * otherwise the client gets the error, or, if its response is already under
+ * way, a truncated one.
+ */
+static void exchange_failed(connection_t *conn, int status) {
+    struct upstream_conn *up = conn->proxy;
+    const upstream_t *upstream = &upstreams[up->upstream];
+
+    if (!up->reused) {
+        server_failed(up->upstream, up->server);
+    }
+    if (status == HTTP_BAD_GATEWAY && !up->received && up->body_sent == 0 &&
+        (up->head_sent == 0 || idempotent(up->method)) && up->tries <= upstream->server_count &&
+        retry(conn) == 0) {
+        return;
+    }
+
+    if (up->head_done) {
+        log_message(LOG_ERROR, "Upstream %s: %s broke off the response to %s", upstream->name,
+                    upstream->servers[up->server].name, up->path);
+        conn->close_after_write = TRUE; /* A truncated response cannot be repaired */
+        exchange_done(conn, FALSE);
+        return;
+    }
+
+    log_message(LOG_ERROR, "Upstream %s: %s %s for %s", upstream->name, upstream->servers[up->server].name,
+                status == HTTP_GATEWAY_TIMEOUT ? "timed out" : "failed", up->path);
+    if (up->body_remaining > 0) {
+        conn->close_after_write = TRUE;
+    }
+
+    http_response_t response;
+    http_response_init(&response);
+    response.error_root = up->error_root;
+    create_error_response(status, &response);
+    connection_respond(conn, &response);
+    free_response(&response);
+    arena_reset();
+
+    up->status = status;
+    exchange_done(conn, FALSE);
+}
+
+void proxy_pump(connection_t *conn) {
+    struct upstream_conn *up = conn->proxy;
+    if (!up) {
+        return;
+    }
+
+    /* A server may answer (413, say) and close before taking the whole body; its response still counts */
+    if (!up->send_failed && send_request(up, conn) != 0) {
+        up->send_failed = TRUE;
+    }
+
+    int rc = receive_response(up, conn);
+    if (rc > 0) {
+        exchange_done(conn, TRUE);
+    } else if (rc < 0 || (up->send_failed && !up->received)) {
+        exchange_failed(conn, HTTP_BAD_GATEWAY);
+    } else if (conn->peer_closed && conn->in_len == 0 && up->body_remaining > 0) {
+        /* The client left halfway through its body: nobody is waiting for an answer */
+        conn->close_after_write = TRUE;
+        up->status = HTTP_BAD_REQUEST;
+        exchange_done(conn, FALSE);
+    }
+}
+
+void proxy_event(struct upstream_conn *up, uint32_t events) {
+    if (up->dead) {
+        return; /* Closed earlier in this batch */
+    }
+    if (!up->client) {
+        /* Idle in the pool: the server closing it (or talking out of turn) retires it */
+        if ((events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) && !still_open(up)) {
+            unlink_idle(up);
+            bury(up);
+        }
+        return;
+    }
+    up->client->worker->resume(up->client);
+}
+
+int proxy_timeout(connection_t *conn) {
+    struct upstream_conn *up = conn->proxy;
+
+    /* Mid-body there is no way to tell the client, so it gets the usual reset */
+    if (!up || up->head_done) {
+        return FALSE;
+    }
+    exchange_failed(conn, HTTP_GATEWAY_TIMEOUT);
+    conn->worker->resume(conn);
+    return TRUE;
+}
+
+void proxy_abort(connection_t *conn) {
+    struct upstream_conn *up = conn->proxy;
+    conn->proxy = NULL;
+    release(up, FALSE);
+}
+
+/* Free connections closed since the last call; run between event batches */
+void proxy_collect(void) {
+    while (graveyard) {
+        struct upstream_conn *up = graveyard;
+        graveyard = up->next;
+        pool_free(up, sizeof(struct upstream_conn));
+    }
+}
+
+void proxy_thread_cleanup(void) {
+    for (int i = 0; i < upstream_count; i++) {
+        for (int j = 0; j < upstreams[i].server_count; j++) {
+            while (state[i][j].idle) {
+                struct upstream_conn *up = state[i][j].idle;
+                unlink_idle(up);
+                bury(up);
+            }
+        }
+    }
+    proxy_collect();
+}
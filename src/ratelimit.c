@@ -0,0 +1,133 @@
+#include "server.h"
+
+/*
+ * Per-client rate limiting (--rate-limit).
+ *
+ * Every client address, or every address prefix with --rate-limit-prefix,
+ * gets a token bucket of --rate-limit-burst tokens refilled at --rate-limit
+ * per second; a request takes a token, and one that finds the bucket empty
+ * is answered 429 before any handler runs. Buckets are kept in GCRA form:
+ * one "theoretical arrival time" per client, the moment its bucket would be
+ * full again. A request moves it one interval later, and is over the limit
+ * if that would put it more than a whole burst ahead of now.
+ *
+ * The table is a fixed array shared by all workers, open-addressed with a
+ * short linear probe and no locks: a slot is claimed by a compare-and-swap
+ * on its key and a bucket is charged by one on its arrival time, so a
+ * request from a known client costs one load and one CAS. A slot whose
+ * arrival time has passed holds a full bucket, which is what a client
+ * without a slot gets anyway, so such idle slots are taken over by new
+ * clients as they are met and nothing ever sweeps the table.
+ *
+ * Key and arrival time are separate words: a worker that looked a client
+ * up just before its idle slot was taken over may charge its token to the
+ * new owner. That costs a client one token at most, and only in that race.
+ * When every slot in reach is held by an active client, the request is let
+ * through and counted (rate_limit_table_full_total) rather than refused.
+ */
+
+struct rate_slot {
+    uint64_t key;               /* Masked address + 1, 0 = never used */
+    uint64_t tat;               /* Theoretical arrival time, ns on metrics_now()'s clock */
+};
+
+static struct {
+    struct rate_slot *slots;
+    uint64_t interval;          /* Nanoseconds per token */
+    uint64_t tolerance;         /* How far ahead of now a full burst may push the arrival time */
+    uint32_t mask;              /* --rate-limit-prefix, host byte order */
+    unsigned long limited;
+    unsigned long overflows;
+} limiter;
+
+int ratelimit_init(const config_t *config) {
+    if (!config || config->rate_limit == 0) {
+        return 0;
+    }
+
+    limiter.slots = calloc(RATE_LIMIT_SLOTS, sizeof(struct rate_slot));
+    if (!limiter.slots) {
+        return -1;
+    }
+
+    int burst = config->rate_limit_burst > 0 ? config->rate_limit_burst : config->rate_limit;
+    limiter.interval = 1000000000ULL / (uint64_t)config->rate_limit;
+    limiter.tolerance = limiter.interval * (uint64_t)burst;
+    limiter.mask = config->rate_limit_prefix > 0 ? 0xFFFFFFFFu << (32 - config->rate_limit_prefix) : 0;
+
+    log_message(LOG_INFO, "Rate limit: %d requests/s per /%d, bursts of %d", config->rate_limit,
+                config->rate_limit_prefix, burst);
+    return 0;
+}
+
+/* The client's slot, claiming an empty or idle one for a new client; NULL when none is in reach */
+static struct rate_slot *find_slot(uint64_t key, uint64_t now) {
+    uint32_t home = (uint32_t)((key * 0x9E3779B97F4A7C15ULL) >> 32) & (RATE_LIMIT_SLOTS - 1);
+
+    /* A known client is looked for first, so a free slot earlier in its probe never gives it a second bucket */
+    for (int probe = 0; probe < RATE_LIMIT_PROBES; probe++) {
+        struct rate_slot *slot = &limiter.slots[(home + probe) & (RATE_LIMIT_SLOTS - 1)];
+        uint64_t owner = __atomic_load_n(&slot->key, __ATOMIC_ACQUIRE);
+        if (owner == key) {
+            return slot;
+        }
+        if (owner == 0) {
+            break; /* Slots are never emptied, so the probe ends at the first one never used */
+        }
+    }
+
+    for (int probe = 0; probe < RATE_LIMIT_PROBES; probe++) {
+        struct rate_slot *slot = &limiter.slots[(home + probe) & (RATE_LIMIT_SLOTS - 1)];
+        uint64_t owner = __atomic_load_n(&slot->key, __ATOMIC_ACQUIRE);
+        if (owner != 0 && __atomic_load_n(&slot->tat, __ATOMIC_RELAXED) > now) {
+            continue; /* Held by an active client */
+        }
+
+        /* Its arrival time is in the past either way, so the new owner starts with a full bucket */
+        if (__atomic_compare_exchange_n(&slot->key, &owner, key, FALSE, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) ||
+            owner == key) {
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+/* Take a token for a request from addr (IPv4, network byte order); FALSE when it is over the limit */
+int ratelimit_allow(uint32_t addr) {
+    if (!limiter.slots || addr == 0) {
+        return TRUE; /* Off, or a peer we have no address for */
+    }
+
+    uint64_t key = (uint64_t)(ntohl(addr) & limiter.mask) + 1;
+    uint64_t now = metrics_now();
+    struct rate_slot *slot = find_slot(key, now);
+    if (!slot) {
+        __atomic_add_fetch(&limiter.overflows, 1, __ATOMIC_RELAXED);
+        return TRUE;
+    }
+
+    uint64_t tat = __atomic_load_n(&slot->tat, __ATOMIC_RELAXED);
+    for (;;) {
+        uint64_t next = (tat > now ? tat : now) + limiter.interval;
+        if (next - now > limiter.tolerance) {
+            __atomic_add_fetch(&limiter.limited, 1, __ATOMIC_RELAXED);
+            return FALSE;
+        }
+        if (__atomic_compare_exchange_n(&slot->tat, &tat, next, TRUE, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            return TRUE;
+        }
+    }
+}
+
+void ratelimit_stats(ratelimit_stats_t *stats) {
+    if (!stats) {
+        return;
+    }
+    stats->limited = __atomic_load_n(&limiter.limited, __ATOMIC_RELAXED);
+    stats->overflows = __atomic_load_n(&limiter.overflows, __ATOMIC_RELAXED);
+}
+
+void ratelimit_cleanup(void) {
+    free(limiter.slots);
+    memset(&limiter, 0, sizeof(limiter));
+}
@@ -0,0 +1,394 @@
+#include "server.h"
+#include <ctype.h>
+
+/*
+ * Request routing.
+ *
+ * Every virtual host owns a compressed radix trie over request paths. A node
+ * carries two handler tables indexed by method: routes mounted exactly on the
+ * node's path, and prefix routes (mounted with a trailing '/') that also
+ * cover everything below it. Lookup walks the trie once, remembering the
+ * deepest prefix route passed on the way, so it is O(path length) and never
+ * allocates.
+ *
+ * A route's handler may take the request as soon as its head is parsed
+ * (streams_body): the proxy relays bodies of any size while they arrive and
+ * uploads store them, where every other handler sees the whole request in
+ * the read buffer.
+ *
+ * Virtual hosts are found by the Host header in a small open-addressing
+ * table; unknown or missing hosts get the default host, which serves the
+ * --root directory.
+ *
+ * Everything is built once at startup and read-only afterwards, so workers
+ * share it without locking.
+ */
+
+#define VHOST_TABLE_SIZE 64 /* Power of two, comfortably above MAX_VHOSTS + 1 */
+
+typedef struct route_node {
+    char *label;                          /* Edge label from the parent */
+    size_t label_length;
+    struct route_node **children;         /* Distinct first label bytes */
+    int child_count;
+    const route_t *exact[HTTP_METHOD_COUNT];
+    const route_t *prefix[HTTP_METHOD_COUNT];
+    unsigned exact_methods;               /* HTTP_METHOD_* bits set in exact[] */
+    unsigned prefix_methods;
+} route_node_t;
+
+typedef struct {
+    char host[MAX_HOST_LENGTH];
+    char root[MAX_ROOT_LENGTH];
+    route_node_t *routes;
+} vhost_t;
+
+#define ALL_METHODS ((1u << HTTP_METHOD_COUNT) - 1)
+
+/* Handlers a route spec can name, and the methods each one answers */
+static const struct {
+    const char *name;
+    route_handler_t handler;
+    unsigned methods;
+    int streams_body;
+    int upstream;           /* ARG names an --upstream, resolved at startup */
+    int directory;          /* ARG names a directory, which must exist at startup */
+} handlers[] = {
+    { "static", handle_static, 1u << HTTP_METHOD_GET, FALSE, FALSE, FALSE },
+    { "metrics", handle_metrics, 1u << HTTP_METHOD_GET, FALSE, FALSE, FALSE },
+    { "proxy", handle_proxy, ALL_METHODS, TRUE, TRUE, FALSE },
+    { "upload", handle_upload, (1u << HTTP_METHOD_PUT) | (1u << HTTP_METHOD_POST), TRUE, FALSE, TRUE },
+};
+
+static struct {
+    vhost_t hosts[MAX_VHOSTS + 1];        /* [0] is the default host */
+    int host_count;
+    signed char table[VHOST_TABLE_SIZE];  /* Index into hosts[], -1 = empty */
+    route_t routes[(MAX_VHOSTS + 1) * (MAX_ROUTES + 2)]; /* Configured and built-in routes of every host */
+    int route_count;
+} router;
+
+/* FNV-1a over the lowercased host name, without the port */
+static uint32_t hash_host(const char *host, size_t length, size_t *name_length) {
+    uint32_t hash = 2166136261u;
+    size_t i = 0;
+
+    /* "[::1]:8080" keeps its brackets; everything else ends at the first ':' */
+    for (; i < length && (host[i] != ':' || host[0] == '['); i++) {
+        hash ^= (unsigned char)tolower((unsigned char)host[i]);
+        hash *= 16777619u;
+        if (host[i] == ']') {
+            i++;
+            break;
+        }
+    }
+    *name_length = i;
+    return hash;
+}
+
+static const vhost_t *find_vhost(const http_request_t *request) {
+    size_t length;
+    const char *host = http_request_header(request, "Host", &length);
+    if (!host || router.host_count == 1) {
+        return &router.hosts[0];
+    }
+
+    size_t name_length;
+    uint32_t hash = hash_host(host, length, &name_length);
+    for (uint32_t slot = hash & (VHOST_TABLE_SIZE - 1); router.table[slot] >= 0;
+         slot = (slot + 1) & (VHOST_TABLE_SIZE - 1)) {
+        const vhost_t *vhost = &router.hosts[(int)router.table[slot]];
+        if (strlen(vhost->host) == name_length && strncasecmp(vhost->host, host, name_length) == 0) {
+            return vhost;
+        }
+    }
+    return &router.hosts[0];
+}
+
+/* ---- trie construction (startup only) ---- */
+
+static route_node_t *node_create(const char *label, size_t length) {
+    route_node_t *node = calloc(1, sizeof(route_node_t));
+    if (!node) {
+        return NULL;
+    }
+    node->label = malloc(length + 1);
+    if (!node->label) {
+        free(node);
+        return NULL;
+    }
+    memcpy(node->label, label, length);
+    node->label[length] = '\0';
+    node->label_length = length;
+    return node;
+}
+
+static void node_destroy(route_node_t *node) {
+    if (!node) {
+        return;
+    }
+    for (int i = 0; i < node->child_count; i++) {
+        node_destroy(node->children[i]);
+    }
+    free(node->children);
+    free(node->label);
+    free(node);
+}
+
+static int node_add_child(route_node_t *node, route_node_t *child) {
+    route_node_t **children = realloc(node->children, (size_t)(node->child_count + 1) * sizeof(*children));
+    if (!children) {
+        return -1;
+    }
+    children[node->child_count++] = child;
+    node->children = children;
+    return 0;
+}
+
+static route_node_t *node_child(const route_node_t *node, char first) {
+    for (int i = 0; i < node->child_count; i++) {
+        if (node->children[i]->label[0] == first) {
+            return node->children[i];
+        }
+    }
+    return NULL;
+}
+
+/* Node for exactly this path, splitting edges and adding nodes as needed */
+static route_node_t *trie_insert(route_node_t *node, const char *path, size_t length) {
+    while (length > 0) {
+        route_node_t *child = node_child(node, path[0]);
+        if (!child) {
+            child = node_create(path, length);
+            if (!child || node_add_child(node, child) != 0) {
+                node_destroy(child);
+                return NULL;
+            }
+            return child;
+        }
+
+        size_t common = 0;
+        while (common < child->label_length && common < length && child->label[common] == path[common]) {
+            common++;
+        }
+
+        /* The path leaves this edge half way: the shared part becomes its own node */
+        if (common < child->label_length) {
+            route_node_t *middle = node_create(child->label, common);
+            if (!middle || node_add_child(middle, child) != 0) {
+                node_destroy(middle);
+                return NULL;
+            }
+            child->label_length -= common;
+            memmove(child->label, child->label + common, child->label_length + 1);
+            for (int i = 0; i < node->child_count; i++) {
+                if (node->children[i] == child) {
+                    node->children[i] = middle;
+                }
+            }
+            child = middle;
+        }
+
+        node = child;
+        path += common;
+        length -= common;
+    }
+    return node;
+}
+
+/* "NAME" or "NAME:ARG" */
+static int add_route(vhost_t *vhost, const char *path, const char *spec) {
+    size_t name_length = strcspn(spec, ":");
+    size_t i;
+    for (i = 0; i < sizeof(handlers) / sizeof(handlers[0]); i++) {
+        if (strlen(handlers[i].name) == name_length && strncmp(handlers[i].name, spec, name_length) == 0) {
+            break;
+        }
+    }
+    if (i == sizeof(handlers) / sizeof(handlers[0])) {
+        log_message(LOG_ERROR, "Unknown route handler: %s", spec);
+        return -1;
+    }
+
+    size_t length = strlen(path);
+    int prefix = length > 0 && path[length - 1] == '/';
+    route_node_t *node = trie_insert(vhost->routes, path, length);
+    if (!node) {
+        log_message(LOG_ERROR, "Out of memory for route %s", path);
+        return -1;
+    }
+
+    route_t *route = &router.routes[router.route_count++];
+    route->handler = handlers[i].handler;
+    route->arg = spec[name_length] == ':' ? spec + name_length + 1 : NULL;
+    route->root = vhost->root;
+    route->streams_body = handlers[i].streams_body;
+    route->mount_length = length;
+    if (handlers[i].directory) {
+        struct stat st;
+        if (!route->arg || stat(route->arg, &st) != 0 || !S_ISDIR(st.st_mode)) {
+            log_message(LOG_ERROR, "Route %s: %s needs an existing directory", path, spec);
+            return -1;
+        }
+    }
+    if (handlers[i].upstream) {
+        route->target = route->arg ? proxy_upstream(route->arg) : NULL;
+        if (!route->target) {
+            log_message(LOG_ERROR, "Route %s: unknown upstream in %s", path, spec);
+            return -1;
+        }
+    }
+
+    /* Later routes on the same path replace earlier ones method by method */
+    const route_t **table = prefix ? node->prefix : node->exact;
+    unsigned *methods = prefix ? &node->prefix_methods : &node->exact_methods;
+    for (int method = 0; method < HTTP_METHOD_COUNT; method++) {
+        if (handlers[i].methods & (1u << method)) {
+            table[method] = route;
+        }
+    }
+    *methods |= handlers[i].methods;
+    return 0;
+}
+
+static int add_vhost(const char *host, const char *root) {
+    vhost_t *vhost = &router.hosts[router.host_count];
+    strncpy(vhost->host, host, sizeof(vhost->host) - 1);
+    strncpy(vhost->root, root, sizeof(vhost->root) - 1);
+    vhost->routes = node_create("", 0);
+    if (!vhost->routes) {
+        return -1;
+    }
+
+    if (host[0] != '\0') {
+        size_t name_length;
+        uint32_t slot = hash_host(host, strlen(host), &name_length) & (VHOST_TABLE_SIZE - 1);
+        while (router.table[slot] >= 0) {
+            slot = (slot + 1) & (VHOST_TABLE_SIZE - 1);
+        }
+        router.table[slot] = (signed char)router.host_count;
+    }
+    router.host_count++;
+    return 0;
+}
+
+int router_init(const config_t *config) {
+    memset(router.table, -1, sizeof(router.table));
+
+    if (add_vhost("", config->root) != 0) {
+        return -1;
+    }
+    for (int i = 0; i < config->vhost_count; i++) {
+        if (add_vhost(config->vhosts[i].host, config->vhosts[i].root) != 0) {
+            return -1;
+        }
+    }
+
+    for (int h = 0; h < router.host_count; h++) {
+        vhost_t *vhost = &router.hosts[h];
+
+        /* Built-in routes first, so configured ones can replace them */
+        if (add_route(vhost, "/", "static") != 0 || add_route(vhost, METRICS_PATH, "metrics") != 0) {
+            return -1;
+        }
+
+        for (int i = 0; i < config->route_count; i++) {
+            const char *host = config->routes[i].host;
+            if (host[0] != '\0' && strcasecmp(host, vhost->host) != 0) {
+                continue;
+            }
+            if (add_route(vhost, config->routes[i].path, config->routes[i].handler) != 0) {
+                return -1;
+            }
+        }
+    }
+
+    log_message(LOG_INFO, "Router: %d virtual hosts, %d routes", router.host_count - 1, config->route_count);
+    return 0;
+}
+
+/* Distinct document roots, for the file cache to watch */
+int router_roots(const char **roots, int max_roots) {
+    int count = 0;
+    for (int h = 0; h < router.host_count && count < max_roots; h++) {
+        int seen = FALSE;
+        for (int i = 0; i < count && !seen; i++) {
+            seen = strcmp(roots[i], router.hosts[h].root) == 0;
+        }
+        if (!seen) {
+            roots[count++] = router.hosts[h].root;
+        }
+    }
+    return count;
+}
+
+/* Handler table of the route a request falls under (with its methods), NULL when nothing matches */
+static const route_t *const *router_match(const http_request_t *request, unsigned *methods,
+                                         const vhost_t **matched) {
+    const vhost_t *vhost = find_vhost(request);
+    if (matched) {
+        *matched = vhost;
+    }
+    const char *path = request->buf + request->path.offset;
+    size_t length = request->path.length;
+
+    const route_node_t *node = vhost->routes;
+    const route_node_t *prefix = node->prefix_methods ? node : NULL;
+    const route_node_t *exact = NULL;
+    for (;;) {
+        if (length == 0) {
+            exact = node->exact_methods ? node : NULL;
+            break;
+        }
+        const route_node_t *child = node_child(node, path[0]);
+        if (!child || child->label_length > length || memcmp(child->label, path, child->label_length) != 0) {
+            break;
+        }
+        node = child;
+        path += child->label_length;
+        length -= child->label_length;
+        if (node->prefix_methods) {
+            prefix = node;
+        }
+    }
+
+    *methods = exact ? exact->exact_methods : prefix ? prefix->prefix_methods : 0;
+    return exact ? exact->exact : prefix ? prefix->prefix : NULL;
+}
+
+/* Whether the request's handler wants it before the body is in (only asked while the body is incomplete) */
+int router_streams_body(const http_request_t *request) {
+    unsigned methods;
+    const route_t *const *table = router_match(request, &methods, NULL);
+    int method = http_request_method(request);
+    return table && method < HTTP_METHOD_COUNT && table[method] && table[method]->streams_body;
+}
+
+void router_dispatch(connection_t *conn, const http_request_t *request, http_response_t *response) {
+    unsigned methods;
+    const vhost_t *vhost;
+    const route_t *const *table = router_match(request, &methods, &vhost);
+    response->error_root = vhost->root; /* Its error pages, including for the 404 and 405 below */
+    if (!table) {
+        create_error_response(HTTP_NOT_FOUND, response);
+        return;
+    }
+
+    int method = http_request_method(request);
+    if (method >= HTTP_METHOD_COUNT || !table[method]) {
+        create_error_response(HTTP_METHOD_NOT_ALLOWED, response);
+        response->allow = methods;
+        return;
+    }
+
+    table[method]->handler(table[method], conn, request, response);
+}
+
+void router_cleanup(void) {
+    for (int h = 0; h < router.host_count; h++) {
+        node_destroy(router.hosts[h].routes);
+        router.hosts[h].routes = NULL;
+    }
+    router.host_count = 0;
+    router.route_count = 0;
+}
@@ -1,195 +1,933 @@
 #include "server.h"
-#include <asm-generic/socket.h>
-#include <climits>
 #include <netinet/in.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
+#include <sys/wait.h>
 #include <unistd.h>
+#include <sched.h>
+
+// Hot restart hand-over: the listening sockets and a readiness pipe travel to the new process in its environment
+#define ENV_LISTEN_FDS "SIMPLEHTTP_LISTEN_FDS"
+#define ENV_READY_FD "SIMPLEHTTP_READY_FD"
 
 // Global server instance for signal handling
 server_t g_server = {0};
 
+static char executable[PATH_MAX];   // Resolved at startup: a deploy renames the new binary over this path
+static char **arguments;
+static int inherited_fds[2 * MAX_WORKERS];
+static int inherited_count;
+static int ready_fd = -1;
+
+static void server_signals(sigset_t *signals);
+static int allowed_cpus(int *cpus, int max_cpus);
+static void inherit_listeners(void);
+static int open_listener(int port, int backlog);
+static int create_listener(int port, int backlog);
+static void supervise(server_t *server);
+static int hot_restart(server_t *server);
+static void wake_workers(server_t *server);
+static void *worker_main(void *arg);
+static void run_event_loop(worker_t *worker);
+static void drain_worker(worker_t *worker);
+static void accept_connections(worker_t *worker, int listen_fd);
+static void expire_connections(worker_t *worker);
+static void resume_connection(connection_t *conn);
+
 int main(int argc, char *argv[])
 {
-    int port = DEFAULT_PORT;
+    // Signals are taken synchronously by the main thread (see supervise), so every thread blocks them
+    sigset_t signals;
+    server_signals(&signals);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    // A hot restart re-executes the same command line
+    arguments = argv;
+    ssize_t length = readlink("/proc/self/exe", executable, sizeof(executable) - 1);
+    if(length <= 0)
+    {
+        length = (ssize_t)strlen(argv[0]) < (ssize_t)sizeof(executable) ? (ssize_t)strlen(argv[0]) : 0;
+        memcpy(executable, argv[0], (size_t)length);
+    }
+    executable[length] = '\0';
 
     // Parse command line arguments
-    if(argc > 1){
-        port = atoi(argv[1]);
-        if(port <=0 || port >= 65535)
-        {
-            fprintf(stderr, "Invalid port number: %s\n", argv[1]);
-            return EXIT_FAILURE;
-        }
+    init_config(&g_config);
+    if(parse_config_args(&g_config, argc, argv) != 0)
+    {
+        fprintf(stderr, "Usage: %s [port] [--port N] [--tls-port N] [--tls-cert FILE] [--tls-key FILE] [--ktls on|off] [--workers N] [--max-requests N] [--max-connections N] [--max-body-size BYTES] [--rate-limit N] [--rate-limit-burst N] [--rate-limit-prefix BITS] [--backlog N] [--cache-size BYTES] [--cache-max-entry BYTES] [--bundle FILE] [--build-bundle FILE] [--gzip on|off] [--gzip-level N] [--gzip-min-length BYTES] [--max-age [TYPE=]SECONDS] [--log-console on|off] [--io epoll|uring] [--header-timeout SEC] [--body-timeout SEC] [--keepalive-timeout SEC] [--write-timeout SEC] [--proxy-timeout SEC] [--drain-timeout SEC] [--root DIR] [--vhost HOST=DIR] [--route [HOST]PATH=HANDLER[:ARG]] [--upstream NAME=ADDR[,ADDR...]] [--balance round-robin|least-conn] [--config FILE]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // Packing the document root is a build step: no logger, no listeners
+    if(g_config.build_bundle[0] != '\0')
+    {
+        return bundle_build(&g_config, g_config.build_bundle) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
     }
 
     // Initialize logger
     init_logger();
-    log_message(LOG_INFO, "Starting HTTP Server on Port %d", port);
+    log_message(LOG_INFO, "Starting HTTP Server on Port %d with %d workers", g_config.port, g_config.workers);
 
-    // Set up signal handlers
-    signal(SIGINT, signal_handler);
-    signal(SIGTERM, signal_handler);
+    // io_uring may be missing or disabled (old kernel, sysctl, seccomp); epoll always works
+    if(g_config.io_backend == IO_BACKEND_URING && !uring_available())
+    {
+        log_message(LOG_ERROR, "io_uring is not available, falling back to epoll");
+        g_config.io_backend = IO_BACKEND_EPOLL;
+    }
+
+    // Handshakes are driven by socket readiness, which the io_uring loop does not watch
+    if(g_config.io_backend == IO_BACKEND_URING && g_config.tls_port != 0)
+    {
+        log_message(LOG_ERROR, "TLS is served by the epoll loop, falling back to epoll");
+        g_config.io_backend = IO_BACKEND_EPOLL;
+    }
+
+    // Certificate and key are loaded once, before any worker accepts
+    if(tls_init(&g_config) != 0)
+    {
+        log_message(LOG_ERROR, "Invalid TLS configuration");
+        close_logger();
+        return EXIT_FAILURE;
+    }
+
+    // Upstream addresses are resolved once, before routes refer to them by name
+    if(proxy_init(&g_config) != 0 || router_init(&g_config) != 0)
+    {
+        log_message(LOG_ERROR, "Invalid routing configuration");
+        close_logger();
+        return EXIT_FAILURE;
+    }
+
+    // One token bucket table for every worker
+    if(ratelimit_init(&g_config) != 0)
+    {
+        log_message(LOG_ERROR, "Cannot allocate the rate limiter");
+        close_logger();
+        return EXIT_FAILURE;
+    }
+
+    // Static file cache (bounded, invalidated through inotify under every document root)
+    const char *roots[MAX_VHOSTS + 1];
+    int root_count = router_roots(roots, MAX_VHOSTS + 1);
+    init_file_cache(g_config.cache_size, g_config.cache_max_entry, roots, root_count);
+
+    // The prebuilt bundle is mapped once and shared by every worker
+    if(g_config.bundle[0] != '\0' && bundle_open(g_config.bundle, g_config.root) != 0)
+    {
+        log_message(LOG_ERROR, "Invalid asset bundle");
+        cleanup_file_cache();
+        close_logger();
+        return EXIT_FAILURE;
+    }
+
+    // Writes to vanished clients fail with EPIPE instead
+    signal(SIGPIPE, SIG_IGN);
 
     // Create and start server
-    if(create_server(port) != 0)
+    if(create_server(&g_config) != 0)
     {
         log_message(LOG_ERROR, "Failed to create server");
+        cleanup_server(&g_server);
         return EXIT_FAILURE;
     }
 
-    printf(COLOR_GREEN "HTTP Server started on port %d", COLOR_RESET, port);
-    printf(Press Ctrl+C to stop the server\n);
+    printf(COLOR_GREEN "HTTP Server started on port %d (%d workers, %s)\n" COLOR_RESET, g_config.port, g_server.worker_count,
+           g_config.io_backend == IO_BACKEND_URING ? "io_uring" : "epoll");
+    if(tls_enabled())
+    {
+        printf(COLOR_GREEN "TLS on port %d\n" COLOR_RESET, g_config.tls_port);
+    }
+    printf("Press Ctrl+C to stop the server\n");
 
     start_server(&g_server);
 
+    printf(COLOR_YELLOW "\nShutting down server ...\n" COLOR_RESET);
+    cleanup_server(&g_server);
+
     return EXIT_SUCCESS;
 }
 
-int create_server(int port)
+int create_server(const config_t *config)
+{
+    g_server.port = config->port;
+    g_server.address.sin_family = AF_INET;
+    g_server.address.sin_addr.s_addr = INADDR_ANY;
+    g_server.address.sin_port = htons(config->port);
+    g_server.running = TRUE;
+
+    g_server.workers = calloc(config->workers, sizeof(worker_t));
+    if(!g_server.workers)
+    {
+        perror("Worker allocation failed");
+        return -1;
+    }
+
+    // Listeners handed over by the process we replace are reused before new ones are opened
+    inherit_listeners();
+
+    // Workers are pinned round-robin over the CPUs the affinity mask allows (taskset, cpusets, containers)
+    int cpus[CPU_SETSIZE];
+    int cpu_count = allowed_cpus(cpus, CPU_SETSIZE);
+
+    // Every worker owns a SO_REUSEPORT listener, an epoll instance and a wake-up eventfd
+    for(int i = 0; i < config->workers; i++)
+    {
+        worker_t *worker = &g_server.workers[i];
+        worker->id = i;
+        worker->cpu = cpus[i % cpu_count];
+        worker->listen_fd = -1;
+        worker->tls_listen_fd = -1;
+        worker->epoll_fd = -1;
+        worker->wake_fd = -1;
+        g_server.worker_count++;
+
+        worker->listen_fd = open_listener(config->port, config->backlog);
+        if(worker->listen_fd < 0)
+        {
+            return -1;
+        }
+
+        worker->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        worker->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if(worker->epoll_fd == -1 || worker->wake_fd == -1)
+        {
+            perror("epoll/eventfd creation failed");
+            return -1;
+        }
+
+        struct epoll_event ev = {0};
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.ptr = &worker->listen_fd;
+        if(epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->listen_fd, &ev) < 0)
+        {
+            perror("epoll_ctl failed");
+            return -1;
+        }
+
+        // The TLS listener, when there is one, is watched the same way
+        if(config->tls_port != 0)
+        {
+            worker->tls_listen_fd = open_listener(config->tls_port, config->backlog);
+            if(worker->tls_listen_fd < 0)
+            {
+                return -1;
+            }
+            ev.data.ptr = &worker->tls_listen_fd;
+            if(epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->tls_listen_fd, &ev) < 0)
+            {
+                perror("epoll_ctl failed");
+                return -1;
+            }
+        }
+
+        ev.events = EPOLLIN;
+        ev.data.ptr = &worker->wake_fd;
+        if(epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->wake_fd, &ev) < 0)
+        {
+            perror("epoll_ctl failed");
+            return -1;
+        }
+    }
+
+    // Handed-over listeners the new configuration has no use for (fewer workers, another port)
+    for(int i = 0; i < inherited_count; i++)
+    {
+        if(inherited_fds[i] >= 0)
+        {
+            close(inherited_fds[i]);
+            inherited_fds[i] = -1;
+        }
+    }
+
+    log_message(LOG_INFO, "Server socket created and listening on port %d", config->port);
+    return 0;
+}
+
+// CPUs in this process's affinity mask, in order; all online ones when the mask cannot be read
+static int allowed_cpus(int *cpus, int max_cpus)
+{
+    cpu_set_t allowed;
+    int count = 0;
+
+    if(sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+    {
+        for(int cpu = 0; cpu < CPU_SETSIZE && count < max_cpus; cpu++)
+        {
+            if(CPU_ISSET(cpu, &allowed))
+            {
+                cpus[count++] = cpu;
+            }
+        }
+    }
+
+    if(count == 0)
+    {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        for(long cpu = 0; cpu < (online > 0 ? online : 1) && count < max_cpus; cpu++)
+        {
+            cpus[count++] = (int)cpu;
+        }
+    }
+    return count;
+}
+
+static void server_signals(sigset_t *signals)
+{
+    sigemptyset(signals);
+    sigaddset(signals, SIGINT);
+    sigaddset(signals, SIGTERM);
+    sigaddset(signals, SIGHUP);
+    sigaddset(signals, SIGUSR2);
+}
+
+// Pick up the listening sockets a previous process left us (see hot_restart)
+static void inherit_listeners(void)
+{
+    const char *list = getenv(ENV_LISTEN_FDS);
+    const char *ready = getenv(ENV_READY_FD);
+
+    while(list && *list != '\0' && inherited_count < (int)(sizeof(inherited_fds) / sizeof(inherited_fds[0])))
+    {
+        char *end;
+        long fd = strtol(list, &end, 10);
+        if(end == list || fd < 0 || fd > INT_MAX)
+        {
+            break;
+        }
+
+        // Only listening sockets are taken; anything else in the variable is left alone
+        int listening = 0;
+        socklen_t length = sizeof(listening);
+        if(getsockopt((int)fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &length) == 0 && listening)
+        {
+            fcntl((int)fd, F_SETFD, FD_CLOEXEC);
+            inherited_fds[inherited_count++] = (int)fd;
+        }
+        list = *end == ',' ? end + 1 : end;
+    }
+
+    // Only an open descriptor past stdio is written to; a stray value must not land on a log or a client
+    if(ready)
+    {
+        char *end;
+        long fd = strtol(ready, &end, 10);
+        if(end != ready && *end == '\0' && fd > 2 && fd <= INT_MAX && fcntl((int)fd, F_GETFD) != -1)
+        {
+            ready_fd = (int)fd;
+            fcntl(ready_fd, F_SETFD, FD_CLOEXEC);
+        }
+        else
+        {
+            log_message(LOG_ERROR, "Ignoring %s=%s: not an open descriptor", ENV_READY_FD, ready);
+        }
+    }
+    unsetenv(ENV_LISTEN_FDS);
+    unsetenv(ENV_READY_FD);
+
+    if(inherited_count > 0)
+    {
+        log_message(LOG_INFO, "Took over %d listening sockets", inherited_count);
+    }
+}
+
+// An inherited listener bound to the port if there is one, a new one otherwise
+static int open_listener(int port, int backlog)
+{
+    for(int i = 0; i < inherited_count; i++)
+    {
+        struct sockaddr_in address;
+        socklen_t length = sizeof(address);
+        int fd = inherited_fds[i];
+        if(fd >= 0 && getsockname(fd, (struct sockaddr*)&address, &length) == 0 &&
+           address.sin_family == AF_INET && ntohs(address.sin_port) == port)
+        {
+            inherited_fds[i] = -1;
+            listen(fd, backlog); // The new configuration's backlog applies to the old socket too
+            return fd;
+        }
+    }
+    return create_listener(port, backlog);
+}
+
+static int create_listener(int port, int backlog)
 {
     int opt = 1;
+    struct sockaddr_in address = {0};
 
-    // Create socket
-    g_server.server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if(g_server.server_fd = -1)
+    // Create non-blocking socket
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd == -1)
     {
         perror("Socket creation failed");
         return -1;
     }
 
-    // Set socket options
-    if(setsockopt(g_server.server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0)
+    // Set socket options; SO_REUSEPORT lets the kernel spread connections over workers
+    if(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0 ||
+       setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0)
     {
         perror("setsockopt failed");
-        close(g_server.server_fd);
+        close(fd);
         return -1;
     }
 
-    // Configure server address
-    g_server.address.sin_family = AF_INET;
-    g_server.address.sin_addr.s_addr = INADDR_ANY;
-    g_server.address.sin_port = htons(port);
-    g_server.port = port;
-    g_server.running = TRUE;
-
     // Bind socket
-    if(bind(g_server.server_fd, (struct sockaddr*) &g_server.address, sizeof(g_server.address)) < 0)
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(port);
+    if(bind(fd, (struct sockaddr*) &address, sizeof(address)) < 0)
         {
             perror("Bind failed");
-            close(g_server.server_fd);
+            close(fd);
             return -1;
         }
 
-    log_message(LOG_INFO, "Server socket created and listening on port %d", port);
-    return 0;
+    if(listen(fd, backlog) < 0)
+    {
+        perror("Listen failed");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
 }
 
 void start_server(server_t *server)
 {
-    int client_fd;
-    struct sockaddr_in client_addr;
-    socklen_t client_len = sizeof(client_addr);
+    // Launch one pinned thread per worker
+    for(int i = 0; i < server->worker_count; i++)
+    {
+        worker_t *worker = &server->workers[i];
+        __atomic_fetch_add(&server->workers_running, 1, __ATOMIC_RELEASE);
+        if(pthread_create(&worker->thread, NULL, worker_main, worker) != 0)
+        {
+            __atomic_fetch_sub(&server->workers_running, 1, __ATOMIC_RELEASE);
+            log_message(LOG_ERROR, "Failed to start worker %d", i);
+            server->worker_count = i;
+            stop_server(server);
+            break;
+        }
+
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        CPU_SET(worker->cpu, &cpuset);
+        if(pthread_setaffinity_np(worker->thread, sizeof(cpuset), &cpuset) != 0)
+        {
+            log_message(LOG_ERROR, "Failed to pin worker %d to CPU %d", i, worker->cpu);
+        }
+    }
+
+    // Taking over from an older process: it can stop accepting now
+    if(ready_fd >= 0)
+    {
+        char ready = 1;
+        if(write(ready_fd, &ready, 1) != 1)
+        {
+            log_message(LOG_ERROR, "Could not signal readiness to the previous process");
+        }
+        close(ready_fd);
+        ready_fd = -1;
+    }
+
+    supervise(server);
+
+    // Wait until every worker has observed the shutdown
+    for(int i = 0; i < server->worker_count; i++)
+    {
+        pthread_join(server->workers[i].thread, NULL);
+    }
+}
+
+// The main thread takes the signals one at a time, outside signal context, until the workers are done
+static void supervise(server_t *server)
+{
+    sigset_t signals;
+    server_signals(&signals);
+    uint64_t drain_deadline = 0;
 
     while(server->running)
     {
-        // Accept incoming connection
-        client_fd = accept(server->server_fd, (struct sockaddr*)&client_addr, &client_len);
+        struct timespec tick = { 0, TIMER_TICK_MS * 1000000L };
+        int sig = sigtimedwait(&signals, NULL, &tick);
 
-        if(client_fd < 0)
+        if(sig == SIGINT || sig == SIGTERM)
+        {
+            stop_server(server);
+        }
+        else if((sig == SIGHUP || sig == SIGUSR2) && !server->draining && hot_restart(server) == 0)
+        {
+            drain_deadline = timer_now() + (uint64_t)g_config.drain_timeout * 1000;
+            server->draining = TRUE;
+            wake_workers(server);
+        }
+
+        // Draining workers return once their last connection is gone; --drain-timeout 0 waits for that
+        if(__atomic_load_n(&server->workers_running, __ATOMIC_ACQUIRE) == 0 ||
+           (server->draining && g_config.drain_timeout > 0 && timer_now() >= drain_deadline))
+        {
+            stop_server(server);
+        }
+    }
+}
+
+/*
+ * Zero-downtime restart (SIGHUP or SIGUSR2): re-execute the binary with the
+ * listening sockets inherited, and once the new process reports that it
+ * serves them, stop accepting here and drain. The sockets never close, so
+ * clients see neither refused connections nor a gap; a new process that
+ * fails to start leaves this one serving as before.
+ */
+static int hot_restart(server_t *server)
+{
+    extern char **environ;
+    char fds[2 * MAX_WORKERS * 12 + sizeof(ENV_LISTEN_FDS) + 1];
+    char ready[sizeof(ENV_READY_FD) + 16];
+    int pipe_fds[2];
+
+    size_t length = (size_t)snprintf(fds, sizeof(fds), "%s=", ENV_LISTEN_FDS);
+    for(int i = 0; i < server->worker_count; i++)
+    {
+        const worker_t *worker = &server->workers[i];
+        length += (size_t)snprintf(fds + length, sizeof(fds) - length, "%s%d", i > 0 ? "," : "", worker->listen_fd);
+        if(worker->tls_listen_fd >= 0)
+        {
+            length += (size_t)snprintf(fds + length, sizeof(fds) - length, ",%d", worker->tls_listen_fd);
+        }
+    }
+
+    if(pipe2(pipe_fds, O_CLOEXEC) != 0)
+    {
+        log_message(LOG_ERROR, "Hot restart failed: %s", strerror(errno));
+        return -1;
+    }
+    snprintf(ready, sizeof(ready), "%s=%d", ENV_READY_FD, pipe_fds[1]);
+
+    // Everything is prepared up front: between fork and exec only async-signal-safe calls are allowed
+    size_t count = 0;
+    while(environ[count])
+    {
+        count++;
+    }
+    char **envp = malloc((count + 3) * sizeof(char*));
+    if(!envp)
+    {
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        return -1;
+    }
+    size_t n = 0;
+    for(size_t i = 0; i < count; i++)
+    {
+        if(strncmp(environ[i], ENV_LISTEN_FDS "=", sizeof(ENV_LISTEN_FDS)) != 0 &&
+           strncmp(environ[i], ENV_READY_FD "=", sizeof(ENV_READY_FD)) != 0)
+        {
+            envp[n++] = environ[i];
+        }
+    }
+    envp[n++] = fds;
+    envp[n++] = ready;
+    envp[n] = NULL;
+
+    pid_t pid = fork();
+    if(pid == 0)
+    {
+        // Only the listeners and the pipe's write end survive the exec
+        for(int i = 0; i < server->worker_count; i++)
+        {
+            fcntl(server->workers[i].listen_fd, F_SETFD, 0);
+            if(server->workers[i].tls_listen_fd >= 0)
             {
-                perror("Accept failed");
-                log_message(LOG_ERROR, "Failed to accept client connection");
+                fcntl(server->workers[i].tls_listen_fd, F_SETFD, 0);
             }
-        continue;
+        }
+        fcntl(pipe_fds[1], F_SETFD, 0);
+        execve(executable, arguments, envp);
+        _exit(127);
+    }
+    free(envp);
+    close(pipe_fds[1]);
+    if(pid < 0)
+    {
+        log_message(LOG_ERROR, "Hot restart failed: %s", strerror(errno));
+        close(pipe_fds[0]);
+        return -1;
     }
 
-    // Log client connection
-    char client_ip[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, INET_ADDRSTRLEN);
-    log_message(LOG_INFO, "New connection from %s:%d", client_ip, ntohs(client_addr.sin_port));
+    // The new process writes one byte once its workers run; exiting early closes the pipe instead
+    struct pollfd wait_ready = { pipe_fds[0], POLLIN, 0 };
+    char byte;
+    int started = poll(&wait_ready, 1, RESTART_READY_TIMEOUT * 1000) == 1 && read(pipe_fds[0], &byte, 1) == 1;
+    close(pipe_fds[0]);
+    if(!started)
+    {
+        log_message(LOG_ERROR, "New process %d did not start, still serving", (int)pid);
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return -1;
+    }
 
-    // handle client request
-    handle_client(client_fd);
+    log_message(LOG_INFO, "Listeners handed to process %d, draining for up to %ds", (int)pid, g_config.drain_timeout);
+    return 0;
+}
 
-    // close client socket
-    close(client_fd);
+static void *worker_main(void *arg)
+{
+    worker_t *worker = arg;
+
+    metrics_thread_init(worker->id);
+    timer_wheel_init(&worker->timers, timer_now());
+    worker->resume = resume_connection;
+
+    // A worker whose ring cannot be set up serves through epoll instead
+    if(g_config.io_backend != IO_BACKEND_URING || uring_run(worker) != 0)
+    {
+        if(g_config.io_backend == IO_BACKEND_URING)
+        {
+            log_message(LOG_ERROR, "Worker %d could not set up io_uring, using epoll", worker->id);
+        }
+        run_event_loop(worker);
+    }
+
+    // Release whatever connections were still open at shutdown
+    while(worker->connections)
+    {
+        connection_close(worker->connections);
+    }
+    proxy_thread_cleanup();
+    pool_thread_cleanup();
+
+    __atomic_fetch_sub(&g_server.workers_running, 1, __ATOMIC_RELEASE);
+    return NULL;
 }
 
-void handle_client(int client_fd)
+static void run_event_loop(worker_t *worker)
 {
-    char buffer[BUFFER_SIZE] = {0};
-    char response_buffer[BUFFER_SIZE * 2] = {0};
-    http_request_t request = {0};
-    http_response_t response = {0};
+    struct epoll_event events[MAX_EVENTS];
+    int draining = FALSE;
 
-    // Read request from client
-    ssize_t bytes_read = recv(client_fd, buffer, BUFFER_SIZE - 1, 0);
-    if(bytes_read <= 0)
+    while(g_server.running)
     {
-        log_message(LOG_ERROR, "Failed to read request from client");
-        return;
+        // Hot restart: new clients go to the new process, ours finish what they started
+        if(g_server.draining && !draining)
+        {
+            draining = TRUE;
+            drain_worker(worker);
+        }
+        if(draining && worker->connection_count == 0)
+        {
+            break;
+        }
+
+        // Upstream connections closed during the last batch can no longer be named by an event
+        proxy_collect();
+
+        // Sleep no longer than the nearest connection deadline
+        int n = epoll_wait(worker->epoll_fd, events, MAX_EVENTS, timer_wheel_timeout(&worker->timers, timer_now()));
+        if(n < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            perror("epoll_wait failed");
+            break;
+        }
+
+        for(int i = 0; i < n; i++)
+        {
+            // Listener readiness: accept everything that is queued
+            if(events[i].data.ptr == &worker->listen_fd || events[i].data.ptr == &worker->tls_listen_fd)
+            {
+                accept_connections(worker, *(int*)events[i].data.ptr);
+                continue;
+            }
+
+            // Shutdown wake-up; the loop condition does the rest
+            if(events[i].data.ptr == &worker->wake_fd)
+            {
+                uint64_t value;
+                while(read(worker->wake_fd, &value, sizeof(value)) > 0)
+                {
+                }
+                continue;
+            }
+
+            // Upstream socket of a proxied exchange; it resumes the client that owns it
+            if((uintptr_t)events[i].data.ptr & EPOLL_TAG_UPSTREAM)
+            {
+                proxy_event((struct upstream_conn*)((uintptr_t)events[i].data.ptr & ~EPOLL_TAG_UPSTREAM),
+                            events[i].events);
+                continue;
+            }
+
+            connection_t *conn = events[i].data.ptr;
+
+            if(events[i].events & EPOLLERR)
+            {
+                conn->state = CONN_CLOSING;
+            }
+            else if(conn->state == CONN_WRITING || (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)))
+            {
+                // Resume reading, parsing or a partially written response
+                connection_process(conn);
+            }
+
+            if(conn->state == CONN_CLOSING)
+            {
+                connection_close(conn);
+            }
+            else
+            {
+                connection_schedule(conn, conn->state == CONN_WRITING);
+            }
+        }
+
+        expire_connections(worker);
     }
+}
 
-    buffer[bytes_read] = '\0';
+// Stop accepting (the listeners live on in the new process) and wind down every open connection
+static void drain_worker(worker_t *worker)
+{
+    epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, worker->listen_fd, NULL);
+    if(worker->tls_listen_fd >= 0)
+    {
+        epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, worker->tls_listen_fd, NULL);
+    }
 
-    // Parse HTTP request
-    if(parse_http_request(buffer, &request) != 0)
+    // Idle keep-alive connections close now, busy ones after the response in progress
+    connection_t *conn = worker->connections;
+    while(conn)
     {
-        log_message(LOG_ERROR, "Failed to parse HTTP request");
-        create_error_response(HTTP_BAD_REQUEST, &response);
+        connection_t *next = conn->next;
+        resume_connection(conn);
+        conn = next;
+    }
+}
+
+// Drive a connection on behalf of something other than its own socket (its upstream, a timeout)
+static void resume_connection(connection_t *conn)
+{
+    connection_process(conn);
+    if(conn->state == CONN_CLOSING)
+    {
+        connection_close(conn);
     }
     else
     {
-        // Handle GET request
-        if(strcmp(request.method, "GET") == 0)
+        connection_schedule(conn, conn->state == CONN_WRITING);
+    }
+}
+
+// Close every connection whose deadline passed, in one batch per loop iteration
+static void expire_connections(worker_t *worker)
+{
+    timer_entry_t *expired = timer_expire(&worker->timers, timer_now());
+    while(expired)
+    {
+        timer_entry_t *timer = expired;
+        expired = expired->next;
+
+        connection_t *conn = connection_expired(timer);
+        if(conn)
         {
-            if(serve_static_file(request.path, &response) != 0)
+            connection_close(conn);
+        }
+    }
+}
+
+static void accept_connections(worker_t *worker, int listen_fd)
+{
+    struct sockaddr_in client_addr;
+    socklen_t client_len;
+    int tls = listen_fd == worker->tls_listen_fd;
+
+    for(;;)
+    {
+        client_len = sizeof(client_addr);
+        int client_fd = accept4(listen_fd, (struct sockaddr*)&client_addr, &client_len,
+                                SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(client_fd < 0)
+        {
+            if(errno == EINTR)
             {
-                create_error_response(HTTP_NOT_FOUND, &response);
+                continue;
+            }
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                perror("Accept failed");
+                log_message(LOG_ERROR, "Failed to accept client connection");
             }
+            return;
         }
-        else
+
+        // Over the limit: answered 503 and closed without reading the request
+        if(!connection_admit(worker, listen_fd, client_fd))
+        {
+            continue;
+        }
+
+        connection_t *conn = connection_create(worker, client_fd, &client_addr);
+        if(!conn)
+        {
+            log_message(LOG_ERROR, "Out of memory for new connection");
+            close(client_fd);
+            continue;
+        }
+        if(tls && tls_accept(conn) != 0)
+        {
+            log_message(LOG_ERROR, "Out of memory for new TLS session");
+            connection_close(conn);
+            continue;
+        }
+
+        // Edge-triggered registration for both directions, never modified afterwards
+        struct epoll_event ev = {0};
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = conn;
+        if(epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) < 0)
         {
-            create_error_response(HTTP_BAD_REQUEST, &response);
+            perror("epoll_ctl failed");
+            connection_close(conn);
+            continue;
         }
+
+        // Even a client that never sends a byte is on the clock
+        connection_schedule(conn, FALSE);
+
+        // Log client connection
+        log_message(LOG_INFO, "New connection from %s:%d", conn->client_ip, ntohs(client_addr.sin_port));
     }
+}
+
+void handle_client(connection_t *conn, const http_request_t *request, http_response_t *response)
+{
+    // Virtual host, path and method pick the handler
+    router_dispatch(conn, request, response);
+}
 
-    // Build and send response
-    build_http_response(&response, response_buffer, sizeof(response_buffer));
-    send(client_fd, response_buffer, strlen(response_buffer), 0);
+// "static": files under the virtual host's document root
+void handle_static(const route_t *route, connection_t *conn, const http_request_t *request, http_response_t *response)
+{
+    char path[MAX_PATH_LENGTH];
 
-    // Log the request
-    struct sockaddr_in client_addr;
-    socklen_t addr_len = sizeof(client_addr);
-    getpeername(client_fd, (struct sockaddr*)&client_addr, &addr_len);
-    char client_ip[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, INET_ADDRSTRLEN);
+    (void)conn;
+
+    // Directory requests map to their index page
+    size_t length = http_slice_copy(request, request->path, path, sizeof(path) - strlen("index.html"));
+    if(length > 0 && path[length - 1] == '/')
+    {
+        strcat(path, "index.html");
+    }
+
+    uint64_t started = metrics_now();
+    if(serve_static_file(route->root, path, request, response) != 0)
+    {
+        create_error_response(HTTP_NOT_FOUND, response);
+    }
+    metrics_observe(METRIC_LOOKUP, metrics_now() - started);
+}
 
-    log_request(request.method, request.path, response.status_code, client_ip);
+// "metrics": Prometheus exposition of the worker counters
+void handle_metrics(const route_t *route, connection_t *conn, const http_request_t *request, http_response_t *response)
+{
+    (void)route;
+    (void)conn;
+    (void)request;
 
-    free_response(&response);
+    if(metrics_render(response) != 0)
+    {
+        create_error_response(HTTP_INTERNAL_ERROR, response);
+    }
+}
+
+// "proxy:NAME": forwarded to a server of the named --upstream, which answers in its own time
+void handle_proxy(const route_t *route, connection_t *conn, const http_request_t *request, http_response_t *response)
+{
+    // Bodies are relayed by their Content-Length
+    if(request->chunked)
+    {
+        create_error_response(HTTP_LENGTH_REQUIRED, response);
+        return;
+    }
+    if(proxy_start(route, conn, request) != 0)
+    {
+        create_error_response(HTTP_BAD_GATEWAY, response);
+        return;
+    }
+    response->deferred = TRUE;
+}
+
+// "upload:DIR": PUT and POST bodies stored as files under DIR, answered once the body is in
+void handle_upload(const route_t *route, connection_t *conn, const http_request_t *request, http_response_t *response)
+{
+    int status = upload_start(route, conn, request);
+    if(status != 0)
+    {
+        create_error_response(status, response);
+        return;
+    }
+    response->deferred = TRUE;
 }
 
 void cleanup_server(server_t *server)
 {
-    if(server->server_fd > 0)
+    for(int i = 0; i < server->worker_count; i++)
     {
-        close(server->server_fd);
-        server->server_fd = 0;
+        worker_t *worker = &server->workers[i];
+        if(worker->wake_fd >= 0)
+        {
+            close(worker->wake_fd);
+        }
+        if(worker->epoll_fd >= 0)
+        {
+            close(worker->epoll_fd);
+        }
+        if(worker->listen_fd >= 0)
+        {
+            close(worker->listen_fd);
+        }
+        if(worker->tls_listen_fd >= 0)
+        {
+            close(worker->tls_listen_fd);
+        }
     }
 
+    free(server->workers);
+    server->workers = NULL;
+    server->worker_count = 0;
+
+    cleanup_file_cache();
+    bundle_close();
+    ratelimit_cleanup();
+    router_cleanup();
+    tls_cleanup();
+
     server->running = FALSE;
     log_message(LOG_INFO, "Server Shutdown Complete!");
     close_logger();
 }
 
-void signal_handler(int sig)
+void stop_server(server_t *server)
 {
-    printf(COLOR_YELLOW "\nRecieved signal %d, shutting down server ...\n", COLOR_RESET, sig);
-    g_server.running = FALSE;
-    cleanup_server(&g_server);
-    exit(EXIT_SUCCESS);
+    server->running = FALSE;
+    wake_workers(server);
+}
+
+// Interrupt every worker's wait so it looks at the running and draining flags
+static void wake_workers(server_t *server)
+{
+    for(int i = 0; i < server->worker_count; i++)
+    {
+        uint64_t one = 1;
+        if(write(server->workers[i].wake_fd, &one, sizeof(one)) < 0)
+        {
+            log_message(LOG_ERROR, "Failed to wake worker %d", i);
+        }
+    }
 }
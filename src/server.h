@@ -2,58 +2,610 @@
 #define SERVER_H
 
 #include "../include/common.h"
+#include <pthread.h>
+#include <sys/uio.h>
+
+// Socket I/O backends (--io)
+enum {
+    IO_BACKEND_EPOLL = 0,
+    IO_BACKEND_URING
+};
+
+// What a connection is waiting for, each with its own deadline
+enum {
+    TIMEOUT_NONE = 0,
+    TIMEOUT_HEADER,         /* Request head still incomplete */
+    TIMEOUT_BODY,           /* Head parsed, body still in flight */
+    TIMEOUT_IDLE,           /* Keep-alive connection between requests */
+    TIMEOUT_WRITE,          /* Response queued, socket not draining */
+    TIMEOUT_UPSTREAM,       /* Proxied exchange, neither side moving */
+    TIMEOUT_COUNT
+};
+
+// Upstream server selection (--balance)
+enum {
+    BALANCE_ROUND_ROBIN = 0,
+    BALANCE_LEAST_CONN
+};
+
+// Why a new client was turned away with a 503 before its request was read
+enum {
+    SHED_NONE = 0,
+    SHED_LIMIT,             /* --max-connections reached */
+    SHED_QUEUE,             /* Accept queue close to overflowing */
+    SHED_COUNT
+};
+
+// How a TLS handshake ended, for the metrics
+enum {
+    HANDSHAKE_FULL = 0,
+    HANDSHAKE_RESUMED,      /* Session ticket or cached session ID */
+    HANDSHAKE_FAILED,
+    HANDSHAKE_COUNT
+};
+
+// Runtime configuration (defaults from common.h, overridden by --key value)
+typedef struct {
+    int port;
+    int tls_port;           /* 0 = no TLS listener */
+    char tls_cert[MAX_ROOT_LENGTH];         /* PEM certificate chain */
+    char tls_key[MAX_ROOT_LENGTH];          /* PEM private key, empty = in the certificate file */
+    int ktls;               /* Hand record encryption to the kernel where it supports it */
+    int workers;
+    int max_requests;
+    int backlog;            /* listen() backlog per worker */
+    int max_connections;    /* Across all workers; clients beyond it get a 503 */
+    size_t max_body_size;   /* Largest request body taken, 0 = no limit; beyond it a 413 */
+    int rate_limit;         /* Requests per second per client address or prefix, 0 = unlimited */
+    int rate_limit_burst;   /* Requests a client may send at once, 0 = one second's worth */
+    int rate_limit_prefix;  /* Leading address bits that identify a client (32 = each address) */
+    size_t cache_size;
+    size_t cache_max_entry;
+    char bundle[MAX_ROOT_LENGTH];           /* Prebuilt asset bundle served for --root, empty = none */
+    char build_bundle[MAX_ROOT_LENGTH];     /* Pack --root into this bundle and exit */
+    int gzip;
+    int gzip_level;
+    size_t gzip_min_length;
+    int log_console;        /* Mirror log lines to stdout */
+    int io_backend;         /* IO_BACKEND_*, workers fall back to epoll without io_uring */
+    int timeouts[TIMEOUT_COUNT];            /* Seconds per TIMEOUT_* phase, 0 = none */
+    int drain_timeout;      /* Seconds an old process keeps serving after a hot restart */
+    char root[MAX_ROOT_LENGTH];             /* Document root for hosts without a --vhost */
+    int vhost_count;
+    struct {
+        char host[MAX_HOST_LENGTH];
+        char root[MAX_ROOT_LENGTH];
+    } vhosts[MAX_VHOSTS];
+    int route_count;
+    struct {
+        char host[MAX_HOST_LENGTH];         /* Empty = every host */
+        char path[MAX_PATH_LENGTH];         /* A trailing '/' mounts a prefix */
+        char handler[MAX_PATH_LENGTH];      /* NAME or NAME:ARG */
+    } routes[MAX_ROUTES];
+    int upstream_count;
+    struct {
+        char name[64];
+        int server_count;
+        char servers[MAX_UPSTREAM_SERVERS][MAX_ROOT_LENGTH];  /* "host:port" or "unix:/path" */
+    } upstreams[MAX_UPSTREAMS];
+    int balance;            /* BALANCE_* */
+    int max_age;            /* Cache-Control max-age when no rule matches, -1 = none */
+    int max_age_rule_count;
+    struct {
+        char type[64];      /* "text/html"; a trailing '*' matches a prefix */
+        int seconds;
+    } max_age_rules[MAX_AGE_RULES];
+} config_t;
+
+struct connection;
+struct uring_conn;
+struct upstream_conn;
+struct http2_conn;
+struct tls_conn;
+struct upload_conn;
+
+// Timer wheel entry, embedded in what it times out; unarmed while prev is NULL
+typedef struct timer_entry {
+    struct timer_entry *next;
+    struct timer_entry *prev;
+    uint64_t expires;       /* Tick the timer fires at */
+} timer_entry_t;
+
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 3
+
+// Hierarchical timer wheel: each level's slot spans a whole turn of the level below
+typedef struct {
+    timer_entry_t slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];  /* List heads */
+    uint64_t next_tick;     /* First tick not processed yet */
+    int count;
+} timer_wheel_t;
+
+// Accept queue of one listener as last sampled (see connection_admit)
+typedef struct {
+    unsigned depth;         /* Connections waiting to be accepted */
+    unsigned limit;         /* Effective backlog (after the somaxconn cap) */
+    uint64_t sampled_at;
+} listen_sample_t;
+
+// Worker: one pinned thread with its own listener and event loop
+typedef struct {
+    int id;
+    int cpu;
+    int listen_fd;
+    int tls_listen_fd;      /* -1 without --tls-port */
+    int epoll_fd;
+    int wake_fd;
+    pthread_t thread;
+    struct connection *connections;
+    int connection_count;
+    timer_wheel_t timers;   /* Connection deadlines */
+    listen_sample_t listen_samples[2];      /* Cleartext listener, TLS listener */
+    void (*resume)(struct connection *conn);  /* Event loop's way to drive a connection from outside its own events */
+} worker_t;
 
 // Server Structure
 typedef struct {
-    int server_fd;
     int port;
     struct sockaddr_in address;
-    int running;
+    volatile sig_atomic_t running;
+    volatile sig_atomic_t draining;     /* Listeners handed to a new process; finish what is open, then exit */
+    worker_t *workers;
+    int worker_count;
+    int workers_running;    /* Worker threads that have not returned yet, updated atomically */
+    int active_connections; /* Open connections across workers, updated atomically */
 } server_t;
 
-// HTTP request structure
+// Request methods the router dispatches on
+enum {
+    HTTP_METHOD_GET = 0,
+    HTTP_METHOD_HEAD,
+    HTTP_METHOD_POST,
+    HTTP_METHOD_PUT,
+    HTTP_METHOD_DELETE,
+    HTTP_METHOD_OPTIONS,
+    HTTP_METHOD_PATCH,
+    HTTP_METHOD_COUNT
+};
+
+// View into the buffer a request was parsed from: no bytes are copied
+typedef struct {
+    uint32_t offset;
+    uint32_t length;
+} http_slice_t;
+
+typedef struct {
+    http_slice_t name;
+    http_slice_t value;
+} http_header_t;
+
+// Results of parse_http_request()
+#define HTTP_PARSE_OK 0
+#define HTTP_PARSE_INCOMPLETE 1
+#define HTTP_PARSE_ERROR -1
+
+// Results of tls_handshake()
+#define TLS_HANDSHAKE_DONE 1
+#define TLS_HANDSHAKE_READ 0        /* Waiting for the client */
+#define TLS_HANDSHAKE_WRITE 2       /* Waiting for room in the socket */
+#define TLS_HANDSHAKE_ERROR -1
+
+// HTTP request structure (incremental parser state plus views into buf)
 typedef struct {
-    char method[16];
-    char path[MAX_PATH_LENGTH];
-    char version[16];
-    char headers[MAX_HEADERS_SIZE];
-    char body[BUFFER_SIZE];
-    int content_length;
+    const char *buf;
+    int parse_state;
+    uint32_t line_start;
+    uint32_t scan_offset;
+    size_t header_length;
+    http_slice_t method;
+    http_slice_t path;
+    http_slice_t query;
+    int version_major;
+    int version_minor;
+    http_header_t headers[MAX_HEADER_COUNT];
+    int header_count;
+    long content_length;
+    int keep_alive;
+    int chunked;            /* Transfer-Encoding: chunked, length unknown until the last chunk */
+    int expect_continue;    /* Expect: 100-continue, until the 100 has been sent */
 } http_request_t;
 
+// Content codings, in server preference order
+enum {
+    ENCODING_IDENTITY = 0,
+    ENCODING_GZIP,
+    ENCODING_DEFLATE,
+    ENCODING_COUNT
+};
+
+// Static file cache entry (opaque, reference counted)
+typedef struct cache_entry cache_entry_t;
+
+typedef struct {
+    int entries;
+    size_t bytes;
+    size_t capacity;
+    unsigned long evictions;
+    unsigned long invalidations;
+} file_cache_stats_t;
+
+// Rate limiter counters, process-wide
+typedef struct {
+    unsigned long limited;  /* Requests answered 429 */
+    unsigned long overflows;/* Requests let through because the table had no slot for their client */
+} ratelimit_stats_t;
+
+// One satisfiable byte range of a representation
+typedef struct {
+    off_t start;
+    size_t length;
+} http_range_t;
+
+// Chunked transfer coding: where a decoder stands in the framing
+enum {
+    CHUNK_SIZE = 0,
+    CHUNK_EXTENSION,        /* Rest of the size line */
+    CHUNK_DATA,
+    CHUNK_DATA_END,         /* CRLF after the data */
+    CHUNK_TRAILER,          /* Start of a trailer line; an empty one ends the body */
+    CHUNK_TRAILER_LINE,
+    CHUNK_DONE
+};
+
+// Chunked body decoder; all zero is the start of a body
+typedef struct {
+    int state;              /* CHUNK_* */
+    int digits;             /* Hex digits of the size line so far */
+    uint64_t remaining;     /* Chunk size as it is read, then data bytes left of the chunk */
+    size_t framing;         /* Bytes of the current size line's extension, or of the trailers so far */
+} http_chunked_t;
+
+// Validators of one static representation
+typedef struct {
+    time_t last_modified;
+    char etag[64];          /* Quoted strong entity tag, empty when there is none */
+} http_validators_t;
+
 // HTTP response structure
 typedef struct {
     int status_code;
     char content_type[128];
-    char *body;
+    const char *body;      /* Generated body, allocated from the request arena */
     size_t body_length;
+    int file_fd;
+    off_t file_offset;
+    cache_entry_t *cache_entry;
+    int content_encoding;
+    int vary_encoding;
+    http_validators_t validators;
+    int max_age;           /* -1 = no Cache-Control */
+    int accept_ranges;
+    size_t total_length;   /* Whole representation, for Content-Range */
+    int range_count;       /* 0 = whole body, 1 = single part, >1 = multipart/byteranges */
+    http_range_t ranges[MAX_RANGES];
+    unsigned allow;        /* HTTP_METHOD_* bits for the Allow header of a 405 */
+    int retry_after;       /* Seconds for a Retry-After header, 0 = none */
+    int keep_alive;
+    int deferred;          /* The handler answers later on its own (proxy); nothing to queue now */
+    const char *error_root;/* Document root custom error pages come from, NULL = --root */
 } http_response_t;
 
+// Output queue entry: a range of the connection's out_buf, of shared memory or of an open file
+typedef enum {
+    OUT_CHUNK_BUFFER,
+    OUT_CHUNK_MEMORY,
+    OUT_CHUNK_FILE
+} out_chunk_type_t;
+
+typedef struct {
+    out_chunk_type_t type;
+    int fd;
+    const char *data;
+    off_t offset;
+    size_t length;
+    void (*release)(void *ctx);
+    void *ctx;
+} out_chunk_t;
+
+// Working state of a busy connection; pooled and detached while it sits idle
+typedef struct {
+    http_request_t request;
+    out_chunk_t out_queue[OUT_QUEUE_SIZE];
+} connection_work_t;
+
+// Connection states
+typedef enum {
+    CONN_READING,
+    CONN_WRITING,
+    CONN_CLOSING
+} conn_state_t;
+
+// Per-connection state, owned by the event loop of one worker
+typedef struct connection {
+    int fd;
+    conn_state_t state;
+    worker_t *worker;
+    struct connection *prev;
+    struct connection *next;
+    char client_ip[INET_ADDRSTRLEN];
+    uint32_t client_addr;       /* Network byte order, 0 = unknown */
+    connection_work_t *work;    /* NULL while idle */
+    char *in_buf;               /* Grows up to BUFFER_SIZE */
+    size_t in_len;
+    size_t in_cap;
+    char *out_buf;
+    size_t out_len;
+    size_t out_cap;
+    int out_head;
+    int out_count;
+    int requests_served;
+    int close_after_write;
+    int peer_closed;
+    timer_entry_t timer;        /* Deadline of the current phase */
+    int deadline;               /* TIMEOUT_* the timer is armed for */
+    int deadline_requests;      /* requests_served when it was armed */
+    uint64_t bytes_sent;        /* Handed to the kernel over the connection's lifetime */
+    uint64_t bytes_delivered;   /* Acknowledged by the peer when last checked */
+    struct uring_conn *uring;   /* io_uring backend state, NULL under epoll */
+    struct upstream_conn *proxy; /* Proxied exchange that owns the connection, NULL otherwise */
+    struct http2_conn *h2;      /* HTTP/2 session once the connection switched to it, NULL for HTTP/1.x */
+    struct tls_conn *tls;       /* TLS session of a connection from the TLS listener, NULL for cleartext */
+    struct upload_conn *upload; /* Upload that owns the connection until its body is stored, NULL otherwise */
+} connection_t;
+
+#define HPACK_MAX_ENTRIES (HPACK_TABLE_SIZE / 32)
+
+// HPACK dynamic table entry: name and value back to back in one pooled copy
+typedef struct {
+    char *field;
+    uint32_t name_length;
+    uint32_t value_length;
+} hpack_entry_t;
+
+// HPACK dynamic table of one direction of an HTTP/2 connection
+typedef struct {
+    hpack_entry_t entries[HPACK_MAX_ENTRIES];  /* Ring, entries[first] is the newest */
+    int first;
+    int count;
+    size_t size;            /* RFC 7541 size: name and value lengths plus 32 per entry */
+    size_t max_size;        /* Current limit, lowered or raised by size updates */
+    size_t limit;           /* Most max_size may become (the SETTINGS_HEADER_TABLE_SIZE in force) */
+} hpack_table_t;
+
+// Route: a handler mounted on a path of one virtual host
+typedef struct route route_t;
+typedef void (*route_handler_t)(const route_t *route, connection_t *conn, const http_request_t *request,
+                                http_response_t *response);
+struct route {
+    route_handler_t handler;
+    const char *arg;        /* Text after "NAME:" in the route spec, NULL without one */
+    const char *root;       /* Document root of the virtual host */
+    const void *target;     /* Resolved from arg at startup (a proxy route's upstream) */
+    size_t mount_length;    /* Length of the path the route is mounted on */
+    int streams_body;       /* Handler takes the request once its head is in and relays the body itself */
+};
+
 // Function prototypes - server.c
-int create_server(int port);
+int create_server(const config_t *config);
 void start_server(server_t *server);
-void handle_client(int client_fd);
+void handle_client(connection_t *conn, const http_request_t *request, http_response_t *response);
+void handle_static(const route_t *route, connection_t *conn, const http_request_t *request, http_response_t *response);
+void handle_metrics(const route_t *route, connection_t *conn, const http_request_t *request, http_response_t *response);
+void handle_proxy(const route_t *route, connection_t *conn, const http_request_t *request, http_response_t *response);
+void handle_upload(const route_t *route, connection_t *conn, const http_request_t *request, http_response_t *response);
+void stop_server(server_t *server);
 void cleanup_server(server_t *server);
-void signal_handler(int sig);
+
+// Function prototypes - config.c
+void init_config(config_t *config);
+int config_set(config_t *config, const char *key, const char *value);
+int config_load(config_t *config, const char *path);
+int parse_config_args(config_t *config, int argc, char *argv[]);
+int config_max_age(const config_t *config, const char *content_type);
+
+// Function prototypes - connection.c
+int connection_admit(worker_t *worker, int listen_fd, int fd);
+connection_t* connection_create(worker_t *worker, int fd, const struct sockaddr_in *client_addr);
+char* connection_input(connection_t *conn, size_t *space);
+int connection_read(connection_t *conn);
+char* connection_reserve(connection_t *conn, size_t length);
+int connection_commit(connection_t *conn, size_t length);
+int connection_append(connection_t *conn, const char *data, size_t length);
+int connection_append_memory(connection_t *conn, const char *data, size_t length,
+                             void (*release)(void *ctx), void *ctx);
+int connection_append_file(connection_t *conn, int fd, off_t offset, size_t length);
+int connection_append_shared_file(connection_t *conn, int fd, off_t offset, size_t length,
+                                  void (*release)(void *ctx), void *ctx);
+int connection_gather(const connection_t *conn, struct iovec *iov, int max_iov);
+void connection_advance(connection_t *conn, size_t bytes);
+int connection_flush(connection_t *conn);
+int connection_respond(connection_t *conn, http_response_t *response);
+int connection_continue(connection_t *conn);
+int connection_handle_input(connection_t *conn);
+void connection_idle(connection_t *conn);
+int connection_drained(const connection_t *conn);
+void connection_schedule(connection_t *conn, int writing);
+connection_t* connection_expired(timer_entry_t *timer);
+void connection_process(connection_t *conn);
+void connection_close(connection_t *conn);
 
 /* Function prototypes - http_parser.c */
-int parse_http_request(const char *raw_request, http_request_t *request);
-void build_http_response(http_response_t *response, char *output_buffer, size_t buffer_size);
+void http_request_init(http_request_t *request);
+int parse_http_request(const char *buf, size_t length, http_request_t *request);
+int http_slice_equals(const http_request_t *request, http_slice_t slice, const char *literal);
+size_t http_slice_copy(const http_request_t *request, http_slice_t slice, char *out, size_t out_size);
+const char* http_request_header(const http_request_t *request, const char *name, size_t *value_length);
+int http_request_method(const http_request_t *request);
+int http_has_token(const char *value, size_t length, const char *token);
+const char* http_method_name(int method);
+int http_parser_set_scanner(const char *name);
+const char* http_parser_scanner(void);
+void http_response_init(http_response_t *response);
+int http_parse_date(const char *value, size_t length, time_t *out);
+size_t http_format_date(time_t t, char *buf, size_t size);
+int http_etag_matches(const char *list, size_t length, const char *etag);
+int http_parse_range(const char *value, size_t length, size_t total, http_range_t *ranges, int max_ranges);
+int http_chunked_scan(http_chunked_t *chunked, const char *data, size_t length, size_t *used);
+void http_chunked_consume(http_chunked_t *chunked, size_t length);
+size_t build_representation_headers(const http_response_t *response, char *buf, size_t size);
+size_t build_http_response(const http_response_t *response, char *output_buffer, size_t buffer_size);
+size_t build_range_part_header(const http_response_t *response, int index, char *buf, size_t size);
+size_t build_multipart_trailer(char *buf, size_t size);
 void create_error_response(int status_code, http_response_t *response);
 void free_response(http_response_t *response);
 
 // Function prototypes - file_handler.c
-int serve_static_file(const char *path, http_response_t *response);
-int file_exists(const char *path);
+int serve_static_file(const char *root, const char *path, const http_request_t *request, http_response_t *response);
 const char* get_content_type(const char *path);
-char* read_file(const char *path ,size_t *file_size);
+
+// Function prototypes - file_cache.c
+int init_file_cache(size_t capacity, size_t max_entry, const char *const *roots, int root_count);
+cache_entry_t* file_cache_lookup(const char *path);
+unsigned long file_cache_generation(void);
+cache_entry_t* file_cache_store(const char *key, char *data, size_t size, const char *headers,
+                                size_t headers_length, const http_validators_t *validators,
+                                unsigned long generation);
+cache_entry_t* file_cache_fill(const char *key, int fd, size_t size, const char *headers,
+                               size_t headers_length, const http_validators_t *validators);
+cache_entry_t* file_cache_wrap(const char *key, const char *data, size_t size, const char *headers,
+                               size_t headers_length, const http_validators_t *validators);
+void file_cache_retain(cache_entry_t *entry);
+const http_validators_t* file_cache_validators(const cache_entry_t *entry);
+const char* file_cache_data(const cache_entry_t *entry, size_t *size);
+const char* file_cache_headers(const cache_entry_t *entry, size_t *length);
+void file_cache_release(void *ctx);
+void file_cache_invalidate(const char *path);
+void file_cache_stats(file_cache_stats_t *stats);
+void cleanup_file_cache(void);
+
+// Function prototypes - bundle.c
+int bundle_build(const config_t *config, const char *output);
+int bundle_open(const char *path, const char *root);
+int bundle_find(const char *root, const char *path);
+const char* bundle_content_type(int asset);
+int bundle_has(int asset, int encoding);
+void bundle_validators(int asset, int encoding, http_validators_t *validators);
+cache_entry_t* bundle_entry(int asset, int encoding);
+cache_entry_t* bundle_publish(int asset, int encoding, const char *headers, size_t headers_length);
+void bundle_close(void);
+
+// Function prototypes - ratelimit.c
+int ratelimit_init(const config_t *config);
+int ratelimit_allow(uint32_t addr);
+void ratelimit_stats(ratelimit_stats_t *stats);
+void ratelimit_cleanup(void);
+
+// Function prototypes - compression.c
+const char* encoding_name(int encoding);
+int is_compressible_type(const char *content_type);
+int negotiate_encoding(const http_request_t *request);
+int compress_buffer(int encoding, int level, const char *input, size_t input_length,
+                    char **output, size_t *output_length);
+
+// Function prototypes - router.c
+int router_init(const config_t *config);
+int router_roots(const char **roots, int max_roots);
+void router_dispatch(connection_t *conn, const http_request_t *request, http_response_t *response);
+int router_streams_body(const http_request_t *request);
+void router_cleanup(void);
+
+// Function prototypes - proxy.c
+#define EPOLL_TAG_UPSTREAM ((uintptr_t)1)   /* Low bit of epoll data.ptr: an upstream socket, not a client */
+int proxy_init(const config_t *config);
+const void* proxy_upstream(const char *name);
+int proxy_start(const route_t *route, connection_t *conn, const http_request_t *request);
+void proxy_pump(connection_t *conn);
+void proxy_event(struct upstream_conn *up, uint32_t events);
+int proxy_timeout(connection_t *conn);
+void proxy_abort(connection_t *conn);
+void proxy_collect(void);
+void proxy_thread_cleanup(void);
+
+// Function prototypes - upload.c
+int upload_start(const route_t *route, connection_t *conn, const http_request_t *request);
+void upload_pump(connection_t *conn);
+void upload_abort(connection_t *conn);
+
+// Function prototypes - http2.c
+int http2_preface(const char *data, size_t length);
+int http2_start(connection_t *conn);
+int http2_upgrade(connection_t *conn, const http_request_t *request);
+int http2_handle_input(connection_t *conn);
+int http2_blocked(const connection_t *conn);
+void http2_close(connection_t *conn);
+
+// Function prototypes - hpack.c
+void hpack_table_init(hpack_table_t *table, size_t limit);
+void hpack_table_resize(hpack_table_t *table, size_t max_size);
+void hpack_table_free(hpack_table_t *table);
+int hpack_decode(hpack_table_t *table, const uint8_t *block, size_t length, char *out, size_t out_size,
+                 http_header_t *fields, int max_fields);
+size_t hpack_encode_size_update(size_t max_size, uint8_t *out, size_t size);
+size_t hpack_encode(hpack_table_t *table, const char *name, size_t name_length, const char *value,
+                    size_t value_length, int indexing, uint8_t *out, size_t size);
+
+// Function prototypes - tls.c
+int tls_init(const config_t *config);
+int tls_enabled(void);
+int tls_accept(connection_t *conn);
+int tls_handshake(connection_t *conn);
+int tls_offloaded(const connection_t *conn);
+ssize_t tls_recv(connection_t *conn, void *buf, size_t length);
+ssize_t tls_send(connection_t *conn, const void *buf, size_t length);
+void tls_close(connection_t *conn);
+void tls_cleanup(void);
+
+// Function prototypes - timer.c
+uint64_t timer_now(void);
+void timer_wheel_init(timer_wheel_t *wheel, uint64_t now_ms);
+void timer_arm(timer_wheel_t *wheel, timer_entry_t *timer, uint64_t now_ms, unsigned timeout_ms);
+void timer_cancel(timer_wheel_t *wheel, timer_entry_t *timer);
+int timer_wheel_timeout(const timer_wheel_t *wheel, uint64_t now_ms);
+timer_entry_t* timer_expire(timer_wheel_t *wheel, uint64_t now_ms);
+
+// Function prototypes - pool.c
+void* pool_alloc(size_t size);
+void pool_free(void *ptr, size_t size);
+size_t pool_capacity(size_t size);
+void* arena_alloc(size_t size);
+void arena_reset(void);
+void pool_thread_cleanup(void);
+
+// Function prototypes - uring.c
+int uring_available(void);
+int uring_run(worker_t *worker);
+
+// Function prototypes - metrics.c
+enum {
+    METRIC_PARSE,
+    METRIC_LOOKUP,
+    METRIC_TOTAL,
+    METRIC_HISTOGRAM_COUNT
+};
+void metrics_thread_init(int worker_id);
+uint64_t metrics_now(void);
+void metrics_observe(int histogram, uint64_t ns);
+void metrics_count_request(const http_request_t *request, int status_code);
+void metrics_count_response(int method, int status_code);
+void metrics_add_bytes(size_t bytes);
+void metrics_connection_opened(void);
+void metrics_connection_closed(void);
+void metrics_count_timeout(int deadline);
+void metrics_count_shed(int reason);
+void metrics_listen_queue(int tls, unsigned depth);
+void metrics_count_handshake(int outcome, int offloaded);
+void metrics_count_cache_lookup(int hit);
+int metrics_render(http_response_t *response);
 
 // Function prototypes logger.c
 void init_logger(void);
 void log_message(int level, const char *format, ...);
 void log_request(const char *method, const char *path, int status_code, const char *client_ip);
+unsigned long log_dropped(void);
 void close_logger(void);
 
-// Global server_t g_server;
+extern server_t g_server;
+extern config_t g_config;
 
 #endif
@@ -0,0 +1,170 @@
+#include "server.h"
+
+/*
+ * Hierarchical timer wheel for connection deadlines.
+ *
+ * Three levels of TIMER_WHEEL_SLOTS slots. Level 0 holds timers due within
+ * one turn (64 ticks of TIMER_TICK_MS), one slot per tick; each slot of
+ * level 1 spans a whole level 0 turn, and each slot of level 2 a whole
+ * level 1 turn. When level 0 wraps, the next level 1 slot is cascaded down
+ * (and level 2 likewise when level 1 wraps), so every timer is moved at
+ * most twice before it fires.
+ *
+ * Arming and cancelling are O(1) list operations on an entry embedded in
+ * the connection; nothing is allocated. Each worker owns its wheel, so
+ * there is no locking either.
+ */
+
+#define LEVEL_MASK (TIMER_WHEEL_SLOTS - 1)
+#define MAX_TICKS (((uint64_t)1 << (TIMER_WHEEL_LEVELS * TIMER_WHEEL_BITS)) - 1)
+
+/* Monotonic milliseconds; the coarse clock is plenty for deadlines and costs no syscall */
+uint64_t timer_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static void list_init(timer_entry_t *head) {
+    head->next = head;
+    head->prev = head;
+}
+
+static void list_add(timer_entry_t *head, timer_entry_t *timer) {
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+static void list_unlink(timer_entry_t *timer) {
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = NULL;
+    timer->prev = NULL;
+}
+
+void timer_wheel_init(timer_wheel_t *wheel, uint64_t now_ms) {
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        for (int slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+            list_init(&wheel->slots[level][slot]);
+        }
+    }
+    wheel->next_tick = now_ms / TIMER_TICK_MS;
+    wheel->count = 0;
+}
+
+/* File a timer under the level whose span covers its distance from next_tick */
+static void wheel_insert(timer_wheel_t *wheel, timer_entry_t *timer) {
+    uint64_t delta = timer->expires - wheel->next_tick;
+    int level;
+
+    if (timer->expires < wheel->next_tick) {
+        timer->expires = wheel->next_tick; /* Already due: fire on the next tick processed */
+        level = 0;
+    } else if (delta < TIMER_WHEEL_SLOTS) {
+        level = 0;
+    } else if (delta < (uint64_t)TIMER_WHEEL_SLOTS * TIMER_WHEEL_SLOTS) {
+        level = 1;
+    } else {
+        if (delta > MAX_TICKS) {
+            timer->expires = wheel->next_tick + MAX_TICKS;
+        }
+        level = 2;
+    }
+
+    int slot = (int)((timer->expires >> (level * TIMER_WHEEL_BITS)) & LEVEL_MASK);
+    list_add(&wheel->slots[level][slot], timer);
+}
+
+void timer_arm(timer_wheel_t *wheel, timer_entry_t *timer, uint64_t now_ms, unsigned timeout_ms) {
+    if (timer->prev) {
+        list_unlink(timer);
+        wheel->count--;
+    }
+
+    /* Round up, so a deadline never fires early */
+    timer->expires = (now_ms + timeout_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    wheel_insert(wheel, timer);
+    wheel->count++;
+}
+
+void timer_cancel(timer_wheel_t *wheel, timer_entry_t *timer) {
+    if (timer->prev) {
+        list_unlink(timer);
+        wheel->count--;
+    }
+}
+
+/* Re-file every timer of one upper level slot; returns the slot index */
+static int cascade(timer_wheel_t *wheel, int level) {
+    int slot = (int)((wheel->next_tick >> (level * TIMER_WHEEL_BITS)) & LEVEL_MASK);
+    timer_entry_t *head = &wheel->slots[level][slot];
+
+    while (head->next != head) {
+        timer_entry_t *timer = head->next;
+        list_unlink(timer);
+        wheel_insert(wheel, timer);
+    }
+    return slot;
+}
+
+/* Milliseconds until the next occupied tick (or the next cascade), -1 when nothing is armed */
+int timer_wheel_timeout(const timer_wheel_t *wheel, uint64_t now_ms) {
+    if (wheel->count == 0) {
+        return -1;
+    }
+
+    uint64_t tick = wheel->next_tick;
+    for (int i = 0; i < TIMER_WHEEL_SLOTS; i++, tick++) {
+        const timer_entry_t *head = &wheel->slots[0][tick & LEVEL_MASK];
+        if (head->next != head || (i > 0 && (tick & LEVEL_MASK) == 0)) {
+            break;
+        }
+    }
+
+    uint64_t due_ms = tick * TIMER_TICK_MS;
+    return due_ms > now_ms ? (int)(due_ms - now_ms) : 0;
+}
+
+/*
+ * Advance the wheel to now and unlink everything that fell due. The expired
+ * timers come back as one list chained through next (prev is NULL, so they
+ * count as unarmed); the caller handles the whole batch.
+ */
+timer_entry_t* timer_expire(timer_wheel_t *wheel, uint64_t now_ms) {
+    uint64_t now_tick = now_ms / TIMER_TICK_MS;
+    timer_entry_t *expired = NULL;
+    timer_entry_t **tail = &expired;
+
+    if (wheel->count == 0) {
+        if (now_tick >= wheel->next_tick) {
+            wheel->next_tick = now_tick + 1;
+        }
+        return NULL;
+    }
+
+    while (wheel->next_tick <= now_tick && wheel->count > 0) {
+        int slot = (int)(wheel->next_tick & LEVEL_MASK);
+        if (slot == 0) {
+            for (int level = 1; level < TIMER_WHEEL_LEVELS && cascade(wheel, level) == 0; level++) {
+            }
+        }
+
+        timer_entry_t *head = &wheel->slots[0][slot];
+        while (head->next != head) {
+            timer_entry_t *timer = head->next;
+            list_unlink(timer);
+            wheel->count--;
+            *tail = timer;
+            tail = &timer->next;
+        }
+        wheel->next_tick++;
+    }
+
+    /* Nothing left to cascade for: jump straight to the present */
+    if (wheel->count == 0 && now_tick >= wheel->next_tick) {
+        wheel->next_tick = now_tick + 1;
+    }
+    return expired;
+}
@@ -0,0 +1,220 @@
+#include "server.h"
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+/*
+ * TLS termination (--tls-port).
+ *
+ * One SSL_CTX serves every worker: OpenSSL locks its session cache
+ * internally, and TLS 1.3 tickets are stateless, so resumption works no
+ * matter which worker a returning client lands on. Handshakes run on the
+ * non-blocking socket from connection_process() until they complete; the
+ * connection is a plain HTTP connection from then on.
+ *
+ * With kTLS (--ktls, on by default) OpenSSL hands the session keys to the
+ * kernel once the handshake is done, and the kernel frames and encrypts
+ * every record. The output queue then goes out exactly as on a cleartext
+ * connection -- sendmsg() for headers and memory, sendfile() for files --
+ * so static files still never pass through userspace. Where the kernel or
+ * the negotiated cipher does not support it, connection_flush() encrypts
+ * through SSL_write() instead, one record at a time.
+ */
+
+struct tls_conn {
+    SSL *ssl;
+    int established;        /* Handshake complete */
+    int offloaded;          /* The kernel encrypts what is written to the socket */
+    int failed;             /* Fatal error: no close_notify on the way out */
+};
+
+static SSL_CTX *tls_ctx;
+
+/* ALPN: HTTP/2 first, so clients that speak it open with its preface (see connection_handle_input) */
+static const unsigned char alpn_protocols[] = "\x02h2\x08http/1.1";
+
+static int select_alpn(SSL *ssl, const unsigned char **out, unsigned char *out_length,
+                       const unsigned char *in, unsigned int in_length, void *arg) {
+    (void)ssl;
+    (void)arg;
+
+    if (SSL_select_next_proto((unsigned char **)out, out_length, alpn_protocols, sizeof(alpn_protocols) - 1,
+                              in, in_length) != OPENSSL_NPN_NEGOTIATED) {
+        return SSL_TLSEXT_ERR_NOACK; /* No overlap: carry on without ALPN, as HTTP/1.1 */
+    }
+    return SSL_TLSEXT_ERR_OK;
+}
+
+static void log_tls_error(const char *what) {
+    char reason[256];
+    unsigned long error = ERR_get_error();
+    ERR_error_string_n(error, reason, sizeof(reason));
+    log_message(LOG_ERROR, "%s: %s", what, error ? reason : "unknown error");
+    ERR_clear_error();
+}
+
+int tls_init(const config_t *config) {
+    if (!config || config->tls_port == 0) {
+        return 0;
+    }
+    if (config->tls_cert[0] == '\0') {
+        log_message(LOG_ERROR, "--tls-port needs --tls-cert");
+        return -1;
+    }
+
+    tls_ctx = SSL_CTX_new(TLS_server_method());
+    if (!tls_ctx) {
+        log_tls_error("Cannot create TLS context");
+        return -1;
+    }
+
+    /* The key may sit in the certificate file */
+    const char *key = config->tls_key[0] != '\0' ? config->tls_key : config->tls_cert;
+    if (SSL_CTX_use_certificate_chain_file(tls_ctx, config->tls_cert) != 1 ||
+        SSL_CTX_use_PrivateKey_file(tls_ctx, key, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(tls_ctx) != 1) {
+        log_tls_error("Cannot load TLS certificate or key");
+        tls_cleanup();
+        return -1;
+    }
+
+    SSL_CTX_set_min_proto_version(tls_ctx, TLS1_2_VERSION);
+    SSL_CTX_set_options(tls_ctx, SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE);
+#ifdef SSL_OP_ENABLE_KTLS
+    if (config->ktls) {
+        SSL_CTX_set_options(tls_ctx, SSL_OP_ENABLE_KTLS);
+    }
+#endif
+
+    /* Writes may come back short and are retried from wherever the queue head then is */
+    SSL_CTX_set_mode(tls_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+                              SSL_MODE_RELEASE_BUFFERS);
+
+    /* Resumption: tickets for clients that take them, the session cache for TLS 1.2 ones that do not */
+    SSL_CTX_set_session_cache_mode(tls_ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_set_session_id_context(tls_ctx, (const unsigned char *)SERVER_NAME, strlen(SERVER_NAME));
+    SSL_CTX_sess_set_cache_size(tls_ctx, TLS_SESSION_CACHE_SIZE);
+    SSL_CTX_set_timeout(tls_ctx, TLS_SESSION_TIMEOUT);
+    SSL_CTX_set_num_tickets(tls_ctx, 1);
+
+    SSL_CTX_set_alpn_select_cb(tls_ctx, select_alpn, NULL);
+
+    log_message(LOG_INFO, "TLS enabled on port %d (kTLS %s)", config->tls_port, config->ktls ? "on" : "off");
+    return 0;
+}
+
+int tls_enabled(void) {
+    return tls_ctx != NULL;
+}
+
+/* Start the server side of a handshake on a freshly accepted socket */
+int tls_accept(connection_t *conn) {
+    struct tls_conn *tls = pool_alloc(sizeof(struct tls_conn));
+    if (!tls) {
+        return -1;
+    }
+
+    memset(tls, 0, sizeof(struct tls_conn));
+    tls->ssl = SSL_new(tls_ctx);
+    if (!tls->ssl || SSL_set_fd(tls->ssl, conn->fd) != 1) {
+        SSL_free(tls->ssl);
+        pool_free(tls, sizeof(struct tls_conn));
+        ERR_clear_error();
+        return -1;
+    }
+    SSL_set_accept_state(tls->ssl);
+    conn->tls = tls;
+    return 0;
+}
+
+/* Drive the handshake as far as the socket allows; TLS_HANDSHAKE_* */
+int tls_handshake(connection_t *conn) {
+    struct tls_conn *tls = conn->tls;
+    if (tls->established) {
+        return TLS_HANDSHAKE_DONE;
+    }
+
+    int rc = SSL_do_handshake(tls->ssl);
+    if (rc == 1) {
+        tls->established = TRUE;
+#ifdef SSL_OP_ENABLE_KTLS
+        tls->offloaded = BIO_get_ktls_send(SSL_get_wbio(tls->ssl)) > 0;
+#endif
+        metrics_count_handshake(SSL_session_reused(tls->ssl) ? HANDSHAKE_RESUMED : HANDSHAKE_FULL,
+                                tls->offloaded);
+        return TLS_HANDSHAKE_DONE;
+    }
+
+    switch (SSL_get_error(tls->ssl, rc)) {
+        case SSL_ERROR_WANT_READ:
+            return TLS_HANDSHAKE_READ;
+        case SSL_ERROR_WANT_WRITE:
+            return TLS_HANDSHAKE_WRITE;
+        default:
+            /* Scanners and clients that distrust the certificate end up here; counted, not logged */
+            tls->failed = TRUE;
+            ERR_clear_error();
+            metrics_count_handshake(HANDSHAKE_FAILED, FALSE);
+            return TLS_HANDSHAKE_ERROR;
+    }
+}
+
+int tls_offloaded(const connection_t *conn) {
+    return conn->tls->offloaded;
+}
+
+/* Map an SSL_read/SSL_write failure onto what recv()/send() would report */
+static ssize_t tls_failure(struct tls_conn *tls, int rc) {
+    switch (SSL_get_error(tls->ssl, rc)) {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            errno = EAGAIN;
+            return -1;
+        case SSL_ERROR_ZERO_RETURN:
+            return 0; /* close_notify */
+        default:
+            /* Reset, EOF without close_notify or a bad record: the connection is done either way */
+            tls->failed = TRUE;
+            ERR_clear_error();
+            errno = EIO;
+            return -1;
+    }
+}
+
+/* recv() for a TLS connection: decrypted application data, 0 at the end of the stream */
+ssize_t tls_recv(connection_t *conn, void *buf, size_t length) {
+    size_t received = 0;
+    if (SSL_read_ex(conn->tls->ssl, buf, length, &received) == 1) {
+        return (ssize_t)received;
+    }
+    return tls_failure(conn->tls, 0);
+}
+
+/* send() for a TLS connection not offloaded to the kernel: encrypts and writes one record */
+ssize_t tls_send(connection_t *conn, const void *buf, size_t length) {
+    size_t written = 0;
+    if (SSL_write_ex(conn->tls->ssl, buf, length, &written) == 1) {
+        return (ssize_t)written;
+    }
+    return tls_failure(conn->tls, 0);
+}
+
+void tls_close(connection_t *conn) {
+    struct tls_conn *tls = conn->tls;
+    if (!tls) {
+        return;
+    }
+
+    /* Best effort close_notify; the socket is closed right after either way */
+    if (tls->established && !tls->failed) {
+        SSL_shutdown(tls->ssl);
+    }
+    SSL_free(tls->ssl);
+    ERR_clear_error();
+    pool_free(tls, sizeof(struct tls_conn));
+    conn->tls = NULL;
+}
+
+void tls_cleanup(void) {
+    SSL_CTX_free(tls_ctx);
+    tls_ctx = NULL;
+}
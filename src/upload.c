@@ -0,0 +1,402 @@
+#include "server.h"
+
+/*
+ * Uploads ("upload:DIR" routes).
+ *
+ * PUT and POST store the request body as a file under DIR, named by the
+ * rest of the request path after the route's mount point. The body goes to
+ * a temporary file next to its target and is renamed over it once complete,
+ * so readers never see half an upload and a failed one leaves nothing
+ * behind.
+ *
+ * Whatever arrived together with the request head is in in_buf already and
+ * is written out from there. The rest moves with splice(), from the socket
+ * into a pipe and from the pipe into the file: it never passes through
+ * userspace, and a multi-gigabyte upload takes one pipe's worth of kernel
+ * memory. Chunked framing is peeked at with MSG_PEEK and then consumed
+ * byte-exact, so only the chunk-size lines are copied out while the chunk
+ * data is spliced like a Content-Length body.
+ *
+ * TLS connections (the kernel only encrypts for us, it does not decrypt)
+ * and io_uring workers (whose receives land in provided buffers) take the
+ * body through in_buf instead and write() it.
+ *
+ * Like a proxied exchange, an upload owns its connection until the body is
+ * in: connection_process() hands it every event instead of reading the
+ * socket itself.
+ */
+
+#define FRAMING_PEEK 128    /* Most read ahead of a chunk-size line at once */
+
+struct upload_conn {
+    int fd;                     /* Temporary file */
+    int pipe_fds[2];            /* -1 when the body comes through in_buf */
+    size_t pipe_size;
+    uint64_t remaining;         /* Content-Length bytes left */
+    uint64_t stored;            /* Body bytes written so far */
+    int chunked;
+    http_chunked_t chunk;       /* Framing of a chunked body; chunk data itself is never scanned */
+    int created;                /* The target did not exist */
+    int status;                 /* Answer when the upload fails, 0 = nobody left to answer */
+    int method;
+    char method_name[16];
+    char path[MAX_PATH_LENGTH];
+    char target[MAX_FILE_PATH];
+    char temp[MAX_FILE_PATH];   /* Empty once renamed over the target */
+    const char *error_root;     /* The virtual host's root, for its error pages */
+    uint64_t started;
+};
+
+static void release(struct upload_conn *up) {
+    if (up->temp[0] != '\0') {
+        unlink(up->temp);
+    }
+    if (up->fd >= 0) {
+        close(up->fd);
+    }
+    if (up->pipe_fds[0] >= 0) {
+        close(up->pipe_fds[0]);
+        close(up->pipe_fds[1]);
+    }
+    pool_free(up, sizeof(struct upload_conn));
+}
+
+/* Splicing needs the plain socket; anything else leaves the pipe unopened */
+static void open_pipe(struct upload_conn *up, const connection_t *conn) {
+    up->pipe_fds[0] = up->pipe_fds[1] = -1;
+    if (conn->tls || conn->uring || pipe2(up->pipe_fds, O_CLOEXEC) != 0) {
+        up->pipe_fds[0] = up->pipe_fds[1] = -1;
+        return;
+    }
+
+    /* A larger pipe moves more per splice; the default is 64 KB */
+    int size = fcntl(up->pipe_fds[1], F_SETPIPE_SZ, UPLOAD_PIPE_SIZE);
+    if (size <= 0) {
+        size = fcntl(up->pipe_fds[1], F_GETPIPE_SZ);
+    }
+    up->pipe_size = size > 0 ? (size_t)size : 65536;
+}
+
+/* Target path and temporary file for an upload; returns 0 or the status to answer with */
+static int open_target(struct upload_conn *up, const route_t *route, const http_request_t *request) {
+    char path[MAX_PATH_LENGTH];
+    if (request->path.length >= sizeof(path)) {
+        return HTTP_NOT_FOUND;
+    }
+    size_t length = http_slice_copy(request, request->path, path, sizeof(path));
+
+    /* The file is named by what follows the mount point; a directory is not something to store */
+    const char *name = path + (route->mount_length < length ? route->mount_length : length);
+    if (*name == '\0' || path[length - 1] == '/' || strstr(name, "..") != NULL) {
+        return HTTP_NOT_FOUND;
+    }
+    int written = snprintf(up->target, sizeof(up->target), "%s/%s", route->arg, name);
+    if (written < 0 || (size_t)written >= sizeof(up->target)) {
+        return HTTP_NOT_FOUND;
+    }
+
+    struct stat st;
+    if (stat(up->target, &st) == 0) {
+        if (S_ISDIR(st.st_mode)) {
+            return HTTP_CONFLICT;
+        }
+    } else {
+        up->created = TRUE;
+    }
+
+    /* Same directory as the target, so the final rename() stays on one filesystem */
+    const char *slash = strrchr(up->target, '/');
+    written = snprintf(up->temp, sizeof(up->temp), "%.*s/.upload-XXXXXX", (int)(slash - up->target), up->target);
+    if (written < 0 || (size_t)written >= sizeof(up->temp)) {
+        up->temp[0] = '\0';
+        return HTTP_NOT_FOUND;
+    }
+    up->fd = mkostemp(up->temp, O_CLOEXEC);
+    if (up->fd < 0) {
+        int missing = errno == ENOENT || errno == ENOTDIR;
+        if (!missing) {
+            log_message(LOG_ERROR, "Cannot create upload file in %s: %s", up->target, strerror(errno));
+        }
+        up->temp[0] = '\0';
+        return missing ? HTTP_CONFLICT : HTTP_INTERNAL_ERROR;
+    }
+    fchmod(up->fd, 0644);
+
+    /* A known length is reserved up front, so the file is laid out in one piece */
+    if (!request->chunked && request->content_length > 0) {
+        fallocate(up->fd, FALLOC_FL_KEEP_SIZE, 0, (off_t)request->content_length);
+    }
+    return 0;
+}
+
+int upload_start(const route_t *route, connection_t *conn, const http_request_t *request) {
+    struct upload_conn *up = pool_alloc(sizeof(struct upload_conn));
+    if (!up) {
+        return HTTP_INTERNAL_ERROR;
+    }
+
+    memset(up, 0, sizeof(struct upload_conn));
+    up->fd = -1;
+    int status = open_target(up, route, request);
+    if (status != 0) {
+        up->pipe_fds[0] = -1;
+        release(up);
+        return status;
+    }
+    open_pipe(up, conn);
+
+    up->chunked = request->chunked;
+    up->remaining = request->chunked ? 0 : (uint64_t)request->content_length;
+    up->method = http_request_method(request);
+    up->started = metrics_now();
+    up->error_root = route->root;
+    http_slice_copy(request, request->method, up->method_name, sizeof(up->method_name));
+    http_slice_copy(request, request->path, up->path, sizeof(up->path));
+    conn->upload = up;
+
+    /* Everything that could refuse the body has been checked: the client may send it */
+    connection_continue(conn);
+    return 0;
+}
+
+static int body_complete(const struct upload_conn *up) {
+    return up->chunked ? up->chunk.state == CHUNK_DONE : up->remaining == 0;
+}
+
+/* Body bytes that may be stored before the next framing: the rest of the chunk, or of the Content-Length */
+static uint64_t body_left(const struct upload_conn *up) {
+    return up->chunked ? up->chunk.remaining : up->remaining;
+}
+
+static void body_stored(struct upload_conn *up, size_t length) {
+    if (up->chunked) {
+        http_chunked_consume(&up->chunk, length);
+    } else {
+        up->remaining -= length;
+    }
+    up->stored += length;
+}
+
+/* Parse framing up to the start of the next chunk's data; returns the bytes used, -1 on bad framing */
+static ssize_t scan_framing(struct upload_conn *up, const char *data, size_t length) {
+    size_t used;
+    int status = http_chunked_scan(&up->chunk, data, length, &used);
+    if (status != 0) {
+        up->status = status;
+        return -1;
+    }
+
+    /* A chunk's size is known before its data: refuse it then, not once the file is full */
+    if (up->chunk.state == CHUNK_DATA && g_config.max_body_size > 0 &&
+        up->stored + up->chunk.remaining > g_config.max_body_size) {
+        up->status = HTTP_CONTENT_TOO_LARGE;
+        return -1;
+    }
+    return (ssize_t)used;
+}
+
+static int write_all(int fd, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t n = write(fd, data, length);
+        if (n > 0) {
+            data += n;
+            length -= (size_t)n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        return -1;
+    }
+    return 0;
+}
+
+/* Store body bytes that are in userspace already; returns how many belonged to the body, -1 on failure */
+static ssize_t store_buffered(struct upload_conn *up, const char *data, size_t length) {
+    size_t i = 0;
+
+    while (i < length && !body_complete(up)) {
+        if (up->chunked && up->chunk.state != CHUNK_DATA) {
+            ssize_t n = scan_framing(up, data + i, length - i);
+            if (n < 0) {
+                return -1;
+            }
+            i += (size_t)n;
+            continue;
+        }
+
+        size_t n = length - i < body_left(up) ? length - i : (size_t)body_left(up);
+        if (write_all(up->fd, data + i, n) != 0) {
+            log_message(LOG_ERROR, "Upload to %s failed: %s", up->target, strerror(errno));
+            up->status = HTTP_INTERNAL_ERROR;
+            return -1;
+        }
+        body_stored(up, n);
+        i += n;
+    }
+    return (ssize_t)i;
+}
+
+/* Move what the pipe holds into the file */
+static int drain_pipe(struct upload_conn *up, size_t length) {
+    while (length > 0) {
+        ssize_t n = splice(up->pipe_fds[0], NULL, up->fd, NULL, length, SPLICE_F_MOVE);
+        if (n > 0) {
+            length -= (size_t)n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        log_message(LOG_ERROR, "Upload to %s failed: %s", up->target, n < 0 ? strerror(errno) : "short write");
+        up->status = HTTP_INTERNAL_ERROR;
+        return -1;
+    }
+    return 0;
+}
+
+/* A chunk-size line or trailer: peeked at, parsed, then consumed exactly, so chunk data stays in the socket */
+static int read_framing(struct upload_conn *up, connection_t *conn) {
+    char framing[FRAMING_PEEK];
+
+    ssize_t n = recv(conn->fd, framing, sizeof(framing), MSG_PEEK);
+    if (n <= 0) {
+        if (n < 0 && errno == EINTR) {
+            return 1;
+        }
+        return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    }
+
+    ssize_t used = scan_framing(up, framing, (size_t)n);
+    if (used < 0) {
+        return -1;
+    }
+    return recv(conn->fd, framing, (size_t)used, 0) == used ? 1 : -1;
+}
+
+/* Body straight from the socket to the file; 1 once it is all stored, 0 to wait, -1 on failure */
+static int splice_body(struct upload_conn *up, connection_t *conn) {
+    while (!body_complete(up)) {
+        if (up->chunked && up->chunk.state != CHUNK_DATA) {
+            int rc = read_framing(up, conn);
+            if (rc <= 0) {
+                return rc;
+            }
+            continue;
+        }
+
+        size_t want = body_left(up) < up->pipe_size ? (size_t)body_left(up) : up->pipe_size;
+        ssize_t n = splice(conn->fd, NULL, up->pipe_fds[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0) {
+            if (drain_pipe(up, (size_t)n) != 0) {
+                return -1;
+            }
+            body_stored(up, (size_t)n);
+            continue;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    }
+    return 1;
+}
+
+/* Take in as much of the body as has arrived; 1 once it is all stored, 0 to wait, -1 on failure */
+static int receive_body(struct upload_conn *up, connection_t *conn) {
+    for (;;) {
+        /* What came in with the head, or everything when there is no splicing */
+        if (conn->in_len > 0) {
+            ssize_t used = store_buffered(up, conn->in_buf, conn->in_len);
+            if (used < 0) {
+                return -1;
+            }
+            memmove(conn->in_buf, conn->in_buf + used, conn->in_len - (size_t)used);
+            conn->in_len -= (size_t)used;
+            conn->in_buf[conn->in_len] = '\0';
+        }
+        if (body_complete(up)) {
+            return 1;
+        }
+
+        if (up->pipe_fds[0] >= 0) {
+            return splice_body(up, conn);
+        }
+        if (conn->uring) {
+            return 0; /* io_uring workers receive on their own and refill in_buf */
+        }
+        if (conn->peer_closed) {
+            return -1;
+        }
+        if (connection_read(conn) != 0) {
+            conn->peer_closed = TRUE;
+        }
+        if (conn->in_len == 0 && !conn->peer_closed) {
+            return 0;
+        }
+    }
+}
+
+/* Put the finished file in place; returns the status to answer with */
+static int commit(struct upload_conn *up) {
+    if (rename(up->temp, up->target) != 0) {
+        log_message(LOG_ERROR, "Cannot store upload as %s: %s", up->target, strerror(errno));
+        return HTTP_INTERNAL_ERROR;
+    }
+    up->temp[0] = '\0';
+
+    /* The watcher would notice too, but a client reading its upload back must not race it */
+    file_cache_invalidate(up->target);
+    return up->created ? HTTP_CREATED : HTTP_NO_CONTENT;
+}
+
+/* Answer, log and let go of the connection */
+static void upload_done(connection_t *conn, int status) {
+    struct upload_conn *up = conn->upload;
+    http_response_t response;
+
+    if (status > 0) {
+        http_response_init(&response);
+        response.error_root = up->error_root;
+        if (status == HTTP_CREATED || status == HTTP_NO_CONTENT) {
+            response.status_code = status;
+        } else {
+            create_error_response(status, &response);
+        }
+        connection_respond(conn, &response);
+        free_response(&response);
+        arena_reset();
+    } else {
+        status = HTTP_BAD_REQUEST; /* The client left halfway through its body */
+    }
+
+    log_request(up->method_name, up->path, status, conn->client_ip);
+    metrics_count_response(up->method, status);
+    metrics_observe(METRIC_TOTAL, metrics_now() - up->started);
+    conn->upload = NULL;
+    release(up);
+}
+
+void upload_pump(connection_t *conn) {
+    struct upload_conn *up = conn->upload;
+    if (!up) {
+        return;
+    }
+
+    int rc = receive_body(up, conn);
+    if (rc > 0) {
+        upload_done(conn, commit(up));
+    } else if (rc < 0) {
+        conn->close_after_write = TRUE; /* Whatever is left of the body is still on its way */
+        upload_done(conn, up->status);
+    }
+}
+
+void upload_abort(connection_t *conn) {
+    struct upload_conn *up = conn->upload;
+    if (!up) {
+        return;
+    }
+    conn->upload = NULL;
+    release(up);
+}
@@ -0,0 +1,923 @@
+#include "server.h"
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/*
+ * io_uring backend (--io uring).
+ *
+ * Runs the same connection code as the epoll loop -- connection_handle_input()
+ * and the output queue -- but replaces the per-event syscalls with one
+ * io_uring_enter() per batch of completions:
+ *
+ *   - one multishot accept on the worker's listener,
+ *   - one multishot recv per connection, landing in a ring of provided
+ *     buffers that is recycled as soon as the bytes are copied to in_buf,
+ *   - responses as a linked chain: a sendmsg of the queued headers and
+ *     memory chunks, then a splice of the next file chunk into a
+ *     per-connection pipe and from the pipe into the socket,
+ *   - one multishot poll on the worker's epoll instance, which holds only
+ *     the upstream sockets of proxied exchanges; they are few, and the
+ *     proxy drives them with plain non-blocking calls under either backend.
+ *
+ * The ring is driven through the raw system calls, so there is no liburing
+ * dependency. Kernels without these features (before 6.0) keep using epoll.
+ */
+
+#define URING_ENTRIES 1024
+#define URING_CQ_ENTRIES 4096
+#define URING_BUFFERS 128               /* Provided receive buffers per worker, power of two */
+#define URING_BUFFER_SIZE 8192
+#define URING_BUFFER_GROUP 0
+#define URING_PIPE_SIZE (256 * 1024)
+#define URING_BACKLOG_LIMIT (64 * 1024) /* Unparsed input beyond in_buf before recv pauses */
+
+/* user_data is the connection pointer with the operation in the low bits */
+enum {
+    OP_ACCEPT = 0,
+    OP_WAKE,
+    OP_CANCEL,
+    OP_RECV,
+    OP_SEND,
+    OP_SPLICE_IN,
+    OP_SPLICE_OUT,
+    OP_POLL,
+    OP_EPOLL
+};
+#define OP_MASK 15  /* Pool objects are at least 16-byte aligned */
+
+struct uring_conn {
+    struct msghdr msg;
+    struct iovec iov[OUT_QUEUE_SIZE];
+    int pipe_fds[2];
+    size_t pipe_size;
+    size_t pipe_bytes;      /* Spliced in from a file, not on the wire yet */
+    int sends;              /* Send side operations in flight */
+    int recv_armed;
+    int recv_paused;
+    int want_poll;
+    int failed;
+    int closing;
+    char *backlog;          /* Received bytes that did not fit in in_buf yet */
+    size_t backlog_len;
+    size_t backlog_cap;
+};
+
+typedef struct {
+    int fd;
+    worker_t *worker;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_local_tail;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    void *rings;
+    size_t rings_size;
+    size_t sqes_size;
+    struct io_uring_buf_ring *buf_ring;
+    size_t buf_ring_size;
+    char *buffers;
+    unsigned short buf_tail;
+    uint64_t wake_value;
+} uring_t;
+
+static void uring_progress(uring_t *ring, connection_t *conn);
+
+/* The worker's ring, for connections resumed from outside a completion (see uring_resume) */
+static __thread uring_t *worker_ring;
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags,
+                              const void *arg, size_t arg_size) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static uint64_t tag(connection_t *conn, int op) {
+    return (uint64_t)(uintptr_t)conn | (uint64_t)op;
+}
+
+/* Every opcode the backend issues; SEND_ZC stands in for multishot recv, both arrived in 6.0 */
+static int uring_probe(int fd) {
+    static const int required[] = {
+        IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SENDMSG, IORING_OP_SPLICE,
+        IORING_OP_POLL_ADD, IORING_OP_ASYNC_CANCEL, IORING_OP_READ, IORING_OP_SEND_ZC,
+    };
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    int supported = probe && sys_io_uring_register(fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+
+    for (size_t i = 0; supported && i < sizeof(required) / sizeof(required[0]); i++) {
+        supported = required[i] <= probe->last_op &&
+                    (probe->ops[required[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    return supported;
+}
+
+int uring_available(void) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    int fd = sys_io_uring_setup(8, &params);
+    if (fd < 0) {
+        return FALSE; /* ENOSYS on old kernels, EPERM when disabled by sysctl or seccomp */
+    }
+    int supported = uring_probe(fd);
+    close(fd);
+    return supported;
+}
+
+static void recycle_buffer(uring_t *ring, unsigned bid) {
+    struct io_uring_buf *buf = &ring->buf_ring->bufs[ring->buf_tail & (URING_BUFFERS - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(ring->buffers + (size_t)bid * URING_BUFFER_SIZE);
+    buf->len = URING_BUFFER_SIZE;
+    buf->bid = (unsigned short)bid;
+    ring->buf_tail++;
+    __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+static void uring_destroy(uring_t *ring) {
+    if (ring->fd >= 0) {
+        close(ring->fd);
+        ring->fd = -1;
+    }
+    if (ring->rings) {
+        munmap(ring->rings, ring->rings_size);
+    }
+    if (ring->sqes) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->buf_ring) {
+        munmap(ring->buf_ring, ring->buf_ring_size);
+    }
+    free(ring->buffers);
+}
+
+static int uring_setup(uring_t *ring) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+    params.cq_entries = URING_CQ_ENTRIES;
+
+    ring->fd = sys_io_uring_setup(URING_ENTRIES, &params);
+    if (ring->fd < 0 || !(params.features & IORING_FEAT_SINGLE_MMAP) ||
+        !(params.features & IORING_FEAT_NODROP) || !uring_probe(ring->fd)) {
+        return -1;
+    }
+
+    /* Submission and completion rings share one mapping */
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->rings_size = sq_size > cq_size ? sq_size : cq_size;
+    ring->rings = mmap(NULL, ring->rings_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ring->fd, IORING_OFF_SQ_RING);
+    if (ring->rings == MAP_FAILED) {
+        ring->rings = NULL;
+        return -1;
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        return -1;
+    }
+
+    char *base = ring->rings;
+    ring->sq_head = (unsigned *)(base + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(base + params.sq_off.tail);
+    ring->sq_mask = *(unsigned *)(base + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->sq_local_tail = *ring->sq_tail;
+    ring->cq_head = (unsigned *)(base + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(base + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(base + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(base + params.cq_off.cqes);
+
+    /* SQE slots are used in order, so the indirection array is the identity */
+    unsigned *array = (unsigned *)(base + params.sq_off.array);
+    for (unsigned i = 0; i < params.sq_entries; i++) {
+        array[i] = i;
+    }
+
+    /* Provided buffer ring: the kernel picks a buffer when data arrives, not when recv is armed */
+    ring->buf_ring_size = URING_BUFFERS * sizeof(struct io_uring_buf);
+    ring->buf_ring = mmap(NULL, ring->buf_ring_size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->buf_ring == MAP_FAILED) {
+        ring->buf_ring = NULL;
+        return -1;
+    }
+    ring->buffers = malloc((size_t)URING_BUFFERS * URING_BUFFER_SIZE);
+    if (!ring->buffers) {
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ring->buf_ring;
+    reg.ring_entries = URING_BUFFERS;
+    reg.bgid = URING_BUFFER_GROUP;
+    if (sys_io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+        return -1;
+    }
+    for (unsigned bid = 0; bid < URING_BUFFERS; bid++) {
+        recycle_buffer(ring, bid);
+    }
+    return 0;
+}
+
+/* Publish queued SQEs and optionally wait for a completion */
+static int uring_enter(uring_t *ring, unsigned min_complete) {
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+    unsigned to_submit = ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (to_submit == 0 && min_complete == 0) {
+        return 0;
+    }
+    return sys_io_uring_enter(ring->fd, to_submit, min_complete, min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+/* Submit and wait for a completion, but no longer than timeout_ms (-1 = no limit) */
+static int uring_wait(uring_t *ring, int timeout_ms) {
+    if (timeout_ms < 0) {
+        return uring_enter(ring, 1);
+    }
+
+    struct __kernel_timespec ts = { timeout_ms / 1000, (long long)(timeout_ms % 1000) * 1000000 };
+    struct io_uring_getevents_arg arg = {0};
+    arg.ts = (uint64_t)(uintptr_t)&ts;
+
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+    unsigned to_submit = ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    return sys_io_uring_enter(ring->fd, to_submit, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                              &arg, sizeof(arg));
+}
+
+/* Make room for count SQEs so a linked chain is never split across two submissions */
+static int uring_reserve(uring_t *ring, unsigned count) {
+    if (ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) + count <= ring->sq_entries) {
+        return 0;
+    }
+    uring_enter(ring, 0);
+    return ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) + count <= ring->sq_entries
+               ? 0 : -1;
+}
+
+static struct io_uring_sqe *uring_sqe(uring_t *ring) {
+    if (uring_reserve(ring, 1) != 0) {
+        return NULL;
+    }
+    struct io_uring_sqe *sqe = &ring->sqes[ring->sq_local_tail & ring->sq_mask];
+    ring->sq_local_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+static int arm_accept(uring_t *ring) {
+    struct io_uring_sqe *sqe = uring_sqe(ring);
+    if (!sqe) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = ring->worker->listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = tag(NULL, OP_ACCEPT);
+    return 0;
+}
+
+static int arm_wake(uring_t *ring) {
+    struct io_uring_sqe *sqe = uring_sqe(ring);
+    if (!sqe) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = ring->worker->wake_fd;
+    sqe->addr = (uint64_t)(uintptr_t)&ring->wake_value;
+    sqe->len = sizeof(ring->wake_value);
+    sqe->user_data = tag(NULL, OP_WAKE);
+    return 0;
+}
+
+/* Upstream sockets report through the worker's epoll set; one multishot poll watches all of them */
+static int arm_epoll(uring_t *ring) {
+    struct io_uring_sqe *sqe = uring_sqe(ring);
+    if (!sqe) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = ring->worker->epoll_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = tag(NULL, OP_EPOLL);
+    return 0;
+}
+
+static int arm_recv(uring_t *ring, connection_t *conn) {
+    struct io_uring_sqe *sqe = uring_sqe(ring);
+    if (!sqe) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->user_data = tag(conn, OP_RECV);
+    conn->uring->recv_armed = TRUE;
+    conn->uring->recv_paused = FALSE;
+    return 0;
+}
+
+/* Stop receiving from a client that pipelines far ahead of its responses */
+static void pause_recv(uring_t *ring, connection_t *conn) {
+    struct io_uring_sqe *sqe = uring_sqe(ring);
+    if (!sqe) {
+        return;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = tag(conn, OP_RECV);
+    sqe->user_data = tag(NULL, OP_CANCEL);
+    conn->uring->recv_paused = TRUE;
+}
+
+static int arm_poll(uring_t *ring, connection_t *conn) {
+    struct io_uring_sqe *sqe = uring_sqe(ring);
+    if (!sqe) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = conn->fd;
+    sqe->poll32_events = POLLOUT;
+    sqe->user_data = tag(conn, OP_POLL);
+    conn->uring->sends++;
+    return 0;
+}
+
+static void uring_conn_free(connection_t *conn) {
+    struct uring_conn *io = conn->uring;
+    if (!io) {
+        return;
+    }
+    if (io->pipe_fds[0] >= 0) {
+        close(io->pipe_fds[0]);
+        close(io->pipe_fds[1]);
+    }
+    free(io->backlog);
+    pool_free(io, sizeof(struct uring_conn));
+    conn->uring = NULL;
+}
+
+/* Connections are freed only once the kernel holds no operation that points at them */
+static void uring_close(connection_t *conn) {
+    struct uring_conn *io = conn->uring;
+
+    if (!io->closing) {
+        io->closing = TRUE;
+        if (conn->proxy) {
+            proxy_abort(conn); /* No point in waiting for the upstream any longer */
+        }
+        if (io->recv_armed || io->sends > 0) {
+            shutdown(conn->fd, SHUT_RDWR); /* Completes whatever is still armed on the socket */
+        }
+    }
+    if (io->recv_armed || io->sends > 0) {
+        return;
+    }
+    uring_conn_free(conn);
+    connection_close(conn);
+}
+
+/* Copy as much as in_buf takes (growing it up to its limit); returns the bytes copied */
+static size_t fill_input(connection_t *conn, const char *data, size_t length) {
+    size_t copied = 0;
+
+    while (copied < length) {
+        size_t space;
+        char *in = connection_input(conn, &space);
+        if (!in || space == 0) {
+            break;
+        }
+        size_t n = length - copied < space ? length - copied : space;
+        memcpy(in, data + copied, n);
+        conn->in_len += n;
+        conn->in_buf[conn->in_len] = '\0';
+        copied += n;
+    }
+    return copied;
+}
+
+/* Append received bytes to in_buf, spilling into the backlog once it is full */
+static int stash_input(connection_t *conn, const char *data, size_t length) {
+    struct uring_conn *io = conn->uring;
+
+    if (io->backlog_len == 0) {
+        size_t n = fill_input(conn, data, length);
+        data += n;
+        length -= n;
+    }
+    if (length == 0) {
+        return 0;
+    }
+
+    if (io->backlog_len + length > io->backlog_cap) {
+        size_t new_cap = io->backlog_cap ? io->backlog_cap : URING_BUFFER_SIZE;
+        while (new_cap < io->backlog_len + length) {
+            new_cap *= 2;
+        }
+        char *new_backlog = realloc(io->backlog, new_cap);
+        if (!new_backlog) {
+            return -1;
+        }
+        io->backlog = new_backlog;
+        io->backlog_cap = new_cap;
+    }
+    memcpy(io->backlog + io->backlog_len, data, length);
+    io->backlog_len += length;
+    return 0;
+}
+
+static void refill_input(connection_t *conn) {
+    struct uring_conn *io = conn->uring;
+    if (io->backlog_len == 0) {
+        return;
+    }
+
+    size_t n = fill_input(conn, io->backlog, io->backlog_len);
+    memmove(io->backlog, io->backlog + n, io->backlog_len - n);
+    io->backlog_len -= n;
+}
+
+static int open_pipe(struct uring_conn *io) {
+    if (pipe2(io->pipe_fds, O_CLOEXEC) != 0) {
+        io->pipe_fds[0] = io->pipe_fds[1] = -1;
+        return -1;
+    }
+    /* A larger pipe moves more of the file per chain; the default is 64 KB */
+    int size = fcntl(io->pipe_fds[1], F_SETPIPE_SZ, URING_PIPE_SIZE);
+    if (size < 0) {
+        size = fcntl(io->pipe_fds[1], F_GETPIPE_SZ);
+    }
+    io->pipe_size = size > 0 ? (size_t)size : 65536;
+    return 0;
+}
+
+static void prep_splice(struct io_uring_sqe *sqe, int fd_in, uint64_t off_in, int fd_out, size_t length,
+                        unsigned flags) {
+    sqe->opcode = IORING_OP_SPLICE;
+    sqe->fd = fd_out;
+    sqe->off = (uint64_t)-1;
+    sqe->splice_fd_in = fd_in;
+    sqe->splice_off_in = off_in;
+    sqe->len = (unsigned)length;
+    sqe->splice_flags = SPLICE_F_MOVE | flags;
+}
+
+/* Submit the next step of the output queue as one linked chain */
+static int uring_send(uring_t *ring, connection_t *conn) {
+    struct uring_conn *io = conn->uring;
+
+    /* Bytes left in the pipe belong to the chunk that was at the head; they go first */
+    if (io->pipe_bytes > 0) {
+        struct io_uring_sqe *sqe = uring_sqe(ring);
+        if (!sqe) {
+            return -1;
+        }
+        prep_splice(sqe, io->pipe_fds[0], (uint64_t)-1, conn->fd, io->pipe_bytes, SPLICE_F_NONBLOCK);
+        sqe->user_data = tag(conn, OP_SPLICE_OUT);
+        io->sends++;
+        return 0;
+    }
+
+    int count = connection_gather(conn, io->iov, OUT_QUEUE_SIZE);
+    int next = conn->out_head + count;
+    out_chunk_t *file = next < conn->out_count && conn->work->out_queue[next].type == OUT_CHUNK_FILE
+                            ? &conn->work->out_queue[next] : NULL;
+
+    if (file && io->pipe_fds[0] < 0 && open_pipe(io) != 0) {
+        return -1;
+    }
+    if (uring_reserve(ring, (count > 0) + (file ? 2 : 0)) != 0) {
+        return -1;
+    }
+
+    /* MSG_WAITALL turns a short send into a failure, which cancels the rest of the chain */
+    if (count > 0) {
+        struct io_uring_sqe *sqe = uring_sqe(ring);
+        memset(&io->msg, 0, sizeof(io->msg));
+        io->msg.msg_iov = io->iov;
+        io->msg.msg_iovlen = (size_t)count;
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = conn->fd;
+        sqe->addr = (uint64_t)(uintptr_t)&io->msg;
+        sqe->len = 1;
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL | (file ? MSG_MORE : 0);
+        sqe->flags = file ? IOSQE_IO_LINK : 0;
+        sqe->user_data = tag(conn, OP_SEND);
+        io->sends++;
+    }
+
+    if (file) {
+        size_t length = file->length < io->pipe_size ? file->length : io->pipe_size;
+        struct io_uring_sqe *sqe = uring_sqe(ring);
+        prep_splice(sqe, file->fd, (uint64_t)file->offset, io->pipe_fds[1], length, 0);
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->user_data = tag(conn, OP_SPLICE_IN);
+
+        sqe = uring_sqe(ring);
+        prep_splice(sqe, io->pipe_fds[0], (uint64_t)-1, conn->fd, length, SPLICE_F_NONBLOCK);
+        sqe->user_data = tag(conn, OP_SPLICE_OUT);
+        io->sends += 2;
+    }
+    return 0;
+}
+
+/* Relay request body from the backlog too, for as long as the upstream keeps taking it */
+static void pump_proxy(connection_t *conn) {
+    struct uring_conn *io = conn->uring;
+
+    for (;;) {
+        size_t pending = conn->in_len + io->backlog_len;
+        proxy_pump(conn);
+        if (!conn->proxy || conn->out_count > 0 || io->backlog_len == 0 ||
+            conn->in_len + io->backlog_len == pending) {
+            return;
+        }
+        refill_input(conn);
+    }
+}
+
+/* Store request body from the backlog too; here an upload never reads the socket itself */
+static void pump_upload(connection_t *conn) {
+    for (;;) {
+        upload_pump(conn);
+        if (!conn->upload || conn->uring->backlog_len == 0) {
+            return;
+        }
+        refill_input(conn);
+    }
+}
+
+/* Same loop as connection_process(), driven by completions instead of readiness */
+static void uring_progress(uring_t *ring, connection_t *conn) {
+    struct uring_conn *io = conn->uring;
+
+    if (io->failed || io->closing) {
+        uring_close(conn);
+        return;
+    }
+    if (io->sends > 0) {
+        connection_schedule(conn, TRUE);
+        return; /* Resume when the chain in flight completes */
+    }
+
+    for (;;) {
+        /* Responses leave strictly in request order: finish the queued ones first */
+        if (conn->out_head < conn->out_count || io->pipe_bytes > 0) {
+            if (uring_send(ring, conn) != 0) {
+                uring_close(conn);
+                return;
+            }
+            connection_schedule(conn, TRUE);
+            return;
+        }
+        conn->out_len = 0;
+        conn->out_head = 0;
+        conn->out_count = 0;
+
+        if (conn->close_after_write && !conn->proxy && !conn->upload) {
+            uring_close(conn);
+            return;
+        }
+
+        refill_input(conn);
+
+        /* A proxied exchange owns the connection until its response is complete */
+        if (conn->proxy) {
+            pump_proxy(conn);
+            if (conn->proxy && conn->out_count == 0) {
+                if (!conn->peer_closed && !io->recv_armed && io->backlog_len < URING_BACKLOG_LIMIT &&
+                    arm_recv(ring, conn) != 0) {
+                    uring_close(conn);
+                    return;
+                }
+                connection_schedule(conn, FALSE);
+                return; /* Waiting on the upstream, or on more request body */
+            }
+            continue;
+        }
+
+        /* So does an upload until its body is stored */
+        if (conn->upload) {
+            pump_upload(conn);
+            if (conn->upload) {
+                if (conn->peer_closed) {
+                    uring_close(conn); /* The client left halfway through its body */
+                    return;
+                }
+                if (!io->recv_armed && arm_recv(ring, conn) != 0) {
+                    uring_close(conn);
+                    return;
+                }
+                connection_schedule(conn, FALSE);
+                return;
+            }
+            continue;
+        }
+
+        int handled = connection_handle_input(conn);
+        if (handled == 0 && conn->out_count == 0) {
+            if (conn->peer_closed || connection_drained(conn)) {
+                uring_close(conn);
+                return;
+            }
+            if (!io->recv_armed && io->backlog_len < URING_BACKLOG_LIMIT && arm_recv(ring, conn) != 0) {
+                uring_close(conn);
+                return;
+            }
+            connection_idle(conn);
+            connection_schedule(conn, FALSE);
+            return; /* Need more input */
+        }
+    }
+}
+
+static void on_accept(uring_t *ring, const struct io_uring_cqe *cqe) {
+    /* Multishot accept ends on errors; keep exactly one armed */
+    if (!(cqe->flags & IORING_CQE_F_MORE) && g_server.running && !g_server.draining && arm_accept(ring) != 0) {
+        log_message(LOG_ERROR, "Worker %d could not re-arm accept", ring->worker->id);
+    }
+    if (cqe->res < 0) {
+        if (cqe->res != -EAGAIN && cqe->res != -EINTR && cqe->res != -ECANCELED) {
+            log_message(LOG_ERROR, "Failed to accept client connection: %s", strerror(-cqe->res));
+        }
+        return;
+    }
+
+    int client_fd = cqe->res;
+    if (!connection_admit(ring->worker, ring->worker->listen_fd, client_fd)) {
+        return; /* Shed with a 503 */
+    }
+
+    struct sockaddr_in client_addr;
+    socklen_t client_len = sizeof(client_addr);
+    int known = getpeername(client_fd, (struct sockaddr *)&client_addr, &client_len) == 0 &&
+                client_addr.sin_family == AF_INET;
+
+    connection_t *conn = connection_create(ring->worker, client_fd, known ? &client_addr : NULL);
+    if (!conn) {
+        log_message(LOG_ERROR, "Out of memory for new connection");
+        close(client_fd);
+        return;
+    }
+
+    conn->uring = pool_alloc(sizeof(struct uring_conn));
+    if (!conn->uring) {
+        log_message(LOG_ERROR, "Out of memory for new connection");
+        connection_close(conn);
+        return;
+    }
+    memset(conn->uring, 0, sizeof(struct uring_conn));
+    conn->uring->pipe_fds[0] = conn->uring->pipe_fds[1] = -1;
+
+    if (arm_recv(ring, conn) != 0) {
+        uring_close(conn);
+        return;
+    }
+    connection_schedule(conn, FALSE);
+
+    log_message(LOG_INFO, "New connection from %s:%d", conn->client_ip,
+                known ? ntohs(client_addr.sin_port) : 0);
+}
+
+static void on_recv(uring_t *ring, connection_t *conn, const struct io_uring_cqe *cqe) {
+    struct uring_conn *io = conn->uring;
+
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        io->recv_armed = FALSE;
+    }
+
+    if (cqe->res > 0) {
+        unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (!io->closing && stash_input(conn, ring->buffers + (size_t)bid * URING_BUFFER_SIZE,
+                                        (size_t)cqe->res) != 0) {
+            io->failed = TRUE;
+        }
+        recycle_buffer(ring, bid);
+        if (io->backlog_len >= URING_BACKLOG_LIMIT && io->recv_armed && !io->recv_paused) {
+            pause_recv(ring, conn);
+        }
+    } else if (cqe->res != -ENOBUFS && cqe->res != -ECANCELED && cqe->res != -EAGAIN) {
+        conn->peer_closed = TRUE; /* EOF or a socket error; ENOBUFS and a pause are re-armed */
+    }
+
+    /* While a response is in flight the new requests wait in in_buf */
+    uring_progress(ring, conn);
+}
+
+static void on_send(uring_t *ring, connection_t *conn, int op, int res) {
+    struct uring_conn *io = conn->uring;
+
+    io->sends--;
+    if (res == -ECANCELED) {
+        /* An earlier link came up short; the queue still says what is left */
+    } else if (res == -EAGAIN) {
+        io->want_poll = TRUE;
+    } else if (res < 0) {
+        io->failed = TRUE;
+    } else if (op == OP_SEND) {
+        connection_advance(conn, (size_t)res);
+        conn->bytes_sent += (size_t)res;
+        metrics_add_bytes((size_t)res);
+    } else if (op == OP_SPLICE_IN) {
+        if (res == 0) {
+            io->failed = TRUE; /* File shrank underneath us; Content-Length is now a lie */
+        }
+        connection_advance(conn, (size_t)res);
+        io->pipe_bytes += (size_t)res;
+    } else if (op == OP_SPLICE_OUT) {
+        if (res == 0 && io->pipe_bytes > 0) {
+            io->failed = TRUE;
+        }
+        io->pipe_bytes -= (size_t)res;
+        conn->bytes_sent += (size_t)res;
+        metrics_add_bytes((size_t)res);
+    }
+
+    if (io->sends > 0) {
+        return;
+    }
+
+    /* Socket buffer full: wait for room, then carry on from the queue */
+    if (io->want_poll && !io->failed && !io->closing) {
+        io->want_poll = FALSE;
+        if (arm_poll(ring, conn) != 0) {
+            io->failed = TRUE;
+        } else {
+            return;
+        }
+    }
+    uring_progress(ring, conn);
+}
+
+/* Drain the epoll set; each ready upstream socket resumes the client it serves */
+static void on_epoll(uring_t *ring, const struct io_uring_cqe *cqe) {
+    struct epoll_event events[MAX_EVENTS];
+    int n;
+
+    if (!(cqe->flags & IORING_CQE_F_MORE) && g_server.running && arm_epoll(ring) != 0) {
+        log_message(LOG_ERROR, "Worker %d could not re-arm the upstream poll", ring->worker->id);
+    }
+
+    do {
+        /* Upstream connections closed since the last drain can no longer be named by an event */
+        proxy_collect();
+        n = epoll_wait(ring->worker->epoll_fd, events, MAX_EVENTS, 0);
+        for (int i = 0; i < n; i++) {
+            proxy_event((struct upstream_conn *)((uintptr_t)events[i].data.ptr & ~EPOLL_TAG_UPSTREAM),
+                        events[i].events);
+        }
+    } while (n == MAX_EVENTS);
+}
+
+/* A proxied connection's upstream moved: carry on as if one of its own completions had arrived */
+static void uring_resume(connection_t *conn) {
+    uring_progress(worker_ring, conn);
+}
+
+static void uring_complete(uring_t *ring, const struct io_uring_cqe *cqe) {
+    int op = (int)(cqe->user_data & OP_MASK);
+    connection_t *conn = (connection_t *)(uintptr_t)(cqe->user_data & ~(uint64_t)OP_MASK);
+
+    switch (op) {
+        case OP_ACCEPT:
+            on_accept(ring, cqe);
+            break;
+        case OP_WAKE:
+            /* Shutdown wake-up; the loop condition does the rest */
+            if (g_server.running) {
+                arm_wake(ring);
+            }
+            break;
+        case OP_CANCEL:
+            break;
+        case OP_RECV:
+            on_recv(ring, conn, cqe);
+            break;
+        case OP_EPOLL:
+            on_epoll(ring, cqe);
+            break;
+        default:
+            on_send(ring, conn, op, cqe->res);
+            break;
+    }
+}
+
+static void uring_reap(uring_t *ring) {
+    unsigned head = *ring->cq_head;
+
+    for (;;) {
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        if (head == tail) {
+            break;
+        }
+        /* Copy the entry out so the slot is free again before the handler submits more work */
+        struct io_uring_cqe cqe = ring->cqes[head & ring->cq_mask];
+        head++;
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+        uring_complete(ring, &cqe);
+    }
+}
+
+/* Hot restart: cancel the accept (the listener lives on in the new process) and wind down every connection */
+static void uring_drain(uring_t *ring) {
+    struct io_uring_sqe *sqe = uring_sqe(ring);
+    if (sqe) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = tag(NULL, OP_ACCEPT);
+        sqe->user_data = tag(NULL, OP_CANCEL);
+    }
+
+    connection_t *conn = ring->worker->connections;
+    while (conn) {
+        connection_t *next = conn->next;
+        uring_progress(ring, conn);
+        conn = next;
+    }
+}
+
+/* Close every connection whose deadline passed; ones with operations in flight finish closing as they complete */
+static void uring_expire(uring_t *ring) {
+    timer_entry_t *expired = timer_expire(&ring->worker->timers, timer_now());
+    while (expired) {
+        timer_entry_t *timer = expired;
+        expired = expired->next;
+
+        connection_t *conn = connection_expired(timer);
+        if (conn) {
+            uring_close(conn);
+        }
+    }
+}
+
+/* Serve the worker's listener until shutdown; returns -1 without serving anything if io_uring is unusable */
+int uring_run(worker_t *worker) {
+    uring_t ring;
+    memset(&ring, 0, sizeof(ring));
+    ring.fd = -1;
+    ring.worker = worker;
+
+    if (uring_setup(&ring) != 0 || arm_accept(&ring) != 0 || arm_wake(&ring) != 0 || arm_epoll(&ring) != 0) {
+        uring_destroy(&ring);
+        return -1;
+    }
+
+    /* The ring now watches the listener and the wake-up eventfd; the epoll set keeps only upstream sockets */
+    epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, worker->listen_fd, NULL);
+    epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, worker->wake_fd, NULL);
+    worker_ring = &ring;
+    worker->resume = uring_resume;
+    log_message(LOG_INFO, "Worker %d using io_uring", worker->id);
+
+    int draining = FALSE;
+    while (g_server.running) {
+        /* Hot restart: same wind-down as the epoll loop, ending with the last connection */
+        if (g_server.draining && !draining) {
+            draining = TRUE;
+            uring_drain(&ring);
+        }
+        if (draining && worker->connection_count == 0) {
+            break;
+        }
+
+        /* Sleep no longer than the nearest connection deadline */
+        int timeout = timer_wheel_timeout(&worker->timers, timer_now());
+        if (uring_wait(&ring, timeout) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY &&
+            errno != ETIME) {
+            log_message(LOG_ERROR, "io_uring_enter failed: %s", strerror(errno));
+            break;
+        }
+        uring_reap(&ring);
+        uring_expire(&ring);
+    }
+
+    /* Closing the ring cancels everything in flight; the caller then closes the connections */
+    uring_destroy(&ring);
+    for (connection_t *conn = worker->connections; conn; conn = conn->next) {
+        uring_conn_free(conn);
+    }
+    return 0;
+}